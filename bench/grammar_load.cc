@@ -0,0 +1,154 @@
+//
+//  grammar_load.cc
+//
+//  Copyright (c) 2022 Yuji Hirose. All rights reserved.
+//  MIT License
+//
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <peglib.h>
+#include <sstream>
+
+using namespace peg;
+
+/*-----------------------------------------------------------------------------
+ *  Synthetic grammars
+ *
+ *  Each generator takes a size and returns a grammar whose cost in the phase
+ *  it stresses should grow linearly with the size.
+ *---------------------------------------------------------------------------*/
+
+// A tree of n rules with literals, classes and repetitions
+static std::string make_rules(size_t n) {
+  std::string s;
+  for (size_t i = 0; i < n; i++) {
+    auto r = "R" + std::to_string(i);
+    auto left = 2 * i + 1;
+    auto right = 2 * i + 2;
+    s += r + " <- ";
+    if (right < n) {
+      s += "R" + std::to_string(left) + " ',' R" + std::to_string(right) +
+           " / ";
+    }
+    s += "'k" + std::to_string(i) + "' [a-z]* / '(' ";
+    if (i + 1 < n) { s += "R" + std::to_string(i + 1) + "? "; }
+    s += "')'\n";
+  }
+  s += "%whitespace <- [ \\t\\r\\n]*\n";
+  return s;
+}
+
+// A chain of n macros, each calling the next one
+static std::string make_macros(size_t n) {
+  std::string s = "S <- M0('x')+\n";
+  for (size_t i = 0; i < n; i++) {
+    s += "M" + std::to_string(i) + "(A) <- '" + std::to_string(i) + "' ";
+    if (i + 1 < n) {
+      s += "M" + std::to_string(i + 1) + "(A)";
+    } else {
+      s += "A";
+    }
+    s += " / A\n";
+  }
+  return s;
+}
+
+// A dictionary of n words
+static std::string make_dictionary(size_t n) {
+  std::string s = "S <- WORD+\nWORD <- ";
+  for (size_t i = 0; i < n; i++) {
+    if (i) { s += " | "; }
+    s += "'w" + std::to_string(i) + "'";
+  }
+  s += "\n%whitespace <- [ \\t\\r\\n]*\n";
+  return s;
+}
+
+// A precedence table with n levels
+static std::string make_precedence(size_t n) {
+  std::string s = "EXPR <- ATOM (OP ATOM)* {\n  precedence\n";
+  for (size_t i = 0; i < n; i++) {
+    s += "    " + std::string(i % 2 ? "R" : "L") + " o" + std::to_string(i) +
+         "\n";
+  }
+  s += "}\nATOM <- < [0-9]+ >\nOP <- < 'o' [0-9]+ >\n"
+       "%whitespace <- [ \\t\\r\\n]*\n";
+  return s;
+}
+
+struct Generator {
+  const char *name;
+  std::string (*make)(size_t n);
+  std::vector<size_t> sizes;
+};
+
+static const Generator generators[] = {
+    {"rules", make_rules, {10, 100, 1000, 10000}},
+    {"macros", make_macros, {10, 100, 1000}},
+    {"dictionary", make_dictionary, {10, 100, 1000, 10000}},
+    {"precedence", make_precedence, {10, 100, 1000}},
+};
+
+int main(int argc, const char **argv) {
+  size_t iterations = argc > 1 ? std::stoul(argv[1]) : 3;
+  if (!iterations) { iterations = 1; }
+
+  auto ms = [](std::chrono::nanoseconds d) {
+    return std::chrono::duration<double, std::milli>(d).count();
+  };
+
+  auto ok = true;
+  for (const auto &gen : generators) {
+    for (auto n : gen.sizes) {
+      auto syntax = gen.make(n);
+
+      // The fastest of the runs, per phase
+      std::vector<std::string> order;
+      std::map<std::string, std::chrono::nanoseconds> phases;
+      std::chrono::nanoseconds total = std::chrono::nanoseconds::max();
+
+      for (size_t i = 0; i < iterations; i++) {
+        std::map<std::string, std::chrono::nanoseconds> run;
+        ParserGenerator::phase_observer() = [&](const char *phase,
+                                                std::chrono::nanoseconds d) {
+          run[phase] += d;
+          if (std::find(order.begin(), order.end(), phase) == order.end()) {
+            order.push_back(phase);
+          }
+        };
+
+        parser pg;
+        auto start = std::chrono::steady_clock::now();
+        ok = pg.load_grammar(syntax) && ok;
+        auto end = std::chrono::steady_clock::now();
+        total = (std::min)(
+            total,
+            std::chrono::duration_cast<std::chrono::nanoseconds>(end - start));
+
+        for (const auto &[phase, d] : run) {
+          auto it = phases.find(phase);
+          phases[phase] = it == phases.end() ? d : (std::min)(it->second, d);
+        }
+      }
+      ParserGenerator::phase_observer() = nullptr;
+
+      auto print = [&](const std::string &phase, std::chrono::nanoseconds d) {
+        std::cout << "{\"grammar\":\"" << gen.name << "\",\"size\":" << n
+                  << ",\"bytes\":" << syntax.size() << ",\"phase\":\"" << phase
+                  << "\",\"ms\":" << ms(d)
+                  << ",\"us_per_unit\":" << ms(d) * 1000 / n << "}"
+                  << std::endl;
+      };
+
+      for (const auto &phase : order) {
+        print(phase, phases[phase]);
+      }
+      print("total", total);
+    }
+  }
+
+  return ok ? 0 : 1;
+}
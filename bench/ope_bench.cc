@@ -0,0 +1,156 @@
+//
+//  ope_bench.cc
+//
+//  Copyright (c) 2022 Yuji Hirose. All rights reserved.
+//  MIT License
+//
+
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <peglib.h>
+
+using namespace peg;
+
+/*-----------------------------------------------------------------------------
+ *  Cases
+ *
+ *  Each grammar repeats one operator over an input made for it, so the time
+ *  is dominated by that operator.
+ *---------------------------------------------------------------------------*/
+
+struct Case {
+  std::string name;
+  std::string grammar;
+  std::string input;
+};
+
+static const size_t input_size = 64 * 1024;
+
+static std::string repeat(const std::string &unit) {
+  std::string s;
+  while (s.size() < input_size) {
+    s += unit;
+  }
+  return s;
+}
+
+// Deterministic pseudo-random numbers, so inputs are the same on every run
+static size_t next_random(size_t &state) {
+  state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+  return state >> 33;
+}
+
+static std::string padded(size_t i, size_t width) {
+  auto s = std::to_string(i);
+  return std::string(width - s.size(), '0') + s;
+}
+
+static std::vector<Case> make_cases() {
+  std::vector<Case> cases;
+
+  cases.push_back({"literal", "S <- 'abcdefgh'*", repeat("abcdefgh")});
+  cases.push_back(
+      {"literal_ignore_case", "S <- 'abcdefgh'i*", repeat("AbCdEfGh")});
+
+  cases.push_back(
+      {"class_ascii", "S <- [a-zA-Z0-9_]*", repeat("Hello_World_0123")});
+  cases.push_back({"class_unicode", "S <- [α-ωА-я]*", repeat("αβγδАБВГ")});
+  cases.push_back(
+      {"class_negated", "S <- [^,\\n]*", repeat("Hello World 0123")});
+  cases.push_back({"any", "S <- .*", repeat("Hello World 0123")});
+
+  for (size_t n : {10, 100, 1000, 10000}) {
+    std::string grammar = "S <- (W ' ')*\nW <- ";
+    for (size_t i = 0; i < n; i++) {
+      if (i) { grammar += " | "; }
+      grammar += "'w" + std::to_string(i) + "'";
+    }
+    std::string input;
+    size_t state = 1;
+    while (input.size() < input_size) {
+      input += "w" + std::to_string(next_random(state) % n) + " ";
+    }
+    cases.push_back({"dictionary_" + std::to_string(n), grammar, input});
+  }
+
+  cases.push_back({"repetition", "S <- ([a-z]+ ' ')*", repeat("hello world ")});
+
+  for (size_t n : {2, 8, 32, 128}) {
+    std::string grammar = "S <- A*\nA <- ";
+    for (size_t i = 0; i < n; i++) {
+      if (i) { grammar += " / "; }
+      grammar += "'x" + padded(i, 3) + "'";
+    }
+    // The last alternative is the one that matches
+    cases.push_back({"choice_" + std::to_string(n), grammar,
+                     repeat("x" + padded(n - 1, 3))});
+  }
+
+  cases.push_back({"back_reference", "S <- ($tag<[a-z]+> '=' $tag ';')*",
+                   repeat("abc=abc;")});
+  cases.push_back({"capture_scope",
+                   "S <- ($( $tag<[a-z]+> ':' $tag ) ';')*",
+                   repeat("abc:abc;")});
+
+  cases.push_back({"whitespace", "S <- 'a'*\n%whitespace <- [ \\t\\n]*",
+                   repeat("a  \t a \n")});
+  cases.push_back({"word",
+                   "S <- ('if' / 'then' / 'else')*\n"
+                   "%whitespace <- [ ]*\n"
+                   "%word <- [a-z]+",
+                   repeat("if then else ")});
+
+  cases.push_back({"precedence",
+                   "EXPR <- ATOM (OP ATOM)* {\n"
+                   "  precedence\n"
+                   "    L + -\n"
+                   "    L * /\n"
+                   "}\n"
+                   "ATOM <- < [0-9]+ >\n"
+                   "OP <- < [-+*/] >\n"
+                   "%whitespace <- [ ]*",
+                   "1" + repeat(" + 2 * 3 - 4 / 5")});
+
+  return cases;
+}
+
+int main(int argc, const char **argv) {
+  std::string only = argc > 1 ? argv[1] : "";
+  auto budget = std::chrono::milliseconds(200);
+
+  auto ok = true;
+  for (const auto &c : make_cases()) {
+    if (!only.empty() && c.name.find(only) == std::string::npos) { continue; }
+
+    parser pg(c.grammar);
+    if (!pg || !pg.parse(c.input)) {
+      std::cerr << c.name << ": failed" << std::endl;
+      ok = false;
+      continue;
+    }
+
+    // The fastest of as many parses as fit in the budget
+    auto best = std::chrono::nanoseconds::max();
+    size_t runs = 0;
+    auto start = std::chrono::steady_clock::now();
+    while (runs < 3 || std::chrono::steady_clock::now() - start < budget) {
+      auto t0 = std::chrono::steady_clock::now();
+      pg.parse(c.input);
+      auto t1 = std::chrono::steady_clock::now();
+      best = (std::min)(
+          best, std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0));
+      runs++;
+    }
+
+    auto ns = static_cast<double>(best.count());
+    auto bytes = static_cast<double>(c.input.size());
+    std::cout << "{\"kernel\":\"" << c.name << "\""
+              << ",\"bytes\":" << c.input.size() << ",\"runs\":" << runs
+              << ",\"ns_per_byte\":" << ns / bytes
+              << ",\"mb_per_s\":" << bytes / (1024 * 1024) / (ns / 1e9) << "}"
+              << std::endl;
+  }
+
+  return ok ? 0 : 1;
+}
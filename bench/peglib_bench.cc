@@ -0,0 +1,360 @@
+//
+//  peglib_bench.cc
+//
+//  Copyright (c) 2022 Yuji Hirose. All rights reserved.
+//  MIT License
+//
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <peglib.h>
+#include <sstream>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#define PEGLIB_BENCH_FORK
+#endif
+
+using namespace peg;
+
+// Counts heap allocations made by the parser
+static std::atomic<size_t> allocations{0};
+
+void *operator new(size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  if (auto p = std::malloc(size ? size : 1)) { return p; }
+  throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+
+static std::string read_file(const char *path) {
+  std::ifstream ifs(path, std::ios::in | std::ios::binary);
+  std::stringstream ss;
+  ss << ifs.rdbuf();
+  return ss.str();
+}
+
+// Peak resident set size of this process in kilobytes, or -1 if it can't be
+// measured. The driver runs each case in a process of its own, so this is the
+// peak of one case.
+static long peak_rss_kb() {
+#if defined(__APPLE__)
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return static_cast<long>(usage.ru_maxrss / 1024);
+#elif defined(__unix__)
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return static_cast<long>(usage.ru_maxrss);
+#else
+  return -1;
+#endif
+}
+
+/*-----------------------------------------------------------------------------
+ *  Corpora
+ *
+ *  Generated from a fixed pattern, so the same size always gives the same
+ *  text.
+ *---------------------------------------------------------------------------*/
+
+static std::string make_json(size_t size) {
+  std::string s = "[";
+  for (size_t i = 0; s.size() < size; i++) {
+    if (i) { s += ",\n  "; }
+    s += R"({"id": )" + std::to_string(i) + R"(, "name": "item [)" +
+         std::to_string(i) + R"(]", "tags": ["a", "b", "c"], "score": )" +
+         std::to_string(i % 1000) + R"(.5e-3, "ok": true, "next": null})";
+  }
+  s += "]";
+  return s;
+}
+
+static std::string make_csv(size_t size) {
+  std::string s = "id,name,comment,score\r\n";
+  for (size_t i = 0; s.size() < size; i++) {
+    s += std::to_string(i) + ",item" + std::to_string(i) + ",";
+    if (i % 3 == 0) {
+      s += R"("quoted, with ""escapes"" and
+a newline")";
+    } else {
+      s += "plain text";
+    }
+    s += "," + std::to_string(i % 1000) + "\r\n";
+  }
+  return s;
+}
+
+static std::string make_pl0(size_t size) {
+  std::string s = "CONST limit = 100;\nVAR x, y, z;\n";
+  size_t n = 0;
+  while (s.size() < size) {
+    auto p = "p" + std::to_string(n++);
+    s += "PROCEDURE " + p + ";\n";
+    s += "  VAR a, b;\n";
+    s += "  BEGIN\n";
+    s += "    a := x * (y - 2) + z / 3;\n";
+    s += "    b := -a + limit;\n";
+    s += "    IF a < b THEN x := x + 1;\n";
+    s += "    WHILE b >= 0 DO b := b - 1;\n";
+    s += "    IF ODD a THEN write a\n";
+    s += "  END;\n";
+  }
+  s += "BEGIN\n  x := 1;\n";
+  for (size_t i = 0; i < n; i++) {
+    s += "  CALL p" + std::to_string(i) + ";\n";
+  }
+  s += "  write x\nEND.\n";
+  return s;
+}
+
+static std::string make_peg(size_t size) {
+  std::string s;
+  for (size_t i = 0; s.size() < size; i++) {
+    auto r = "Rule" + std::to_string(i);
+    auto next = "Rule" + std::to_string(i + 1);
+    s += r + " <- '" + r + "' " + next + "? / < [a-z0-9_]+ > (',' " + next +
+         ")* / '(' " + next + " ')' {no_ast_opt}\n";
+  }
+  s += "%whitespace <- [ \\t\\r\\n]*\n";
+  return s;
+}
+
+struct Corpus {
+  const char *name;
+  const char *grammar;
+  std::string (*make)(size_t size);
+};
+
+static const Corpus corpora[] = {
+    {"json", "json.peg", make_json},
+    {"csv", "csv.peg", make_csv},
+    {"pl0", "pl0.peg", make_pl0},
+    {"cpp-peglib", "cpp-peglib.peg", make_peg},
+};
+
+/*-----------------------------------------------------------------------------
+ *  Modes
+ *---------------------------------------------------------------------------*/
+
+enum class Mode { Plain, Packrat, Ast, OptimizedAst };
+
+static const char *mode_name(Mode mode) {
+  switch (mode) {
+  case Mode::Plain: return "plain";
+  case Mode::Packrat: return "packrat";
+  case Mode::Ast: return "ast";
+  case Mode::OptimizedAst: return "ast-opt";
+  }
+  return "";
+}
+
+struct Result {
+  std::vector<double> latencies; // ms
+  size_t allocations = 0;
+  bool ok = true;
+};
+
+static Result run(const std::string &syntax, const std::string &text,
+                  Mode mode, bool logger, size_t iterations) {
+  parser pg(syntax);
+  if (mode == Mode::Packrat) { pg.enable_packrat_parsing(); }
+  if (mode == Mode::Ast || mode == Mode::OptimizedAst) { pg.enable_ast(); }
+  if (logger) {
+    pg.set_logger([](size_t, size_t, const std::string &) {});
+  }
+
+  auto parse = [&]() {
+    if (mode == Mode::Ast || mode == Mode::OptimizedAst) {
+      std::shared_ptr<Ast> ast;
+      auto ret = pg.parse(text, ast);
+      if (ret && mode == Mode::OptimizedAst) { ast = pg.optimize_ast(ast); }
+      return ret;
+    }
+    return pg.parse(text);
+  };
+
+  Result result;
+  result.ok = parse(); // warm up
+
+  auto before = allocations.load();
+  for (size_t i = 0; i < iterations; i++) {
+    auto start = std::chrono::steady_clock::now();
+    result.ok = parse() && result.ok;
+    auto end = std::chrono::steady_clock::now();
+    result.latencies.push_back(
+        std::chrono::duration<double, std::milli>(end - start).count());
+  }
+  result.allocations = (allocations.load() - before) / iterations;
+  return result;
+}
+
+static double percentile(std::vector<double> v, double p) {
+  std::sort(v.begin(), v.end());
+  auto i = static_cast<size_t>(p * static_cast<double>(v.size()) + 0.999999);
+  return v[(std::min)((std::max)(i, static_cast<size_t>(1)), v.size()) - 1];
+}
+
+static std::vector<std::string> split(const std::string &s, char delim) {
+  std::vector<std::string> elems;
+  std::stringstream ss(s);
+  std::string elem;
+  while (std::getline(ss, elem, delim)) {
+    elems.push_back(elem);
+  }
+  return elems;
+}
+
+// Runs one case and prints its result
+static bool run_case(const Corpus &corpus, size_t kb, Mode mode, bool logger,
+                     size_t iterations) {
+  auto syntax = read_file(
+      (std::string(PEGLIB_GRAMMAR_DIR "/") + corpus.grammar).c_str());
+  auto text = corpus.make(kb * 1024);
+
+  auto r = run(syntax, text, mode, logger, iterations);
+
+  auto p50 = percentile(r.latencies, 0.5);
+  auto mb = static_cast<double>(text.size()) / (1024 * 1024);
+  auto rss = peak_rss_kb();
+
+  std::cout << "{\"grammar\":\"" << corpus.name << "\""
+            << ",\"bytes\":" << text.size() << ",\"mode\":\""
+            << mode_name(mode) << "\""
+            << ",\"logger\":" << (logger ? "true" : "false")
+            << ",\"ok\":" << (r.ok ? "true" : "false")
+            << ",\"iterations\":" << iterations
+            << ",\"mb_per_s\":" << mb / (p50 / 1000) << ",\"p50_ms\":" << p50
+            << ",\"p90_ms\":" << percentile(r.latencies, 0.9)
+            << ",\"p99_ms\":" << percentile(r.latencies, 0.99)
+            << ",\"allocations_per_parse\":" << r.allocations
+            << ",\"peak_rss_kb\":";
+  if (rss < 0) {
+    std::cout << "null";
+  } else {
+    std::cout << rss;
+  }
+  std::cout << "}" << std::endl;
+
+  return r.ok;
+}
+
+#ifdef PEGLIB_BENCH_FORK
+// Runs one case in a new process started with --case, so that its peak RSS
+// doesn't include the cases before it
+static bool spawn_case(const char *self, const Corpus &corpus, size_t kb,
+                       Mode mode, bool logger, size_t iterations) {
+  std::vector<std::string> args = {
+      self,
+      "--case",
+      std::string(corpus.name) + "," + std::to_string(kb) + "," +
+          mode_name(mode) + "," + (logger ? "1" : "0"),
+      "--iterations",
+      std::to_string(iterations)};
+  std::vector<char *> argv;
+  for (auto &arg : args) {
+    argv.push_back(arg.data());
+  }
+  argv.push_back(nullptr);
+
+  std::cout.flush();
+  auto pid = fork();
+  if (pid == 0) {
+    execvp(self, argv.data());
+    std::perror("peglib-bench");
+    _exit(127);
+  }
+  if (pid < 0) {
+    std::perror("peglib-bench");
+    return false;
+  }
+
+  int status = 0;
+  if (waitpid(pid, &status, 0) < 0) { return false; }
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+#endif
+
+int main(int argc, const char **argv) {
+  std::vector<size_t> sizes{16, 128, 1024}; // KB
+  size_t iterations = 10;
+  std::string only;
+  std::vector<std::string> one_case;
+
+  for (auto i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--sizes" && i + 1 < argc) {
+      sizes.clear();
+      for (const auto &kb : split(argv[++i], ',')) {
+        sizes.push_back(std::stoul(kb));
+      }
+    } else if (arg == "--iterations" && i + 1 < argc) {
+      iterations = (std::max)(static_cast<size_t>(std::stoul(argv[++i])),
+                              static_cast<size_t>(1));
+    } else if (arg == "--grammar" && i + 1 < argc) {
+      only = argv[++i];
+    } else if (arg == "--case" && i + 1 < argc) {
+      one_case = split(argv[++i], ',');
+    } else {
+      std::cerr << R"(usage: peglib-bench [options]
+
+  options:
+    --sizes KB,...: corpus sizes in kilobytes (default: 16,128,1024)
+    --iterations N: timed parses per case (default: 10)
+    --grammar NAME: only run json, csv, pl0 or cpp-peglib
+    --case NAME,KB,MODE,LOGGER: run a single case in this process
+
+  Prints one JSON object per case. Each case runs in a process of its own
+  where fork is available, so that peak_rss_kb is measured per case.
+)";
+      return 1;
+    }
+  }
+
+  const Mode modes[] = {Mode::Plain, Mode::Packrat, Mode::Ast,
+                        Mode::OptimizedAst};
+
+  if (!one_case.empty()) {
+    if (one_case.size() != 4) { return 1; }
+    for (const auto &corpus : corpora) {
+      if (one_case[0] != corpus.name) { continue; }
+      for (auto mode : modes) {
+        if (one_case[2] != mode_name(mode)) { continue; }
+        return run_case(corpus, std::stoul(one_case[1]), mode,
+                        one_case[3] == "1", iterations)
+                   ? 0
+                   : 1;
+      }
+    }
+    return 1;
+  }
+
+  auto ok = true;
+  for (const auto &corpus : corpora) {
+    if (!only.empty() && only != corpus.name) { continue; }
+
+    for (auto kb : sizes) {
+      for (auto mode : modes) {
+        for (auto logger : {false, true}) {
+#ifdef PEGLIB_BENCH_FORK
+          ok = spawn_case(argv[0], corpus, kb, mode, logger, iterations) && ok;
+#else
+          ok = run_case(corpus, kb, mode, logger, iterations) && ok;
+#endif
+        }
+      }
+    }
+  }
+
+  return ok ? 0 : 1;
+}
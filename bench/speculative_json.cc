@@ -0,0 +1,77 @@
+//
+//  speculative_json.cc
+//
+//  Copyright (c) 2022 Yuji Hirose. All rights reserved.
+//  MIT License
+//
+
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <peglib.h>
+
+using namespace peg;
+
+static std::string read_file(const char *path) {
+  std::ifstream ifs(path, std::ios::in | std::ios::binary);
+  std::stringstream ss;
+  ss << ifs.rdbuf();
+  return ss.str();
+}
+
+static std::string make_json(size_t size) {
+  std::string json = "[";
+  for (size_t i = 0; json.size() < size; i++) {
+    if (i) { json += ",\n  "; }
+    json += R"({"id": )" + std::to_string(i) +
+            R"(, "name": "item [)" + std::to_string(i) +
+            R"(]", "tags": ["a", "b", "c"], "score": )" +
+            std::to_string(i % 1000) + R"(.5e-3, "ok": true})";
+  }
+  json += "]";
+  return json;
+}
+
+template <typename F> static double measure(F fn) {
+  auto start = std::chrono::steady_clock::now();
+  fn();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+int main(int argc, const char **argv) {
+  size_t megabytes = argc > 1 ? std::atoi(argv[1]) : 16;
+  size_t chunk_kilobytes = argc > 2 ? std::atoi(argv[2]) : 256;
+
+  parser parser(read_file(PEGLIB_GRAMMAR_DIR "/json.peg"));
+  if (!parser) {
+    std::cerr << "failed to load json.peg" << std::endl;
+    return 1;
+  }
+
+  auto json = make_json(megabytes * 1024 * 1024);
+  parser.set_parallel_chunk_size(chunk_kilobytes * 1024);
+
+  bool serial_ret = false;
+  auto serial = measure([&]() { serial_ret = parser.parse(json); });
+
+  bool speculative_ret = false;
+  auto speculative = measure(
+      [&]() { speculative_ret = parser.parse_speculative(json, "value"); });
+
+  if (!serial_ret || !speculative_ret) {
+    std::cerr << "parse failed" << std::endl;
+    return 1;
+  }
+
+  std::cout << "input:       " << json.size() / 1024 / 1024 << " MB"
+            << std::endl;
+  std::cout << "threads:     " << std::thread::hardware_concurrency()
+            << std::endl;
+  std::cout << "serial:      " << serial << " ms" << std::endl;
+  std::cout << "speculative: " << speculative << " ms" << std::endl;
+  std::cout << "speedup:     " << serial / speculative << "x" << std::endl;
+
+  return 0;
+}
@@ -0,0 +1,670 @@
+//
+//  peglib-jit.cc
+//
+//  Copyright (c) 2022 Yuji Hirose. All rights reserved.
+//  MIT License
+//
+
+#include "peglib-jit.h"
+
+#include "llvm/ExecutionEngine/ExecutionEngine.h"
+#include "llvm/ExecutionEngine/MCJIT.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Target/TargetMachine.h"
+
+namespace peg {
+namespace jit {
+
+namespace {
+
+using MatchFunction = size_t (*)(const char *s, size_t n);
+
+/*-----------------------------------------------------------------------------
+ *  Analysis
+ *---------------------------------------------------------------------------*/
+
+// Checks if an expression only consists of operators which can be lowered.
+// Literals skip whitespace and check words at runtime, so they can only be
+// lowered where neither happens.
+struct IsLowerable : public Ope::Visitor {
+  using Ope::Visitor::visit;
+
+  static bool check(Ope &ope, bool literals) {
+    IsLowerable vis(literals);
+    ope.accept(vis);
+    return vis.lowerable_;
+  }
+
+  void visit(Sequence &ope) override {
+    for (auto op : ope.opes_) {
+      op->accept(*this);
+    }
+  }
+  void visit(PrioritizedChoice &ope) override {
+    // The choice is visible through SemanticValues::choice()
+    if (!isolated_) { lowerable_ = false; }
+    for (auto op : ope.opes_) {
+      op->accept(*this);
+    }
+  }
+  void visit(Repetition &ope) override { isolate(*ope.ope_); }
+  void visit(AndPredicate &ope) override { isolate(*ope.ope_); }
+  void visit(NotPredicate &ope) override { isolate(*ope.ope_); }
+  void visit(LiteralString &) override {
+    if (!literals_) { lowerable_ = false; }
+  }
+  void visit(CharacterClass &ope) override {
+    if (ope.ignore_case()) { lowerable_ = false; }
+  }
+  void visit(Character &) override {}
+  void visit(AnyCharacter &) override {}
+
+  void visit(Dictionary &) override { lowerable_ = false; }
+  void visit(CaptureScope &) override { lowerable_ = false; }
+  void visit(Capture &) override { lowerable_ = false; }
+  void visit(TokenBoundary &) override { lowerable_ = false; }
+  void visit(Ignore &) override { lowerable_ = false; }
+  void visit(User &) override { lowerable_ = false; }
+  void visit(WeakHolder &) override { lowerable_ = false; }
+  void visit(Holder &) override { lowerable_ = false; }
+  void visit(Reference &) override { lowerable_ = false; }
+  void visit(Whitespace &) override { lowerable_ = false; }
+  void visit(BackReference &) override { lowerable_ = false; }
+  void visit(PrecedenceClimbing &) override { lowerable_ = false; }
+  void visit(Recovery &) override { lowerable_ = false; }
+  void visit(Cut &) override { lowerable_ = false; }
+
+private:
+  IsLowerable(bool literals) : literals_(literals) {}
+
+  // Operators which parse into their own semantic values
+  void isolate(Ope &ope) {
+    isolated_++;
+    ope.accept(*this);
+    isolated_--;
+  }
+
+  bool literals_;
+  size_t isolated_ = 0;
+  bool lowerable_ = true;
+};
+
+// Single operators are as fast in the interpreter as behind a function call
+struct IsComposite : public Ope::Visitor {
+  using Ope::Visitor::visit;
+
+  static bool check(Ope &ope) {
+    IsComposite vis;
+    ope.accept(vis);
+    return vis.composite_;
+  }
+
+  void visit(Sequence &) override { composite_ = true; }
+  void visit(PrioritizedChoice &) override { composite_ = true; }
+  void visit(Repetition &) override { composite_ = true; }
+  void visit(AndPredicate &) override { composite_ = true; }
+  void visit(NotPredicate &) override { composite_ = true; }
+
+private:
+  bool composite_ = false;
+};
+
+// Collects references with whether they are inside a token boundary
+struct ReferenceSites : public Ope::Visitor {
+  using Ope::Visitor::visit;
+
+  void visit(Sequence &ope) override {
+    for (auto op : ope.opes_) {
+      op->accept(*this);
+    }
+  }
+  void visit(PrioritizedChoice &ope) override {
+    for (auto op : ope.opes_) {
+      op->accept(*this);
+    }
+  }
+  void visit(Repetition &ope) override { ope.ope_->accept(*this); }
+  void visit(AndPredicate &ope) override { ope.ope_->accept(*this); }
+  void visit(NotPredicate &ope) override { ope.ope_->accept(*this); }
+  void visit(CaptureScope &ope) override { ope.ope_->accept(*this); }
+  void visit(Capture &ope) override { ope.ope_->accept(*this); }
+  void visit(TokenBoundary &ope) override {
+    in_token_++;
+    ope.ope_->accept(*this);
+    in_token_--;
+  }
+  void visit(Ignore &ope) override { ope.ope_->accept(*this); }
+  void visit(WeakHolder &ope) override { ope.weak_.lock()->accept(*this); }
+  void visit(Reference &ope) override {
+    sites.emplace_back(ope.name_, in_token_ > 0);
+    for (auto arg : ope.args_) {
+      arg->accept(*this);
+    }
+  }
+  void visit(Whitespace &ope) override { ope.ope_->accept(*this); }
+  void visit(PrecedenceClimbing &ope) override {
+    ope.atom_->accept(*this);
+    ope.binop_->accept(*this);
+  }
+  void visit(Recovery &ope) override { ope.ope_->accept(*this); }
+
+  std::vector<std::pair<std::string, bool>> sites;
+
+private:
+  size_t in_token_ = 0;
+};
+
+// Finds rules which are only ever parsed inside a token boundary, where
+// literals don't skip whitespace.
+inline std::unordered_set<std::string>
+token_context_rules(const Grammar &grammar) {
+  std::unordered_map<std::string, std::vector<std::pair<std::string, bool>>>
+      sites;
+  std::unordered_set<std::string> referenced;
+  for (const auto &[name, rule] : grammar) {
+    ReferenceSites vis;
+    rule.get_core_operator()->accept(vis);
+    for (const auto &site : vis.sites) {
+      referenced.insert(site.first);
+    }
+    sites[name] = std::move(vis.sites);
+  }
+
+  std::unordered_set<std::string> rules;
+  for (const auto &[name, rule] : grammar) {
+    // The start rule has the whitespace operator
+    if (!rule.is_macro && !rule.whitespaceOpe && referenced.count(name) &&
+        name != WHITESPACE_DEFINITION_NAME && name != WORD_DEFINITION_NAME) {
+      rules.insert(name);
+    }
+  }
+
+  auto changed = true;
+  while (changed) {
+    changed = false;
+    for (const auto &[name, rule_sites] : sites) {
+      if (rules.count(name)) { continue; }
+      for (const auto &[target, in_token] : rule_sites) {
+        if (!in_token && rules.erase(target)) { changed = true; }
+      }
+    }
+  }
+  return rules;
+}
+
+/*-----------------------------------------------------------------------------
+ *  Code generation
+ *---------------------------------------------------------------------------*/
+
+// Lowers an expression to a function `size_t f(const char *s, size_t n)`,
+// which returns the matched length or -1, like Ope::parse.
+class Lowering : public Ope::Visitor {
+public:
+  using Ope::Visitor::visit;
+
+  Lowering(llvm::Module &module)
+      : module_(module), builder_(module.getContext()) {}
+
+  llvm::Function *lower(Ope &ope, const std::string &name) {
+    auto i64 = builder_.getInt64Ty();
+    auto type = llvm::FunctionType::get(i64, {builder_.getInt8PtrTy(), i64},
+                                        false);
+    fn_ = llvm::Function::Create(type, llvm::Function::ExternalLinkage, name,
+                                 module_);
+    s_ = fn_->getArg(0);
+    n_ = fn_->getArg(1);
+
+    auto entry = block("entry");
+    auto fail = block("fail");
+    builder_.SetInsertPoint(entry);
+    pos_ = variable(i64);
+    builder_.CreateStore(builder_.getInt64(0), pos_);
+
+    fail_ = fail;
+    ope.accept(*this);
+    builder_.CreateRet(load_pos());
+
+    builder_.SetInsertPoint(fail);
+    builder_.CreateRet(builder_.getInt64(static_cast<uint64_t>(-1)));
+    return fn_;
+  }
+
+  void visit(Sequence &ope) override {
+    for (auto op : ope.opes_) {
+      op->accept(*this);
+    }
+  }
+
+  void visit(PrioritizedChoice &ope) override {
+    auto save = load_pos();
+    auto done = block("choice.done");
+    auto fail = fail_;
+    for (size_t i = 0; i < ope.opes_.size(); i++) {
+      auto last = i + 1 == ope.opes_.size();
+      auto next = last ? fail : block("choice.next");
+      gen(*ope.opes_[i], next);
+      builder_.CreateBr(done);
+      if (!last) {
+        builder_.SetInsertPoint(next);
+        builder_.CreateStore(save, pos_);
+      }
+    }
+    builder_.SetInsertPoint(done);
+  }
+
+  void visit(Repetition &ope) override {
+    auto i64 = builder_.getInt64Ty();
+    auto count = variable(i64);
+    builder_.CreateStore(builder_.getInt64(0), count);
+
+    auto loop = block("rep.loop");
+    auto body = block("rep.body");
+    auto exit = block("rep.exit");
+    auto done = block("rep.done");
+    builder_.CreateBr(loop);
+
+    builder_.SetInsertPoint(loop);
+    if (ope.max_ == std::numeric_limits<size_t>::max()) {
+      builder_.CreateBr(body);
+    } else {
+      auto cnt = builder_.CreateLoad(i64, count);
+      builder_.CreateCondBr(
+          builder_.CreateICmpULT(cnt, builder_.getInt64(ope.max_)), body,
+          done);
+    }
+
+    builder_.SetInsertPoint(body);
+    auto save = load_pos();
+    gen(*ope.ope_, exit);
+    auto cnt = builder_.CreateLoad(i64, count);
+    builder_.CreateStore(builder_.CreateAdd(cnt, builder_.getInt64(1)), count);
+    builder_.CreateBr(loop);
+
+    builder_.SetInsertPoint(exit);
+    builder_.CreateStore(save, pos_);
+    if (ope.min_ > 0) {
+      auto cnt = builder_.CreateLoad(i64, count);
+      builder_.CreateCondBr(
+          builder_.CreateICmpULT(cnt, builder_.getInt64(ope.min_)), fail_,
+          done);
+    } else {
+      builder_.CreateBr(done);
+    }
+
+    builder_.SetInsertPoint(done);
+  }
+
+  void visit(AndPredicate &ope) override {
+    auto save = load_pos();
+    gen(*ope.ope_, fail_);
+    builder_.CreateStore(save, pos_);
+  }
+
+  void visit(NotPredicate &ope) override {
+    auto save = load_pos();
+    auto ok = block("npd.ok");
+    gen(*ope.ope_, ok);
+    builder_.CreateBr(fail_);
+    builder_.SetInsertPoint(ok);
+    builder_.CreateStore(save, pos_);
+  }
+
+  void visit(LiteralString &ope) override {
+    match_bytes(ope.lit_, ope.ignore_case_);
+  }
+
+  void visit(Character &ope) override {
+    match_bytes(std::string(1, ope.ch_), false);
+  }
+
+  void visit(AnyCharacter &) override {
+    auto pos = load_pos();
+    auto rem = builder_.CreateSub(n_, pos);
+    require(rem, 1);
+
+    auto b = load_byte(pos, 0);
+    llvm::Value *len = builder_.getInt64(0);
+    len = select_len(b, 0xF8, 0xF0, rem, 4, len);
+    len = select_len(b, 0xF0, 0xE0, rem, 3, len);
+    len = select_len(b, 0xE0, 0xC0, rem, 2, len);
+    len = builder_.CreateSelect(
+        builder_.CreateICmpULT(b, builder_.getInt32(0x80)),
+        builder_.getInt64(1), len);
+
+    fail_if(builder_.CreateICmpEQ(len, builder_.getInt64(0)));
+    builder_.CreateStore(builder_.CreateAdd(pos, len), pos_);
+  }
+
+  void visit(CharacterClass &ope) override {
+    auto i32 = builder_.getInt32Ty();
+    auto i64 = builder_.getInt64Ty();
+
+    auto pos = load_pos();
+    auto rem = builder_.CreateSub(n_, pos);
+    require(rem, 1);
+
+    // Same as decode_codepoint, which yields 0 for both on invalid input
+    auto cp_var = variable(i32);
+    auto len_var = variable(i64);
+    auto b = load_byte(pos, 0);
+    builder_.CreateStore(b, cp_var);
+    builder_.CreateStore(builder_.getInt64(1), len_var);
+
+    auto multi = block("cls.multi");
+    auto decoded = block("cls.decoded");
+    builder_.CreateCondBr(builder_.CreateICmpULT(b, builder_.getInt32(0x80)),
+                          decoded, multi);
+
+    builder_.SetInsertPoint(multi);
+    builder_.CreateStore(builder_.getInt32(0), cp_var);
+    builder_.CreateStore(builder_.getInt64(0), len_var);
+    llvm::Value *need = builder_.getInt64(0);
+    need = select_len(b, 0xF8, 0xF0, nullptr, 4, need);
+    need = select_len(b, 0xF0, 0xE0, nullptr, 3, need);
+    need = select_len(b, 0xE0, 0xC0, nullptr, 2, need);
+    auto enough = block("cls.enough");
+    builder_.CreateCondBr(builder_.CreateICmpULE(need, rem), enough, decoded);
+
+    builder_.SetInsertPoint(enough);
+    auto sw = builder_.CreateSwitch(need, decoded, 3);
+    for (uint32_t bytes = 2; bytes <= 4; bytes++) {
+      auto bb = block("cls.decode");
+      sw->addCase(builder_.getInt64(bytes), bb);
+      builder_.SetInsertPoint(bb);
+      auto cp = builder_.CreateAnd(b, builder_.getInt32(0xFF >> (bytes + 1)));
+      for (uint32_t i = 1; i < bytes; i++) {
+        auto cont = builder_.CreateAnd(load_byte(pos, i),
+                                       builder_.getInt32(0x3F));
+        cp = builder_.CreateOr(builder_.CreateShl(cp, 6), cont);
+      }
+      builder_.CreateStore(cp, cp_var);
+      builder_.CreateStore(builder_.getInt64(bytes), len_var);
+      builder_.CreateBr(decoded);
+    }
+
+    builder_.SetInsertPoint(decoded);
+    auto cp = builder_.CreateLoad(i32, cp_var);
+    auto len = builder_.CreateLoad(i64, len_var);
+
+    // Invalid input matches neither a class nor its negation
+    fail_if(builder_.CreateICmpEQ(len, builder_.getInt64(0)));
+
+    llvm::Value *in = builder_.getFalse();
+    for (const auto &[lo, hi] : ope.ranges()) {
+      auto in_range = builder_.CreateAnd(
+          builder_.CreateICmpUGE(cp, builder_.getInt32(lo)),
+          builder_.CreateICmpULE(cp, builder_.getInt32(hi)));
+      in = builder_.CreateOr(in, in_range);
+    }
+    fail_if(ope.negated() ? in : builder_.CreateNot(in));
+    builder_.CreateStore(builder_.CreateAdd(pos, len), pos_);
+  }
+
+private:
+  llvm::BasicBlock *block(const char *name) {
+    return llvm::BasicBlock::Create(module_.getContext(), name, fn_);
+  }
+
+  // Allocas in the entry block are promoted to registers by the optimizer
+  llvm::AllocaInst *variable(llvm::Type *type) {
+    auto &entry = fn_->getEntryBlock();
+    llvm::IRBuilder<> builder(&entry, entry.begin());
+    return builder.CreateAlloca(type);
+  }
+
+  void gen(Ope &ope, llvm::BasicBlock *fail) {
+    auto save = fail_;
+    fail_ = fail;
+    ope.accept(*this);
+    fail_ = save;
+  }
+
+  llvm::Value *load_pos() {
+    return builder_.CreateLoad(builder_.getInt64Ty(), pos_);
+  }
+
+  llvm::Value *load_byte(llvm::Value *pos, uint64_t offset) {
+    auto i8 = builder_.getInt8Ty();
+    auto idx = builder_.CreateAdd(pos, builder_.getInt64(offset));
+    auto ptr = builder_.CreateInBoundsGEP(i8, s_, idx);
+    return builder_.CreateZExt(builder_.CreateLoad(i8, ptr),
+                               builder_.getInt32Ty());
+  }
+
+  void fail_if(llvm::Value *cond) {
+    auto cont = block("cont");
+    builder_.CreateCondBr(cond, fail_, cont);
+    builder_.SetInsertPoint(cont);
+  }
+
+  void require(llvm::Value *rem, uint64_t len) {
+    fail_if(builder_.CreateICmpULT(rem, builder_.getInt64(len)));
+  }
+
+  // `(b & mask) == lead && rem >= len ? len : otherwise`
+  llvm::Value *select_len(llvm::Value *b, uint32_t mask, uint32_t lead,
+                          llvm::Value *rem, uint64_t len,
+                          llvm::Value *otherwise) {
+    llvm::Value *cond = builder_.CreateICmpEQ(
+        builder_.CreateAnd(b, builder_.getInt32(mask)),
+        builder_.getInt32(lead));
+    if (rem) {
+      cond = builder_.CreateAnd(
+          cond, builder_.CreateICmpUGE(rem, builder_.getInt64(len)));
+    }
+    return builder_.CreateSelect(cond, builder_.getInt64(len), otherwise);
+  }
+
+  void match_bytes(const std::string &lit, bool ignore_case) {
+    if (lit.empty()) { return; }
+
+    auto pos = load_pos();
+    require(builder_.CreateSub(n_, pos), lit.size());
+
+    for (size_t i = 0; i < lit.size(); i++) {
+      auto b = load_byte(pos, i);
+      auto ch = static_cast<uint8_t>(lit[i]);
+      if (ignore_case) {
+        b = to_lower(b);
+        if ('A' <= ch && ch <= 'Z') { ch = ch - 'A' + 'a'; }
+      }
+      fail_if(builder_.CreateICmpNE(b, builder_.getInt32(ch)));
+    }
+    builder_.CreateStore(builder_.CreateAdd(pos, builder_.getInt64(lit.size())),
+                         pos_);
+  }
+
+  llvm::Value *to_lower(llvm::Value *b) {
+    auto upper = builder_.CreateICmpULT(
+        builder_.CreateSub(b, builder_.getInt32('A')), builder_.getInt32(26));
+    return builder_.CreateSelect(
+        upper, builder_.CreateAdd(b, builder_.getInt32('a' - 'A')), b);
+  }
+
+  llvm::Module &module_;
+  llvm::IRBuilder<> builder_;
+  llvm::Function *fn_ = nullptr;
+  llvm::Value *s_ = nullptr;
+  llvm::Value *n_ = nullptr;
+  llvm::AllocaInst *pos_ = nullptr;
+  llvm::BasicBlock *fail_ = nullptr;
+};
+
+/*-----------------------------------------------------------------------------
+ *  Rewriting
+ *---------------------------------------------------------------------------*/
+
+struct Target {
+  std::shared_ptr<Ope> ope;
+  std::function<void(const std::shared_ptr<Ope> &)> replace;
+};
+
+// Finds the largest lowerable expressions in a rule
+struct FindTargets : public Ope::Visitor {
+  using Ope::Visitor::visit;
+
+  FindTargets(bool literals, std::vector<Target> &targets)
+      : literals_(literals), targets_(targets) {}
+
+  void find(std::shared_ptr<Ope> &slot) {
+    if (IsComposite::check(*slot) &&
+        IsLowerable::check(*slot, literals_ || in_token_ > 0)) {
+      targets_.push_back({slot, [&slot](const std::shared_ptr<Ope> &ope) {
+                            slot = ope;
+                          }});
+    } else {
+      slot->accept(*this);
+    }
+  }
+
+  void visit(Sequence &ope) override {
+    for (auto &op : ope.opes_) {
+      find(op);
+    }
+  }
+  void visit(PrioritizedChoice &ope) override {
+    for (auto &op : ope.opes_) {
+      find(op);
+    }
+  }
+  void visit(Repetition &ope) override { find(ope.ope_); }
+  void visit(AndPredicate &ope) override { find(ope.ope_); }
+  void visit(NotPredicate &ope) override { find(ope.ope_); }
+  void visit(CaptureScope &ope) override { find(ope.ope_); }
+  void visit(Capture &ope) override { find(ope.ope_); }
+  void visit(TokenBoundary &ope) override {
+    in_token_++;
+    find(ope.ope_);
+    in_token_--;
+  }
+  void visit(Ignore &ope) override { find(ope.ope_); }
+  void visit(Recovery &ope) override { find(ope.ope_); }
+
+private:
+  bool literals_;
+  std::vector<Target> &targets_;
+  size_t in_token_ = 0;
+};
+
+struct Engine {
+  std::unique_ptr<llvm::LLVMContext> context;
+  std::unique_ptr<llvm::ExecutionEngine> engine;
+};
+
+inline void optimize(llvm::Module &module) {
+  llvm::LoopAnalysisManager lam;
+  llvm::FunctionAnalysisManager fam;
+  llvm::CGSCCAnalysisManager cgam;
+  llvm::ModuleAnalysisManager mam;
+
+  llvm::PassBuilder pb;
+  pb.registerModuleAnalyses(mam);
+  pb.registerCGSCCAnalyses(cgam);
+  pb.registerFunctionAnalyses(fam);
+  pb.registerLoopAnalyses(lam);
+  pb.crossRegisterProxies(lam, fam, cgam, mam);
+
+  auto mpm = pb.buildPerModuleDefaultPipeline(llvm::OptimizationLevel::O2);
+  mpm.run(module, mam);
+}
+
+} // namespace
+
+size_t compile(parser &parser) {
+  if (!parser) { return 0; }
+
+  const auto &grammar = parser.get_grammar();
+
+  // Literals check words at runtime when there is a word expression
+  auto has_word = grammar.count(WORD_DEFINITION_NAME) > 0;
+  auto has_whitespace = grammar.count(WHITESPACE_DEFINITION_NAME) > 0;
+  auto token_rules = token_context_rules(grammar);
+
+  std::vector<Target> targets;
+  for (const auto &[name, rule] : grammar) {
+    auto literals = !has_word && (!has_whitespace || token_rules.count(name));
+    auto core = rule.get_core_operator();
+    FindTargets vis(literals, targets);
+    if (IsComposite::check(*core) && IsLowerable::check(*core, literals)) {
+      auto key = name;
+      targets.push_back({core, [&parser, key](const std::shared_ptr<Ope> &ope) {
+                           parser[key.c_str()] <= ope;
+                         }});
+    } else {
+      core->accept(vis);
+    }
+
+    // Literals in whitespace don't skip whitespace again
+    if (auto wsp = std::dynamic_pointer_cast<Whitespace>(rule.whitespaceOpe)) {
+      if (auto ign = std::dynamic_pointer_cast<Ignore>(wsp->ope_)) {
+        FindTargets vis(!has_word, targets);
+        vis.find(ign->ope_);
+      }
+    }
+  }
+  if (targets.empty()) { return 0; }
+
+  static std::once_flag init_target;
+  std::call_once(init_target, []() {
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+  });
+
+  auto engine = std::make_shared<Engine>();
+  engine->context = std::make_unique<llvm::LLVMContext>();
+  auto module = std::make_unique<llvm::Module>("peglib", *engine->context);
+
+  std::string error;
+  std::unique_ptr<llvm::TargetMachine> tm(
+      llvm::EngineBuilder().setErrorStr(&error).selectTarget());
+  if (!tm) { return 0; }
+  module->setDataLayout(tm->createDataLayout());
+  module->setTargetTriple(tm->getTargetTriple().str());
+
+  std::vector<std::string> names;
+  Lowering lowering(*module);
+  for (const auto &target : targets) {
+    auto fn = lowering.lower(*target.ope, "peg_jit_" +
+                                              std::to_string(names.size()));
+    names.push_back(fn->getName().str());
+  }
+  if (llvm::verifyModule(*module, &llvm::errs())) { return 0; }
+
+  optimize(*module);
+
+  engine->engine.reset(llvm::EngineBuilder(std::move(module))
+                           .setErrorStr(&error)
+                           .setEngineKind(llvm::EngineKind::JIT)
+                           .create(tm.release()));
+  if (!engine->engine) { return 0; }
+  engine->engine->finalizeObject();
+
+  std::vector<MatchFunction> fns;
+  for (const auto &name : names) {
+    auto addr = engine->engine->getFunctionAddress(name);
+    if (!addr) { return 0; }
+    fns.push_back(reinterpret_cast<MatchFunction>(addr));
+  }
+
+  // The engine lives as long as any compiled operator
+  for (size_t i = 0; i < targets.size(); i++) {
+    auto fn = fns[i];
+    targets[i].replace(usr([engine, fn](const char *s, size_t n,
+                                        SemanticValues & /*vs*/,
+                                        std::any & /*dt*/) { return fn(s, n); }));
+  }
+  return targets.size();
+}
+
+bool load_grammar(parser &parser, std::string_view syntax,
+                  const Rules &rules) {
+  if (!parser.load_grammar(syntax, rules)) { return false; }
+  compile(parser);
+  return true;
+}
+
+} // namespace jit
+} // namespace peg
@@ -0,0 +1,31 @@
+//
+//  peglib-jit.h
+//
+//  Copyright (c) 2022 Yuji Hirose. All rights reserved.
+//  MIT License
+//
+
+#pragma once
+
+#include <peglib.h>
+
+namespace peg {
+namespace jit {
+
+// Compiles the lexical parts of the loaded grammar to machine code with LLVM.
+// Expressions made only of literals, characters, character classes,
+// repetitions and predicates are lowered to native functions, and the rest of
+// the grammar keeps running on the interpreter. Semantic actions and ASTs are
+// unaffected, but error positions inside compiled expressions are not
+// tracked, so parse again with an interpreted parser for detailed errors.
+//
+// Returns the number of compiled expressions. 0 means the grammar has nothing
+// worth compiling, or LLVM failed, and the parser is left as it was.
+size_t compile(parser &parser);
+
+// Loads a grammar and compiles it.
+bool load_grammar(parser &parser, std::string_view syntax,
+                  const Rules &rules = Rules());
+
+} // namespace jit
+} // namespace peg
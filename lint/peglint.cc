@@ -5,6 +5,7 @@
 //  MIT License
 //
 
+#include <charconv>
 #include <fstream>
 #include <peglib.h>
 #include <sstream>
@@ -22,6 +23,12 @@ inline bool read_file(const char *path, vector<char> &buff) {
   return true;
 }
 
+inline bool parse_number(const string &s, size_t &n) {
+  auto end = s.data() + s.size();
+  auto [ptr, ec] = from_chars(s.data(), end, n);
+  return ec == errc() && ptr == end;
+}
+
 inline vector<string> split(const string &s, char delim) {
   vector<string> elems;
   stringstream ss(s);
@@ -43,6 +50,19 @@ int main(int argc, const char **argv) {
   auto opt_trace = false;
   auto opt_verbose = false;
   auto opt_profile = false;
+  auto opt_profile_format = peg::ProfileFormat::Table;
+  auto opt_heatmap = false;
+  auto opt_find_slow = false;
+  auto opt_analyze = false;
+  auto opt_auto_cut = false;
+  const char *opt_emit_cpp = nullptr;
+  const char *opt_binary_trace = nullptr;
+  const char *opt_decode_trace = nullptr;
+  const char *opt_trace_json = nullptr;
+  peg::ChromeTraceOptions opt_trace_json_options;
+  vector<string> opt_trace_rules;
+  size_t opt_trace_begin = 0;
+  size_t opt_trace_end = static_cast<size_t>(-1);
   vector<const char *> path_list;
 
   auto argi = 1;
@@ -70,8 +90,69 @@ int main(int argc, const char **argv) {
       opt_trace = true;
     } else if (string("--profile") == arg) {
       opt_profile = true;
+    } else if (string("--profile-format") == arg) {
+      opt_profile = true;
+      if (argi < argc) {
+        auto format = string(argv[argi++]);
+        if (format == "json") {
+          opt_profile_format = peg::ProfileFormat::Json;
+        } else if (format == "folded") {
+          opt_profile_format = peg::ProfileFormat::Folded;
+        } else if (format != "table") {
+          opt_help = true;
+        }
+      }
+    } else if (string("--analyze") == arg) {
+      opt_analyze = true;
+    } else if (string("--auto-cut") == arg) {
+      opt_auto_cut = true;
+    } else if (string("--find-slow") == arg) {
+      opt_find_slow = true;
+    } else if (string("--heatmap") == arg) {
+      opt_heatmap = true;
+    } else if (string("--binary-trace") == arg) {
+      if (argi < argc) { opt_binary_trace = argv[argi++]; }
+    } else if (string("--trace-rules") == arg) {
+      if (argi < argc) { opt_trace_rules = split(argv[argi++], ','); }
+    } else if (string("--trace-range") == arg) {
+      if (argi < argc) {
+        auto range = string(argv[argi++]);
+        auto colon = range.find(':');
+        if (colon != string::npos) {
+          auto begin = range.substr(0, colon);
+          auto end = range.substr(colon + 1);
+          if (!begin.empty() && !parse_number(begin, opt_trace_begin)) {
+            opt_help = true;
+          }
+          if (!end.empty() && !parse_number(end, opt_trace_end)) {
+            opt_help = true;
+          }
+        } else {
+          opt_help = true;
+        }
+      }
+    } else if (string("--trace-json") == arg) {
+      if (argi < argc) { opt_trace_json = argv[argi++]; }
+    } else if (string("--trace-json-depth") == arg) {
+      if (argi < argc &&
+          !parse_number(argv[argi++], opt_trace_json_options.max_depth)) {
+        opt_help = true;
+      }
+    } else if (string("--trace-json-min-us") == arg) {
+      if (argi < argc) {
+        size_t us;
+        if (parse_number(argv[argi++], us)) {
+          opt_trace_json_options.min_duration = chrono::microseconds(us);
+        } else {
+          opt_help = true;
+        }
+      }
+    } else if (string("--decode-trace") == arg) {
+      if (argi < argc) { opt_decode_trace = argv[argi++]; }
     } else if (string("--verbose") == arg) {
       opt_verbose = true;
+    } else if (string("--emit-cpp") == arg) {
+      if (argi < argc) { opt_emit_cpp = argv[argi++]; }
     } else {
       path_list.push_back(arg);
     }
@@ -88,7 +169,20 @@ int main(int argc, const char **argv) {
     --opt-only: optimize only AST nodes selected with `no_ast_opt` instruction
     --trace: show concise trace messages
     --profile: show profile report
+    --profile-format table|json|folded: show profile report in the format (folded stacks are for flame graphs)
+    --analyze: show where the grammar can parse the same input more than once, and how to avoid it
+    --auto-cut: insert cuts where the grammar can't match later alternatives, and show them
+    --find-slow: search for input that makes the parser backtrack the most, starting from the source text if any
+    --heatmap: show how many times each part of the source was examined, and by which rules
+    --binary-trace FILE: record the trace in a compact binary file
+    --trace-rules RULE,...: record only the parts of the trace inside the rules
+    --trace-range BEGIN:END: record only operators starting at byte offsets in [BEGIN, END)
+    --decode-trace FILE: print a binary trace file like --trace
+    --trace-json FILE: write rule calls in the Chrome trace event format for chrome://tracing or Perfetto
+    --trace-json-depth N: record only rules nested up to N deep
+    --trace-json-min-us N: record only rule calls that took N microseconds or more
     --verbose: verbose output for trace and profile
+    --emit-cpp NAME: print a C++ header defining `peg::parser NAME()`, which parses with a function per rule
 )";
 
     return 1;
@@ -111,7 +205,38 @@ int main(int argc, const char **argv) {
 
   if (!parser.load_grammar(syntax.data(), syntax.size())) { return -1; }
 
-  if (path_list.size() < 2 && !opt_source) { return 0; }
+  if (opt_emit_cpp) {
+    if (!parser.emit_cpp(cout, opt_emit_cpp)) {
+      cerr << "can't generate C++ code for the grammar." << endl;
+      return -1;
+    }
+    return 0;
+  }
+
+  if (opt_analyze) {
+    auto findings = peg::analyze_backtracking(
+        parser, string_view(syntax.data(), syntax.size()));
+    for (const auto &f : findings) {
+      cout << syntax_path << ":" << f.line << ":" << f.col << ": [" << f.rule
+           << "] " << f.message << endl;
+      cout << "  suggestion: " << f.suggestion << endl;
+    }
+  }
+
+  if (opt_auto_cut) {
+    auto cuts =
+        parser.enable_auto_cut(string_view(syntax.data(), syntax.size()));
+    for (const auto &cut : cuts) {
+      cout << syntax_path << ":" << cut.line << ":" << cut.col << ": ["
+           << cut.rule << "] cut inserted in alternative " << cut.alternative
+           << ": " << cut.text << endl;
+    }
+  }
+
+  if (path_list.size() < 2 && !opt_source && !opt_decode_trace &&
+      !opt_find_slow) {
+    return 0;
+  }
 
   // Check source
   std::string source_path = "[commandline]";
@@ -123,15 +248,75 @@ int main(int argc, const char **argv) {
     source_path = path_list[1];
   }
 
+  if (opt_decode_trace) {
+    peg::BinaryTrace trace;
+    ifstream ifs(opt_decode_trace, ios::in | ios::binary);
+    if (!trace.load(ifs)) {
+      cerr << "can't read the trace file." << endl;
+      return -1;
+    }
+    trace.decode(cout, string_view(source.data(), source.size()));
+    return 0;
+  }
+
   parser.set_logger([&](size_t ln, size_t col, const string &msg) {
     cerr << source_path << ":" << ln << ":" << col << ": " << msg << endl;
   });
 
   if (opt_packrat) { parser.enable_packrat_parsing(); }
 
+  if (opt_find_slow) {
+    parser.set_logger(peg::Log());
+
+    vector<string> seeds;
+    if (!source.empty()) { seeds.emplace_back(source.data(), source.size()); }
+
+    auto slow = find_slow_input(parser, seeds);
+    cout << "slowest input: " << slow.input.size() << " bytes, "
+         << slow.invocations << (slow.capped ? "+" : "")
+         << " operator calls, " << slow.invocations_per_byte()
+         << " per byte" << endl
+         << "'" << peg::escape_characters(slow.input) << "'" << endl
+         << endl
+         << "rule calls:" << endl;
+    for (const auto &[name, calls] : slow.rules) {
+      cout << "  " << name << " " << calls << endl;
+    }
+    return 0;
+  }
+
   if (opt_trace) { enable_tracing(parser, std::cout); }
 
-  if (opt_profile) { enable_profiling(parser, std::cout); }
+  peg::BinaryTrace binary_trace;
+  if (opt_binary_trace) {
+    binary_trace.set_rule_filter(opt_trace_rules);
+    binary_trace.set_range_filter(opt_trace_begin, opt_trace_end);
+    enable_binary_tracing(parser, binary_trace);
+  }
+  auto se = peg::scope_exit([&]() {
+    if (opt_binary_trace) {
+      ofstream ofs(opt_binary_trace, ios::out | ios::binary);
+      binary_trace.save(ofs);
+      if (binary_trace.dropped()) {
+        cerr << "trace buffer is full. " << binary_trace.dropped()
+             << " oldest events were dropped." << endl;
+      }
+    }
+  });
+
+  ofstream trace_json;
+  if (opt_trace_json) {
+    trace_json.open(opt_trace_json, ios::out);
+    if (trace_json.fail()) {
+      cerr << "can't open the trace file." << endl;
+      return -1;
+    }
+    enable_chrome_tracing(parser, trace_json, opt_trace_json_options);
+  }
+
+  if (opt_profile) { enable_profiling(parser, std::cout, opt_profile_format); }
+
+  if (opt_heatmap) { enable_heatmap(parser, std::cout); }
 
   parser.set_verbose_trace(opt_verbose);
 
@@ -17,12 +17,19 @@
 
 #include <algorithm>
 #include <any>
+#include <array>
+#include <atomic>
+#include <bitset>
 #include <cassert>
 #include <cctype>
 #if __has_include(<charconv>)
 #include <charconv>
 #endif
+#include <chrono>
+#include <cstdint>
 #include <cstring>
+#include <deque>
+#include <exception>
 #include <functional>
 #include <initializer_list>
 #include <iostream>
@@ -33,6 +40,7 @@
 #include <set>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
@@ -101,14 +109,77 @@ inline size_t codepoint_length(const char *s8, size_t l) {
   return 0;
 }
 
+// The text is scanned eight bytes at a time in a 64-bit word, which compilers
+// turn into vector code where it pays off.
+inline uint64_t load_word(const char *s8) {
+  uint64_t w;
+  std::memcpy(&w, s8, sizeof(w));
+  return w;
+}
+
+constexpr uint64_t high_bits = 0x8080808080808080ull;
+
+// Counts the bytes that aren't continuation bytes, which is the number of
+// code points if the text is valid UTF-8.
 inline size_t codepoint_count(const char *s8, size_t l) {
   size_t count = 0;
-  for (size_t i = 0; i < l; i += codepoint_length(s8 + i, l - i)) {
-    count++;
+  size_t i = 0;
+  for (; i + 8 <= l; i += 8) {
+    auto w = load_word(s8 + i);
+    auto cont = (w & ~(w << 1) & high_bits) >> 7; // 10xxxxxx
+    count += 8 - static_cast<size_t>((cont * 0x0101010101010101ull) >> 56);
+  }
+  for (; i < l; i++) {
+    if ((s8[i] & 0xC0) != 0x80) { count++; }
   }
   return count;
 }
 
+// Length of the valid UTF-8 prefix of the text, so `l` if it is all valid.
+// Overlong forms, surrogates and code points above U+10FFFF are invalid.
+inline size_t valid_utf8_length(const char *s8, size_t l) {
+  size_t i = 0;
+  while (i < l) {
+    if (i + 8 <= l && !(load_word(s8 + i) & high_bits)) {
+      i += 8;
+      continue;
+    }
+
+    auto b = static_cast<uint8_t>(s8[i]);
+    if (b < 0x80) {
+      i++;
+      continue;
+    }
+
+    // Range of the second byte, which rules out the invalid code points
+    size_t len = 0;
+    uint8_t lo = 0x80;
+    uint8_t hi = 0xBF;
+    if (0xC2 <= b && b <= 0xDF) {
+      len = 2;
+    } else if (0xE0 <= b && b <= 0xEF) {
+      len = 3;
+      if (b == 0xE0) { lo = 0xA0; }
+      if (b == 0xED) { hi = 0x9F; }
+    } else if (0xF0 <= b && b <= 0xF4) {
+      len = 4;
+      if (b == 0xF0) { lo = 0x90; }
+      if (b == 0xF4) { hi = 0x8F; }
+    } else {
+      return i;
+    }
+
+    if (l - i < len) { return i; }
+    auto b1 = static_cast<uint8_t>(s8[i + 1]);
+    if (b1 < lo || hi < b1) { return i; }
+    for (size_t j = 2; j < len; j++) {
+      if ((s8[i + j] & 0xC0) != 0x80) { return i; }
+    }
+    i += len;
+  }
+  return l;
+}
+
 inline size_t encode_codepoint(char32_t cp, char *buff) {
   if (cp < 0x0080) {
     buff[0] = static_cast<char>(cp & 0x7F);
@@ -387,6 +458,7 @@ public:
       : ignore_case_(ignore_case) {
     size_t id = 0;
     for (const auto &item : items) {
+      max_length_ = (std::max)(max_length_, item.size());
       const auto &s = ignore_case ? to_lower(item) : item;
       for (size_t len = 1; len <= item.size(); len++) {
         auto last = len == item.size();
@@ -433,6 +505,22 @@ public:
 
   size_t size() const { return dic_.size(); }
 
+  size_t max_length() const { return max_length_; }
+
+  bool ignore_case() const { return ignore_case_; }
+
+  // Items in their original order. Lower-cased if the trie ignores case.
+  std::vector<std::string> items() const {
+    std::vector<std::string> items;
+    for (const auto &[key, info] : dic_) {
+      if (info.match) {
+        if (info.id >= items.size()) { items.resize(info.id + 1); }
+        items[info.id] = key;
+      }
+    }
+    return items;
+  }
+
 private:
   std::string to_lower(std::string s) const {
     for (char &c : s) {
@@ -452,6 +540,7 @@ private:
   std::map<std::string, Info, std::less<>> dic_;
 
   bool ignore_case_;
+  size_t max_length_ = 0;
 };
 
 /*-----------------------------------------------------------------------------
@@ -531,6 +620,13 @@ struct SemanticValues : protected std::vector<std::any> {
   // Choice number (0 based index)
   size_t choice() const { return choice_; }
 
+  // Sets the choice number, for the parse functions generated by
+  // parser::emit_cpp
+  void set_choice(size_t choice, size_t choice_count) {
+    choice_ = choice;
+    choice_count_ = choice_count;
+  }
+
   // Tokens
   std::vector<std::string_view> tokens;
 
@@ -751,6 +847,361 @@ private:
   }
 };
 
+/*
+ * Incremental parse state
+ */
+struct TextEdit {
+  size_t offset = 0;
+  size_t removed = 0;
+  std::string inserted;
+};
+
+class ParseState {
+public:
+  ParseState() : text_(std::make_shared<std::string>()) {}
+
+  explicit ParseState(std::string_view text)
+      : text_(std::make_shared<std::string>(text)) {}
+
+  const std::string &text() const { return *text_; }
+
+  size_t memo_size() const { return memo_.size(); }
+
+  void apply_edits(const std::vector<TextEdit> &edits);
+
+  void clear_memo() {
+    memo_.clear();
+    pending_.clear();
+  }
+
+private:
+  friend class Context;
+  friend class Definition;
+
+  struct MemoEntry {
+    size_t pos;
+    size_t def_id;
+    size_t len;
+    size_t examined;
+    std::any val;
+    // Semantic values may refer to the text they were parsed from
+    std::shared_ptr<const std::string> text;
+  };
+
+  static bool less(const MemoEntry &a, const MemoEntry &b) {
+    return a.pos < b.pos || (a.pos == b.pos && a.def_id < b.def_id);
+  }
+
+  const MemoEntry *find(size_t pos, size_t def_id) const {
+    auto it = std::lower_bound(
+        memo_.begin(), memo_.end(), std::pair(pos, def_id),
+        [](const MemoEntry &m, const std::pair<size_t, size_t> &key) {
+          return m.pos < key.first ||
+                 (m.pos == key.first && m.def_id < key.second);
+        });
+    if (it != memo_.end() && it->pos == pos && it->def_id == def_id) {
+      return &*it;
+    }
+    return nullptr;
+  }
+
+  void bind(const void *owner, size_t def_count) {
+    if (owner_ != owner || def_count_ != def_count) {
+      clear_memo();
+      owner_ = owner;
+      def_count_ = def_count;
+    }
+  }
+
+  void commit() {
+    std::sort(pending_.begin(), pending_.end(), less);
+    auto mid = memo_.size();
+    memo_.insert(memo_.end(), std::make_move_iterator(pending_.begin()),
+                 std::make_move_iterator(pending_.end()));
+    std::inplace_merge(memo_.begin(), memo_.begin() + mid, memo_.end(), less);
+    pending_.clear();
+  }
+
+  std::shared_ptr<std::string> text_;
+  std::vector<MemoEntry> memo_;
+  std::vector<MemoEntry> pending_;
+  const void *owner_ = nullptr;
+  size_t def_count_ = 0;
+};
+
+inline void ParseState::apply_edits(const std::vector<TextEdit> &edits) {
+  if (edits.empty()) { return; }
+
+  // Strings referenced by retained semantic values must stay untouched, so
+  // edits are applied to a fresh copy of the text.
+  auto text = std::make_shared<std::string>(*text_);
+
+  for (const auto &edit : edits) {
+    if (edit.offset > text->size() ||
+        edit.removed > text->size() - edit.offset) {
+      throw std::out_of_range("Invalid text edit range...");
+    }
+    text->replace(edit.offset, edit.removed, edit.inserted);
+
+    // Shift entries after the edit and drop the ones which examined it
+    auto end = edit.offset + edit.removed;
+    size_t j = 0;
+    for (size_t i = 0; i < memo_.size(); i++) {
+      auto &m = memo_[i];
+      if (m.pos >= end) {
+        m.pos = m.pos - edit.removed + edit.inserted.size();
+      } else if (m.pos + m.examined > edit.offset) {
+        continue;
+      }
+      if (i != j) { memo_[j] = std::move(m); }
+      j++;
+    }
+    memo_.resize(j);
+  }
+
+  if (!std::is_sorted(memo_.begin(), memo_.end(), less)) {
+    std::stable_sort(memo_.begin(), memo_.end(), less);
+  }
+  memo_.erase(std::unique(memo_.begin(), memo_.end(),
+                          [](const MemoEntry &a, const MemoEntry &b) {
+                            return a.pos == b.pos && a.def_id == b.def_id;
+                          }),
+              memo_.end());
+
+  text_ = text;
+}
+
+/*
+ * Metrics
+ */
+
+// Aggregates parse counts, parse latency and per-rule call counts over many
+// parses and threads. Each thread updates its own shard without locking, and
+// the shards are merged when a snapshot is taken. A registry is attached to
+// one parser with parser::enable_metrics and must outlive its use there.
+class MetricsRegistry {
+public:
+  // Upper bounds of the latency histogram buckets, in nanoseconds. The last
+  // bucket has no upper bound.
+  static constexpr std::array<uint64_t, 12> latency_bounds = {
+      10'000,     50'000,     100'000,     500'000,     1'000'000,
+      5'000'000,  10'000'000, 50'000'000,  100'000'000, 500'000'000,
+      1'000'000'000, 5'000'000'000};
+
+  struct Snapshot {
+    struct Rule {
+      std::string name;
+      uint64_t success = 0;
+      uint64_t fail = 0;
+    };
+
+    uint64_t parses = 0;
+    uint64_t failures = 0;
+    uint64_t latency_sum_ns = 0;
+    // Not cumulative. The last one counts parses above all bounds.
+    std::array<uint64_t, latency_bounds.size() + 1> latency_buckets{};
+    std::vector<Rule> rules;
+  };
+
+  class Shard {
+  public:
+    void count_rule(size_t id, bool success) {
+      increment(rules_[id * 2 + (success ? 0 : 1)]);
+    }
+
+    void count_parse(bool success, std::chrono::nanoseconds duration) {
+      auto ns = static_cast<uint64_t>(duration.count());
+      increment(parses_);
+      if (!success) { increment(failures_); }
+      latency_sum_ns_.store(latency_sum_ns_.load(std::memory_order_relaxed) +
+                                ns,
+                            std::memory_order_relaxed);
+      size_t i = 0;
+      while (i < latency_bounds.size() && ns > latency_bounds[i]) {
+        i++;
+      }
+      increment(latency_buckets_[i]);
+    }
+
+  private:
+    friend class MetricsRegistry;
+
+    using Counter = std::atomic<uint64_t>;
+
+    // Only the owning thread writes, so a relaxed load and store is enough.
+    static void increment(Counter &counter) {
+      counter.store(counter.load(std::memory_order_relaxed) + 1,
+                    std::memory_order_relaxed);
+    }
+
+    void reserve(size_t rule_count) {
+      if (rule_count <= rule_count_) { return; }
+      auto rules = std::make_unique<Counter[]>(rule_count * 2);
+      for (size_t i = 0; i < rule_count_ * 2; i++) {
+        rules[i].store(rules_[i].load(std::memory_order_relaxed),
+                       std::memory_order_relaxed);
+      }
+      std::lock_guard<std::mutex> guard(mutex_);
+      rules_.swap(rules);
+      rule_count_ = rule_count;
+    }
+
+    Counter parses_{0};
+    Counter failures_{0};
+    Counter latency_sum_ns_{0};
+    std::array<Counter, latency_bounds.size() + 1> latency_buckets_{};
+    std::unique_ptr<Counter[]> rules_;
+    size_t rule_count_ = 0;
+    std::mutex mutex_;
+  };
+
+  MetricsRegistry() : serial_(next_serial()) {}
+
+  MetricsRegistry(const MetricsRegistry &) = delete;
+  MetricsRegistry &operator=(const MetricsRegistry &) = delete;
+
+  // Returns the calling thread's shard, sized for `rule_count` rules.
+  Shard &local_shard(size_t rule_count) {
+    // The registry owns the shards. Each thread caches the last one it used,
+    // keyed by the registry's serial number, which is never reused, so the
+    // cache can't point to a shard of a registry that is gone.
+    thread_local struct {
+      uint64_t serial = 0;
+      Shard *shard = nullptr;
+    } cache;
+
+    if (cache.serial != serial_) {
+      std::lock_guard<std::mutex> guard(mutex_);
+      auto &shard = shards_[std::this_thread::get_id()];
+      if (!shard) { shard = std::make_unique<Shard>(); }
+      cache.serial = serial_;
+      cache.shard = shard.get();
+    }
+    cache.shard->reserve(rule_count);
+    return *cache.shard;
+  }
+
+  void set_rule_names(std::vector<std::string> names) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    rule_names_ = std::move(names);
+  }
+
+  // Counts since construction or the last reset.
+  Snapshot snapshot() const {
+    std::lock_guard<std::mutex> guard(mutex_);
+    auto snapshot = merge();
+    snapshot.parses -= baseline_.parses;
+    snapshot.failures -= baseline_.failures;
+    snapshot.latency_sum_ns -= baseline_.latency_sum_ns;
+    for (size_t i = 0; i < snapshot.latency_buckets.size(); i++) {
+      snapshot.latency_buckets[i] -= baseline_.latency_buckets[i];
+    }
+    for (size_t i = 0; i < snapshot.rules.size(); i++) {
+      if (i < baseline_.rules.size()) {
+        snapshot.rules[i].success -= baseline_.rules[i].success;
+        snapshot.rules[i].fail -= baseline_.rules[i].fail;
+      }
+    }
+    return snapshot;
+  }
+
+  // Shards are never written by other threads, so a reset only moves the
+  // baseline that snapshots are measured from.
+  void reset() {
+    std::lock_guard<std::mutex> guard(mutex_);
+    baseline_ = merge();
+  }
+
+  // Writes a snapshot in the Prometheus text exposition format.
+  void write_prometheus(std::ostream &os,
+                        const std::string &prefix = "peglib") const {
+    auto s = snapshot();
+
+    os << "# HELP " << prefix << "_parses_total Number of parses.\n"
+       << "# TYPE " << prefix << "_parses_total counter\n"
+       << prefix << "_parses_total " << s.parses << "\n";
+
+    os << "# HELP " << prefix
+       << "_parse_failures_total Number of parses that failed.\n"
+       << "# TYPE " << prefix << "_parse_failures_total counter\n"
+       << prefix << "_parse_failures_total " << s.failures << "\n";
+
+    auto name = prefix + "_parse_duration_seconds";
+    os << "# HELP " << name << " Parse latency.\n"
+       << "# TYPE " << name << " histogram\n";
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i < s.latency_buckets.size(); i++) {
+      cumulative += s.latency_buckets[i];
+      os << name << "_bucket{le=\"";
+      if (i < latency_bounds.size()) {
+        os << latency_bounds[i] / 1e9;
+      } else {
+        os << "+Inf";
+      }
+      os << "\"} " << cumulative << "\n";
+    }
+    os << name << "_sum " << s.latency_sum_ns / 1e9 << "\n"
+       << name << "_count " << s.parses << "\n";
+
+    name = prefix + "_rule_calls_total";
+    os << "# HELP " << name << " Number of rule calls by result.\n"
+       << "# TYPE " << name << " counter\n";
+    for (const auto &rule : s.rules) {
+      std::string label;
+      for (auto ch : rule.name) {
+        if (ch == '\\' || ch == '"') { label += '\\'; }
+        label += ch;
+      }
+      os << name << "{rule=\"" << label << "\",result=\"success\"} "
+         << rule.success << "\n"
+         << name << "{rule=\"" << label << "\",result=\"fail\"} "
+         << rule.fail << "\n";
+    }
+  }
+
+private:
+  static uint64_t next_serial() {
+    static std::atomic<uint64_t> serial{0};
+    return ++serial;
+  }
+
+  Snapshot merge() const {
+    Snapshot snapshot;
+    snapshot.rules.resize(rule_names_.size());
+    for (size_t i = 0; i < rule_names_.size(); i++) {
+      snapshot.rules[i].name = rule_names_[i];
+    }
+
+    auto load = [](const Shard::Counter &counter) {
+      return counter.load(std::memory_order_relaxed);
+    };
+
+    for (const auto &[_, shard] : shards_) {
+      snapshot.parses += load(shard->parses_);
+      snapshot.failures += load(shard->failures_);
+      snapshot.latency_sum_ns += load(shard->latency_sum_ns_);
+      for (size_t i = 0; i < snapshot.latency_buckets.size(); i++) {
+        snapshot.latency_buckets[i] += load(shard->latency_buckets_[i]);
+      }
+
+      std::lock_guard<std::mutex> guard(shard->mutex_);
+      auto n = (std::min)(shard->rule_count_, snapshot.rules.size());
+      for (size_t i = 0; i < n; i++) {
+        snapshot.rules[i].success += load(shard->rules_[i * 2]);
+        snapshot.rules[i].fail += load(shard->rules_[i * 2 + 1]);
+      }
+    }
+    return snapshot;
+  }
+
+  const uint64_t serial_;
+  mutable std::mutex mutex_;
+  // Shards of threads that have exited are kept for their counts
+  std::unordered_map<std::thread::id, std::unique_ptr<Shard>> shards_;
+  std::vector<std::string> rule_names_;
+  Snapshot baseline_;
+};
+
 /*
  * Context
  */
@@ -766,6 +1217,42 @@ using TracerLeave = std::function<void(
 
 using TracerStartOrEnd = std::function<void(std::any &trace_data)>;
 
+// Results of speculative parses of one rule, filled in by worker threads
+// ahead of the serial parse. The input is divided into equally sized chunks
+// and a chunk becomes visible to the serial parse once its worker is done.
+struct Speculation {
+  struct Fragment {
+    size_t pos;
+    size_t len;
+    std::any val;
+  };
+
+  struct Chunk {
+    std::atomic<bool> done{false};
+    std::vector<Fragment> fragments;
+  };
+
+  Speculation(const Definition *rule, size_t chunk_size, size_t chunk_count)
+      : rule(rule), chunk_size(chunk_size), chunks(chunk_count) {}
+
+  const Fragment *find(size_t pos) const {
+    auto k = pos / chunk_size;
+    if (k >= chunks.size() || !chunks[k].done.load(std::memory_order_acquire)) {
+      return nullptr;
+    }
+    const auto &fragments = chunks[k].fragments;
+    auto it = std::lower_bound(
+        fragments.begin(), fragments.end(), pos,
+        [](const Fragment &f, size_t pos) { return f.pos < pos; });
+    if (it != fragments.end() && it->pos == pos) { return &*it; }
+    return nullptr;
+  }
+
+  const Definition *rule;
+  const size_t chunk_size;
+  std::vector<Chunk> chunks;
+};
+
 class Context {
 public:
   const char *path;
@@ -788,8 +1275,15 @@ public:
 
   std::shared_ptr<Ope> wordOpe;
 
-  std::vector<std::map<std::string_view, std::string>> capture_scope_stack;
-  size_t capture_scope_stack_size = 0;
+  // Captured text, most recent last. Each entry points into the input.
+  struct CaptureValue {
+    std::string_view name;
+    std::string_view text;
+  };
+  std::vector<CaptureValue> capture_values;
+
+  // Back reference text that error messages point to
+  std::unordered_set<std::string> back_reference_literals;
 
   std::vector<bool> cut_stack;
 
@@ -801,34 +1295,60 @@ public:
   std::map<std::pair<size_t, size_t>, std::tuple<size_t, std::any>>
       cache_values;
 
+  // Furthest input offset (exclusive) inspected so far. Inspecting the end of
+  // input counts as one extra byte, so appended text invalidates memo entries.
+  size_t examined_end = 0;
+
+  // Whether terminals update examined_end. Only incremental reparsing and
+  // tracers that report examined bytes need it.
+  bool track_examined = false;
+
+  ParseState *parse_state = nullptr;
+  const Speculation *speculation = nullptr;
+  std::unordered_map<size_t, size_t> cache_examined;
+
   TracerEnter tracer_enter;
   TracerLeave tracer_leave;
   std::any trace_data;
   const bool verbose_trace;
 
+  // Set by a tracer to end the parse early. Traced operators entered after
+  // it is set fail without reading the input.
+  mutable bool stop_parse = false;
+
+  // Profiling support: whether the last rule was served from the memo table,
+  // and the total time spent in semantic actions while tracing.
+  bool memo_hit = false;
+  std::chrono::steady_clock::duration action_time{};
+
+  MetricsRegistry::Shard *metrics = nullptr;
+
   Log log;
 
+  // Packrat results are memoized for positions in [memo_begin, memo_end),
+  // which is the whole input by default.
   Context(const char *path, const char *s, size_t l, size_t def_count,
           std::shared_ptr<Ope> whitespaceOpe, std::shared_ptr<Ope> wordOpe,
           bool enablePackratParsing, TracerEnter tracer_enter,
           TracerLeave tracer_leave, std::any trace_data, bool verbose_trace,
-          Log log)
+          Log log, size_t memo_begin = 0,
+          size_t memo_end = static_cast<size_t>(-1))
       : path(path), s(s), l(l), whitespaceOpe(whitespaceOpe), wordOpe(wordOpe),
         def_count(def_count), enablePackratParsing(enablePackratParsing),
-        cache_registered(enablePackratParsing ? def_count * (l + 1) : 0),
-        cache_success(enablePackratParsing ? def_count * (l + 1) : 0),
-        tracer_enter(tracer_enter), tracer_leave(tracer_leave),
-        trace_data(trace_data), verbose_trace(verbose_trace), log(log) {
+        track_examined(tracer_enter != nullptr), tracer_enter(tracer_enter),
+        tracer_leave(tracer_leave), trace_data(trace_data),
+        verbose_trace(verbose_trace), log(log), memo_begin_(memo_begin),
+        memo_end_((std::min)(memo_end, l + 1)) {
+    if (enablePackratParsing && memo_begin_ < memo_end_) {
+      cache_registered.resize(def_count * (memo_end_ - memo_begin_));
+      cache_success.resize(def_count * (memo_end_ - memo_begin_));
+    }
 
     push_args({});
-    push_capture_scope();
   }
 
   ~Context() {
-    pop_capture_scope();
-
     assert(!value_stack_size);
-    assert(!capture_scope_stack_size);
     assert(cut_stack.empty());
   }
 
@@ -841,13 +1361,22 @@ public:
                T fn) {
     if (!enablePackratParsing) {
       fn(val);
+      memo_hit = false;
       return;
     }
 
-    auto col = a_s - s;
-    auto idx = def_count * static_cast<size_t>(col) + def_id;
+    auto col = static_cast<size_t>(a_s - s);
+    if (col < memo_discarded_end_ || col < memo_begin_ || col >= memo_end_) {
+      fn(val);
+      memo_hit = false;
+      return;
+    }
+
+    auto idx = def_count * (col - memo_begin_) + def_id;
 
     if (cache_registered[idx]) {
+      memo_hit = true;
+      if (parse_state) { mark_examined(a_s, cache_examined[idx]); }
       if (cache_success[idx]) {
         auto key = std::pair(col, def_id);
         std::tie(len, val) = cache_values[key];
@@ -856,10 +1385,38 @@ public:
         len = static_cast<size_t>(-1);
         return;
       }
-    } else {
+    } else if (!parse_state) {
       fn(val);
+      memo_hit = false;
+      cache_registered[idx] = true;
+      cache_success[idx] = success(len);
+      if (success(len)) {
+        auto key = std::pair(col, def_id);
+        cache_values[key] = std::pair(len, val);
+      }
+      return;
+    } else {
+      size_t examined;
+      if (auto m = parse_state->find(col, def_id)) {
+        memo_hit = true;
+        len = m->len;
+        val = m->val;
+        examined = m->examined;
+      } else {
+        auto save_examined_end = examined_end;
+        examined_end = col;
+        fn(val);
+        memo_hit = false;
+        examined = examined_end - col;
+        examined_end = (std::max)(examined_end, save_examined_end);
+        parse_state->pending_.push_back(ParseState::MemoEntry{
+            col, def_id, len, examined, val,
+            val.has_value() ? parse_state->text_ : nullptr});
+      }
+      mark_examined(a_s, examined);
       cache_registered[idx] = true;
       cache_success[idx] = success(len);
+      cache_examined[idx] = examined;
       if (success(len)) {
         auto key = std::pair(col, def_id);
         cache_values[key] = std::pair(len, val);
@@ -868,16 +1425,37 @@ public:
     }
   }
 
-  SemanticValues &push() {
-    push_capture_scope();
-    return push_semantic_values_scope();
+  // Forgets memo entries for positions before `a_s`. Called when an
+  // automatically inserted cut commits the outermost choice, since no choice
+  // can backtrack there any more. Predicates still can, so positions below
+  // the discarded end are parsed again and never memoized.
+  void discard_memo(const char *a_s) {
+    if (!enablePackratParsing || parse_state || speculation) { return; }
+    auto col = static_cast<size_t>(a_s - s);
+    if (col <= memo_discarded_end_) { return; }
+    cache_values.erase(cache_values.begin(),
+                       cache_values.lower_bound(std::pair(col, size_t(0))));
+    auto begin = (std::max)(memo_discarded_end_, memo_begin_);
+    auto end = (std::min)(col, memo_end_);
+    if (begin < end) {
+      auto first =
+          static_cast<std::ptrdiff_t>(def_count * (begin - memo_begin_));
+      auto last = static_cast<std::ptrdiff_t>(def_count * (end - memo_begin_));
+      std::fill(cache_registered.begin() + first,
+                cache_registered.begin() + last, false);
+    }
+    memo_discarded_end_ = col;
   }
 
-  void pop() {
-    pop_capture_scope();
-    pop_semantic_values_scope();
+  void mark_examined(const char *a_s, size_t len) {
+    auto end = static_cast<size_t>(a_s - s) + len;
+    if (end > examined_end) { examined_end = end; }
   }
 
+  SemanticValues &push() { return push_semantic_values_scope(); }
+
+  void pop() { pop_semantic_values_scope(); }
+
   // Semantic values
   SemanticValues &push_semantic_values_scope() {
     assert(value_stack_size <= value_stack.size());
@@ -903,6 +1481,15 @@ public:
 
   void pop_semantic_values_scope() { value_stack_size--; }
 
+  // Reuses the semantic value buffers left over from a previous parse
+  void
+  adopt_value_stack(std::vector<std::shared_ptr<SemanticValues>> &values) {
+    value_stack.swap(values);
+    for (auto &vs : value_stack) {
+      vs->c_ = this;
+    }
+  }
+
   // Arguments
   void push_args(std::vector<std::shared_ptr<Ope>> &&args) {
     args_stack.emplace_back(args);
@@ -914,28 +1501,24 @@ public:
     return args_stack[args_stack.size() - 1];
   }
 
-  // Capture scope
-  void push_capture_scope() {
-    assert(capture_scope_stack_size <= capture_scope_stack.size());
-    if (capture_scope_stack_size == capture_scope_stack.size()) {
-      capture_scope_stack.emplace_back(
-          std::map<std::string_view, std::string>());
-    } else {
-      auto &cs = capture_scope_stack[capture_scope_stack_size];
-      if (!cs.empty()) { cs.clear(); }
-    }
-    capture_scope_stack_size++;
+  // Capture scope. A scope is the number of capture values when it was
+  // entered, and leaving it without keeping them drops the values set since,
+  // so a scope without captures costs nothing.
+  size_t capture_scope() const { return capture_values.size(); }
+
+  void discard_capture_values(size_t scope) {
+    if (capture_values.size() > scope) { capture_values.resize(scope); }
   }
 
-  void pop_capture_scope() { capture_scope_stack_size--; }
+  void set_capture_value(std::string_view name, const char *a_s, size_t a_n) {
+    capture_values.push_back({name, std::string_view(a_s, a_n)});
+  }
 
-  void shift_capture_values() {
-    assert(capture_scope_stack_size >= 2);
-    auto curr = &capture_scope_stack[capture_scope_stack_size - 1];
-    auto prev = curr - 1;
-    for (const auto &[k, v] : *curr) {
-      (*prev)[k] = v;
+  const std::string_view *find_capture_value(std::string_view name) const {
+    for (auto it = capture_values.rbegin(); it != capture_values.rend(); ++it) {
+      if (it->name == name) { return &it->text; }
     }
+    return nullptr;
   }
 
   // Error
@@ -973,6 +1556,31 @@ public:
   bool ignore_trace_state = false;
   mutable std::once_flag source_line_index_init_;
   mutable std::vector<size_t> source_line_index;
+
+private:
+  const size_t memo_begin_;
+  const size_t memo_end_;
+  size_t memo_discarded_end_ = 0;
+};
+
+// Hides operators parsed in its scope from the tracer, unless the trace is
+// verbose. It does nothing when tracing is compiled out.
+class IgnoreTraceState {
+public:
+#ifdef CPPPEGLIB_DISABLE_TRACE
+  IgnoreTraceState(Context & /*c*/, bool /*ignore*/ = true) {}
+#else
+  IgnoreTraceState(Context &c, bool ignore = true)
+      : c_(c), save_(c.ignore_trace_state) {
+    if (ignore) { c.ignore_trace_state = !c.verbose_trace; }
+  }
+
+  ~IgnoreTraceState() { c_.ignore_trace_state = save_; }
+
+private:
+  Context &c_;
+  bool save_;
+#endif
 };
 
 /*
@@ -1036,15 +1644,17 @@ public:
       if (!for_label_) { c.cut_stack.pop_back(); }
     });
 
+    auto captures = c.capture_scope();
+
     size_t id = 0;
     for (const auto &ope : opes_) {
       if (!c.cut_stack.empty()) { c.cut_stack.back() = false; }
 
       auto &chvs = c.push();
-      c.error_info.keep_previous_token = id > 0;
+      if (c.log) { c.error_info.keep_previous_token = id > 0; }
       auto se = scope_exit([&]() {
         c.pop();
-        c.error_info.keep_previous_token = false;
+        if (c.log) { c.error_info.keep_previous_token = false; }
       });
 
       len = ope->parse(s, n, chvs, c, dt);
@@ -1053,12 +1663,12 @@ public:
         vs.append(chvs);
         vs.choice_count_ = opes_.size();
         vs.choice_ = id;
-        c.shift_capture_values();
-        break;
-      } else if (!c.cut_stack.empty() && c.cut_stack.back()) {
         break;
       }
 
+      c.discard_capture_values(captures);
+      if (!c.cut_stack.empty() && c.cut_stack.back()) { break; }
+
       id++;
     }
 
@@ -1071,6 +1681,7 @@ public:
 
   std::vector<std::shared_ptr<Ope>> opes_;
   bool for_label_ = false;
+  const char *s_ = nullptr; // position in the grammar text, if any
 };
 
 class Repetition : public Ope {
@@ -1083,6 +1694,7 @@ public:
     size_t count = 0;
     size_t i = 0;
     while (count < min_) {
+      auto captures = c.capture_scope();
       auto &chvs = c.push();
       auto se = scope_exit([&]() { c.pop(); });
 
@@ -1090,8 +1702,8 @@ public:
 
       if (success(len)) {
         vs.append(chvs);
-        c.shift_capture_values();
       } else {
+        c.discard_capture_values(captures);
         return len;
       }
       i += len;
@@ -1099,6 +1711,7 @@ public:
     }
 
     while (count < max_) {
+      auto captures = c.capture_scope();
       auto &chvs = c.push();
       auto se = scope_exit([&]() { c.pop(); });
 
@@ -1106,8 +1719,8 @@ public:
 
       if (success(len)) {
         vs.append(chvs);
-        c.shift_capture_values();
       } else {
+        c.discard_capture_values(captures);
         break;
       }
       i += len;
@@ -1147,8 +1760,12 @@ public:
 
   size_t parse_core(const char *s, size_t n, SemanticValues & /*vs*/,
                     Context &c, std::any &dt) const override {
+    auto captures = c.capture_scope();
     auto &chvs = c.push();
-    auto se = scope_exit([&]() { c.pop(); });
+    auto se = scope_exit([&]() {
+      c.pop();
+      c.discard_capture_values(captures);
+    });
 
     auto len = ope_->parse(s, n, chvs, c, dt);
 
@@ -1162,6 +1779,7 @@ public:
   void accept(Visitor &v) override;
 
   std::shared_ptr<Ope> ope_;
+  const char *s_ = nullptr; // position in the grammar text, if any
 };
 
 class NotPredicate : public Ope {
@@ -1170,8 +1788,12 @@ public:
 
   size_t parse_core(const char *s, size_t n, SemanticValues & /*vs*/,
                     Context &c, std::any &dt) const override {
+    auto captures = c.capture_scope();
     auto &chvs = c.push();
-    auto se = scope_exit([&]() { c.pop(); });
+    auto se = scope_exit([&]() {
+      c.pop();
+      c.discard_capture_values(captures);
+    });
     auto len = ope_->parse(s, n, chvs, c, dt);
     if (success(len)) {
       c.set_error_pos(s);
@@ -1184,6 +1806,7 @@ public:
   void accept(Visitor &v) override;
 
   std::shared_ptr<Ope> ope_;
+  const char *s_ = nullptr; // position in the grammar text, if any
 };
 
 class Dictionary : public Ope, public std::enable_shared_from_this<Dictionary> {
@@ -1239,23 +1862,44 @@ public:
       }
     }
     assert(!ranges_.empty());
+    init_ascii_bits();
   }
 
   CharacterClass(const std::vector<std::pair<char32_t, char32_t>> &ranges,
                  bool negated, bool ignore_case)
       : ranges_(ranges), negated_(negated), ignore_case_(ignore_case) {
     assert(!ranges_.empty());
+    init_ascii_bits();
   }
 
   size_t parse_core(const char *s, size_t n, SemanticValues & /*vs*/,
                     Context &c, std::any & /*dt*/) const override {
     if (n < 1) {
+      if (c.track_examined) { c.mark_examined(s, 1); }
+      c.set_error_pos(s);
+      return static_cast<size_t>(-1);
+    }
+
+    // ASCII is matched by a table lookup without decoding
+    auto b = static_cast<uint8_t>(s[0]);
+    if (b < 0x80) {
+      if (c.track_examined) { c.mark_examined(s, 1); }
+      if (ascii_bits_[b]) { return 1; }
       c.set_error_pos(s);
       return static_cast<size_t>(-1);
     }
 
     char32_t cp = 0;
     auto len = decode_codepoint(s, n, cp);
+    if (c.track_examined) {
+      c.mark_examined(s, (std::max)(len, static_cast<size_t>(1)));
+    }
+
+    // Invalid UTF-8 matches neither a class nor its negation
+    if (!len) {
+      c.set_error_pos(s);
+      return static_cast<size_t>(-1);
+    }
 
     for (const auto &range : ranges_) {
       if (in_range(range, cp)) {
@@ -1278,7 +1922,17 @@ public:
 
   void accept(Visitor &v) override;
 
+  const std::vector<std::pair<char32_t, char32_t>> &ranges() const {
+    return ranges_;
+  }
+  bool negated() const { return negated_; }
+  bool ignore_case() const { return ignore_case_; }
+
 private:
+  friend class GrammarSnapshot;
+  friend class CppEmitter;
+  friend class CppRuleEmitter;
+
   bool in_range(const std::pair<char32_t, char32_t> &range, char32_t cp) const {
     if (ignore_case_) {
       auto cpl = std::tolower(cp);
@@ -1289,9 +1943,19 @@ private:
     }
   }
 
+  void init_ascii_bits() {
+    for (char32_t cp = 0; cp < 0x80; cp++) {
+      auto in = std::any_of(
+          ranges_.begin(), ranges_.end(),
+          [&](const auto &range) { return in_range(range, cp); });
+      ascii_bits_[cp] = in != negated_;
+    }
+  }
+
   std::vector<std::pair<char32_t, char32_t>> ranges_;
   bool negated_;
   bool ignore_case_;
+  std::bitset<0x80> ascii_bits_; // whether each ASCII character matches
 };
 
 class Character : public Ope, public std::enable_shared_from_this<Character> {
@@ -1300,6 +1964,7 @@ public:
 
   size_t parse_core(const char *s, size_t n, SemanticValues & /*vs*/,
                     Context &c, std::any & /*dt*/) const override {
+    if (c.track_examined) { c.mark_examined(s, 1); }
     if (n < 1 || s[0] != ch_) {
       c.set_error_pos(s);
       return static_cast<size_t>(-1);
@@ -1318,6 +1983,9 @@ public:
   size_t parse_core(const char *s, size_t n, SemanticValues & /*vs*/,
                     Context &c, std::any & /*dt*/) const override {
     auto len = codepoint_length(s, n);
+    if (c.track_examined) {
+      c.mark_examined(s, (std::max)(len, static_cast<size_t>(1)));
+    }
     if (len < 1) {
       c.set_error_pos(s);
       return static_cast<size_t>(-1);
@@ -1334,8 +2002,8 @@ public:
 
   size_t parse_core(const char *s, size_t n, SemanticValues &vs, Context &c,
                     std::any &dt) const override {
-    c.push_capture_scope();
-    auto se = scope_exit([&]() { c.pop_capture_scope(); });
+    auto captures = c.capture_scope();
+    auto se = scope_exit([&]() { c.discard_capture_values(captures); });
     return ope_->parse(s, n, vs, c, dt);
   }
 
@@ -1348,8 +2016,9 @@ class Capture : public Ope {
 public:
   using MatchAction = std::function<void(const char *s, size_t n, Context &c)>;
 
-  Capture(const std::shared_ptr<Ope> &ope, MatchAction ma)
-      : ope_(ope), match_action_(ma) {}
+  Capture(const std::shared_ptr<Ope> &ope, MatchAction ma,
+          std::string_view name = std::string_view())
+      : ope_(ope), match_action_(ma), name_(name) {}
 
   size_t parse_core(const char *s, size_t n, SemanticValues &vs, Context &c,
                     std::any &dt) const override {
@@ -1362,6 +2031,7 @@ public:
 
   std::shared_ptr<Ope> ope_;
   MatchAction match_action_;
+  std::string_view name_;
 };
 
 class TokenBoundary : public Ope {
@@ -1398,9 +2068,10 @@ using Parser = std::function<size_t(const char *s, size_t n, SemanticValues &vs,
 class User : public Ope {
 public:
   User(Parser fn) : fn_(fn) {}
-  size_t parse_core(const char *s, size_t n, SemanticValues &vs,
-                    Context & /*c*/, std::any &dt) const override {
+  size_t parse_core(const char *s, size_t n, SemanticValues &vs, Context &c,
+                    std::any &dt) const override {
     assert(fn_);
+    if (c.track_examined) { c.mark_examined(s, n + 1); }
     return fn_(s, n, vs, dt);
   }
   void accept(Visitor &v) override;
@@ -1434,6 +2105,12 @@ public:
 
   void accept(Visitor &v) override;
 
+  // Parses the rule with `body`, which parses its expression into the values
+  // it is given. Macros are handled by parse_core.
+  template <typename Body>
+  size_t parse_rule(const char *s, size_t n, SemanticValues &vs, Context &c,
+                    std::any &dt, Body body) const;
+
   std::any reduce(SemanticValues &vs, std::any &dt) const;
 
   const std::string &name() const;
@@ -1472,6 +2149,7 @@ public:
 
   Definition *rule_;
   size_t iarg_;
+  bool in_macro_ = false; // arguments can refer to macro parameters
 };
 
 class Whitespace : public Ope {
@@ -1547,13 +2225,21 @@ public:
 
 class Cut : public Ope, public std::enable_shared_from_this<Cut> {
 public:
-  size_t parse_core(const char * /*s*/, size_t /*n*/, SemanticValues & /*vs*/,
+  // Cuts inserted by parser::enable_auto_cut discard memo entries
+  explicit Cut(bool discard_memo = false) : discard_memo_(discard_memo) {}
+
+  size_t parse_core(const char *s, size_t /*n*/, SemanticValues & /*vs*/,
                     Context &c, std::any & /*dt*/) const override {
-    if (!c.cut_stack.empty()) { c.cut_stack.back() = true; }
+    if (!c.cut_stack.empty()) {
+      c.cut_stack.back() = true;
+      if (discard_memo_ && c.cut_stack.size() == 1) { c.discard_memo(s); }
+    }
     return 0;
   }
 
   void accept(Visitor &v) override;
+
+  bool discard_memo_;
 };
 
 /*
@@ -1642,8 +2328,9 @@ inline std::shared_ptr<Ope> csc(const std::shared_ptr<Ope> &ope) {
 }
 
 inline std::shared_ptr<Ope> cap(const std::shared_ptr<Ope> &ope,
-                                Capture::MatchAction ma) {
-  return std::make_shared<Capture>(ope, ma);
+                                Capture::MatchAction ma,
+                                std::string_view name = std::string_view()) {
+  return std::make_shared<Capture>(ope, ma, name);
 }
 
 inline std::shared_ptr<Ope> tok(const std::shared_ptr<Ope> &ope) {
@@ -1689,45 +2376,194 @@ inline std::shared_ptr<Ope> rec(const std::shared_ptr<Ope> &ope) {
 inline std::shared_ptr<Ope> cut() { return std::make_shared<Cut>(); }
 
 /*
- * Visitor
+ * Static expressions
  */
-struct Ope::Visitor {
-  virtual ~Visitor() {}
-  virtual void visit(Sequence &) {}
-  virtual void visit(PrioritizedChoice &) {}
-  virtual void visit(Repetition &) {}
-  virtual void visit(AndPredicate &) {}
-  virtual void visit(NotPredicate &) {}
-  virtual void visit(Dictionary &) {}
-  virtual void visit(LiteralString &) {}
-  virtual void visit(CharacterClass &) {}
-  virtual void visit(Character &) {}
-  virtual void visit(AnyCharacter &) {}
-  virtual void visit(CaptureScope &) {}
-  virtual void visit(Capture &) {}
-  virtual void visit(TokenBoundary &) {}
-  virtual void visit(Ignore &) {}
-  virtual void visit(User &) {}
-  virtual void visit(WeakHolder &) {}
-  virtual void visit(Holder &) {}
-  virtual void visit(Reference &) {}
-  virtual void visit(Whitespace &) {}
-  virtual void visit(BackReference &) {}
-  virtual void visit(PrecedenceClimbing &) {}
-  virtual void visit(Recovery &) {}
-  virtual void visit(Cut &) {}
+// Lexical expressions whose structure is part of their type, so that the
+// compiler can inline a whole rule. Each expression has a static
+// `match(s, n)` returning the matched length, or -1 on failure. `st::ope<E>()`
+// wraps an expression as an operator for use in a dynamic grammar. Wrap it
+// with `tok` to skip whitespace after it like a token.
+//
+//   using Ident = st::seq<st::cls<st::range<'a', 'z'>, st::range<'_'>>,
+//                         st::zom<st::cls<st::range<'a', 'z'>,
+//                                         st::range<'0', '9'>>>>;
+//   rules["IDENT"] = tok(st::ope<Ident>());
+namespace st {
+
+template <char32_t Lo, char32_t Hi = Lo> struct range {
+  static constexpr char32_t lo = Lo;
+  static constexpr char32_t hi = Hi;
 };
 
-struct TraceOpeName : public Ope::Visitor {
-  using Ope::Visitor::visit;
+template <typename... Ranges> constexpr std::array<uint64_t, 2> ascii_bits() {
+  std::array<uint64_t, 2> bits{};
+  for (const auto &[lo, hi] :
+       {std::pair<char32_t, char32_t>(Ranges::lo, Ranges::hi)...}) {
+    for (auto cp = lo; cp <= hi && cp < 0x80; cp++) {
+      bits[cp / 64] |= static_cast<uint64_t>(1) << (cp % 64);
+    }
+  }
+  return bits;
+}
 
-  void visit(Sequence &) override { name_ = "Sequence"; }
-  void visit(PrioritizedChoice &) override { name_ = "PrioritizedChoice"; }
-  void visit(Repetition &) override { name_ = "Repetition"; }
-  void visit(AndPredicate &) override { name_ = "AndPredicate"; }
-  void visit(NotPredicate &) override { name_ = "NotPredicate"; }
-  void visit(Dictionary &) override { name_ = "Dictionary"; }
-  void visit(LiteralString &) override { name_ = "LiteralString"; }
+template <bool Negated, typename... Ranges> struct char_class {
+  static_assert(sizeof...(Ranges) > 0, "empty character class");
+
+  static constexpr std::array<uint64_t, 2> bits = ascii_bits<Ranges...>();
+
+  static size_t match(const char *s, size_t n) {
+    if (n < 1) { return static_cast<size_t>(-1); }
+
+    auto b = static_cast<uint8_t>(s[0]);
+    if (b < 0x80) {
+      auto in = ((bits[b / 64] >> (b % 64)) & 1) != 0;
+      return in != Negated ? 1 : static_cast<size_t>(-1);
+    }
+
+    char32_t cp = 0;
+    auto len = decode_codepoint(s, n, cp);
+    if (!len) { return static_cast<size_t>(-1); }
+    auto in = ((Ranges::lo <= cp && cp <= Ranges::hi) || ...);
+    return in != Negated ? len : static_cast<size_t>(-1);
+  }
+};
+
+template <typename... Ranges> using cls = char_class<false, Ranges...>;
+template <typename... Ranges> using ncls = char_class<true, Ranges...>;
+
+constexpr char to_lower(char ch) {
+  return 'A' <= ch && ch <= 'Z' ? static_cast<char>(ch - 'A' + 'a') : ch;
+}
+
+template <bool IgnoreCase, char... Cs> struct literal {
+  static constexpr std::array<char, sizeof...(Cs)> str = {Cs...};
+
+  static size_t match(const char *s, size_t n) {
+    if (n < str.size()) { return static_cast<size_t>(-1); }
+    for (size_t i = 0; i < str.size(); i++) {
+      auto ch = IgnoreCase ? to_lower(s[i]) : s[i];
+      if (ch != str[i]) { return static_cast<size_t>(-1); }
+    }
+    return str.size();
+  }
+};
+
+template <char... Cs> using lit = literal<false, Cs...>;
+template <char... Cs> using liti = literal<true, to_lower(Cs)...>;
+template <char C> using chr = literal<false, C>;
+
+struct dot {
+  static size_t match(const char *s, size_t n) {
+    auto len = codepoint_length(s, n);
+    return len ? len : static_cast<size_t>(-1);
+  }
+};
+
+template <typename... Es> struct seq {
+  static size_t match(const char *s, size_t n) {
+    size_t i = 0;
+    auto ok = ([&]() {
+      auto len = Es::match(s + i, n - i);
+      if (fail(len)) { return false; }
+      i += len;
+      return true;
+    }() && ...);
+    return ok ? i : static_cast<size_t>(-1);
+  }
+};
+
+template <typename... Es> struct cho {
+  static size_t match(const char *s, size_t n) {
+    auto len = static_cast<size_t>(-1);
+    ((len = Es::match(s, n), success(len)) || ...);
+    return len;
+  }
+};
+
+template <typename E, size_t Min, size_t Max> struct rep {
+  static size_t match(const char *s, size_t n) {
+    size_t count = 0;
+    size_t i = 0;
+    while (count < Max) {
+      auto len = E::match(s + i, n - i);
+      if (fail(len)) { break; }
+
+      // An empty match would repeat at the same position for ever, so the
+      // rest of the repetitions match empty too
+      if (len == 0) { return i; }
+
+      i += len;
+      count++;
+    }
+    return count < Min ? static_cast<size_t>(-1) : i;
+  }
+};
+
+template <typename E>
+using zom = rep<E, 0, std::numeric_limits<size_t>::max()>;
+template <typename E>
+using oom = rep<E, 1, std::numeric_limits<size_t>::max()>;
+template <typename E> using opt = rep<E, 0, 1>;
+
+template <typename E> struct apd {
+  static size_t match(const char *s, size_t n) {
+    return success(E::match(s, n)) ? 0 : static_cast<size_t>(-1);
+  }
+};
+
+template <typename E> struct npd {
+  static size_t match(const char *s, size_t n) {
+    return success(E::match(s, n)) ? static_cast<size_t>(-1) : 0;
+  }
+};
+
+template <typename E> std::shared_ptr<Ope> ope() {
+  return usr([](const char *s, size_t n, SemanticValues & /*vs*/,
+                std::any & /*dt*/) { return E::match(s, n); });
+}
+
+} // namespace st
+
+/*
+ * Visitor
+ */
+struct Ope::Visitor {
+  virtual ~Visitor() {}
+  virtual void visit(Sequence &) {}
+  virtual void visit(PrioritizedChoice &) {}
+  virtual void visit(Repetition &) {}
+  virtual void visit(AndPredicate &) {}
+  virtual void visit(NotPredicate &) {}
+  virtual void visit(Dictionary &) {}
+  virtual void visit(LiteralString &) {}
+  virtual void visit(CharacterClass &) {}
+  virtual void visit(Character &) {}
+  virtual void visit(AnyCharacter &) {}
+  virtual void visit(CaptureScope &) {}
+  virtual void visit(Capture &) {}
+  virtual void visit(TokenBoundary &) {}
+  virtual void visit(Ignore &) {}
+  virtual void visit(User &) {}
+  virtual void visit(WeakHolder &) {}
+  virtual void visit(Holder &) {}
+  virtual void visit(Reference &) {}
+  virtual void visit(Whitespace &) {}
+  virtual void visit(BackReference &) {}
+  virtual void visit(PrecedenceClimbing &) {}
+  virtual void visit(Recovery &) {}
+  virtual void visit(Cut &) {}
+};
+
+struct TraceOpeName : public Ope::Visitor {
+  using Ope::Visitor::visit;
+
+  void visit(Sequence &) override { name_ = "Sequence"; }
+  void visit(PrioritizedChoice &) override { name_ = "PrioritizedChoice"; }
+  void visit(Repetition &) override { name_ = "Repetition"; }
+  void visit(AndPredicate &) override { name_ = "AndPredicate"; }
+  void visit(NotPredicate &) override { name_ = "NotPredicate"; }
+  void visit(Dictionary &) override { name_ = "Dictionary"; }
+  void visit(LiteralString &) override { name_ = "LiteralString"; }
   void visit(CharacterClass &) override { name_ = "CharacterClass"; }
   void visit(Character &) override { name_ = "Character"; }
   void visit(AnyCharacter &) override { name_ = "AnyCharacter"; }
@@ -2199,2714 +3035,7231 @@ private:
   const std::vector<std::string> &params_;
 };
 
-/*
- * Keywords
- */
-static const char *WHITESPACE_DEFINITION_NAME = "%whitespace";
-static const char *WORD_DEFINITION_NAME = "%word";
-static const char *RECOVER_DEFINITION_NAME = "%recover";
-
-/*
- * Definition
- */
-class Definition {
-public:
-  struct Result {
-    bool ret;
-    bool recovered;
-    size_t len;
-    ErrorInfo error_info;
-  };
+// Copies a macro body with its parameters replaced by arguments. Only the
+// operators that contain a parameter have to be copied, but copying all of
+// the composites keeps it simple; leaves and rules are shared.
+struct SubstituteArguments : public Ope::Visitor {
+  using Ope::Visitor::visit;
 
-  Definition() : holder_(std::make_shared<Holder>(this)) {}
+  SubstituteArguments(const std::vector<std::shared_ptr<Ope>> &args)
+      : args_(args) {}
 
-  Definition(const Definition &rhs) : name(rhs.name), holder_(rhs.holder_) {
-    holder_->outer_ = this;
+  std::shared_ptr<Ope> copy(const std::shared_ptr<Ope> &ope) {
+    found_ope = ope;
+    ope->accept(*this);
+    return found_ope;
   }
 
-  Definition(const std::shared_ptr<Ope> &ope)
-      : holder_(std::make_shared<Holder>(this)) {
-    *this <= ope;
+  std::vector<std::shared_ptr<Ope>>
+  copy(const std::vector<std::shared_ptr<Ope>> &opes) {
+    std::vector<std::shared_ptr<Ope>> ret;
+    for (const auto &ope : opes) {
+      ret.push_back(copy(ope));
+    }
+    return ret;
   }
 
-  operator std::shared_ptr<Ope>() {
-    return std::make_shared<WeakHolder>(holder_);
+  void visit(Sequence &ope) override {
+    found_ope = std::make_shared<Sequence>(copy(ope.opes_));
   }
-
-  Definition &operator<=(const std::shared_ptr<Ope> &ope) {
-    holder_->ope_ = ope;
-    return *this;
+  void visit(PrioritizedChoice &ope) override {
+    auto choice = std::make_shared<PrioritizedChoice>(copy(ope.opes_));
+    choice->for_label_ = ope.for_label_;
+    choice->s_ = ope.s_;
+    found_ope = choice;
   }
-
-  Result parse(const char *s, size_t n, const char *path = nullptr,
-               Log log = nullptr) const {
-    SemanticValues vs;
-    std::any dt;
-    return parse_core(s, n, vs, dt, path, log);
+  void visit(Repetition &ope) override {
+    found_ope = rep(copy(ope.ope_), ope.min_, ope.max_);
   }
-
-  Result parse(const char *s, const char *path = nullptr,
-               Log log = nullptr) const {
-    auto n = strlen(s);
-    return parse(s, n, path, log);
+  void visit(AndPredicate &ope) override {
+    auto pred = std::make_shared<AndPredicate>(copy(ope.ope_));
+    pred->s_ = ope.s_;
+    found_ope = pred;
   }
-
-  Result parse(const char *s, size_t n, std::any &dt,
-               const char *path = nullptr, Log log = nullptr) const {
-    SemanticValues vs;
-    return parse_core(s, n, vs, dt, path, log);
+  void visit(NotPredicate &ope) override {
+    auto pred = std::make_shared<NotPredicate>(copy(ope.ope_));
+    pred->s_ = ope.s_;
+    found_ope = pred;
   }
-
-  Result parse(const char *s, std::any &dt, const char *path = nullptr,
-               Log log = nullptr) const {
-    auto n = strlen(s);
-    return parse(s, n, dt, path, log);
+  void visit(CaptureScope &ope) override { found_ope = csc(copy(ope.ope_)); }
+  void visit(Capture &ope) override {
+    found_ope = cap(copy(ope.ope_), ope.match_action_, ope.name_);
   }
+  void visit(TokenBoundary &ope) override { found_ope = tok(copy(ope.ope_)); }
+  void visit(Ignore &ope) override { found_ope = ign(copy(ope.ope_)); }
+  void visit(Reference &ope) override;
+  void visit(Whitespace &ope) override { found_ope = wsp(copy(ope.ope_)); }
+  void visit(PrecedenceClimbing &) override { ok = false; }
+  void visit(Recovery &ope) override { found_ope = rec(copy(ope.ope_)); }
 
-  template <typename T>
-  Result parse_and_get_value(const char *s, size_t n, T &val,
-                             const char *path = nullptr,
-                             Log log = nullptr) const {
-    SemanticValues vs;
-    std::any dt;
-    auto r = parse_core(s, n, vs, dt, path, log);
-    if (r.ret && !vs.empty() && vs.front().has_value()) {
-      val = std::any_cast<T>(vs[0]);
-    }
-    return r;
-  }
+  std::shared_ptr<Ope> found_ope;
+  bool ok = true; // false if the body can't be copied
 
-  template <typename T>
-  Result parse_and_get_value(const char *s, T &val, const char *path = nullptr,
-                             Log log = nullptr) const {
-    auto n = strlen(s);
-    return parse_and_get_value(s, n, val, path, log);
-  }
+private:
+  const std::vector<std::shared_ptr<Ope>> &args_;
+};
 
-  template <typename T>
-  Result parse_and_get_value(const char *s, size_t n, std::any &dt, T &val,
-                             const char *path = nullptr,
-                             Log log = nullptr) const {
-    SemanticValues vs;
-    auto r = parse_core(s, n, vs, dt, path, log);
-    if (r.ret && !vs.empty() && vs.front().has_value()) {
-      val = std::any_cast<T>(vs[0]);
-    }
-    return r;
-  }
+// Turns each macro application into a rule of its own, so it is parsed like
+// any other rule and its results can be memoized. Applications whose
+// arguments keep growing, as in recursion with `M(x) <- x M((x x))`, and
+// macros using precedence climbing are left to be expanded while parsing.
+class MacroExpander : public Ope::Visitor {
+public:
+  using Ope::Visitor::visit;
 
-  template <typename T>
-  Result parse_and_get_value(const char *s, std::any &dt, T &val,
-                             const char *path = nullptr,
-                             Log log = nullptr) const {
-    auto n = strlen(s);
-    return parse_and_get_value(s, n, dt, val, path, log);
-  }
+  void expand(Grammar &grammar);
 
-#if defined(__cpp_lib_char8_t)
-  Result parse(const char8_t *s, size_t n, const char *path = nullptr,
-               Log log = nullptr) const {
-    return parse(reinterpret_cast<const char *>(s), n, path, log);
+  void visit(Sequence &ope) override {
+    for (auto op : ope.opes_) {
+      op->accept(*this);
+    }
   }
-
-  Result parse(const char8_t *s, const char *path = nullptr,
-               Log log = nullptr) const {
-    return parse(reinterpret_cast<const char *>(s), path, log);
+  void visit(PrioritizedChoice &ope) override {
+    for (auto op : ope.opes_) {
+      op->accept(*this);
+    }
   }
-
-  Result parse(const char8_t *s, size_t n, std::any &dt,
-               const char *path = nullptr, Log log = nullptr) const {
-    return parse(reinterpret_cast<const char *>(s), n, dt, path, log);
+  void visit(Repetition &ope) override { ope.ope_->accept(*this); }
+  void visit(AndPredicate &ope) override { ope.ope_->accept(*this); }
+  void visit(NotPredicate &ope) override { ope.ope_->accept(*this); }
+  void visit(CaptureScope &ope) override { ope.ope_->accept(*this); }
+  void visit(Capture &ope) override { ope.ope_->accept(*this); }
+  void visit(TokenBoundary &ope) override { ope.ope_->accept(*this); }
+  void visit(Ignore &ope) override { ope.ope_->accept(*this); }
+  void visit(Reference &ope) override;
+  void visit(Whitespace &ope) override { ope.ope_->accept(*this); }
+  void visit(PrecedenceClimbing &ope) override {
+    ope.atom_->accept(*this);
+    ope.binop_->accept(*this);
   }
+  void visit(Recovery &ope) override { ope.ope_->accept(*this); }
 
-  Result parse(const char8_t *s, std::any &dt, const char *path = nullptr,
-               Log log = nullptr) const {
-    return parse(reinterpret_cast<const char *>(s), dt, path, log);
-  }
+private:
+  Definition *instantiate(Definition &macro,
+                          const std::vector<std::shared_ptr<Ope>> &args);
 
-  template <typename T>
-  Result parse_and_get_value(const char8_t *s, size_t n, T &val,
-                             const char *path = nullptr,
-                             Log log = nullptr) const {
-    return parse_and_get_value(reinterpret_cast<const char *>(s), n, val, *path,
-                               log);
-  }
+  static constexpr size_t max_depth = 4; // nested instances of one macro
+  static constexpr size_t max_instances = 4096;
 
-  template <typename T>
-  Result parse_and_get_value(const char8_t *s, T &val,
-                             const char *path = nullptr,
-                             Log log = nullptr) const {
-    return parse_and_get_value(reinterpret_cast<const char *>(s), val, *path,
-                               log);
-  }
+  std::unordered_map<const Definition *, size_t> depth_;
+  size_t instance_count_ = 0;
+};
 
-  template <typename T>
-  Result parse_and_get_value(const char8_t *s, size_t n, std::any &dt, T &val,
-                             const char *path = nullptr,
-                             Log log = nullptr) const {
-    return parse_and_get_value(reinterpret_cast<const char *>(s), n, dt, val,
-                               *path, log);
-  }
+// Bytes that can start a match, whether it can match the empty string, and
+// the rules that can be called at the starting position, including those
+// called by lookahead.
+struct FirstSet {
+  std::bitset<256> bytes;
+  bool nullable = false;
+  std::set<std::string> rules;
+};
 
-  template <typename T>
-  Result parse_and_get_value(const char8_t *s, std::any &dt, T &val,
-                             const char *path = nullptr,
-                             Log log = nullptr) const {
-    return parse_and_get_value(reinterpret_cast<const char *>(s), dt, val,
-                               *path, log);
-  }
-#endif
-
-  void operator=(Action a) { action = a; }
+struct ComputeFirstSet : public Ope::Visitor {
+  using Ope::Visitor::visit;
 
-  template <typename T> Definition &operator,(T fn) {
-    operator=(fn);
-    return *this;
+  void visit(Sequence &ope) override {
+    FirstSet fs;
+    fs.nullable = true;
+    for (auto op : ope.opes_) {
+      auto f = get(*op);
+      fs.bytes |= f.bytes;
+      fs.rules.insert(f.rules.begin(), f.rules.end());
+      if (!f.nullable) {
+        fs.nullable = false;
+        break;
+      }
+    }
+    result_ = fs;
   }
-
-  Definition &operator~() {
-    ignoreSemanticValue = true;
-    return *this;
+  void visit(PrioritizedChoice &ope) override {
+    FirstSet fs;
+    for (auto op : ope.opes_) {
+      auto f = get(*op);
+      fs.bytes |= f.bytes;
+      fs.nullable = fs.nullable || f.nullable;
+      fs.rules.insert(f.rules.begin(), f.rules.end());
+    }
+    result_ = fs;
   }
-
-  void accept(Ope::Visitor &v) { holder_->accept(v); }
-
-  std::shared_ptr<Ope> get_core_operator() const { return holder_->ope_; }
-
-  bool is_token() const {
-    std::call_once(is_token_init_, [this]() {
-      is_token_ = TokenChecker::is_token(*get_core_operator());
-    });
-    return is_token_;
+  void visit(Repetition &ope) override {
+    auto fs = get(*ope.ope_);
+    fs.nullable = fs.nullable || ope.min_ == 0;
+    result_ = fs;
+  }
+  void visit(AndPredicate &ope) override { set_lookahead(*ope.ope_); }
+  void visit(NotPredicate &ope) override { set_lookahead(*ope.ope_); }
+  void visit(Dictionary &ope) override {
+    FirstSet fs;
+    for (const auto &item : ope.trie_.items()) {
+      if (item.empty()) {
+        fs.nullable = true;
+      } else {
+        add_byte(fs, item[0], ope.trie_.ignore_case());
+      }
+    }
+    result_ = fs;
   }
+  void visit(LiteralString &ope) override {
+    FirstSet fs;
+    if (ope.lit_.empty()) {
+      fs.nullable = true;
+    } else {
+      add_byte(fs, ope.lit_[0], ope.ignore_case_);
+    }
+    result_ = fs;
+  }
+  void visit(CharacterClass &ope) override {
+    auto in_class = [&](char32_t cp) {
+      for (const auto &[first, last] : ope.ranges()) {
+        if (ope.ignore_case() ? std::tolower(first) <= std::tolower(cp) &&
+                                    std::tolower(cp) <= std::tolower(last)
+                              : first <= cp && cp <= last) {
+          return true;
+        }
+      }
+      return false;
+    };
 
-  std::string name;
-  const char *s_ = nullptr;
-  std::pair<size_t, size_t> line_ = {1, 1};
-
-  std::function<bool(const SemanticValues &vs, const std::any &dt,
-                     std::string &msg)>
-      predicate;
-
-  size_t id = 0;
-  Action action;
-  std::function<void(const Context &c, const char *s, size_t n, std::any &dt)>
-      enter;
-  std::function<void(const Context &c, const char *s, size_t n, size_t matchlen,
-                     std::any &value, std::any &dt)>
-      leave;
-  bool ignoreSemanticValue = false;
-  std::shared_ptr<Ope> whitespaceOpe;
-  std::shared_ptr<Ope> wordOpe;
-  bool enablePackratParsing = false;
-  bool is_macro = false;
-  std::vector<std::string> params;
-  bool disable_action = false;
-
-  TracerEnter tracer_enter;
-  TracerLeave tracer_leave;
-  bool verbose_trace = false;
-  TracerStartOrEnd tracer_start;
-  TracerStartOrEnd tracer_end;
-
-  std::string error_message;
-  bool no_ast_opt = false;
+    FirstSet fs;
+    if (ope.negated()) {
+      // Only ASCII characters can be excluded byte by byte
+      fs.bytes.set();
+      for (size_t b = 0; b < 0x80; b++) {
+        if (in_class(static_cast<char32_t>(b))) { fs.bytes.reset(b); }
+      }
+    } else {
+      for (size_t b = 0; b < 0x80; b++) {
+        if (in_class(static_cast<char32_t>(b))) { fs.bytes.set(b); }
+      }
+      // Lead bytes of multi-byte sequences. Invalid UTF-8 matches no class.
+      for (const auto &range : ope.ranges()) {
+        if (range.second >= 0x80) {
+          for (size_t b = 0xC0; b < 0xF8; b++) {
+            fs.bytes.set(b);
+          }
+        }
+      }
+    }
+    result_ = fs;
+  }
+  void visit(Character &ope) override {
+    FirstSet fs;
+    add_byte(fs, ope.ch_, false);
+    result_ = fs;
+  }
+  void visit(AnyCharacter &) override {
+    FirstSet fs;
+    fs.bytes.set();
+    result_ = fs;
+  }
+  void visit(CaptureScope &ope) override { result_ = get(*ope.ope_); }
+  void visit(Capture &ope) override { result_ = get(*ope.ope_); }
+  void visit(TokenBoundary &ope) override { result_ = get(*ope.ope_); }
+  void visit(Ignore &ope) override { result_ = get(*ope.ope_); }
+  void visit(User &) override { set_unknown(); }
+  void visit(WeakHolder &ope) override { result_ = get(*ope.weak_.lock()); }
+  void visit(Holder &ope) override;
+  void visit(Reference &ope) override;
+  void visit(Whitespace &ope) override { result_ = get(*ope.ope_); }
+  void visit(BackReference &) override { set_unknown(); }
+  void visit(PrecedenceClimbing &ope) override { result_ = get(*ope.atom_); }
+  void visit(Recovery &ope) override { result_ = get(*ope.ope_); }
+  void visit(Cut &) override {
+    FirstSet fs;
+    fs.nullable = true;
+    result_ = fs;
+  }
 
-  bool eoi_check = true;
+  // Results for rules are cached, so the same instance should be used for
+  // the operators of one grammar.
+  FirstSet get(Ope &ope) {
+    ope.accept(*this);
+    return std::move(result_);
+  }
 
 private:
-  friend class Reference;
-  friend class ParserGenerator;
-
-  Definition &operator=(const Definition &rhs);
-  Definition &operator=(Definition &&rhs);
-
-  void initialize_definition_ids() const {
-    std::call_once(definition_ids_init_, [&]() {
-      AssignIDToDefinition vis;
-      holder_->accept(vis);
-      if (whitespaceOpe) { whitespaceOpe->accept(vis); }
-      if (wordOpe) { wordOpe->accept(vis); }
-      definition_ids_.swap(vis.ids);
-    });
+  static void add_byte(FirstSet &fs, char ch, bool ignore_case) {
+    auto b = static_cast<unsigned char>(ch);
+    fs.bytes.set(b);
+    if (ignore_case) {
+      fs.bytes.set(static_cast<unsigned char>(std::tolower(b)));
+      fs.bytes.set(static_cast<unsigned char>(std::toupper(b)));
+    }
   }
 
-  Result parse_core(const char *s, size_t n, SemanticValues &vs, std::any &dt,
-                    const char *path, Log log) const {
-    initialize_definition_ids();
+  void set_lookahead(Ope &ope) {
+    FirstSet fs;
+    fs.nullable = true;
+    fs.rules = get(ope).rules;
+    result_ = fs;
+  }
 
-    std::shared_ptr<Ope> ope = holder_;
+  void set_unknown() {
+    FirstSet fs;
+    fs.bytes.set();
+    fs.nullable = true;
+    result_ = fs;
+  }
 
-    std::any trace_data;
-    if (tracer_start) { tracer_start(trace_data); }
-    auto se = scope_exit([&]() {
-      if (tracer_end) { tracer_end(trace_data); }
-    });
+  FirstSet result_;
+  std::unordered_map<const Definition *, FirstSet> cache_;
+  std::unordered_set<const Definition *> active_;
+  std::vector<const std::vector<std::shared_ptr<Ope>> *> args_stack_;
+};
 
-    Context c(path, s, n, definition_ids_.size(), whitespaceOpe, wordOpe,
-              enablePackratParsing, tracer_enter, tracer_leave, trace_data,
-              verbose_trace, log);
+// Writes an operator back in PEG syntax
+struct PegText : public Ope::Visitor {
+  using Ope::Visitor::visit;
 
-    size_t i = 0;
+  void visit(Sequence &ope) override {
+    if (nested_) { text_ += "("; }
+    for (size_t i = 0; i < ope.opes_.size(); i++) {
+      if (i) { text_ += " "; }
+      text_ += group(*ope.opes_[i]);
+    }
+    if (nested_) { text_ += ")"; }
+  }
+  void visit(PrioritizedChoice &ope) override {
+    if (nested_) { text_ += "("; }
+    for (size_t i = 0; i < ope.opes_.size(); i++) {
+      if (i) { text_ += " / "; }
+      text_ += get(*ope.opes_[i]);
+    }
+    if (nested_) { text_ += ")"; }
+  }
+  void visit(Repetition &ope) override {
+    text_ += group(*ope.ope_);
+    auto inf = std::numeric_limits<size_t>::max();
+    if (ope.min_ == 0 && ope.max_ == 1) {
+      text_ += "?";
+    } else if (ope.min_ == 0 && ope.max_ == inf) {
+      text_ += "*";
+    } else if (ope.min_ == 1 && ope.max_ == inf) {
+      text_ += "+";
+    } else if (ope.min_ == ope.max_) {
+      text_ += "{" + std::to_string(ope.min_) + "}";
+    } else if (ope.max_ == inf) {
+      text_ += "{" + std::to_string(ope.min_) + ",}";
+    } else {
+      text_ += "{" + std::to_string(ope.min_) + "," + std::to_string(ope.max_) +
+               "}";
+    }
+  }
+  void visit(AndPredicate &ope) override { text_ += "&" + group(*ope.ope_); }
+  void visit(NotPredicate &ope) override { text_ += "!" + group(*ope.ope_); }
+  void visit(Dictionary &ope) override {
+    if (nested_) { text_ += "("; }
+    auto items = ope.trie_.items();
+    for (size_t i = 0; i < items.size(); i++) {
+      if (i) { text_ += " | "; }
+      text_ += quote(items[i], ope.trie_.ignore_case());
+    }
+    if (nested_) { text_ += ")"; }
+  }
+  void visit(LiteralString &ope) override {
+    text_ += quote(ope.lit_, ope.ignore_case_);
+  }
+  void visit(CharacterClass &ope) override {
+    text_ += ope.negated() ? "[^" : "[";
+    for (const auto &[first, last] : ope.ranges()) {
+      text_ += class_char(first);
+      if (first != last) { text_ += "-" + class_char(last); }
+    }
+    text_ += ope.ignore_case() ? "]i" : "]";
+  }
+  void visit(Character &ope) override {
+    text_ += quote(std::string(1, ope.ch_), false);
+  }
+  void visit(AnyCharacter &) override { text_ += "."; }
+  void visit(CaptureScope &ope) override {
+    text_ += "$(" + get(*ope.ope_) + ")";
+  }
+  void visit(Capture &ope) override {
+    text_ += "$" + std::string(ope.name_) + "<" + get(*ope.ope_) + ">";
+  }
+  void visit(TokenBoundary &ope) override {
+    text_ += "< " + get(*ope.ope_) + " >";
+  }
+  void visit(Ignore &ope) override { text_ += "~" + group(*ope.ope_); }
+  void visit(User &) override { text_ += "<user>"; }
+  void visit(WeakHolder &ope) override { ope.weak_.lock()->accept(*this); }
+  void visit(Holder &ope) override { text_ += ope.name(); }
+  void visit(Reference &ope) override {
+    text_ += ope.name_;
+    if (ope.is_macro_) {
+      text_ += "(";
+      for (size_t i = 0; i < ope.args_.size(); i++) {
+        if (i) { text_ += ", "; }
+        text_ += get(*ope.args_[i]);
+      }
+      text_ += ")";
+    }
+  }
+  void visit(Whitespace &ope) override { ope.ope_->accept(*this); }
+  void visit(BackReference &ope) override { text_ += "$" + ope.name_; }
+  void visit(PrecedenceClimbing &ope) override {
+    auto atom = group(*ope.atom_);
+    if (nested_) { text_ += "("; }
+    text_ += atom + " (" + group(*ope.binop_) + " " + atom + ")*";
+    if (nested_) { text_ += ")"; }
+  }
+  void visit(Recovery &ope) override { ope.ope_->accept(*this); }
+  void visit(Cut &) override { text_ += "↑"; }
 
-    if (whitespaceOpe) {
-      auto save_ignore_trace_state = c.ignore_trace_state;
-      c.ignore_trace_state = !c.verbose_trace;
-      auto se =
-          scope_exit([&]() { c.ignore_trace_state = save_ignore_trace_state; });
+  static std::string get(Ope &ope) {
+    PegText vis;
+    ope.accept(vis);
+    return vis.text_;
+  }
 
-      auto len = whitespaceOpe->parse(s, n, vs, c, dt);
-      if (fail(len)) { return Result{false, c.recovered, i, c.error_info}; }
+  // In parentheses if needed as an operand
+  static std::string group(Ope &ope) {
+    PegText vis;
+    vis.nested_ = true;
+    ope.accept(vis);
+    return vis.text_;
+  }
 
-      i = len;
+private:
+  static std::string quote(const std::string &s, bool ignore_case) {
+    std::string str;
+    for (auto c : s) {
+      if (c == '\'' || c == '\\') { str += '\\'; }
+      str += c;
     }
+    return "'" + escape_characters(str) + (ignore_case ? "'i" : "'");
+  }
 
-    auto len = ope->parse(s + i, n - i, vs, c, dt);
-    auto ret = success(len);
-    if (ret) {
-      i += len;
-      if (eoi_check) {
-        if (i < n) {
-          if (c.error_info.error_pos - c.s < s + i - c.s) {
-            c.error_info.message_pos = s + i;
-            c.error_info.message = "expected end of input";
-          }
-          ret = false;
-        }
-      }
+  static std::string class_char(char32_t cp) {
+    switch (cp) {
+    case ']': return "\\]";
+    case '\\': return "\\\\";
+    case '-': return "\\-";
+    case '^': return "\\^";
+    default: return escape_characters(encode_codepoint(cp));
     }
-    return Result{ret, c.recovered, i, c.error_info};
   }
 
-  std::shared_ptr<Holder> holder_;
-  mutable std::once_flag is_token_init_;
-  mutable bool is_token_ = false;
-  mutable std::once_flag assign_id_to_definition_init_;
-  mutable std::once_flag definition_ids_init_;
-  mutable std::unordered_map<void *, size_t> definition_ids_;
+  std::string text_;
+  bool nested_ = false;
 };
 
 /*
- * Implementations
+ * Keywords
  */
+static const char *WHITESPACE_DEFINITION_NAME = "%whitespace";
+static const char *WORD_DEFINITION_NAME = "%word";
+static const char *RECOVER_DEFINITION_NAME = "%recover";
 
-inline size_t parse_literal(const char *s, size_t n, SemanticValues &vs,
-                            Context &c, std::any &dt, const std::string &lit,
-                            std::once_flag &init_is_word, bool &is_word,
-                            bool ignore_case) {
-  size_t i = 0;
-  for (; i < lit.size(); i++) {
-    if (i >= n || (ignore_case ? (std::tolower(s[i]) != std::tolower(lit[i]))
-                               : (s[i] != lit[i]))) {
-      c.set_error_pos(s, lit.data());
-      return static_cast<size_t>(-1);
-    }
-  }
-
-  // Word check
-  if (c.wordOpe) {
-    auto save_ignore_trace_state = c.ignore_trace_state;
-    c.ignore_trace_state = !c.verbose_trace;
-    auto se =
-        scope_exit([&]() { c.ignore_trace_state = save_ignore_trace_state; });
-
-    std::call_once(init_is_word, [&]() {
-      SemanticValues dummy_vs;
-      Context dummy_c(nullptr, c.s, c.l, 0, nullptr, nullptr, false, nullptr,
-                      nullptr, nullptr, false, nullptr);
-      std::any dummy_dt;
-
-      auto len =
-          c.wordOpe->parse(lit.data(), lit.size(), dummy_vs, dummy_c, dummy_dt);
-      is_word = success(len);
-    });
+/*
+ * Definition
+ */
+class Definition {
+public:
+  struct Result {
+    bool ret;
+    bool recovered;
+    size_t len;
+    ErrorInfo error_info;
+  };
 
-    if (is_word) {
-      SemanticValues dummy_vs;
-      Context dummy_c(nullptr, c.s, c.l, 0, nullptr, nullptr, false, nullptr,
-                      nullptr, nullptr, false, nullptr);
-      std::any dummy_dt;
+  Definition() : holder_(std::make_shared<Holder>(this)) {}
 
-      NotPredicate ope(c.wordOpe);
-      auto len = ope.parse(s + i, n - i, dummy_vs, dummy_c, dummy_dt);
-      if (fail(len)) {
-        c.set_error_pos(s, lit.data());
-        return len;
-      }
-      i += len;
-    }
+  Definition(const Definition &rhs) : name(rhs.name), holder_(rhs.holder_) {
+    holder_->outer_ = this;
   }
 
-  // Skip whitespace
-  if (!c.in_token_boundary_count && c.whitespaceOpe) {
-    auto save_ignore_trace_state = c.ignore_trace_state;
-    c.ignore_trace_state = !c.verbose_trace;
-    auto se =
-        scope_exit([&]() { c.ignore_trace_state = save_ignore_trace_state; });
+  Definition(const std::shared_ptr<Ope> &ope)
+      : holder_(std::make_shared<Holder>(this)) {
+    *this <= ope;
+  }
 
-    auto len = c.whitespaceOpe->parse(s + i, n - i, vs, c, dt);
-    if (fail(len)) { return len; }
-    i += len;
+  operator std::shared_ptr<Ope>() {
+    return std::make_shared<WeakHolder>(holder_);
   }
 
-  return i;
-}
+  Definition &operator<=(const std::shared_ptr<Ope> &ope) {
+    holder_->ope_ = ope;
+    parse_body = nullptr;
+    return *this;
+  }
 
-inline std::pair<size_t, size_t> SemanticValues::line_info() const {
-  assert(c_);
-  return c_->line_info(sv_.data());
-}
-
-inline void ErrorInfo::output_log(const Log &log, const char *s, size_t n) {
-  if (message_pos) {
-    if (message_pos > last_output_pos) {
-      last_output_pos = message_pos;
-      auto line = line_info(s, message_pos);
-      std::string msg;
-      if (auto unexpected_token = heuristic_error_token(s, n, message_pos);
-          !unexpected_token.empty()) {
-        msg = replace_all(message, "%t", unexpected_token);
-
-        auto unexpected_char = unexpected_token.substr(
-            0,
-            codepoint_length(unexpected_token.data(), unexpected_token.size()));
+  Result parse(const char *s, size_t n, const char *path = nullptr,
+               Log log = nullptr) const {
+    SemanticValues vs;
+    std::any dt;
+    return parse_core(s, n, vs, dt, path, log);
+  }
 
-        msg = replace_all(msg, "%c", unexpected_char);
-      } else {
-        msg = message;
-      }
-      log(line.first, line.second, msg, label);
-    }
-  } else if (error_pos) {
-    if (error_pos > last_output_pos) {
-      last_output_pos = error_pos;
-      auto line = line_info(s, error_pos);
+  Result parse(const char *s, const char *path = nullptr,
+               Log log = nullptr) const {
+    auto n = strlen(s);
+    return parse(s, n, path, log);
+  }
 
-      std::string msg;
-      if (expected_tokens.empty()) {
-        msg = "syntax error.";
-      } else {
-        msg = "syntax error";
+  Result parse(const char *s, size_t n, std::any &dt,
+               const char *path = nullptr, Log log = nullptr) const {
+    SemanticValues vs;
+    return parse_core(s, n, vs, dt, path, log);
+  }
 
-        // unexpected token
-        if (auto unexpected_token = heuristic_error_token(s, n, error_pos);
-            !unexpected_token.empty()) {
-          msg += ", unexpected '";
-          msg += unexpected_token;
-          msg += "'";
-        }
+  Result parse(const char *s, std::any &dt, const char *path = nullptr,
+               Log log = nullptr) const {
+    auto n = strlen(s);
+    return parse(s, n, dt, path, log);
+  }
 
-        auto first_item = true;
-        size_t i = 0;
-        while (i < expected_tokens.size()) {
-          auto [error_literal, error_rule] = expected_tokens[i];
+  template <typename T>
+  Result parse_and_get_value(const char *s, size_t n, T &val,
+                             const char *path = nullptr,
+                             Log log = nullptr) const {
+    SemanticValues vs;
+    std::any dt;
+    auto r = parse_core(s, n, vs, dt, path, log);
+    if (r.ret && !vs.empty() && vs.front().has_value()) {
+      val = std::any_cast<T>(vs[0]);
+    }
+    return r;
+  }
 
-          // Skip rules start with '_'
-          if (!(error_rule && error_rule->name[0] == '_')) {
-            msg += (first_item ? ", expecting " : ", ");
-            if (error_literal) {
-              msg += "'";
-              msg += error_literal;
-              msg += "'";
-            } else {
-              msg += "<" + error_rule->name + ">";
-              if (label.empty()) { label = error_rule->name; }
-            }
-            first_item = false;
-          }
+  template <typename T>
+  Result parse_and_get_value(const char *s, T &val, const char *path = nullptr,
+                             Log log = nullptr) const {
+    auto n = strlen(s);
+    return parse_and_get_value(s, n, val, path, log);
+  }
 
-          i++;
-        }
-        msg += ".";
-      }
-      log(line.first, line.second, msg, label);
+  template <typename T>
+  Result parse_and_get_value(const char *s, size_t n, std::any &dt, T &val,
+                             const char *path = nullptr,
+                             Log log = nullptr) const {
+    SemanticValues vs;
+    auto r = parse_core(s, n, vs, dt, path, log);
+    if (r.ret && !vs.empty() && vs.front().has_value()) {
+      val = std::any_cast<T>(vs[0]);
     }
+    return r;
   }
-}
 
-inline void Context::set_error_pos(const char *a_s, const char *literal) {
-  if (log) {
-    if (error_info.error_pos <= a_s) {
-      if (error_info.error_pos < a_s || !error_info.keep_previous_token) {
-        error_info.error_pos = a_s;
-        error_info.expected_tokens.clear();
-      }
+  template <typename T>
+  Result parse_and_get_value(const char *s, std::any &dt, T &val,
+                             const char *path = nullptr,
+                             Log log = nullptr) const {
+    auto n = strlen(s);
+    return parse_and_get_value(s, n, dt, val, path, log);
+  }
 
-      const char *error_literal = nullptr;
-      const Definition *error_rule = nullptr;
+#if defined(__cpp_lib_char8_t)
+  Result parse(const char8_t *s, size_t n, const char *path = nullptr,
+               Log log = nullptr) const {
+    return parse(reinterpret_cast<const char *>(s), n, path, log);
+  }
 
-      if (literal) {
-        error_literal = literal;
-      } else if (!rule_stack.empty()) {
-        auto rule = rule_stack.back();
-        auto ope = rule->get_core_operator();
-        if (auto token = FindLiteralToken::token(*ope);
-            token && token[0] != '\0') {
-          error_literal = token;
-        }
-      }
+  Result parse(const char8_t *s, const char *path = nullptr,
+               Log log = nullptr) const {
+    return parse(reinterpret_cast<const char *>(s), path, log);
+  }
 
-      for (auto r : rule_stack) {
-        error_rule = r;
-        if (r->is_token()) { break; }
-      }
+  Result parse(const char8_t *s, size_t n, std::any &dt,
+               const char *path = nullptr, Log log = nullptr) const {
+    return parse(reinterpret_cast<const char *>(s), n, dt, path, log);
+  }
 
-      if (error_literal || error_rule) {
-        error_info.add(error_literal, error_rule);
-      }
-    }
+  Result parse(const char8_t *s, std::any &dt, const char *path = nullptr,
+               Log log = nullptr) const {
+    return parse(reinterpret_cast<const char *>(s), dt, path, log);
   }
-}
 
-inline void Context::trace_enter(const Ope &ope, const char *a_s, size_t n,
-                                 const SemanticValues &vs, std::any &dt) {
-  trace_ids.push_back(next_trace_id++);
-  tracer_enter(ope, a_s, n, vs, *this, dt, trace_data);
-}
+  template <typename T>
+  Result parse_and_get_value(const char8_t *s, size_t n, T &val,
+                             const char *path = nullptr,
+                             Log log = nullptr) const {
+    return parse_and_get_value(reinterpret_cast<const char *>(s), n, val, *path,
+                               log);
+  }
 
-inline void Context::trace_leave(const Ope &ope, const char *a_s, size_t n,
-                                 const SemanticValues &vs, std::any &dt,
-                                 size_t len) {
-  tracer_leave(ope, a_s, n, vs, *this, dt, len, trace_data);
-  trace_ids.pop_back();
-}
+  template <typename T>
+  Result parse_and_get_value(const char8_t *s, T &val,
+                             const char *path = nullptr,
+                             Log log = nullptr) const {
+    return parse_and_get_value(reinterpret_cast<const char *>(s), val, *path,
+                               log);
+  }
 
-inline bool Context::is_traceable(const Ope &ope) const {
-  if (tracer_enter && tracer_leave) {
-    if (ignore_trace_state) { return false; }
-    return !dynamic_cast<const peg::Reference *>(&ope);
+  template <typename T>
+  Result parse_and_get_value(const char8_t *s, size_t n, std::any &dt, T &val,
+                             const char *path = nullptr,
+                             Log log = nullptr) const {
+    return parse_and_get_value(reinterpret_cast<const char *>(s), n, dt, val,
+                               *path, log);
   }
-  return false;
-}
 
-inline size_t Ope::parse(const char *s, size_t n, SemanticValues &vs,
-                         Context &c, std::any &dt) const {
-  if (c.is_traceable(*this)) {
-    c.trace_enter(*this, s, n, vs, dt);
-    auto len = parse_core(s, n, vs, c, dt);
-    c.trace_leave(*this, s, n, vs, dt, len);
-    return len;
+  template <typename T>
+  Result parse_and_get_value(const char8_t *s, std::any &dt, T &val,
+                             const char *path = nullptr,
+                             Log log = nullptr) const {
+    return parse_and_get_value(reinterpret_cast<const char *>(s), dt, val,
+                               *path, log);
   }
-  return parse_core(s, n, vs, c, dt);
-}
+#endif
 
-inline size_t Dictionary::parse_core(const char *s, size_t n,
-                                     SemanticValues &vs, Context &c,
-                                     std::any &dt) const {
-  size_t id;
-  auto i = trie_.match(s, n, id);
+  void operator=(Action a) { action = a; }
 
-  if (i == 0) {
-    c.set_error_pos(s);
-    return static_cast<size_t>(-1);
+  template <typename T> Definition &operator,(T fn) {
+    operator=(fn);
+    return *this;
   }
 
-  vs.choice_count_ = trie_.size();
-  vs.choice_ = id;
+  Definition &operator~() {
+    ignoreSemanticValue = true;
+    return *this;
+  }
 
-  // Word check
-  if (c.wordOpe) {
-    auto save_ignore_trace_state = c.ignore_trace_state;
-    c.ignore_trace_state = !c.verbose_trace;
-    auto se =
-        scope_exit([&]() { c.ignore_trace_state = save_ignore_trace_state; });
+  void accept(Ope::Visitor &v) { holder_->accept(v); }
 
-    {
-      SemanticValues dummy_vs;
-      Context dummy_c(nullptr, c.s, c.l, 0, nullptr, nullptr, false, nullptr,
-                      nullptr, nullptr, false, nullptr);
-      std::any dummy_dt;
+  std::shared_ptr<Ope> get_core_operator() const { return holder_->ope_; }
 
-      NotPredicate ope(c.wordOpe);
-      auto len = ope.parse(s + i, n - i, dummy_vs, dummy_c, dummy_dt);
-      if (fail(len)) {
-        c.set_error_pos(s);
-        return len;
-      }
-      i += len;
-    }
+  // Parses the rule like a reference to it does. Used by the parse functions
+  // generated by parser::emit_cpp, which give the rule's `body` if they have
+  // it.
+  size_t parse_rule(const char *s, size_t n, SemanticValues &vs, Context &c,
+                    std::any &dt) const {
+    IgnoreTraceState ignore_trace_state(c, ignoreSemanticValue);
+    return holder_->parse(s, n, vs, c, dt);
+  }
+
+  template <typename Body>
+  size_t parse_rule(const char *s, size_t n, SemanticValues &vs, Context &c,
+                    std::any &dt, Body body) const {
+    IgnoreTraceState ignore_trace_state(c, ignoreSemanticValue);
+#ifndef CPPPEGLIB_DISABLE_TRACE
+    if (c.is_traceable(*holder_)) { return holder_->parse(s, n, vs, c, dt); }
+#endif
+    return holder_->parse_rule(s, n, vs, c, dt, body);
   }
 
-  // Skip whitespace
-  if (!c.in_token_boundary_count && c.whitespaceOpe) {
-    auto save_ignore_trace_state = c.ignore_trace_state;
-    c.ignore_trace_state = !c.verbose_trace;
-    auto se =
-        scope_exit([&]() { c.ignore_trace_state = save_ignore_trace_state; });
+  // Names of the rules reachable from this one, indexed by definition id
+  std::vector<std::string> rule_names() const {
+    initialize_definition_ids();
+    std::vector<std::string> names(definition_ids_.size());
+    for (const auto &[p, id] : definition_ids_) {
+      names[id] = static_cast<const Definition *>(p)->name;
+    }
+    return names;
+  }
 
-    auto len = c.whitespaceOpe->parse(s + i, n - i, vs, c, dt);
-    if (fail(len)) { return len; }
-    i += len;
+  bool is_token() const {
+    std::call_once(is_token_init_, [this]() {
+      is_token_ = TokenChecker::is_token(*get_core_operator());
+    });
+    return is_token_;
   }
 
-  return i;
-}
+  std::string name;
+  const char *s_ = nullptr;
+  std::pair<size_t, size_t> line_ = {1, 1};
 
-inline size_t LiteralString::parse_core(const char *s, size_t n,
-                                        SemanticValues &vs, Context &c,
-                                        std::any &dt) const {
-  return parse_literal(s, n, vs, c, dt, lit_, init_is_word_, is_word_,
-                       ignore_case_);
-}
+  std::function<bool(const SemanticValues &vs, const std::any &dt,
+                     std::string &msg)>
+      predicate;
 
-inline size_t TokenBoundary::parse_core(const char *s, size_t n,
-                                        SemanticValues &vs, Context &c,
-                                        std::any &dt) const {
-  auto save_ignore_trace_state = c.ignore_trace_state;
-  c.ignore_trace_state = !c.verbose_trace;
-  auto se =
-      scope_exit([&]() { c.ignore_trace_state = save_ignore_trace_state; });
+  size_t id = 0;
+  Action action;
+  std::function<void(const Context &c, const char *s, size_t n, std::any &dt)>
+      enter;
+  std::function<void(const Context &c, const char *s, size_t n, size_t matchlen,
+                     std::any &value, std::any &dt)>
+      leave;
+  bool ignoreSemanticValue = false;
+  std::shared_ptr<Ope> whitespaceOpe;
+  std::shared_ptr<Ope> wordOpe;
+  bool enablePackratParsing = false;
+  bool is_macro = false;
+  std::vector<std::string> params;
+  Definition *instance_of = nullptr; // the macro this rule instantiates
+  bool disable_action = false;
 
-  size_t len;
-  {
-    c.in_token_boundary_count++;
-    auto se = scope_exit([&]() { c.in_token_boundary_count--; });
-    len = ope_->parse(s, n, vs, c, dt);
-  }
+  // Parses the rule's expression in place of its operator. Set by parsers
+  // generated with parser::emit_cpp.
+  std::function<size_t(const char *s, size_t n, SemanticValues &vs,
+                       Context &c, std::any &dt)>
+      parse_body;
 
-  if (success(len)) {
-    vs.tokens.emplace_back(std::string_view(s, len));
+  TracerEnter tracer_enter;
+  TracerLeave tracer_leave;
+  bool verbose_trace = false;
+  TracerStartOrEnd tracer_start;
+  TracerStartOrEnd tracer_end;
 
-    if (!c.in_token_boundary_count) {
-      if (c.whitespaceOpe) {
-        auto l = c.whitespaceOpe->parse(s + len, n - len, vs, c, dt);
-        if (fail(l)) { return l; }
-        len += l;
-      }
-    }
-  }
-  return len;
-}
+  MetricsRegistry *metrics = nullptr;
 
-inline size_t Holder::parse_core(const char *s, size_t n, SemanticValues &vs,
-                                 Context &c, std::any &dt) const {
-  if (!ope_) {
-    throw std::logic_error("Uninitialized definition ope was used...");
-  }
+  std::string error_message;
+  bool no_ast_opt = false;
 
-  // Macro reference
-  if (outer_->is_macro) {
-    c.rule_stack.push_back(outer_);
-    auto len = ope_->parse(s, n, vs, c, dt);
-    c.rule_stack.pop_back();
-    return len;
-  }
+  bool eoi_check = true;
+  bool utf8_check = false;
 
-  size_t len;
-  std::any val;
+private:
+  friend class Reference;
+  friend class ParserGenerator;
+  friend class GrammarSnapshot;
+  friend class CppEmitter;
+  friend class MacroExpander;
+  friend class parser;
 
-  c.packrat(s, outer_->id, len, val, [&](std::any &a_val) {
-    if (outer_->enter) { outer_->enter(c, s, n, dt); }
-    auto &chvs = c.push_semantic_values_scope();
-    auto se = scope_exit([&]() {
-      c.pop_semantic_values_scope();
-      if (outer_->leave) { outer_->leave(c, s, n, len, a_val, dt); }
+  Definition &operator=(const Definition &rhs);
+  Definition &operator=(Definition &&rhs);
+
+  void initialize_definition_ids() const {
+    std::call_once(definition_ids_init_, [&]() {
+      AssignIDToDefinition vis;
+      holder_->accept(vis);
+      if (whitespaceOpe) { whitespaceOpe->accept(vis); }
+      if (wordOpe) { wordOpe->accept(vis); }
+      definition_ids_.swap(vis.ids);
     });
+  }
 
-    c.rule_stack.push_back(outer_);
-    len = ope_->parse(s, n, chvs, c, dt);
-    c.rule_stack.pop_back();
+  Result parse_core(const char *s, size_t n, SemanticValues &vs, std::any &dt,
+                    const char *path, Log log, ParseState *state = nullptr,
+                    std::vector<std::shared_ptr<SemanticValues>> *scratch =
+                        nullptr,
+                    const Speculation *speculation = nullptr) const {
+    initialize_definition_ids();
 
-    // Invoke action
-    if (success(len)) {
-      chvs.sv_ = std::string_view(s, len);
-      chvs.name_ = outer_->name;
+    std::shared_ptr<Ope> ope = holder_;
 
-      auto ope_ptr = ope_.get();
-      {
-        auto tok_ptr = dynamic_cast<const peg::TokenBoundary *>(ope_ptr);
-        if (tok_ptr) { ope_ptr = tok_ptr->ope_.get(); }
-      }
-      if (!dynamic_cast<const peg::PrioritizedChoice *>(ope_ptr) &&
-          !dynamic_cast<const peg::Dictionary *>(ope_ptr)) {
-        chvs.choice_count_ = 0;
-        chvs.choice_ = 0;
-      }
+    std::any trace_data;
+#ifndef CPPPEGLIB_DISABLE_TRACE
+    if (tracer_start) { tracer_start(trace_data); }
+    auto se = scope_exit([&]() {
+      if (tracer_end) { tracer_end(trace_data); }
+    });
+#endif
 
-      std::string msg;
-      if (outer_->predicate && !outer_->predicate(chvs, dt, msg)) {
-        if (c.log && !msg.empty() && c.error_info.message_pos < s) {
-          c.error_info.message_pos = s;
-          c.error_info.message = msg;
-          c.error_info.label = outer_->name;
-        }
-        len = static_cast<size_t>(-1);
+    Context c(path, s, n, definition_ids_.size(), whitespaceOpe, wordOpe,
+              enablePackratParsing || state, tracer_enter, tracer_leave,
+              trace_data, verbose_trace, log);
+
+    auto ret = false;
+    std::chrono::steady_clock::time_point metrics_start;
+    if (metrics) {
+      c.metrics = &metrics->local_shard(definition_ids_.size());
+      metrics_start = std::chrono::steady_clock::now();
+    }
+    auto se_metrics = scope_exit([&]() {
+      if (c.metrics) {
+        c.metrics->count_parse(ret, std::chrono::steady_clock::now() -
+                                        metrics_start);
       }
+    });
 
-      if (success(len)) {
-        if (!c.recovered) { a_val = reduce(chvs, dt); }
-      } else {
-        if (c.log && !msg.empty() && c.error_info.message_pos < s) {
-          c.error_info.message_pos = s;
-          c.error_info.message = msg;
-          c.error_info.label = outer_->name;
-        }
-      }
-    } else {
-      if (c.log && !outer_->error_message.empty() &&
-          c.error_info.message_pos < s) {
-        c.error_info.message_pos = s;
-        c.error_info.message = outer_->error_message;
-        c.error_info.label = outer_->name;
-      }
+    if (state) {
+      state->bind(this, definition_ids_.size());
+      c.parse_state = state;
+      c.track_examined = true;
     }
-  });
+    auto se_state = scope_exit([&]() {
+      if (state) { state->commit(); }
+    });
 
-  if (success(len)) {
-    if (!outer_->ignoreSemanticValue) {
-      vs.emplace_back(std::move(val));
-      vs.tags.emplace_back(str2tag(outer_->name));
-    }
-  }
+    c.speculation = speculation;
 
-  return len;
-}
+    if (scratch) { c.adopt_value_stack(*scratch); }
+    auto se_scratch = scope_exit([&]() {
+      if (scratch) { c.value_stack.swap(*scratch); }
+    });
 
-inline std::any Holder::reduce(SemanticValues &vs, std::any &dt) const {
-  if (outer_->action && !outer_->disable_action) {
-    return outer_->action(vs, dt);
-  } else if (vs.empty()) {
-    return std::any();
-  } else {
-    return std::move(vs.front());
-  }
-}
+    if (utf8_check && !check_utf8(s, n, c)) {
+      return Result{false, false, 0, c.error_info};
+    }
 
-inline const std::string &Holder::name() const { return outer_->name; }
+    size_t i = 0;
 
-inline const std::string &Holder::trace_name() const {
-  std::call_once(trace_name_init_,
-                 [this]() { trace_name_ = "[" + outer_->name + "]"; });
-  return trace_name_;
-}
+    if (whitespaceOpe) {
+      IgnoreTraceState ignore_trace_state(c);
 
-inline size_t Reference::parse_core(const char *s, size_t n, SemanticValues &vs,
-                                    Context &c, std::any &dt) const {
-  auto save_ignore_trace_state = c.ignore_trace_state;
-  if (rule_ && rule_->ignoreSemanticValue) {
-    c.ignore_trace_state = !c.verbose_trace;
-  }
-  auto se =
-      scope_exit([&]() { c.ignore_trace_state = save_ignore_trace_state; });
-
-  if (rule_) {
-    // Reference rule
-    if (rule_->is_macro) {
-      // Macro
-      FindReference vis(c.top_args(), c.rule_stack.back()->params);
-
-      // Collect arguments
-      std::vector<std::shared_ptr<Ope>> args;
-      for (auto arg : args_) {
-        arg->accept(vis);
-        args.emplace_back(std::move(vis.found_ope));
-      }
-
-      c.push_args(std::move(args));
-      auto se = scope_exit([&]() { c.pop_args(); });
-      auto ope = get_core_operator();
-      return ope->parse(s, n, vs, c, dt);
-    } else {
-      // Definition
-      c.push_args(std::vector<std::shared_ptr<Ope>>());
-      auto se = scope_exit([&]() { c.pop_args(); });
-      auto ope = get_core_operator();
-      return ope->parse(s, n, vs, c, dt);
-    }
-  } else {
-    // Reference parameter in macro
-    const auto &args = c.top_args();
-    return args[iarg_]->parse(s, n, vs, c, dt);
-  }
-}
+      auto len = whitespaceOpe->parse(s, n, vs, c, dt);
+      if (fail(len)) { return Result{false, c.recovered, i, c.error_info}; }
 
-inline std::shared_ptr<Ope> Reference::get_core_operator() const {
-  return rule_->holder_;
-}
+      i = len;
+    }
 
-inline size_t BackReference::parse_core(const char *s, size_t n,
-                                        SemanticValues &vs, Context &c,
-                                        std::any &dt) const {
-  auto size = static_cast<int>(c.capture_scope_stack_size);
-  for (auto i = size - 1; i >= 0; i--) {
-    auto index = static_cast<size_t>(i);
-    const auto &cs = c.capture_scope_stack[index];
-    if (cs.find(name_) != cs.end()) {
-      const auto &lit = cs.at(name_);
-      std::once_flag init_is_word;
-      auto is_word = false;
-      return parse_literal(s, n, vs, c, dt, lit, init_is_word, is_word, false);
+    auto len = ope->parse(s + i, n - i, vs, c, dt);
+    ret = success(len);
+    if (ret) {
+      i += len;
+      if (eoi_check) {
+        if (i < n) {
+          if (c.error_info.error_pos - c.s < s + i - c.s) {
+            c.error_info.message_pos = s + i;
+            c.error_info.message = "expected end of input";
+          }
+          ret = false;
+        }
+      }
     }
+    return Result{ret, c.recovered, i, c.error_info};
   }
 
-  c.error_info.message_pos = s;
-  c.error_info.message = "undefined back reference '$" + name_ + "'...";
-  return static_cast<size_t>(-1);
-}
+  // Parses consecutive matches of this rule from `pos` until a match ends at
+  // or beyond `end`, as if the rule were repeated up to the end of input.
+  // `s` and `n` cover the whole input, so positions in values and errors are
+  // absolute. Whitespace, word and packrat settings and the definition ids
+  // are taken from `start`, which must reach this rule. Packrat results are
+  // memoized for positions up to `end` only.
+  Result parse_records_core(const char *s, size_t n, size_t pos, size_t end,
+                            SemanticValues &vs, std::any &dt,
+                            const char *path, Log log,
+                            const Definition &start) const {
+    std::shared_ptr<Ope> ope = holder_;
 
-inline Definition &
-PrecedenceClimbing::get_reference_for_binop(Context &c) const {
-  if (rule_.is_macro) {
-    // Reference parameter in macro
-    const auto &args = c.top_args();
-    auto iarg = dynamic_cast<Reference &>(*binop_).iarg_;
-    auto arg = args[iarg];
-    return *dynamic_cast<Reference &>(*arg).rule_;
-  }
+    Context c(path, s, n, start.definition_ids_.size(), start.whitespaceOpe,
+              start.wordOpe, start.enablePackratParsing, nullptr, nullptr,
+              std::any(), false, log, pos, end + 1);
 
-  return *dynamic_cast<Reference &>(*binop_).rule_;
-}
+    size_t i = pos;
 
-inline size_t PrecedenceClimbing::parse_expression(const char *s, size_t n,
-                                                   SemanticValues &vs,
-                                                   Context &c, std::any &dt,
-                                                   size_t min_prec) const {
-  auto len = atom_->parse(s, n, vs, c, dt);
-  if (fail(len)) { return len; }
+    // The first chunk checks the whole input
+    if (i == 0 && start.utf8_check && !check_utf8(s, n, c)) {
+      return Result{false, false, 0, c.error_info};
+    }
 
-  std::string tok;
-  auto &rule = get_reference_for_binop(c);
-  auto action = std::move(rule.action);
+    if (i == 0 && start.whitespaceOpe) {
+      auto len = start.whitespaceOpe->parse(s, n, vs, c, dt);
+      if (fail(len)) { return Result{false, c.recovered, i, c.error_info}; }
 
-  rule.action = [&](SemanticValues &vs2, std::any &dt2) {
-    tok = vs2.token();
-    if (action) {
-      return action(vs2, dt2);
-    } else if (!vs2.empty()) {
-      return vs2[0];
+      i = len;
     }
-    return std::any();
-  };
-  auto action_se = scope_exit([&]() { rule.action = std::move(action); });
 
-  auto i = len;
-  while (i < n) {
-    std::vector<std::any> save_values(vs.begin(), vs.end());
-    auto save_tokens = vs.tokens;
+    while (i < end) {
+      auto len = ope->parse(s + i, n - i, vs, c, dt);
+      if (fail(len)) { return Result{false, c.recovered, i, c.error_info}; }
 
-    auto chvs = c.push_semantic_values_scope();
-    auto chlen = binop_->parse(s + i, n - i, chvs, c, dt);
-    c.pop_semantic_values_scope();
+      if (len == 0) {
+        if (c.error_info.error_pos - c.s < s + i - c.s) {
+          c.error_info.message_pos = s + i;
+          c.error_info.message = "expected end of input";
+        }
+        return Result{false, c.recovered, i, c.error_info};
+      }
 
-    if (fail(chlen)) { break; }
+      i += len;
+    }
 
-    auto it = info_.find(tok);
-    if (it == info_.end()) { break; }
+    return Result{true, c.recovered, i, c.error_info};
+  }
 
-    auto level = std::get<0>(it->second);
-    auto assoc = std::get<1>(it->second);
+  // Reports the first invalid UTF-8 sequence in the input as an error
+  static bool check_utf8(const char *s, size_t n, Context &c) {
+    auto len = valid_utf8_length(s, n);
+    if (len == n) { return true; }
+    c.error_info.message_pos = s + len;
+    c.error_info.message = "invalid UTF-8 sequence.";
+    return false;
+  }
 
-    if (level < min_prec) { break; }
+  std::shared_ptr<Holder> holder_;
+  bool user_rule_ = false;
+  mutable std::once_flag is_token_init_;
+  mutable bool is_token_ = false;
+  mutable std::once_flag assign_id_to_definition_init_;
+  mutable std::once_flag definition_ids_init_;
+  mutable std::unordered_map<void *, size_t> definition_ids_;
 
-    vs.emplace_back(std::move(chvs[0]));
-    i += chlen;
+  // Instances of this macro, by their arguments
+  std::unordered_map<std::string, std::unique_ptr<Definition>> instances_;
+};
 
-    auto next_min_prec = level;
-    if (assoc == 'L') { next_min_prec = level + 1; }
+/*
+ * Implementations
+ */
 
-    chvs = c.push_semantic_values_scope();
-    chlen = parse_expression(s + i, n - i, chvs, c, dt, next_min_prec);
-    c.pop_semantic_values_scope();
+// Fails if the word expression matches at `s`, so that a keyword doesn't
+// match the start of a longer word
+inline size_t parse_word_end(const char *s, size_t n, Context &c) {
+  SemanticValues dummy_vs;
+  Context dummy_c(nullptr, c.s, c.l, 0, nullptr, nullptr, false, nullptr,
+                  nullptr, nullptr, false, nullptr);
+  dummy_c.track_examined = c.track_examined;
+  std::any dummy_dt;
+
+  NotPredicate ope(c.wordOpe);
+  auto len = ope.parse(s, n, dummy_vs, dummy_c, dummy_dt);
+  c.examined_end = (std::max)(c.examined_end, dummy_c.examined_end);
+  return len;
+}
 
-    if (fail(chlen)) {
-      vs.assign(save_values.begin(), save_values.end());
-      vs.tokens = save_tokens;
-      i = chlen;
-      break;
+inline size_t parse_literal(const char *s, size_t n, SemanticValues &vs,
+                            Context &c, std::any &dt, std::string_view lit,
+                            std::once_flag &init_is_word, bool &is_word,
+                            bool ignore_case) {
+  size_t i = 0;
+  for (; i < lit.size(); i++) {
+    if (i >= n || (ignore_case ? (std::tolower(s[i]) != std::tolower(lit[i]))
+                               : (s[i] != lit[i]))) {
+      if (c.track_examined) { c.mark_examined(s, i + 1); }
+      c.set_error_pos(s, lit.data());
+      return static_cast<size_t>(-1);
     }
+  }
+  if (c.track_examined) { c.mark_examined(s, i); }
 
-    vs.emplace_back(std::move(chvs[0]));
-    i += chlen;
+  // Word check
+  if (c.wordOpe) {
+    IgnoreTraceState ignore_trace_state(c);
 
-    std::any val;
-    if (rule_.action) {
-      vs.sv_ = std::string_view(s, i);
-      val = rule_.action(vs, dt);
-    } else if (!vs.empty()) {
-      val = vs[0];
+    std::call_once(init_is_word, [&]() {
+      SemanticValues dummy_vs;
+      Context dummy_c(nullptr, c.s, c.l, 0, nullptr, nullptr, false, nullptr,
+                      nullptr, nullptr, false, nullptr);
+      std::any dummy_dt;
+
+      auto len =
+          c.wordOpe->parse(lit.data(), lit.size(), dummy_vs, dummy_c, dummy_dt);
+      is_word = success(len);
+    });
+
+    if (is_word) {
+      auto len = parse_word_end(s + i, n - i, c);
+      if (fail(len)) {
+        c.set_error_pos(s, lit.data());
+        return len;
+      }
+      i += len;
     }
-    vs.clear();
-    vs.emplace_back(std::move(val));
+  }
+
+  // Skip whitespace
+  if (!c.in_token_boundary_count && c.whitespaceOpe) {
+    IgnoreTraceState ignore_trace_state(c);
+
+    auto len = c.whitespaceOpe->parse(s + i, n - i, vs, c, dt);
+    if (fail(len)) { return len; }
+    i += len;
   }
 
   return i;
 }
 
-inline size_t Recovery::parse_core(const char *s, size_t n,
-                                   SemanticValues & /*vs*/, Context &c,
-                                   std::any & /*dt*/) const {
-  const auto &rule = dynamic_cast<Reference &>(*ope_);
+inline std::pair<size_t, size_t> SemanticValues::line_info() const {
+  assert(c_);
+  return c_->line_info(sv_.data());
+}
 
-  // Custom error message
-  if (c.log) {
-    auto label = dynamic_cast<Reference *>(rule.args_[0].get());
-    if (label && !label->rule_->error_message.empty()) {
-      c.error_info.message_pos = s;
-      c.error_info.message = label->rule_->error_message;
-      c.error_info.label = label->rule_->name;
-    }
-  }
+inline void ErrorInfo::output_log(const Log &log, const char *s, size_t n) {
+  if (message_pos) {
+    if (message_pos > last_output_pos) {
+      last_output_pos = message_pos;
+      auto line = line_info(s, message_pos);
+      std::string msg;
+      if (auto unexpected_token = heuristic_error_token(s, n, message_pos);
+          !unexpected_token.empty()) {
+        msg = replace_all(message, "%t", unexpected_token);
 
-  // Recovery
-  auto len = static_cast<size_t>(-1);
-  {
-    auto save_log = c.log;
-    c.log = nullptr;
-    auto se = scope_exit([&]() { c.log = save_log; });
+        auto unexpected_char = unexpected_token.substr(
+            0,
+            codepoint_length(unexpected_token.data(), unexpected_token.size()));
 
-    SemanticValues dummy_vs;
-    std::any dummy_dt;
+        msg = replace_all(msg, "%c", unexpected_char);
+      } else {
+        msg = message;
+      }
+      log(line.first, line.second, msg, label);
+    }
+  } else if (error_pos) {
+    if (error_pos > last_output_pos) {
+      last_output_pos = error_pos;
+      auto line = line_info(s, error_pos);
 
-    len = rule.parse(s, n, dummy_vs, c, dummy_dt);
-  }
+      std::string msg;
+      if (expected_tokens.empty()) {
+        msg = "syntax error.";
+      } else {
+        msg = "syntax error";
 
-  if (success(len)) {
-    c.recovered = true;
+        // unexpected token
+        if (auto unexpected_token = heuristic_error_token(s, n, error_pos);
+            !unexpected_token.empty()) {
+          msg += ", unexpected '";
+          msg += unexpected_token;
+          msg += "'";
+        }
 
-    if (c.log) {
-      c.error_info.output_log(c.log, c.s, c.l);
-      c.error_info.clear();
-    }
-  }
+        auto first_item = true;
+        size_t i = 0;
+        while (i < expected_tokens.size()) {
+          auto [error_literal, error_rule] = expected_tokens[i];
 
-  // Cut
-  if (!c.cut_stack.empty()) {
-    c.cut_stack.back() = true;
+          // Skip rules start with '_'
+          if (!(error_rule && error_rule->name[0] == '_')) {
+            msg += (first_item ? ", expecting " : ", ");
+            if (error_literal) {
+              msg += "'";
+              msg += error_literal;
+              msg += "'";
+            } else {
+              msg += "<" + error_rule->name + ">";
+              if (label.empty()) { label = error_rule->name; }
+            }
+            first_item = false;
+          }
 
-    if (c.cut_stack.size() == 1) {
-      // TODO: Remove unneeded entries in packrat memoise table
+          i++;
+        }
+        msg += ".";
+      }
+      log(line.first, line.second, msg, label);
     }
   }
-
-  return len;
 }
 
-inline void Sequence::accept(Visitor &v) { v.visit(*this); }
-inline void PrioritizedChoice::accept(Visitor &v) { v.visit(*this); }
-inline void Repetition::accept(Visitor &v) { v.visit(*this); }
-inline void AndPredicate::accept(Visitor &v) { v.visit(*this); }
-inline void NotPredicate::accept(Visitor &v) { v.visit(*this); }
-inline void Dictionary::accept(Visitor &v) { v.visit(*this); }
-inline void LiteralString::accept(Visitor &v) { v.visit(*this); }
-inline void CharacterClass::accept(Visitor &v) { v.visit(*this); }
-inline void Character::accept(Visitor &v) { v.visit(*this); }
-inline void AnyCharacter::accept(Visitor &v) { v.visit(*this); }
-inline void CaptureScope::accept(Visitor &v) { v.visit(*this); }
-inline void Capture::accept(Visitor &v) { v.visit(*this); }
-inline void TokenBoundary::accept(Visitor &v) { v.visit(*this); }
-inline void Ignore::accept(Visitor &v) { v.visit(*this); }
-inline void User::accept(Visitor &v) { v.visit(*this); }
-inline void WeakHolder::accept(Visitor &v) { v.visit(*this); }
-inline void Holder::accept(Visitor &v) { v.visit(*this); }
-inline void Reference::accept(Visitor &v) { v.visit(*this); }
-inline void Whitespace::accept(Visitor &v) { v.visit(*this); }
-inline void BackReference::accept(Visitor &v) { v.visit(*this); }
-inline void PrecedenceClimbing::accept(Visitor &v) { v.visit(*this); }
-inline void Recovery::accept(Visitor &v) { v.visit(*this); }
-inline void Cut::accept(Visitor &v) { v.visit(*this); }
+inline void Context::set_error_pos(const char *a_s, const char *literal) {
+  if (log) {
+    if (error_info.error_pos <= a_s) {
+      if (error_info.error_pos < a_s || !error_info.keep_previous_token) {
+        error_info.error_pos = a_s;
+        error_info.expected_tokens.clear();
+      }
 
-inline void AssignIDToDefinition::visit(Holder &ope) {
-  auto p = static_cast<void *>(ope.outer_);
-  if (ids.count(p)) { return; }
-  auto id = ids.size();
-  ids[p] = id;
-  ope.outer_->id = id;
-  ope.ope_->accept(*this);
-}
+      const char *error_literal = nullptr;
+      const Definition *error_rule = nullptr;
 
-inline void AssignIDToDefinition::visit(Reference &ope) {
-  if (ope.rule_) {
-    for (auto arg : ope.args_) {
-      arg->accept(*this);
+      if (literal) {
+        error_literal = literal;
+      } else if (!rule_stack.empty()) {
+        auto rule = rule_stack.back();
+        auto ope = rule->get_core_operator();
+        if (auto token = FindLiteralToken::token(*ope);
+            token && token[0] != '\0') {
+          error_literal = token;
+        }
+      }
+
+      for (auto r : rule_stack) {
+        error_rule = r;
+        if (r->is_token()) { break; }
+      }
+
+      if (error_literal || error_rule) {
+        error_info.add(error_literal, error_rule);
+      }
     }
-    ope.rule_->accept(*this);
   }
 }
 
-inline void AssignIDToDefinition::visit(PrecedenceClimbing &ope) {
-  ope.atom_->accept(*this);
-  ope.binop_->accept(*this);
+inline void Context::trace_enter(const Ope &ope, const char *a_s, size_t n,
+                                 const SemanticValues &vs, std::any &dt) {
+  trace_ids.push_back(next_trace_id++);
+  tracer_enter(ope, a_s, n, vs, *this, dt, trace_data);
 }
 
-inline void TokenChecker::visit(Reference &ope) {
-  if (ope.is_macro_) {
-    for (auto arg : ope.args_) {
-      arg->accept(*this);
-    }
-  } else {
-    has_rule_ = true;
-  }
+inline void Context::trace_leave(const Ope &ope, const char *a_s, size_t n,
+                                 const SemanticValues &vs, std::any &dt,
+                                 size_t len) {
+  tracer_leave(ope, a_s, n, vs, *this, dt, len, trace_data);
+  trace_ids.pop_back();
 }
 
-inline void FindLiteralToken::visit(Reference &ope) {
-  if (ope.is_macro_) {
-    ope.rule_->accept(*this);
-    for (auto arg : ope.args_) {
-      arg->accept(*this);
-    }
+inline bool Context::is_traceable(const Ope &ope) const {
+  if (tracer_enter && tracer_leave) {
+    if (ignore_trace_state) { return false; }
+    return !dynamic_cast<const peg::Reference *>(&ope);
   }
+  return false;
 }
 
-inline void DetectLeftRecursion::visit(Reference &ope) {
-  if (ope.name_ == name_) {
-    error_s = ope.s_;
-  } else if (!refs_.count(ope.name_)) {
-    refs_.insert(ope.name_);
-    if (ope.rule_) {
-      ope.rule_->accept(*this);
-      if (done_ == false) { return; }
-    }
+inline size_t Ope::parse(const char *s, size_t n, SemanticValues &vs,
+                         Context &c, std::any &dt) const {
+#ifndef CPPPEGLIB_DISABLE_TRACE
+  if (c.is_traceable(*this)) {
+    c.trace_enter(*this, s, n, vs, dt);
+    auto len = c.stop_parse ? static_cast<size_t>(-1)
+                            : parse_core(s, n, vs, c, dt);
+    c.trace_leave(*this, s, n, vs, dt, len);
+    return len;
   }
-  done_ = true;
+#endif
+  return parse_core(s, n, vs, c, dt);
 }
 
-inline void HasEmptyElement::visit(Sequence &ope) {
-  auto save_is_empty = false;
-  const char *save_error_s = nullptr;
-  std::string save_error_name;
+inline size_t Dictionary::parse_core(const char *s, size_t n,
+                                     SemanticValues &vs, Context &c,
+                                     std::any &dt) const {
+  size_t id;
+  auto i = trie_.match(s, n, id);
+  if (c.track_examined) {
+    c.mark_examined(s, trie_.max_length() <= n ? trie_.max_length() : n + 1);
+  }
 
-  auto it = ope.opes_.begin();
-  while (it != ope.opes_.end()) {
-    (*it)->accept(*this);
-    if (!is_empty) {
-      ++it;
-      while (it != ope.opes_.end()) {
-        DetectInfiniteLoop vis(refs_, has_error_cache_);
-        (*it)->accept(vis);
-        if (vis.has_error) {
-          is_empty = true;
-          error_s = vis.error_s;
-          error_name = vis.error_name;
-        }
-        ++it;
+  if (i == 0) {
+    c.set_error_pos(s);
+    return static_cast<size_t>(-1);
+  }
+
+  vs.choice_count_ = trie_.size();
+  vs.choice_ = id;
+
+  // Word check
+  if (c.wordOpe) {
+    IgnoreTraceState ignore_trace_state(c);
+
+    {
+      SemanticValues dummy_vs;
+      Context dummy_c(nullptr, c.s, c.l, 0, nullptr, nullptr, false, nullptr,
+                      nullptr, nullptr, false, nullptr);
+      dummy_c.track_examined = c.track_examined;
+      std::any dummy_dt;
+
+      NotPredicate ope(c.wordOpe);
+      auto len = ope.parse(s + i, n - i, dummy_vs, dummy_c, dummy_dt);
+      c.examined_end = (std::max)(c.examined_end, dummy_c.examined_end);
+      if (fail(len)) {
+        c.set_error_pos(s);
+        return len;
       }
-      return;
+      i += len;
     }
+  }
 
-    save_is_empty = is_empty;
-    save_error_s = error_s;
-    save_error_name = error_name;
+  // Skip whitespace
+  if (!c.in_token_boundary_count && c.whitespaceOpe) {
+    IgnoreTraceState ignore_trace_state(c);
 
-    is_empty = false;
-    error_name.clear();
-    ++it;
+    auto len = c.whitespaceOpe->parse(s + i, n - i, vs, c, dt);
+    if (fail(len)) { return len; }
+    i += len;
   }
 
-  is_empty = save_is_empty;
-  error_s = save_error_s;
-  error_name = save_error_name;
+  return i;
 }
 
-inline void HasEmptyElement::visit(Reference &ope) {
-  auto it = std::find_if(refs_.begin(), refs_.end(),
-                         [&](const std::pair<const char *, std::string> &ref) {
-                           return ope.name_ == ref.second;
-                         });
-  if (it != refs_.end()) { return; }
-
-  if (ope.rule_) {
-    refs_.emplace_back(ope.s_, ope.name_);
-    ope.rule_->accept(*this);
-    refs_.pop_back();
-  }
+inline size_t LiteralString::parse_core(const char *s, size_t n,
+                                        SemanticValues &vs, Context &c,
+                                        std::any &dt) const {
+  return parse_literal(s, n, vs, c, dt, lit_, init_is_word_, is_word_,
+                       ignore_case_);
 }
 
-inline void DetectInfiniteLoop::visit(Reference &ope) {
-  auto it = std::find_if(refs_.begin(), refs_.end(),
-                         [&](const std::pair<const char *, std::string> &ref) {
-                           return ope.name_ == ref.second;
-                         });
-  if (it != refs_.end()) { return; }
-
-  if (ope.rule_) {
-    auto it = has_error_cache_.find(ope.name_);
-    if (it != has_error_cache_.end()) {
-      has_error = it->second;
-    } else {
-      refs_.emplace_back(ope.s_, ope.name_);
-      ope.rule_->accept(*this);
-      refs_.pop_back();
-      has_error_cache_[ope.name_] = has_error;
-    }
-  }
+inline size_t TokenBoundary::parse_core(const char *s, size_t n,
+                                        SemanticValues &vs, Context &c,
+                                        std::any &dt) const {
+  IgnoreTraceState ignore_trace_state(c);
 
-  if (ope.is_macro_) {
-    for (auto arg : ope.args_) {
-      arg->accept(*this);
-    }
+  size_t len;
+  {
+    c.in_token_boundary_count++;
+    auto se = scope_exit([&]() { c.in_token_boundary_count--; });
+    len = ope_->parse(s, n, vs, c, dt);
   }
-}
 
-inline void ReferenceChecker::visit(Reference &ope) {
-  auto it = std::find(params_.begin(), params_.end(), ope.name_);
-  if (it != params_.end()) { return; }
+  if (success(len)) {
+    vs.tokens.emplace_back(std::string_view(s, len));
 
-  if (!grammar_.count(ope.name_)) {
-    error_s[ope.name_] = ope.s_;
-    error_message[ope.name_] = "'" + ope.name_ + "' is not defined.";
-  } else {
-    if (!referenced.count(ope.name_)) { referenced.insert(ope.name_); }
-    const auto &rule = grammar_.at(ope.name_);
-    if (rule.is_macro) {
-      if (!ope.is_macro_ || ope.args_.size() != rule.params.size()) {
-        error_s[ope.name_] = ope.s_;
-        error_message[ope.name_] = "incorrect number of arguments.";
+    if (!c.in_token_boundary_count) {
+      if (c.whitespaceOpe) {
+        auto l = c.whitespaceOpe->parse(s + len, n - len, vs, c, dt);
+        if (fail(l)) { return l; }
+        len += l;
       }
-    } else if (ope.is_macro_) {
-      error_s[ope.name_] = ope.s_;
-      error_message[ope.name_] = "'" + ope.name_ + "' is not macro.";
-    }
-    for (auto arg : ope.args_) {
-      arg->accept(*this);
     }
   }
+  return len;
 }
 
-inline void LinkReferences::visit(Reference &ope) {
-  // Check if the reference is a macro parameter
-  auto found_param = false;
-  for (size_t i = 0; i < params_.size(); i++) {
-    const auto &param = params_[i];
-    if (param == ope.name_) {
-      ope.iarg_ = i;
-      found_param = true;
-      break;
-    }
-  }
-
-  // Check if the reference is a definition rule
-  if (!found_param && grammar_.count(ope.name_)) {
-    auto &rule = grammar_.at(ope.name_);
-    ope.rule_ = &rule;
+inline size_t Holder::parse_core(const char *s, size_t n, SemanticValues &vs,
+                                 Context &c, std::any &dt) const {
+  if (!ope_) {
+    throw std::logic_error("Uninitialized definition ope was used...");
   }
 
-  for (auto arg : ope.args_) {
-    arg->accept(*this);
+  // Macro reference
+  if (outer_->is_macro) {
+    c.rule_stack.push_back(outer_);
+    auto len = ope_->parse(s, n, vs, c, dt);
+    c.rule_stack.pop_back();
+    return len;
   }
-}
 
-inline void FindReference::visit(Reference &ope) {
-  for (size_t i = 0; i < args_.size(); i++) {
-    const auto &name = params_[i];
-    if (name == ope.name_) {
-      found_ope = args_[i];
-      return;
-    }
-  }
-  found_ope = ope.shared_from_this();
-}
+  // Macro instance. Its values go to the caller like the macro's, and they
+  // are kept in the memo to be added again on a hit.
+  if (outer_->instance_of) {
+    if (c.log) { c.rule_stack.push_back(outer_->instance_of); }
+    auto se = scope_exit([&]() {
+      if (c.log) { c.rule_stack.pop_back(); }
+    });
 
-/*-----------------------------------------------------------------------------
- *  PEG parser generator
- *---------------------------------------------------------------------------*/
+    if (!c.enablePackratParsing) { return ope_->parse(s, n, vs, c, dt); }
 
-using Rules = std::unordered_map<std::string, std::shared_ptr<Ope>>;
+    auto append = [&](SemanticValues &chvs) {
+      vs.append(chvs);
+      if (chvs.choice_count_) {
+        vs.choice_count_ = chvs.choice_count_;
+        vs.choice_ = chvs.choice_;
+      }
+    };
 
-class ParserGenerator {
-public:
-  static std::shared_ptr<Grammar> parse(const char *s, size_t n,
-                                        const Rules &rules, std::string &start,
-                                        bool &enablePackratParsing, Log log) {
-    return get_instance().perform_core(s, n, rules, start, enablePackratParsing,
-                                       log);
-  }
+    size_t len;
+    std::any val;
+    auto hit = true;
+    c.packrat(s, outer_->id, len, val, [&](std::any &a_val) {
+      hit = false;
+      auto &chvs = c.push_semantic_values_scope();
+      auto se = scope_exit([&]() { c.pop_semantic_values_scope(); });
+      len = ope_->parse(s, n, chvs, c, dt);
+      if (success(len)) {
+        a_val = chvs;
+        append(chvs);
+      }
+    });
 
-  static std::shared_ptr<Grammar> parse(const char *s, size_t n,
-                                        std::string &start,
-                                        bool &enablePackratParsing, Log log) {
-    Rules dummy;
-    return parse(s, n, dummy, start, enablePackratParsing, log);
+    if (hit && success(len)) { append(std::any_cast<SemanticValues &>(val)); }
+    return len;
   }
 
-  // For debugging purpose
-  static Grammar &grammar() { return get_instance().g; }
+  return parse_rule(s, n, vs, c, dt, [&](SemanticValues &chvs) {
+    if (outer_->parse_body) { return outer_->parse_body(s, n, chvs, c, dt); }
+    return ope_->parse(s, n, chvs, c, dt);
+  });
+}
 
-private:
-  static ParserGenerator &get_instance() {
-    static ParserGenerator instance;
-    return instance;
+template <typename Body>
+inline size_t Holder::parse_rule(const char *s, size_t n, SemanticValues &vs,
+                                 Context &c, std::any &dt, Body body) const {
+  // Reuse the result of a speculative parse at the same position
+  if (c.speculation && c.speculation->rule == outer_ &&
+      !c.in_token_boundary_count) {
+    if (auto f = c.speculation->find(static_cast<size_t>(s - c.s))) {
+      c.memo_hit = true;
+      if (!outer_->ignoreSemanticValue) {
+        vs.emplace_back(f->val);
+        vs.tags.emplace_back(str2tag(outer_->name));
+      }
+      return f->len;
+    }
   }
 
-  ParserGenerator() {
-    make_grammar();
-    setup_actions();
-  }
-
-  struct Instruction {
-    std::string type;
-    std::any data;
-    std::string_view sv;
-  };
+  size_t len;
+  std::any val;
 
-  struct Data {
-    std::shared_ptr<Grammar> grammar;
-    std::string start;
-    const char *start_pos = nullptr;
+  c.packrat(s, outer_->id, len, val, [&](std::any &a_val) {
+    if (outer_->enter) { outer_->enter(c, s, n, dt); }
+    auto &chvs = c.push_semantic_values_scope();
+    auto se = scope_exit([&]() {
+      c.pop_semantic_values_scope();
+      if (outer_->leave) { outer_->leave(c, s, n, len, a_val, dt); }
+    });
 
-    std::vector<std::pair<std::string, const char *>> duplicates_of_definition;
+    // The rule stack is only used for error messages, apart from macros
+    if (c.log) { c.rule_stack.push_back(outer_); }
+    len = body(chvs);
+    if (c.log) { c.rule_stack.pop_back(); }
 
-    std::vector<std::pair<std::string, const char *>> duplicates_of_instruction;
-    std::map<std::string, std::vector<Instruction>> instructions;
+    // Invoke action
+    if (success(len)) {
+      chvs.sv_ = std::string_view(s, len);
+      chvs.name_ = outer_->name;
 
-    std::vector<std::pair<std::string, const char *>> undefined_back_references;
-    std::vector<std::set<std::string_view>> captures_stack{{}};
+      auto ope_ptr = ope_.get();
+      {
+        auto tok_ptr = dynamic_cast<const peg::TokenBoundary *>(ope_ptr);
+        if (tok_ptr) { ope_ptr = tok_ptr->ope_.get(); }
+      }
+      if (!dynamic_cast<const peg::PrioritizedChoice *>(ope_ptr) &&
+          !dynamic_cast<const peg::Dictionary *>(ope_ptr)) {
+        chvs.choice_count_ = 0;
+        chvs.choice_ = 0;
+      }
 
-    std::set<std::string_view> captures_in_current_definition;
-    bool enablePackratParsing = true;
+      std::string msg;
+      if (outer_->predicate && !outer_->predicate(chvs, dt, msg)) {
+        if (c.log && !msg.empty() && c.error_info.message_pos < s) {
+          c.error_info.message_pos = s;
+          c.error_info.message = msg;
+          c.error_info.label = outer_->name;
+        }
+        len = static_cast<size_t>(-1);
+      }
 
-    Data() : grammar(std::make_shared<Grammar>()) {}
-  };
+      if (success(len)) {
+        if (!c.recovered) {
+          if (c.tracer_enter) {
+            auto start = std::chrono::steady_clock::now();
+            a_val = reduce(chvs, dt);
+            c.action_time += std::chrono::steady_clock::now() - start;
+          } else {
+            a_val = reduce(chvs, dt);
+          }
+        }
+      } else {
+        if (c.log && !msg.empty() && c.error_info.message_pos < s) {
+          c.error_info.message_pos = s;
+          c.error_info.message = msg;
+          c.error_info.label = outer_->name;
+        }
+      }
+    } else {
+      if (c.log && !outer_->error_message.empty() &&
+          c.error_info.message_pos < s) {
+        c.error_info.message_pos = s;
+        c.error_info.message = outer_->error_message;
+        c.error_info.label = outer_->name;
+      }
+    }
+  });
 
-  void make_grammar() {
-    // Setup PEG syntax parser
-    g["Grammar"] <= seq(g["Spacing"], oom(g["Definition"]), g["EndOfFile"]);
-    g["Definition"] <=
-        cho(seq(g["Ignore"], g["IdentCont"], g["Parameters"], g["LEFTARROW"],
-                g["Expression"], opt(g["Instruction"])),
-            seq(g["Ignore"], g["Identifier"], g["LEFTARROW"], g["Expression"],
-                opt(g["Instruction"])));
-    g["Expression"] <= seq(g["Sequence"], zom(seq(g["SLASH"], g["Sequence"])));
-    g["Sequence"] <= zom(cho(g["CUT"], g["Prefix"]));
-    g["Prefix"] <= seq(opt(cho(g["AND"], g["NOT"])), g["SuffixWithLabel"]);
-    g["SuffixWithLabel"] <=
-        seq(g["Suffix"], opt(seq(g["LABEL"], g["Identifier"])));
-    g["Suffix"] <= seq(g["Primary"], opt(g["Loop"]));
-    g["Loop"] <= cho(g["QUESTION"], g["STAR"], g["PLUS"], g["Repetition"]);
-    g["Primary"] <= cho(seq(g["Ignore"], g["IdentCont"], g["Arguments"],
-                            npd(g["LEFTARROW"])),
-                        seq(g["Ignore"], g["Identifier"],
-                            npd(seq(opt(g["Parameters"]), g["LEFTARROW"]))),
-                        seq(g["OPEN"], g["Expression"], g["CLOSE"]),
-                        seq(g["BeginTok"], g["Expression"], g["EndTok"]),
-                        g["CapScope"],
-                        seq(g["BeginCap"], g["Expression"], g["EndCap"]),
-                        g["BackRef"], g["DictionaryI"], g["LiteralI"],
-                        g["Dictionary"], g["Literal"], g["NegatedClassI"],
-                        g["NegatedClass"], g["ClassI"], g["Class"], g["DOT"]);
+  if (c.metrics) { c.metrics->count_rule(outer_->id, success(len)); }
 
-    g["Identifier"] <= seq(g["IdentCont"], g["Spacing"]);
-    g["IdentCont"] <= tok(seq(g["IdentStart"], zom(g["IdentRest"])));
+  if (success(len)) {
+    if (!outer_->ignoreSemanticValue) {
+      vs.emplace_back(std::move(val));
+      vs.tags.emplace_back(str2tag(outer_->name));
+    }
+  }
 
-    const static std::vector<std::pair<char32_t, char32_t>> range = {
-        {0x0080, 0xFFFF}};
-    g["IdentStart"] <= seq(npd(lit(u8(u8"↑"))), npd(lit(u8(u8"⇑"))),
-                           cho(cls("a-zA-Z_%"), cls(range)));
+  return len;
+}
 
-    g["IdentRest"] <= cho(g["IdentStart"], cls("0-9"));
+inline std::any Holder::reduce(SemanticValues &vs, std::any &dt) const {
+  if (outer_->action && !outer_->disable_action) {
+    return outer_->action(vs, dt);
+  } else if (vs.empty()) {
+    return std::any();
+  } else {
+    return std::move(vs.front());
+  }
+}
 
-    g["Dictionary"] <= seq(g["LiteralD"], oom(seq(g["PIPE"], g["LiteralD"])));
+inline const std::string &Holder::name() const { return outer_->name; }
 
-    g["DictionaryI"] <=
-        seq(g["LiteralID"], oom(seq(g["PIPE"], g["LiteralID"])));
+inline const std::string &Holder::trace_name() const {
+  std::call_once(trace_name_init_,
+                 [this]() { trace_name_ = "[" + outer_->name + "]"; });
+  return trace_name_;
+}
 
-    auto lit_ope = cho(seq(cls("'"), tok(zom(seq(npd(cls("'")), g["Char"]))),
-                           cls("'"), g["Spacing"]),
-                       seq(cls("\""), tok(zom(seq(npd(cls("\"")), g["Char"]))),
-                           cls("\""), g["Spacing"]));
-    g["Literal"] <= lit_ope;
-    g["LiteralD"] <= lit_ope;
+inline size_t Reference::parse_core(const char *s, size_t n, SemanticValues &vs,
+                                    Context &c, std::any &dt) const {
+  IgnoreTraceState ignore_trace_state(c, rule_ && rule_->ignoreSemanticValue);
 
-    auto lit_case_ignore_ope =
-        cho(seq(cls("'"), tok(zom(seq(npd(cls("'")), g["Char"]))), lit("'i"),
-                g["Spacing"]),
-            seq(cls("\""), tok(zom(seq(npd(cls("\"")), g["Char"]))), lit("\"i"),
-                g["Spacing"]));
-    g["LiteralI"] <= lit_case_ignore_ope;
-    g["LiteralID"] <= lit_case_ignore_ope;
+  if (!rule_) {
+    // Reference parameter in macro
+    const auto &args = c.top_args();
+    return args[iarg_]->parse(s, n, vs, c, dt);
+  }
 
-    // NOTE: The original Brian Ford's paper uses 'zom' instead of 'oom'.
-    g["Class"] <= seq(chr('['), npd(chr('^')),
-                      tok(oom(seq(npd(chr(']')), g["Range"]))), chr(']'),
-                      g["Spacing"]);
-    g["ClassI"] <= seq(chr('['), npd(chr('^')),
-                       tok(oom(seq(npd(chr(']')), g["Range"]))), lit("]i"),
-                       g["Spacing"]);
+  // Definition, or macro instance
+  if (!rule_->is_macro) { return rule_->holder_->parse(s, n, vs, c, dt); }
 
-    g["NegatedClass"] <= seq(lit("[^"),
-                             tok(oom(seq(npd(chr(']')), g["Range"]))), chr(']'),
-                             g["Spacing"]);
-    g["NegatedClassI"] <= seq(lit("[^"),
-                              tok(oom(seq(npd(chr(']')), g["Range"]))),
-                              lit("]i"), g["Spacing"]);
+  // Macro that wasn't instantiated. Arguments in a macro body can refer to
+  // its parameters, and the macro is on top of the rule stack then.
+  if (in_macro_) {
+    FindReference vis(c.top_args(), c.rule_stack.back()->params);
 
-    // NOTE: This is different from The original Brian Ford's paper, and this
-    // modification allows us to specify `[+-]` as a valid char class.
-    g["Range"] <=
-        cho(seq(g["Char"], chr('-'), npd(chr(']')), g["Char"]), g["Char"]);
+    std::vector<std::shared_ptr<Ope>> args;
+    for (auto arg : args_) {
+      arg->accept(vis);
+      args.emplace_back(std::move(vis.found_ope));
+    }
+    c.push_args(std::move(args));
+  } else {
+    c.push_args(std::vector<std::shared_ptr<Ope>>(args_));
+  }
 
-    g["Char"] <=
-        cho(seq(chr('\\'), cls("fnrtv'\"[]\\^")),
-            seq(chr('\\'), cls("0-3"), cls("0-7"), cls("0-7")),
-            seq(chr('\\'), cls("0-7"), opt(cls("0-7"))),
-            seq(lit("\\x"), cls("0-9a-fA-F"), opt(cls("0-9a-fA-F"))),
-            seq(lit("\\u"),
-                cho(seq(cho(seq(chr('0'), cls("0-9a-fA-F")), lit("10")),
-                        rep(cls("0-9a-fA-F"), 4, 4)),
-                    rep(cls("0-9a-fA-F"), 4, 5))),
-            seq(npd(chr('\\')), dot()));
+  auto se = scope_exit([&]() { c.pop_args(); });
+  return rule_->holder_->parse(s, n, vs, c, dt);
+}
 
-    g["Repetition"] <=
-        seq(g["BeginBracket"], g["RepetitionRange"], g["EndBracket"]);
-    g["RepetitionRange"] <= cho(seq(g["Number"], g["COMMA"], g["Number"]),
-                                seq(g["Number"], g["COMMA"]), g["Number"],
-                                seq(g["COMMA"], g["Number"]));
-    g["Number"] <= seq(oom(cls("0-9")), g["Spacing"]);
+inline std::shared_ptr<Ope> Reference::get_core_operator() const {
+  return rule_->holder_;
+}
 
-    g["CapScope"] <= seq(g["BeginCapScope"], g["Expression"], g["EndCapScope"]);
+inline size_t BackReference::parse_core(const char *s, size_t n,
+                                        SemanticValues &vs, Context &c,
+                                        std::any &dt) const {
+  if (auto text = c.find_capture_value(name_)) {
+    // Error messages point to the expected literal after the parse
+    auto lit = *text;
+    if (c.log) { lit = *c.back_reference_literals.emplace(lit).first; }
+    std::once_flag init_is_word;
+    auto is_word = false;
+    return parse_literal(s, n, vs, c, dt, lit, init_is_word, is_word, false);
+  }
 
-    g["LEFTARROW"] <= seq(cho(lit("<-"), lit(u8(u8"←"))), g["Spacing"]);
-    ~g["SLASH"] <= seq(chr('/'), g["Spacing"]);
-    ~g["PIPE"] <= seq(chr('|'), g["Spacing"]);
-    g["AND"] <= seq(chr('&'), g["Spacing"]);
-    g["NOT"] <= seq(chr('!'), g["Spacing"]);
-    g["QUESTION"] <= seq(chr('?'), g["Spacing"]);
-    g["STAR"] <= seq(chr('*'), g["Spacing"]);
-    g["PLUS"] <= seq(chr('+'), g["Spacing"]);
-    ~g["OPEN"] <= seq(chr('('), g["Spacing"]);
-    ~g["CLOSE"] <= seq(chr(')'), g["Spacing"]);
-    g["DOT"] <= seq(chr('.'), g["Spacing"]);
+  c.error_info.message_pos = s;
+  c.error_info.message = "undefined back reference '$" + name_ + "'...";
+  return static_cast<size_t>(-1);
+}
 
-    g["CUT"] <= seq(lit(u8(u8"↑")), g["Spacing"]);
-    ~g["LABEL"] <= seq(cho(chr('^'), lit(u8(u8"⇑"))), g["Spacing"]);
+inline Definition &
+PrecedenceClimbing::get_reference_for_binop(Context &c) const {
+  if (rule_.is_macro) {
+    // Reference parameter in macro
+    const auto &args = c.top_args();
+    auto iarg = dynamic_cast<Reference &>(*binop_).iarg_;
+    auto arg = args[iarg];
+    return *dynamic_cast<Reference &>(*arg).rule_;
+  }
 
-    ~g["Spacing"] <= zom(cho(g["Space"], g["Comment"]));
-    g["Comment"] <=
-        seq(chr('#'), zom(seq(npd(g["EndOfLine"]), dot())), g["EndOfLine"]);
-    g["Space"] <= cho(chr(' '), chr('\t'), g["EndOfLine"]);
-    g["EndOfLine"] <= cho(lit("\r\n"), chr('\n'), chr('\r'));
-    g["EndOfFile"] <= npd(dot());
+  return *dynamic_cast<Reference &>(*binop_).rule_;
+}
 
-    ~g["BeginTok"] <= seq(chr('<'), g["Spacing"]);
-    ~g["EndTok"] <= seq(chr('>'), g["Spacing"]);
+inline size_t PrecedenceClimbing::parse_expression(const char *s, size_t n,
+                                                   SemanticValues &vs,
+                                                   Context &c, std::any &dt,
+                                                   size_t min_prec) const {
+  auto len = atom_->parse(s, n, vs, c, dt);
+  if (fail(len)) { return len; }
 
-    ~g["BeginCapScope"] <= seq(chr('$'), chr('('), g["Spacing"]);
-    ~g["EndCapScope"] <= seq(chr(')'), g["Spacing"]);
+  std::string tok;
+  auto &rule = get_reference_for_binop(c);
+  auto action = std::move(rule.action);
 
-    g["BeginCap"] <= seq(chr('$'), tok(g["IdentCont"]), chr('<'), g["Spacing"]);
-    ~g["EndCap"] <= seq(chr('>'), g["Spacing"]);
+  rule.action = [&](SemanticValues &vs2, std::any &dt2) {
+    tok = vs2.token();
+    if (action) {
+      return action(vs2, dt2);
+    } else if (!vs2.empty()) {
+      return vs2[0];
+    }
+    return std::any();
+  };
+  auto action_se = scope_exit([&]() { rule.action = std::move(action); });
 
-    g["BackRef"] <= seq(chr('$'), tok(g["IdentCont"]), g["Spacing"]);
+  auto i = len;
+  while (i < n) {
+    std::vector<std::any> save_values(vs.begin(), vs.end());
+    auto save_tokens = vs.tokens;
 
-    g["IGNORE"] <= chr('~');
+    auto chvs = c.push_semantic_values_scope();
+    auto chlen = binop_->parse(s + i, n - i, chvs, c, dt);
+    c.pop_semantic_values_scope();
 
-    g["Ignore"] <= opt(g["IGNORE"]);
-    g["Parameters"] <= seq(g["OPEN"], g["Identifier"],
-                           zom(seq(g["COMMA"], g["Identifier"])), g["CLOSE"]);
-    g["Arguments"] <= seq(g["OPEN"], g["Expression"],
-                          zom(seq(g["COMMA"], g["Expression"])), g["CLOSE"]);
-    ~g["COMMA"] <= seq(chr(','), g["Spacing"]);
+    if (fail(chlen)) { break; }
 
-    // Instruction grammars
-    g["Instruction"] <=
-        seq(g["BeginBracket"],
-            opt(seq(g["InstructionItem"], zom(seq(g["InstructionItemSeparator"],
-                                                  g["InstructionItem"])))),
-            g["EndBracket"]);
-    g["InstructionItem"] <=
-        cho(g["PrecedenceClimbing"], g["ErrorMessage"], g["NoAstOpt"]);
-    ~g["InstructionItemSeparator"] <= seq(chr(';'), g["Spacing"]);
+    auto it = info_.find(tok);
+    if (it == info_.end()) { break; }
 
-    ~g["SpacesZom"] <= zom(g["Space"]);
-    ~g["SpacesOom"] <= oom(g["Space"]);
-    ~g["BeginBracket"] <= seq(chr('{'), g["Spacing"]);
-    ~g["EndBracket"] <= seq(chr('}'), g["Spacing"]);
+    auto level = std::get<0>(it->second);
+    auto assoc = std::get<1>(it->second);
 
-    // PrecedenceClimbing instruction
-    g["PrecedenceClimbing"] <=
-        seq(lit("precedence"), g["SpacesOom"], g["PrecedenceInfo"],
-            zom(seq(g["SpacesOom"], g["PrecedenceInfo"])), g["SpacesZom"]);
-    g["PrecedenceInfo"] <=
-        seq(g["PrecedenceAssoc"],
-            oom(seq(ign(g["SpacesOom"]), g["PrecedenceOpe"])));
-    g["PrecedenceOpe"] <=
-        cho(seq(cls("'"),
-                tok(zom(seq(npd(cho(g["Space"], cls("'"))), g["Char"]))),
-                cls("'")),
-            seq(cls("\""),
-                tok(zom(seq(npd(cho(g["Space"], cls("\""))), g["Char"]))),
-                cls("\"")),
-            tok(oom(seq(npd(cho(g["PrecedenceAssoc"], g["Space"], chr('}'))),
-                        dot()))));
-    g["PrecedenceAssoc"] <= cls("LR");
+    if (level < min_prec) { break; }
 
-    // Error message instruction
-    g["ErrorMessage"] <= seq(lit("error_message"), g["SpacesOom"],
-                             g["LiteralD"], g["SpacesZom"]);
+    vs.emplace_back(std::move(chvs[0]));
+    i += chlen;
 
-    // No Ast node optimization instruction
-    g["NoAstOpt"] <= seq(lit("no_ast_opt"), g["SpacesZom"]);
+    auto next_min_prec = level;
+    if (assoc == 'L') { next_min_prec = level + 1; }
 
-    // Set definition names
-    for (auto &x : g) {
-      x.second.name = x.first;
+    chvs = c.push_semantic_values_scope();
+    chlen = parse_expression(s + i, n - i, chvs, c, dt, next_min_prec);
+    c.pop_semantic_values_scope();
+
+    if (fail(chlen)) {
+      vs.assign(save_values.begin(), save_values.end());
+      vs.tokens = save_tokens;
+      i = chlen;
+      break;
     }
-  }
 
-  void setup_actions() {
-    g["Definition"] = [&](const SemanticValues &vs, std::any &dt) {
-      auto &data = *std::any_cast<Data *>(dt);
+    vs.emplace_back(std::move(chvs[0]));
+    i += chlen;
 
-      auto is_macro = vs.choice() == 0;
-      auto ignore = std::any_cast<bool>(vs[0]);
-      auto name = std::any_cast<std::string>(vs[1]);
+    std::any val;
+    if (rule_.action) {
+      vs.sv_ = std::string_view(s, i);
+      val = rule_.action(vs, dt);
+    } else if (!vs.empty()) {
+      val = vs[0];
+    }
+    vs.clear();
+    vs.emplace_back(std::move(val));
+  }
 
-      std::vector<std::string> params;
-      std::shared_ptr<Ope> ope;
-      auto has_instructions = false;
+  return i;
+}
 
-      if (is_macro) {
-        params = std::any_cast<std::vector<std::string>>(vs[2]);
-        ope = std::any_cast<std::shared_ptr<Ope>>(vs[4]);
-        if (vs.size() == 6) { has_instructions = true; }
-      } else {
-        ope = std::any_cast<std::shared_ptr<Ope>>(vs[3]);
-        if (vs.size() == 5) { has_instructions = true; }
-      }
+inline size_t Recovery::parse_core(const char *s, size_t n,
+                                   SemanticValues & /*vs*/, Context &c,
+                                   std::any & /*dt*/) const {
+  const auto &rule = dynamic_cast<Reference &>(*ope_);
 
-      if (has_instructions) {
-        auto index = is_macro ? 5 : 4;
-        std::unordered_set<std::string> types;
-        for (const auto &instruction :
-             std::any_cast<std::vector<Instruction>>(vs[index])) {
-          const auto &type = instruction.type;
-          if (types.find(type) == types.end()) {
-            data.instructions[name].push_back(instruction);
-            types.insert(instruction.type);
-            if (type == "declare_symbol" || type == "check_symbol") {
-              if (!TokenChecker::is_token(*ope)) { ope = tok(ope); }
-            }
-          } else {
-            data.duplicates_of_instruction.emplace_back(type,
-                                                        instruction.sv.data());
-          }
-        }
-      }
+  // Custom error message
+  if (c.log) {
+    auto label = dynamic_cast<Reference *>(rule.args_[0].get());
+    if (label && !label->rule_->error_message.empty()) {
+      c.error_info.message_pos = s;
+      c.error_info.message = label->rule_->error_message;
+      c.error_info.label = label->rule_->name;
+    }
+  }
 
-      auto &grammar = *data.grammar;
-      if (!grammar.count(name)) {
-        auto &rule = grammar[name];
-        rule <= ope;
-        rule.name = name;
-        rule.s_ = vs.sv().data();
-        rule.line_ = line_info(vs.ss, rule.s_);
-        rule.ignoreSemanticValue = ignore;
-        rule.is_macro = is_macro;
-        rule.params = params;
+  // Recovery
+  auto len = static_cast<size_t>(-1);
+  {
+    auto save_log = c.log;
+    c.log = nullptr;
+    auto se = scope_exit([&]() { c.log = save_log; });
 
-        if (data.start.empty()) {
-          data.start = rule.name;
-          data.start_pos = rule.s_;
-        }
-      } else {
-        data.duplicates_of_definition.emplace_back(name, vs.sv().data());
-      }
-    };
+    SemanticValues dummy_vs;
+    std::any dummy_dt;
 
-    g["Definition"].enter = [](const Context & /*c*/, const char * /*s*/,
-                               size_t /*n*/, std::any &dt) {
-      auto &data = *std::any_cast<Data *>(dt);
-      data.captures_in_current_definition.clear();
-    };
+    len = rule.parse(s, n, dummy_vs, c, dummy_dt);
+  }
 
-    g["Expression"] = [&](const SemanticValues &vs) {
-      if (vs.size() == 1) {
-        return std::any_cast<std::shared_ptr<Ope>>(vs[0]);
-      } else {
-        std::vector<std::shared_ptr<Ope>> opes;
-        for (auto i = 0u; i < vs.size(); i++) {
-          opes.emplace_back(std::any_cast<std::shared_ptr<Ope>>(vs[i]));
-        }
-        const std::shared_ptr<Ope> ope =
-            std::make_shared<PrioritizedChoice>(opes);
-        return ope;
-      }
-    };
+  if (success(len)) {
+    c.recovered = true;
 
-    g["Sequence"] = [&](const SemanticValues &vs) {
-      if (vs.empty()) {
-        return npd(lit(""));
-      } else if (vs.size() == 1) {
-        return std::any_cast<std::shared_ptr<Ope>>(vs[0]);
-      } else {
-        std::vector<std::shared_ptr<Ope>> opes;
-        for (const auto &x : vs) {
-          opes.emplace_back(std::any_cast<std::shared_ptr<Ope>>(x));
-        }
-        const std::shared_ptr<Ope> ope = std::make_shared<Sequence>(opes);
-        return ope;
-      }
-    };
+    if (c.log) {
+      c.error_info.output_log(c.log, c.s, c.l);
+      c.error_info.clear();
+    }
+  }
 
-    g["Prefix"] = [&](const SemanticValues &vs) {
-      std::shared_ptr<Ope> ope;
-      if (vs.size() == 1) {
-        ope = std::any_cast<std::shared_ptr<Ope>>(vs[0]);
-      } else {
-        assert(vs.size() == 2);
-        auto tok = std::any_cast<char>(vs[0]);
-        ope = std::any_cast<std::shared_ptr<Ope>>(vs[1]);
-        if (tok == '&') {
-          ope = apd(ope);
-        } else { // '!'
-          ope = npd(ope);
-        }
-      }
-      return ope;
-    };
+  // Cut
+  if (!c.cut_stack.empty()) {
+    c.cut_stack.back() = true;
 
-    g["SuffixWithLabel"] = [&](const SemanticValues &vs, std::any &dt) {
-      auto ope = std::any_cast<std::shared_ptr<Ope>>(vs[0]);
-      if (vs.size() == 1) {
-        return ope;
-      } else {
-        assert(vs.size() == 2);
-        auto &data = *std::any_cast<Data *>(dt);
-        const auto &ident = std::any_cast<std::string>(vs[1]);
-        auto label = ref(*data.grammar, ident, vs.sv().data(), false, {});
-        auto recovery = rec(ref(*data.grammar, RECOVER_DEFINITION_NAME,
-                                vs.sv().data(), true, {label}));
-        return cho4label_(ope, recovery);
-      }
-    };
+    if (c.cut_stack.size() == 1) {
+      // TODO: Remove unneeded entries in packrat memoise table
+    }
+  }
 
-    struct Loop {
-      enum class Type { opt = 0, zom, oom, rep };
-      Type type;
-      std::pair<size_t, size_t> range;
-    };
+  return len;
+}
 
-    g["Suffix"] = [&](const SemanticValues &vs) {
-      auto ope = std::any_cast<std::shared_ptr<Ope>>(vs[0]);
-      if (vs.size() == 1) {
-        return ope;
-      } else {
-        assert(vs.size() == 2);
-        auto loop = std::any_cast<Loop>(vs[1]);
-        switch (loop.type) {
-        case Loop::Type::opt: return opt(ope);
-        case Loop::Type::zom: return zom(ope);
-        case Loop::Type::oom: return oom(ope);
-        default: // Regex-like repetition
-          return rep(ope, loop.range.first, loop.range.second);
-        }
+inline void Sequence::accept(Visitor &v) { v.visit(*this); }
+inline void PrioritizedChoice::accept(Visitor &v) { v.visit(*this); }
+inline void Repetition::accept(Visitor &v) { v.visit(*this); }
+inline void AndPredicate::accept(Visitor &v) { v.visit(*this); }
+inline void NotPredicate::accept(Visitor &v) { v.visit(*this); }
+inline void Dictionary::accept(Visitor &v) { v.visit(*this); }
+inline void LiteralString::accept(Visitor &v) { v.visit(*this); }
+inline void CharacterClass::accept(Visitor &v) { v.visit(*this); }
+inline void Character::accept(Visitor &v) { v.visit(*this); }
+inline void AnyCharacter::accept(Visitor &v) { v.visit(*this); }
+inline void CaptureScope::accept(Visitor &v) { v.visit(*this); }
+inline void Capture::accept(Visitor &v) { v.visit(*this); }
+inline void TokenBoundary::accept(Visitor &v) { v.visit(*this); }
+inline void Ignore::accept(Visitor &v) { v.visit(*this); }
+inline void User::accept(Visitor &v) { v.visit(*this); }
+inline void WeakHolder::accept(Visitor &v) { v.visit(*this); }
+inline void Holder::accept(Visitor &v) { v.visit(*this); }
+inline void Reference::accept(Visitor &v) { v.visit(*this); }
+inline void Whitespace::accept(Visitor &v) { v.visit(*this); }
+inline void BackReference::accept(Visitor &v) { v.visit(*this); }
+inline void PrecedenceClimbing::accept(Visitor &v) { v.visit(*this); }
+inline void Recovery::accept(Visitor &v) { v.visit(*this); }
+inline void Cut::accept(Visitor &v) { v.visit(*this); }
+
+inline void AssignIDToDefinition::visit(Holder &ope) {
+  auto p = static_cast<void *>(ope.outer_);
+  if (ids.count(p)) { return; }
+  auto id = ids.size();
+  ids[p] = id;
+  ope.outer_->id = id;
+  ope.ope_->accept(*this);
+}
+
+inline void AssignIDToDefinition::visit(Reference &ope) {
+  if (ope.rule_) {
+    for (auto arg : ope.args_) {
+      arg->accept(*this);
+    }
+    ope.rule_->accept(*this);
+  }
+}
+
+inline void AssignIDToDefinition::visit(PrecedenceClimbing &ope) {
+  ope.atom_->accept(*this);
+  ope.binop_->accept(*this);
+}
+
+inline void TokenChecker::visit(Reference &ope) {
+  if (ope.is_macro_) {
+    for (auto arg : ope.args_) {
+      arg->accept(*this);
+    }
+  } else {
+    has_rule_ = true;
+  }
+}
+
+inline void FindLiteralToken::visit(Reference &ope) {
+  if (ope.is_macro_) {
+    ope.rule_->accept(*this);
+    for (auto arg : ope.args_) {
+      arg->accept(*this);
+    }
+  }
+}
+
+inline void DetectLeftRecursion::visit(Reference &ope) {
+  if (ope.name_ == name_) {
+    error_s = ope.s_;
+  } else if (!refs_.count(ope.name_)) {
+    refs_.insert(ope.name_);
+    if (ope.rule_) {
+      ope.rule_->accept(*this);
+      if (done_ == false) { return; }
+    }
+  }
+  done_ = true;
+}
+
+inline void HasEmptyElement::visit(Sequence &ope) {
+  auto save_is_empty = false;
+  const char *save_error_s = nullptr;
+  std::string save_error_name;
+
+  auto it = ope.opes_.begin();
+  while (it != ope.opes_.end()) {
+    (*it)->accept(*this);
+    if (!is_empty) {
+      ++it;
+      while (it != ope.opes_.end()) {
+        DetectInfiniteLoop vis(refs_, has_error_cache_);
+        (*it)->accept(vis);
+        if (vis.has_error) {
+          is_empty = true;
+          error_s = vis.error_s;
+          error_name = vis.error_name;
+        }
+        ++it;
+      }
+      return;
+    }
+
+    save_is_empty = is_empty;
+    save_error_s = error_s;
+    save_error_name = error_name;
+
+    is_empty = false;
+    error_name.clear();
+    ++it;
+  }
+
+  is_empty = save_is_empty;
+  error_s = save_error_s;
+  error_name = save_error_name;
+}
+
+inline void HasEmptyElement::visit(Reference &ope) {
+  auto it = std::find_if(refs_.begin(), refs_.end(),
+                         [&](const std::pair<const char *, std::string> &ref) {
+                           return ope.name_ == ref.second;
+                         });
+  if (it != refs_.end()) { return; }
+
+  if (ope.rule_) {
+    refs_.emplace_back(ope.s_, ope.name_);
+    ope.rule_->accept(*this);
+    refs_.pop_back();
+  }
+}
+
+inline void DetectInfiniteLoop::visit(Reference &ope) {
+  auto it = std::find_if(refs_.begin(), refs_.end(),
+                         [&](const std::pair<const char *, std::string> &ref) {
+                           return ope.name_ == ref.second;
+                         });
+  if (it != refs_.end()) { return; }
+
+  if (ope.rule_) {
+    auto it = has_error_cache_.find(ope.name_);
+    if (it != has_error_cache_.end()) {
+      has_error = it->second;
+    } else {
+      refs_.emplace_back(ope.s_, ope.name_);
+      ope.rule_->accept(*this);
+      refs_.pop_back();
+      has_error_cache_[ope.name_] = has_error;
+    }
+  }
+
+  if (ope.is_macro_) {
+    for (auto arg : ope.args_) {
+      arg->accept(*this);
+    }
+  }
+}
+
+inline void ReferenceChecker::visit(Reference &ope) {
+  auto it = std::find(params_.begin(), params_.end(), ope.name_);
+  if (it != params_.end()) { return; }
+
+  if (!grammar_.count(ope.name_)) {
+    error_s[ope.name_] = ope.s_;
+    error_message[ope.name_] = "'" + ope.name_ + "' is not defined.";
+  } else {
+    if (!referenced.count(ope.name_)) { referenced.insert(ope.name_); }
+    const auto &rule = grammar_.at(ope.name_);
+    if (rule.is_macro) {
+      if (!ope.is_macro_ || ope.args_.size() != rule.params.size()) {
+        error_s[ope.name_] = ope.s_;
+        error_message[ope.name_] = "incorrect number of arguments.";
+      }
+    } else if (ope.is_macro_) {
+      error_s[ope.name_] = ope.s_;
+      error_message[ope.name_] = "'" + ope.name_ + "' is not macro.";
+    }
+    for (auto arg : ope.args_) {
+      arg->accept(*this);
+    }
+  }
+}
+
+inline void LinkReferences::visit(Reference &ope) {
+  // Check if the reference is a macro parameter
+  auto found_param = false;
+  for (size_t i = 0; i < params_.size(); i++) {
+    const auto &param = params_[i];
+    if (param == ope.name_) {
+      ope.iarg_ = i;
+      found_param = true;
+      break;
+    }
+  }
+
+  // Check if the reference is a definition rule
+  if (!found_param && grammar_.count(ope.name_)) {
+    auto &rule = grammar_.at(ope.name_);
+    ope.rule_ = &rule;
+  }
+  ope.in_macro_ = !params_.empty();
+
+  for (auto arg : ope.args_) {
+    arg->accept(*this);
+  }
+}
+
+inline void FindReference::visit(Reference &ope) {
+  for (size_t i = 0; i < args_.size(); i++) {
+    const auto &name = params_[i];
+    if (name == ope.name_) {
+      found_ope = args_[i];
+      return;
+    }
+  }
+  found_ope = ope.shared_from_this();
+}
+
+inline void SubstituteArguments::visit(Reference &ope) {
+  if (!ope.rule_) {
+    found_ope = args_[ope.iarg_];
+  } else if (ope.rule_->is_macro) {
+    auto ref = std::make_shared<Reference>(ope.grammar_, ope.name_, ope.s_,
+                                           ope.is_macro_, copy(ope.args_));
+    ref->rule_ = ope.rule_;
+    ref->iarg_ = ope.iarg_;
+    found_ope = ref;
+  }
+}
+
+inline void MacroExpander::expand(Grammar &grammar) {
+  for (auto &[_, rule] : grammar) {
+    if (rule.is_macro) { continue; }
+    if (auto ope = rule.get_core_operator()) { ope->accept(*this); }
+  }
+}
+
+inline void MacroExpander::visit(Reference &ope) {
+  for (auto arg : ope.args_) {
+    arg->accept(*this);
+  }
+
+  if (ope.rule_ && ope.rule_->is_macro) {
+    if (auto rule = instantiate(*ope.rule_, ope.args_)) { ope.rule_ = rule; }
+  }
+}
+
+inline Definition *
+MacroExpander::instantiate(Definition &macro,
+                           const std::vector<std::shared_ptr<Ope>> &args) {
+  std::string key;
+  for (size_t i = 0; i < args.size(); i++) {
+    if (i) { key += ", "; }
+    key += PegText::get(*args[i]);
+  }
+
+  auto it = macro.instances_.find(key);
+  if (it != macro.instances_.end()) { return it->second.get(); }
+
+  if (depth_[&macro] >= max_depth || instance_count_ >= max_instances) {
+    return nullptr;
+  }
+
+  SubstituteArguments vis(args);
+  auto ope = vis.copy(macro.get_core_operator());
+  if (!vis.ok) { return nullptr; }
+
+  auto instance = std::make_unique<Definition>();
+  instance->name = macro.name;
+  instance->s_ = macro.s_;
+  instance->line_ = macro.line_;
+  instance->ignoreSemanticValue = macro.ignoreSemanticValue;
+  instance->instance_of = &macro;
+  *instance <= ope;
+
+  auto rule = instance.get();
+  macro.instances_.emplace(std::move(key), std::move(instance));
+  instance_count_++;
+
+  // Macro applications in the copied body
+  depth_[&macro]++;
+  ope->accept(*this);
+  depth_[&macro]--;
+
+  return rule;
+}
+
+inline void ComputeFirstSet::visit(Holder &ope) {
+  // Macro bodies depend on their arguments
+  const auto *rule = ope.outer_;
+  if (!rule->is_macro) {
+    auto it = cache_.find(rule);
+    if (it != cache_.end()) {
+      result_ = it->second;
+      return;
+    }
+  }
+
+  // Only reachable through left recursion, which is rejected when loading
+  if (active_.count(rule)) {
+    result_ = FirstSet();
+    return;
+  }
+
+  active_.insert(rule);
+  auto fs = get(*ope.ope_);
+  active_.erase(rule);
+  fs.rules.insert(rule->name);
+
+  if (!rule->is_macro) { cache_[rule] = fs; }
+  result_ = fs;
+}
+
+inline void ComputeFirstSet::visit(Reference &ope) {
+  if (!ope.rule_) {
+    // A macro parameter is the argument from the caller's point of view
+    if (args_stack_.empty() || ope.iarg_ >= args_stack_.back()->size()) {
+      set_unknown();
+      return;
+    }
+    auto args = args_stack_.back();
+    args_stack_.pop_back();
+    auto fs = get(*(*args)[ope.iarg_]);
+    args_stack_.push_back(args);
+    result_ = fs;
+  } else if (ope.is_macro_) {
+    args_stack_.push_back(&ope.args_);
+    auto fs = get(*ope.get_core_operator());
+    args_stack_.pop_back();
+    result_ = fs;
+  } else {
+    result_ = get(*ope.get_core_operator());
+  }
+}
+
+/*-----------------------------------------------------------------------------
+ *  PEG parser generator
+ *---------------------------------------------------------------------------*/
+
+using Rules = std::unordered_map<std::string, std::shared_ptr<Ope>>;
+
+class ParserGenerator {
+public:
+  static std::shared_ptr<Grammar> parse(const char *s, size_t n,
+                                        const Rules &rules, std::string &start,
+                                        bool &enablePackratParsing, Log log) {
+    return get_instance().perform_core(s, n, rules, start, enablePackratParsing,
+                                       log);
+  }
+
+  static std::shared_ptr<Grammar> parse(const char *s, size_t n,
+                                        std::string &start,
+                                        bool &enablePackratParsing, Log log) {
+    Rules dummy;
+    return parse(s, n, dummy, start, enablePackratParsing, log);
+  }
+
+  // For debugging purpose
+  static Grammar &grammar() { return get_instance().g; }
+
+  // Called on this thread with the name and duration of each phase of
+  // grammar loading. Used by benchmarks.
+  using PhaseObserver = std::function<void(const char *phase,
+                                           std::chrono::nanoseconds duration)>;
+
+  static PhaseObserver &phase_observer() {
+    thread_local PhaseObserver observer;
+    return observer;
+  }
+
+private:
+  static ParserGenerator &get_instance() {
+    static ParserGenerator instance;
+    return instance;
+  }
+
+  ParserGenerator() {
+    make_grammar();
+    setup_actions();
+  }
+
+  struct Instruction {
+    std::string type;
+    std::any data;
+    std::string_view sv;
+  };
+
+  struct Data {
+    std::shared_ptr<Grammar> grammar;
+    std::string start;
+    const char *start_pos = nullptr;
+
+    std::vector<std::pair<std::string, const char *>> duplicates_of_definition;
+
+    std::vector<std::pair<std::string, const char *>> duplicates_of_instruction;
+    std::map<std::string, std::vector<Instruction>> instructions;
+
+    std::vector<std::pair<std::string, const char *>> undefined_back_references;
+    std::vector<std::set<std::string_view>> captures_stack{{}};
+
+    std::set<std::string_view> captures_in_current_definition;
+    bool enablePackratParsing = true;
+
+    Data() : grammar(std::make_shared<Grammar>()) {}
+  };
+
+  void make_grammar() {
+    // Setup PEG syntax parser
+    g["Grammar"] <= seq(g["Spacing"], oom(g["Definition"]), g["EndOfFile"]);
+    g["Definition"] <=
+        cho(seq(g["Ignore"], g["IdentCont"], g["Parameters"], g["LEFTARROW"],
+                g["Expression"], opt(g["Instruction"])),
+            seq(g["Ignore"], g["Identifier"], g["LEFTARROW"], g["Expression"],
+                opt(g["Instruction"])));
+    g["Expression"] <= seq(g["Sequence"], zom(seq(g["SLASH"], g["Sequence"])));
+    g["Sequence"] <= zom(cho(g["CUT"], g["Prefix"]));
+    g["Prefix"] <= seq(opt(cho(g["AND"], g["NOT"])), g["SuffixWithLabel"]);
+    g["SuffixWithLabel"] <=
+        seq(g["Suffix"], opt(seq(g["LABEL"], g["Identifier"])));
+    g["Suffix"] <= seq(g["Primary"], opt(g["Loop"]));
+    g["Loop"] <= cho(g["QUESTION"], g["STAR"], g["PLUS"], g["Repetition"]);
+    g["Primary"] <= cho(seq(g["Ignore"], g["IdentCont"], g["Arguments"],
+                            npd(g["LEFTARROW"])),
+                        seq(g["Ignore"], g["Identifier"],
+                            npd(seq(opt(g["Parameters"]), g["LEFTARROW"]))),
+                        seq(g["OPEN"], g["Expression"], g["CLOSE"]),
+                        seq(g["BeginTok"], g["Expression"], g["EndTok"]),
+                        g["CapScope"],
+                        seq(g["BeginCap"], g["Expression"], g["EndCap"]),
+                        g["BackRef"], g["DictionaryI"], g["LiteralI"],
+                        g["Dictionary"], g["Literal"], g["NegatedClassI"],
+                        g["NegatedClass"], g["ClassI"], g["Class"], g["DOT"]);
+
+    g["Identifier"] <= seq(g["IdentCont"], g["Spacing"]);
+    g["IdentCont"] <= tok(seq(g["IdentStart"], zom(g["IdentRest"])));
+
+    const static std::vector<std::pair<char32_t, char32_t>> range = {
+        {0x0080, 0xFFFF}};
+    g["IdentStart"] <= seq(npd(lit(u8(u8"↑"))), npd(lit(u8(u8"⇑"))),
+                           cho(cls("a-zA-Z_%"), cls(range)));
+
+    g["IdentRest"] <= cho(g["IdentStart"], cls("0-9"));
+
+    g["Dictionary"] <= seq(g["LiteralD"], oom(seq(g["PIPE"], g["LiteralD"])));
+
+    g["DictionaryI"] <=
+        seq(g["LiteralID"], oom(seq(g["PIPE"], g["LiteralID"])));
+
+    auto lit_ope = cho(seq(cls("'"), tok(zom(seq(npd(cls("'")), g["Char"]))),
+                           cls("'"), g["Spacing"]),
+                       seq(cls("\""), tok(zom(seq(npd(cls("\"")), g["Char"]))),
+                           cls("\""), g["Spacing"]));
+    g["Literal"] <= lit_ope;
+    g["LiteralD"] <= lit_ope;
+
+    auto lit_case_ignore_ope =
+        cho(seq(cls("'"), tok(zom(seq(npd(cls("'")), g["Char"]))), lit("'i"),
+                g["Spacing"]),
+            seq(cls("\""), tok(zom(seq(npd(cls("\"")), g["Char"]))), lit("\"i"),
+                g["Spacing"]));
+    g["LiteralI"] <= lit_case_ignore_ope;
+    g["LiteralID"] <= lit_case_ignore_ope;
+
+    // NOTE: The original Brian Ford's paper uses 'zom' instead of 'oom'.
+    g["Class"] <= seq(chr('['), npd(chr('^')),
+                      tok(oom(seq(npd(chr(']')), g["Range"]))), chr(']'),
+                      g["Spacing"]);
+    g["ClassI"] <= seq(chr('['), npd(chr('^')),
+                       tok(oom(seq(npd(chr(']')), g["Range"]))), lit("]i"),
+                       g["Spacing"]);
+
+    g["NegatedClass"] <= seq(lit("[^"),
+                             tok(oom(seq(npd(chr(']')), g["Range"]))), chr(']'),
+                             g["Spacing"]);
+    g["NegatedClassI"] <= seq(lit("[^"),
+                              tok(oom(seq(npd(chr(']')), g["Range"]))),
+                              lit("]i"), g["Spacing"]);
+
+    // NOTE: This is different from The original Brian Ford's paper, and this
+    // modification allows us to specify `[+-]` as a valid char class.
+    g["Range"] <=
+        cho(seq(g["Char"], chr('-'), npd(chr(']')), g["Char"]), g["Char"]);
+
+    g["Char"] <=
+        cho(seq(chr('\\'), cls("fnrtv'\"[]\\^")),
+            seq(chr('\\'), cls("0-3"), cls("0-7"), cls("0-7")),
+            seq(chr('\\'), cls("0-7"), opt(cls("0-7"))),
+            seq(lit("\\x"), cls("0-9a-fA-F"), opt(cls("0-9a-fA-F"))),
+            seq(lit("\\u"),
+                cho(seq(cho(seq(chr('0'), cls("0-9a-fA-F")), lit("10")),
+                        rep(cls("0-9a-fA-F"), 4, 4)),
+                    rep(cls("0-9a-fA-F"), 4, 5))),
+            seq(npd(chr('\\')), dot()));
+
+    g["Repetition"] <=
+        seq(g["BeginBracket"], g["RepetitionRange"], g["EndBracket"]);
+    g["RepetitionRange"] <= cho(seq(g["Number"], g["COMMA"], g["Number"]),
+                                seq(g["Number"], g["COMMA"]), g["Number"],
+                                seq(g["COMMA"], g["Number"]));
+    g["Number"] <= seq(oom(cls("0-9")), g["Spacing"]);
+
+    g["CapScope"] <= seq(g["BeginCapScope"], g["Expression"], g["EndCapScope"]);
+
+    g["LEFTARROW"] <= seq(cho(lit("<-"), lit(u8(u8"←"))), g["Spacing"]);
+    ~g["SLASH"] <= seq(chr('/'), g["Spacing"]);
+    ~g["PIPE"] <= seq(chr('|'), g["Spacing"]);
+    g["AND"] <= seq(chr('&'), g["Spacing"]);
+    g["NOT"] <= seq(chr('!'), g["Spacing"]);
+    g["QUESTION"] <= seq(chr('?'), g["Spacing"]);
+    g["STAR"] <= seq(chr('*'), g["Spacing"]);
+    g["PLUS"] <= seq(chr('+'), g["Spacing"]);
+    ~g["OPEN"] <= seq(chr('('), g["Spacing"]);
+    ~g["CLOSE"] <= seq(chr(')'), g["Spacing"]);
+    g["DOT"] <= seq(chr('.'), g["Spacing"]);
+
+    g["CUT"] <= seq(lit(u8(u8"↑")), g["Spacing"]);
+    ~g["LABEL"] <= seq(cho(chr('^'), lit(u8(u8"⇑"))), g["Spacing"]);
+
+    ~g["Spacing"] <= zom(cho(g["Space"], g["Comment"]));
+    g["Comment"] <=
+        seq(chr('#'), zom(seq(npd(g["EndOfLine"]), dot())), g["EndOfLine"]);
+    g["Space"] <= cho(chr(' '), chr('\t'), g["EndOfLine"]);
+    g["EndOfLine"] <= cho(lit("\r\n"), chr('\n'), chr('\r'));
+    g["EndOfFile"] <= npd(dot());
+
+    ~g["BeginTok"] <= seq(chr('<'), g["Spacing"]);
+    ~g["EndTok"] <= seq(chr('>'), g["Spacing"]);
+
+    ~g["BeginCapScope"] <= seq(chr('$'), chr('('), g["Spacing"]);
+    ~g["EndCapScope"] <= seq(chr(')'), g["Spacing"]);
+
+    g["BeginCap"] <= seq(chr('$'), tok(g["IdentCont"]), chr('<'), g["Spacing"]);
+    ~g["EndCap"] <= seq(chr('>'), g["Spacing"]);
+
+    g["BackRef"] <= seq(chr('$'), tok(g["IdentCont"]), g["Spacing"]);
+
+    g["IGNORE"] <= chr('~');
+
+    g["Ignore"] <= opt(g["IGNORE"]);
+    g["Parameters"] <= seq(g["OPEN"], g["Identifier"],
+                           zom(seq(g["COMMA"], g["Identifier"])), g["CLOSE"]);
+    g["Arguments"] <= seq(g["OPEN"], g["Expression"],
+                          zom(seq(g["COMMA"], g["Expression"])), g["CLOSE"]);
+    ~g["COMMA"] <= seq(chr(','), g["Spacing"]);
+
+    // Instruction grammars
+    g["Instruction"] <=
+        seq(g["BeginBracket"],
+            opt(seq(g["InstructionItem"], zom(seq(g["InstructionItemSeparator"],
+                                                  g["InstructionItem"])))),
+            g["EndBracket"]);
+    g["InstructionItem"] <=
+        cho(g["PrecedenceClimbing"], g["ErrorMessage"], g["NoAstOpt"]);
+    ~g["InstructionItemSeparator"] <= seq(chr(';'), g["Spacing"]);
+
+    ~g["SpacesZom"] <= zom(g["Space"]);
+    ~g["SpacesOom"] <= oom(g["Space"]);
+    ~g["BeginBracket"] <= seq(chr('{'), g["Spacing"]);
+    ~g["EndBracket"] <= seq(chr('}'), g["Spacing"]);
+
+    // PrecedenceClimbing instruction
+    g["PrecedenceClimbing"] <=
+        seq(lit("precedence"), g["SpacesOom"], g["PrecedenceInfo"],
+            zom(seq(g["SpacesOom"], g["PrecedenceInfo"])), g["SpacesZom"]);
+    g["PrecedenceInfo"] <=
+        seq(g["PrecedenceAssoc"],
+            oom(seq(ign(g["SpacesOom"]), g["PrecedenceOpe"])));
+    g["PrecedenceOpe"] <=
+        cho(seq(cls("'"),
+                tok(zom(seq(npd(cho(g["Space"], cls("'"))), g["Char"]))),
+                cls("'")),
+            seq(cls("\""),
+                tok(zom(seq(npd(cho(g["Space"], cls("\""))), g["Char"]))),
+                cls("\"")),
+            tok(oom(seq(npd(cho(g["PrecedenceAssoc"], g["Space"], chr('}'))),
+                        dot()))));
+    g["PrecedenceAssoc"] <= cls("LR");
+
+    // Error message instruction
+    g["ErrorMessage"] <= seq(lit("error_message"), g["SpacesOom"],
+                             g["LiteralD"], g["SpacesZom"]);
+
+    // No Ast node optimization instruction
+    g["NoAstOpt"] <= seq(lit("no_ast_opt"), g["SpacesZom"]);
+
+    // Set definition names
+    for (auto &x : g) {
+      x.second.name = x.first;
+    }
+  }
+
+  void setup_actions() {
+    g["Definition"] = [&](const SemanticValues &vs, std::any &dt) {
+      auto &data = *std::any_cast<Data *>(dt);
+
+      auto is_macro = vs.choice() == 0;
+      auto ignore = std::any_cast<bool>(vs[0]);
+      auto name = std::any_cast<std::string>(vs[1]);
+
+      std::vector<std::string> params;
+      std::shared_ptr<Ope> ope;
+      auto has_instructions = false;
+
+      if (is_macro) {
+        params = std::any_cast<std::vector<std::string>>(vs[2]);
+        ope = std::any_cast<std::shared_ptr<Ope>>(vs[4]);
+        if (vs.size() == 6) { has_instructions = true; }
+      } else {
+        ope = std::any_cast<std::shared_ptr<Ope>>(vs[3]);
+        if (vs.size() == 5) { has_instructions = true; }
+      }
+
+      if (has_instructions) {
+        auto index = is_macro ? 5 : 4;
+        std::unordered_set<std::string> types;
+        for (const auto &instruction :
+             std::any_cast<std::vector<Instruction>>(vs[index])) {
+          const auto &type = instruction.type;
+          if (types.find(type) == types.end()) {
+            data.instructions[name].push_back(instruction);
+            types.insert(instruction.type);
+            if (type == "declare_symbol" || type == "check_symbol") {
+              if (!TokenChecker::is_token(*ope)) { ope = tok(ope); }
+            }
+          } else {
+            data.duplicates_of_instruction.emplace_back(type,
+                                                        instruction.sv.data());
+          }
+        }
+      }
+
+      auto &grammar = *data.grammar;
+      if (!grammar.count(name)) {
+        auto &rule = grammar[name];
+        rule <= ope;
+        rule.name = name;
+        rule.s_ = vs.sv().data();
+        rule.line_ = line_info(vs.ss, rule.s_);
+        rule.ignoreSemanticValue = ignore;
+        rule.is_macro = is_macro;
+        rule.params = params;
+
+        if (data.start.empty()) {
+          data.start = rule.name;
+          data.start_pos = rule.s_;
+        }
+      } else {
+        data.duplicates_of_definition.emplace_back(name, vs.sv().data());
+      }
+    };
+
+    g["Definition"].enter = [](const Context & /*c*/, const char * /*s*/,
+                               size_t /*n*/, std::any &dt) {
+      auto &data = *std::any_cast<Data *>(dt);
+      data.captures_in_current_definition.clear();
+    };
+
+    g["Expression"] = [&](const SemanticValues &vs) {
+      if (vs.size() == 1) {
+        return std::any_cast<std::shared_ptr<Ope>>(vs[0]);
+      } else {
+        std::vector<std::shared_ptr<Ope>> opes;
+        for (auto i = 0u; i < vs.size(); i++) {
+          opes.emplace_back(std::any_cast<std::shared_ptr<Ope>>(vs[i]));
+        }
+        auto choice = std::make_shared<PrioritizedChoice>(opes);
+        choice->s_ = vs.sv().data();
+        const std::shared_ptr<Ope> ope = choice;
+        return ope;
+      }
+    };
+
+    g["Sequence"] = [&](const SemanticValues &vs) {
+      if (vs.empty()) {
+        return npd(lit(""));
+      } else if (vs.size() == 1) {
+        return std::any_cast<std::shared_ptr<Ope>>(vs[0]);
+      } else {
+        std::vector<std::shared_ptr<Ope>> opes;
+        for (const auto &x : vs) {
+          opes.emplace_back(std::any_cast<std::shared_ptr<Ope>>(x));
+        }
+        const std::shared_ptr<Ope> ope = std::make_shared<Sequence>(opes);
+        return ope;
+      }
+    };
+
+    g["Prefix"] = [&](const SemanticValues &vs) {
+      std::shared_ptr<Ope> ope;
+      if (vs.size() == 1) {
+        ope = std::any_cast<std::shared_ptr<Ope>>(vs[0]);
+      } else {
+        assert(vs.size() == 2);
+        auto tok = std::any_cast<char>(vs[0]);
+        ope = std::any_cast<std::shared_ptr<Ope>>(vs[1]);
+        if (tok == '&') {
+          auto pred = std::make_shared<AndPredicate>(ope);
+          pred->s_ = vs.sv().data();
+          ope = pred;
+        } else { // '!'
+          auto pred = std::make_shared<NotPredicate>(ope);
+          pred->s_ = vs.sv().data();
+          ope = pred;
+        }
+      }
+      return ope;
+    };
+
+    g["SuffixWithLabel"] = [&](const SemanticValues &vs, std::any &dt) {
+      auto ope = std::any_cast<std::shared_ptr<Ope>>(vs[0]);
+      if (vs.size() == 1) {
+        return ope;
+      } else {
+        assert(vs.size() == 2);
+        auto &data = *std::any_cast<Data *>(dt);
+        const auto &ident = std::any_cast<std::string>(vs[1]);
+        auto label = ref(*data.grammar, ident, vs.sv().data(), false, {});
+        auto recovery = rec(ref(*data.grammar, RECOVER_DEFINITION_NAME,
+                                vs.sv().data(), true, {label}));
+        return cho4label_(ope, recovery);
+      }
+    };
+
+    struct Loop {
+      enum class Type { opt = 0, zom, oom, rep };
+      Type type;
+      std::pair<size_t, size_t> range;
+    };
+
+    g["Suffix"] = [&](const SemanticValues &vs) {
+      auto ope = std::any_cast<std::shared_ptr<Ope>>(vs[0]);
+      if (vs.size() == 1) {
+        return ope;
+      } else {
+        assert(vs.size() == 2);
+        auto loop = std::any_cast<Loop>(vs[1]);
+        switch (loop.type) {
+        case Loop::Type::opt: return opt(ope);
+        case Loop::Type::zom: return zom(ope);
+        case Loop::Type::oom: return oom(ope);
+        default: // Regex-like repetition
+          return rep(ope, loop.range.first, loop.range.second);
+        }
+      }
+    };
+
+    g["Loop"] = [&](const SemanticValues &vs) {
+      switch (vs.choice()) {
+      case 0: // Option
+        return Loop{Loop::Type::opt, std::pair<size_t, size_t>()};
+      case 1: // Zero or More
+        return Loop{Loop::Type::zom, std::pair<size_t, size_t>()};
+      case 2: // One or More
+        return Loop{Loop::Type::oom, std::pair<size_t, size_t>()};
+      default: // Regex-like repetition
+        return Loop{Loop::Type::rep,
+                    std::any_cast<std::pair<size_t, size_t>>(vs[0])};
+      }
+    };
+
+    g["Primary"] = [&](const SemanticValues &vs, std::any &dt) {
+      auto &data = *std::any_cast<Data *>(dt);
+
+      switch (vs.choice()) {
+      case 0:   // Macro Reference
+      case 1: { // Reference
+        auto is_macro = vs.choice() == 0;
+        auto ignore = std::any_cast<bool>(vs[0]);
+        const auto &ident = std::any_cast<std::string>(vs[1]);
+
+        std::vector<std::shared_ptr<Ope>> args;
+        if (is_macro) {
+          args = std::any_cast<std::vector<std::shared_ptr<Ope>>>(vs[2]);
+        }
+
+        auto ope = ref(*data.grammar, ident, vs.sv().data(), is_macro, args);
+        if (ident == RECOVER_DEFINITION_NAME) { ope = rec(ope); }
+
+        if (ignore) {
+          return ign(ope);
+        } else {
+          return ope;
+        }
+      }
+      case 2: { // (Expression)
+        return std::any_cast<std::shared_ptr<Ope>>(vs[0]);
+      }
+      case 3: { // TokenBoundary
+        return tok(std::any_cast<std::shared_ptr<Ope>>(vs[0]));
+      }
+      case 4: { // CaptureScope
+        return csc(std::any_cast<std::shared_ptr<Ope>>(vs[0]));
+      }
+      case 5: { // Capture
+        const auto &name = std::any_cast<std::string_view>(vs[0]);
+        auto ope = std::any_cast<std::shared_ptr<Ope>>(vs[1]);
+
+        data.captures_stack.back().insert(name);
+        data.captures_in_current_definition.insert(name);
+
+        return cap(
+            ope,
+            [name](const char *a_s, size_t a_n, Context &c) {
+              c.set_capture_value(name, a_s, a_n);
+            },
+            name);
+      }
+      default: {
+        return std::any_cast<std::shared_ptr<Ope>>(vs[0]);
+      }
+      }
+    };
+
+    g["IdentCont"] = [](const SemanticValues &vs) {
+      return std::string(vs.sv().data(), vs.sv().length());
+    };
+
+    g["Dictionary"] = [](const SemanticValues &vs) {
+      auto items = vs.transform<std::string>();
+      return dic(items, false);
+    };
+    g["DictionaryI"] = [](const SemanticValues &vs) {
+      auto items = vs.transform<std::string>();
+      return dic(items, true);
+    };
+
+    g["Literal"] = [](const SemanticValues &vs) {
+      const auto &tok = vs.tokens.front();
+      return lit(resolve_escape_sequence(tok.data(), tok.size()));
+    };
+    g["LiteralI"] = [](const SemanticValues &vs) {
+      const auto &tok = vs.tokens.front();
+      return liti(resolve_escape_sequence(tok.data(), tok.size()));
+    };
+    g["LiteralD"] = [](const SemanticValues &vs) {
+      auto &tok = vs.tokens.front();
+      return resolve_escape_sequence(tok.data(), tok.size());
+    };
+    g["LiteralID"] = [](const SemanticValues &vs) {
+      auto &tok = vs.tokens.front();
+      return resolve_escape_sequence(tok.data(), tok.size());
+    };
+
+    g["Class"] = [](const SemanticValues &vs) {
+      auto ranges = vs.transform<std::pair<char32_t, char32_t>>();
+      return cls(ranges);
+    };
+    g["ClassI"] = [](const SemanticValues &vs) {
+      auto ranges = vs.transform<std::pair<char32_t, char32_t>>();
+      return cls(ranges, true);
+    };
+    g["NegatedClass"] = [](const SemanticValues &vs) {
+      auto ranges = vs.transform<std::pair<char32_t, char32_t>>();
+      return ncls(ranges);
+    };
+    g["NegatedClassI"] = [](const SemanticValues &vs) {
+      auto ranges = vs.transform<std::pair<char32_t, char32_t>>();
+      return ncls(ranges, true);
+    };
+    g["Range"] = [](const SemanticValues &vs) {
+      switch (vs.choice()) {
+      case 0: {
+        auto s1 = std::any_cast<std::string>(vs[0]);
+        auto s2 = std::any_cast<std::string>(vs[1]);
+        auto cp1 = decode_codepoint(s1.data(), s1.length());
+        auto cp2 = decode_codepoint(s2.data(), s2.length());
+        return std::pair(cp1, cp2);
+      }
+      case 1: {
+        auto s = std::any_cast<std::string>(vs[0]);
+        auto cp = decode_codepoint(s.data(), s.length());
+        return std::pair(cp, cp);
+      }
+      }
+      return std::pair<char32_t, char32_t>(0, 0);
+    };
+    g["Char"] = [](const SemanticValues &vs) {
+      return resolve_escape_sequence(vs.sv().data(), vs.sv().length());
+    };
+
+    g["RepetitionRange"] = [&](const SemanticValues &vs) {
+      switch (vs.choice()) {
+      case 0: { // Number COMMA Number
+        auto min = std::any_cast<size_t>(vs[0]);
+        auto max = std::any_cast<size_t>(vs[1]);
+        return std::pair(min, max);
+      }
+      case 1: // Number COMMA
+        return std::pair(std::any_cast<size_t>(vs[0]),
+                         std::numeric_limits<size_t>::max());
+      case 2: { // Number
+        auto n = std::any_cast<size_t>(vs[0]);
+        return std::pair(n, n);
+      }
+      default: // COMMA Number
+        return std::pair(std::numeric_limits<size_t>::min(),
+                         std::any_cast<size_t>(vs[0]));
+      }
+    };
+    g["Number"] = [&](const SemanticValues &vs) {
+      return vs.token_to_number<size_t>();
+    };
+
+    g["CapScope"].enter = [](const Context & /*c*/, const char * /*s*/,
+                             size_t /*n*/, std::any &dt) {
+      auto &data = *std::any_cast<Data *>(dt);
+      data.captures_stack.emplace_back();
+    };
+    g["CapScope"].leave = [](const Context & /*c*/, const char * /*s*/,
+                             size_t /*n*/, size_t /*matchlen*/,
+                             std::any & /*value*/, std::any &dt) {
+      auto &data = *std::any_cast<Data *>(dt);
+      data.captures_stack.pop_back();
+    };
+
+    g["AND"] = [](const SemanticValues &vs) { return *vs.sv().data(); };
+    g["NOT"] = [](const SemanticValues &vs) { return *vs.sv().data(); };
+    g["QUESTION"] = [](const SemanticValues &vs) { return *vs.sv().data(); };
+    g["STAR"] = [](const SemanticValues &vs) { return *vs.sv().data(); };
+    g["PLUS"] = [](const SemanticValues &vs) { return *vs.sv().data(); };
+
+    g["DOT"] = [](const SemanticValues & /*vs*/) { return dot(); };
+
+    g["CUT"] = [](const SemanticValues & /*vs*/) { return cut(); };
+
+    g["BeginCap"] = [](const SemanticValues &vs) { return vs.token(); };
+
+    g["BackRef"] = [&](const SemanticValues &vs, std::any &dt) {
+      auto &data = *std::any_cast<Data *>(dt);
+
+      // Undefined back reference check
+      {
+        auto found = false;
+        auto it = data.captures_stack.rbegin();
+        while (it != data.captures_stack.rend()) {
+          if (it->find(vs.token()) != it->end()) {
+            found = true;
+            break;
+          }
+          ++it;
+        }
+        if (!found) {
+          auto ptr = vs.token().data() - 1; // include '$' symbol
+          data.undefined_back_references.emplace_back(vs.token(), ptr);
+        }
+      }
+
+      // NOTE: Disable packrat parsing if a back reference is not defined in
+      // captures in the current definition rule.
+      if (data.captures_in_current_definition.find(vs.token()) ==
+          data.captures_in_current_definition.end()) {
+        data.enablePackratParsing = false;
+      }
+
+      return bkr(vs.token_to_string());
+    };
+
+    g["Ignore"] = [](const SemanticValues &vs) { return vs.size() > 0; };
+
+    g["Parameters"] = [](const SemanticValues &vs) {
+      return vs.transform<std::string>();
+    };
+
+    g["Arguments"] = [](const SemanticValues &vs) {
+      return vs.transform<std::shared_ptr<Ope>>();
+    };
+
+    g["PrecedenceClimbing"] = [](const SemanticValues &vs) {
+      PrecedenceClimbing::BinOpeInfo binOpeInfo;
+      size_t level = 1;
+      for (auto v : vs) {
+        auto tokens = std::any_cast<std::vector<std::string_view>>(v);
+        auto assoc = tokens[0][0];
+        for (size_t i = 1; i < tokens.size(); i++) {
+          binOpeInfo[tokens[i]] = std::pair(level, assoc);
+        }
+        level++;
+      }
+      Instruction instruction;
+      instruction.type = "precedence";
+      instruction.data = binOpeInfo;
+      instruction.sv = vs.sv();
+      return instruction;
+    };
+    g["PrecedenceInfo"] = [](const SemanticValues &vs) {
+      return vs.transform<std::string_view>();
+    };
+    g["PrecedenceOpe"] = [](const SemanticValues &vs) { return vs.token(); };
+    g["PrecedenceAssoc"] = [](const SemanticValues &vs) { return vs.token(); };
+
+    g["ErrorMessage"] = [](const SemanticValues &vs) {
+      Instruction instruction;
+      instruction.type = "error_message";
+      instruction.data = std::any_cast<std::string>(vs[0]);
+      instruction.sv = vs.sv();
+      return instruction;
+    };
+
+    g["NoAstOpt"] = [](const SemanticValues &vs) {
+      Instruction instruction;
+      instruction.type = "no_ast_opt";
+      instruction.sv = vs.sv();
+      return instruction;
+    };
+
+    g["Instruction"] = [](const SemanticValues &vs) {
+      return vs.transform<Instruction>();
+    };
+  }
+
+  bool apply_precedence_instruction(Definition &rule,
+                                    const PrecedenceClimbing::BinOpeInfo &info,
+                                    const char *s, Log log) {
+    try {
+      auto &seq = dynamic_cast<Sequence &>(*rule.get_core_operator());
+      auto atom = seq.opes_[0];
+      auto &rep = dynamic_cast<Repetition &>(*seq.opes_[1]);
+      auto &seq1 = dynamic_cast<Sequence &>(*rep.ope_);
+      auto binop = seq1.opes_[0];
+      auto atom1 = seq1.opes_[1];
+
+      auto atom_name = dynamic_cast<Reference &>(*atom).name_;
+      auto binop_name = dynamic_cast<Reference &>(*binop).name_;
+      auto atom1_name = dynamic_cast<Reference &>(*atom1).name_;
+
+      if (!rep.is_zom() || atom_name != atom1_name || atom_name == binop_name) {
+        if (log) {
+          auto line = line_info(s, rule.s_);
+          log(line.first, line.second,
+              "'precedence' instruction cannot be applied to '" + rule.name +
+                  "'.",
+              "");
+        }
+        return false;
+      }
+
+      rule.holder_->ope_ = pre(atom, binop, info, rule);
+      rule.disable_action = true;
+    } catch (...) {
+      if (log) {
+        auto line = line_info(s, rule.s_);
+        log(line.first, line.second,
+            "'precedence' instruction cannot be applied to '" + rule.name +
+                "'.",
+            "");
+      }
+      return false;
+    }
+    return true;
+  }
+
+  std::shared_ptr<Grammar> perform_core(const char *s, size_t n,
+                                        const Rules &rules, std::string &start,
+                                        bool &enablePackratParsing, Log log) {
+    Data data;
+    auto &grammar = *data.grammar;
+
+    const auto &observer = phase_observer();
+    std::chrono::steady_clock::time_point phase_start;
+    if (observer) { phase_start = std::chrono::steady_clock::now(); }
+    auto end_phase = [&](const char *phase) {
+      if (observer) {
+        auto now = std::chrono::steady_clock::now();
+        observer(phase, now - phase_start);
+        phase_start = now;
+      }
+    };
+
+    // Built-in macros
+    {
+      // `%recover`
+      {
+        auto &rule = grammar[RECOVER_DEFINITION_NAME];
+        rule <= ref(grammar, "x", "", false, {});
+        rule.name = RECOVER_DEFINITION_NAME;
+        rule.s_ = "[native]";
+        rule.ignoreSemanticValue = true;
+        rule.is_macro = true;
+        rule.params = {"x"};
+      }
+    }
+
+    std::any dt = &data;
+    auto r = g["Grammar"].parse(s, n, dt, nullptr, log);
+    end_phase("meta-parse");
+
+    if (!r.ret) {
+      if (log) {
+        if (r.error_info.message_pos) {
+          auto line = line_info(s, r.error_info.message_pos);
+          log(line.first, line.second, r.error_info.message,
+              r.error_info.label);
+        } else {
+          auto line = line_info(s, r.error_info.error_pos);
+          log(line.first, line.second, "syntax error", r.error_info.label);
+        }
+      }
+      return nullptr;
+    }
+
+    // User provided rules
+    for (auto [user_name, user_rule] : rules) {
+      auto name = user_name;
+      auto ignore = false;
+      if (!name.empty() && name[0] == '~') {
+        ignore = true;
+        name.erase(0, 1);
+      }
+      if (!name.empty()) {
+        auto &rule = grammar[name];
+        rule <= user_rule;
+        rule.name = name;
+        rule.ignoreSemanticValue = ignore;
+        rule.user_rule_ = true;
+      }
+    }
+    end_phase("user rules");
+
+    // Check duplicated definitions
+    auto ret = true;
+
+    if (!data.duplicates_of_definition.empty()) {
+      for (const auto &[name, ptr] : data.duplicates_of_definition) {
+        if (log) {
+          auto line = line_info(s, ptr);
+          log(line.first, line.second,
+              "The definition '" + name + "' is already defined.", "");
+        }
+      }
+      ret = false;
+    }
+
+    // Check duplicated instructions
+    if (!data.duplicates_of_instruction.empty()) {
+      for (const auto &[type, ptr] : data.duplicates_of_instruction) {
+        if (log) {
+          auto line = line_info(s, ptr);
+          log(line.first, line.second,
+              "The instruction '" + type + "' is already defined.", "");
+        }
+      }
+      ret = false;
+    }
+
+    // Check undefined back references
+    if (!data.undefined_back_references.empty()) {
+      for (const auto &[name, ptr] : data.undefined_back_references) {
+        if (log) {
+          auto line = line_info(s, ptr);
+          log(line.first, line.second,
+              "The back reference '" + name + "' is undefined.", "");
+        }
+      }
+      ret = false;
+    }
+
+    // Set root definition
+    auto &start_rule = grammar[data.start];
+
+    // Check if the start rule has ignore operator
+    {
+      if (start_rule.ignoreSemanticValue) {
+        if (log) {
+          auto line = line_info(s, start_rule.s_);
+          log(line.first, line.second,
+              "Ignore operator cannot be applied to '" + start_rule.name + "'.",
+              "");
+        }
+        ret = false;
+      }
+    }
+
+    end_phase("duplicate checks");
+
+    if (!ret) { return nullptr; }
+
+    // Check missing definitions
+    auto referenced = std::unordered_set<std::string>{
+        WHITESPACE_DEFINITION_NAME,
+        WORD_DEFINITION_NAME,
+        RECOVER_DEFINITION_NAME,
+        start_rule.name,
+    };
+
+    for (auto &[_, rule] : grammar) {
+      ReferenceChecker vis(grammar, rule.params);
+      rule.accept(vis);
+      referenced.insert(vis.referenced.begin(), vis.referenced.end());
+      for (const auto &[name, ptr] : vis.error_s) {
+        if (log) {
+          auto line = line_info(s, ptr);
+          log(line.first, line.second, vis.error_message[name], "");
+        }
+        ret = false;
+      }
+    }
+
+    for (auto &[name, rule] : grammar) {
+      if (!referenced.count(name)) {
+        if (log) {
+          auto line = line_info(s, rule.s_);
+          auto msg = "'" + name + "' is not referenced.";
+          log(line.first, line.second, msg, "");
+        }
+      }
+    }
+    end_phase("ReferenceChecker");
+
+    if (!ret) { return nullptr; }
+
+    // Link references
+    for (auto &x : grammar) {
+      auto &rule = x.second;
+      LinkReferences vis(grammar, rule.params);
+      rule.accept(vis);
+    }
+    end_phase("LinkReferences");
+
+    // Check left recursion
+    ret = true;
+
+    for (auto &[name, rule] : grammar) {
+      DetectLeftRecursion vis(name);
+      rule.accept(vis);
+      if (vis.error_s) {
+        if (log) {
+          auto line = line_info(s, vis.error_s);
+          log(line.first, line.second, "'" + name + "' is left recursive.", "");
+        }
+        ret = false;
+      }
+    }
+    end_phase("DetectLeftRecursion");
+
+    if (!ret) { return nullptr; }
+
+    // Check infinite loop
+    if (detect_infiniteLoop(data, start_rule, log, s)) { return nullptr; }
+    end_phase("DetectInfiniteLoop");
+
+    // Automatic whitespace skipping
+    if (grammar.count(WHITESPACE_DEFINITION_NAME)) {
+      for (auto &x : grammar) {
+        auto &rule = x.second;
+        auto ope = rule.get_core_operator();
+        if (IsLiteralToken::check(*ope)) { rule <= tok(ope); }
+      }
+
+      auto &rule = grammar[WHITESPACE_DEFINITION_NAME];
+      start_rule.whitespaceOpe = wsp(rule.get_core_operator());
+
+      if (detect_infiniteLoop(data, rule, log, s)) { return nullptr; }
+    }
+    end_phase("whitespace");
+
+    // Word expression
+    if (grammar.count(WORD_DEFINITION_NAME)) {
+      auto &rule = grammar[WORD_DEFINITION_NAME];
+      start_rule.wordOpe = rule.get_core_operator();
+
+      if (detect_infiniteLoop(data, rule, log, s)) { return nullptr; }
+    }
+    end_phase("word");
+
+    // Apply instructions
+    for (const auto &[name, instructions] : data.instructions) {
+      auto &rule = grammar[name];
+
+      for (const auto &instruction : instructions) {
+        if (instruction.type == "precedence") {
+          const auto &info =
+              std::any_cast<PrecedenceClimbing::BinOpeInfo>(instruction.data);
+
+          if (!apply_precedence_instruction(rule, info, s, log)) {
+            return nullptr;
+          }
+        } else if (instruction.type == "error_message") {
+          rule.error_message = std::any_cast<std::string>(instruction.data);
+        } else if (instruction.type == "no_ast_opt") {
+          rule.no_ast_opt = true;
+        }
+      }
+    }
+    end_phase("instructions");
+
+    MacroExpander().expand(grammar);
+    end_phase("MacroExpander");
+
+    // Set root definition
+    start = data.start;
+    enablePackratParsing = data.enablePackratParsing;
+
+    return data.grammar;
+  }
+
+  bool detect_infiniteLoop(const Data &data, Definition &rule, const Log &log,
+                           const char *s) const {
+    std::vector<std::pair<const char *, std::string>> refs;
+    std::unordered_map<std::string, bool> has_error_cache;
+    DetectInfiniteLoop vis(data.start_pos, rule.name, refs, has_error_cache);
+    rule.accept(vis);
+    if (vis.has_error) {
+      if (log) {
+        auto line = line_info(s, vis.error_s);
+        log(line.first, line.second,
+            "infinite loop is detected in '" + vis.error_name + "'.", "");
+      }
+      return true;
+    }
+    return false;
+  }
+
+  Grammar g;
+};
+
+/*-----------------------------------------------------------------------------
+ *  Grammar snapshot
+ *---------------------------------------------------------------------------*/
+
+// Links the references of a grammar whose rules were built directly rather
+// than by ParserGenerator, and sets up the whitespace and word operators.
+inline void link_grammar(Grammar &grammar, const std::string &start) {
+  for (auto &[_, rule] : grammar) {
+    LinkReferences vis(grammar, rule.params);
+    rule.accept(vis);
+
+    // LinkReferences doesn't visit binary operators, since ParserGenerator
+    // links them before the precedence instruction is applied.
+    auto ope = rule.get_core_operator();
+    if (auto pre = dynamic_cast<PrecedenceClimbing *>(ope.get())) {
+      pre->binop_->accept(vis);
+    }
+  }
+
+  auto &start_rule = grammar[start];
+  if (grammar.count(WHITESPACE_DEFINITION_NAME)) {
+    start_rule.whitespaceOpe =
+        wsp(grammar[WHITESPACE_DEFINITION_NAME].get_core_operator());
+  }
+  if (grammar.count(WORD_DEFINITION_NAME)) {
+    start_rule.wordOpe = grammar[WORD_DEFINITION_NAME].get_core_operator();
+  }
+
+  MacroExpander().expand(grammar);
+}
+
+// FNV-1a hash of a grammar text, used to key snapshots and to check their
+// contents
+inline uint64_t grammar_text_hash(std::string_view text) {
+  uint64_t hash = 14695981039346656037ull;
+  for (auto ch : text) {
+    hash ^= static_cast<unsigned char>(ch);
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+// Binary image of a linked and validated grammar. Loading one skips parsing
+// the grammar text and all the checks in ParserGenerator. Rules supplied via
+// `Rules` are stored by name only and must be given again when loading.
+class GrammarSnapshot {
+public:
+  // Snapshots written with a different version are rejected
+  static const uint32_t version = 2;
+
+  static bool save(std::ostream &os, const Grammar &grammar,
+                   const std::string &start, bool enablePackratParsing,
+                   uint64_t hash) {
+    std::ostringstream payload;
+    Writer w(payload);
+    w.write_string(start);
+    w.write_bool(enablePackratParsing);
+
+    w.write_u64(grammar.size());
+    for (const auto &[name, rule] : grammar) {
+      w.write_string(name);
+      w.write_bool(rule.user_rule_);
+      w.write_bool(rule.ignoreSemanticValue);
+      w.write_bool(rule.is_macro);
+      w.write_bool(rule.no_ast_opt);
+      w.write_bool(rule.disable_action);
+      w.write_u64(rule.params.size());
+      for (const auto &param : rule.params) {
+        w.write_string(param);
+      }
+      w.write_string(rule.error_message);
+      w.write_u64(rule.line_.first);
+      w.write_u64(rule.line_.second);
+      if (!rule.user_rule_) { rule.get_core_operator()->accept(w); }
+    }
+
+    const auto &start_rule = grammar.at(start);
+    w.write_bool(start_rule.whitespaceOpe != nullptr);
+    w.write_bool(start_rule.wordOpe != nullptr);
+    if (!w.ok) { return false; }
+
+    auto data = payload.str();
+    Writer header(os);
+    header.write_bytes(magic(), 4);
+    header.write_u64(version);
+    header.write_u64(hash);
+    header.write_u64(data.size());
+    header.write_u64(grammar_text_hash(data));
+    header.write_bytes(data.data(), data.size());
+    return os.good();
+  }
+
+  static std::shared_ptr<Grammar> load(std::istream &is, uint64_t hash,
+                                       const Rules &rules, std::string &start,
+                                       bool &enablePackratParsing) {
+    // Strings referred to by string views in the operators live as long as
+    // the grammar
+    struct Storage {
+      Grammar grammar;
+      std::deque<std::string> strings;
+    };
+    auto storage = std::make_shared<Storage>();
+    auto &grammar = storage->grammar;
+
+    char buf[36];
+    if (!is.read(buf, sizeof(buf))) { return nullptr; }
+    Reader h(std::string_view(buf, sizeof(buf)), grammar, storage->strings);
+    char id[4];
+    h.read_bytes(id, 4);
+    if (memcmp(id, magic(), 4) || h.read_u64() != version ||
+        h.read_u64() != hash) {
+      return nullptr;
+    }
+    auto size = h.read_u64();
+    auto checksum = h.read_u64();
+
+    // Read in chunks, so a corrupt size can't allocate more than the stream
+    // holds
+    std::string data;
+    while (data.size() < size) {
+      char chunk[4096];
+      auto len = static_cast<std::streamsize>(
+          (std::min)(size - data.size(), static_cast<uint64_t>(sizeof(chunk))));
+      if (!is.read(chunk, len)) { return nullptr; }
+      data.append(chunk, static_cast<size_t>(len));
+    }
+    if (grammar_text_hash(data) != checksum) { return nullptr; }
+
+    Reader r(data, grammar, storage->strings);
+
+    auto start_name = r.read_string();
+    auto packrat = r.read_bool();
+
+    auto rule_count = r.read_count();
+    for (uint64_t i = 0; r.ok && i < rule_count; i++) {
+      auto name = r.read_string();
+      auto &rule = grammar[name];
+      rule.name = name;
+      rule.user_rule_ = r.read_bool();
+      rule.ignoreSemanticValue = r.read_bool();
+      rule.is_macro = r.read_bool();
+      rule.no_ast_opt = r.read_bool();
+      rule.disable_action = r.read_bool();
+      auto param_count = r.read_count();
+      for (uint64_t j = 0; r.ok && j < param_count; j++) {
+        rule.params.push_back(r.read_string());
+      }
+      rule.error_message = r.read_string();
+      rule.line_.first = r.read_u64();
+      rule.line_.second = r.read_u64();
+
+      if (rule.user_rule_) {
+        auto it = rules.find(rule.ignoreSemanticValue ? "~" + name : name);
+        if (it == rules.end()) { it = rules.find(name); }
+        if (it == rules.end()) { return nullptr; }
+        rule <= it->second;
+      } else {
+        rule <= r.read_ope(rule);
+      }
+    }
+
+    auto has_whitespace = r.read_bool();
+    auto has_word = r.read_bool();
+
+    if (!r.ok || !grammar.count(start_name)) { return nullptr; }
+
+    if (has_whitespace != grammar.count(WHITESPACE_DEFINITION_NAME) ||
+        has_word != grammar.count(WORD_DEFINITION_NAME) || r.left()) {
+      return nullptr;
+    }
+
+    // Every reference must name a rule or a parameter, or parsing would
+    // follow a null rule
+    for (auto &[_, rule] : grammar) {
+      ReferenceChecker vis(grammar, rule.params);
+      rule.accept(vis);
+      auto ope = rule.get_core_operator();
+      if (auto pre = dynamic_cast<PrecedenceClimbing *>(ope.get())) {
+        pre->binop_->accept(vis);
+      }
+      if (!vis.error_s.empty()) { return nullptr; }
+    }
+
+    link_grammar(grammar, start_name);
+
+    start = start_name;
+    enablePackratParsing = packrat;
+
+    return std::shared_ptr<Grammar>(storage, &storage->grammar);
+  }
+
+private:
+  enum class Tag : char {
+    Sequence,
+    PrioritizedChoice,
+    Repetition,
+    AndPredicate,
+    NotPredicate,
+    Dictionary,
+    LiteralString,
+    CharacterClass,
+    Character,
+    AnyCharacter,
+    CaptureScope,
+    Capture,
+    TokenBoundary,
+    Ignore,
+    Reference,
+    Whitespace,
+    BackReference,
+    PrecedenceClimbing,
+    Recovery,
+    Cut,
+  };
+
+  static const char *magic() { return "PEGS"; }
+
+  struct Writer : public Ope::Visitor {
+    using Ope::Visitor::visit;
+
+    Writer(std::ostream &os) : os_(os) {}
+
+    void write_bytes(const char *s, size_t n) { os_.write(s, n); }
+
+    void write_u64(uint64_t v) {
+      for (auto i = 0; i < 8; i++) {
+        os_.put(static_cast<char>(v >> (i * 8)));
+      }
+    }
+
+    void write_bool(bool v) { os_.put(v ? 1 : 0); }
+
+    void write_tag(Tag tag) { os_.put(static_cast<char>(tag)); }
+
+    void write_string(std::string_view s) {
+      write_u64(s.size());
+      write_bytes(s.data(), s.size());
+    }
+
+    void write_opes(const std::vector<std::shared_ptr<Ope>> &opes) {
+      write_u64(opes.size());
+      for (const auto &ope : opes) {
+        ope->accept(*this);
+      }
+    }
+
+    void visit(Sequence &ope) override {
+      write_tag(Tag::Sequence);
+      write_opes(ope.opes_);
+    }
+    void visit(PrioritizedChoice &ope) override {
+      write_tag(Tag::PrioritizedChoice);
+      write_bool(ope.for_label_);
+      write_opes(ope.opes_);
+    }
+    void visit(Repetition &ope) override {
+      write_tag(Tag::Repetition);
+      write_u64(ope.min_);
+      write_u64(ope.max_);
+      ope.ope_->accept(*this);
+    }
+    void visit(AndPredicate &ope) override {
+      write_tag(Tag::AndPredicate);
+      ope.ope_->accept(*this);
+    }
+    void visit(NotPredicate &ope) override {
+      write_tag(Tag::NotPredicate);
+      ope.ope_->accept(*this);
+    }
+    void visit(Dictionary &ope) override {
+      write_tag(Tag::Dictionary);
+      write_bool(ope.trie_.ignore_case());
+      auto items = ope.trie_.items();
+      write_u64(items.size());
+      for (const auto &item : items) {
+        write_string(item);
+      }
+    }
+    void visit(LiteralString &ope) override {
+      write_tag(Tag::LiteralString);
+      write_bool(ope.ignore_case_);
+      write_string(ope.lit_);
+    }
+    void visit(CharacterClass &ope) override {
+      write_tag(Tag::CharacterClass);
+      write_bool(ope.negated_);
+      write_bool(ope.ignore_case_);
+      write_u64(ope.ranges_.size());
+      for (const auto &[first, second] : ope.ranges_) {
+        write_u64(first);
+        write_u64(second);
+      }
+    }
+    void visit(Character &ope) override {
+      write_tag(Tag::Character);
+      os_.put(ope.ch_);
+    }
+    void visit(AnyCharacter &) override { write_tag(Tag::AnyCharacter); }
+    void visit(CaptureScope &ope) override {
+      write_tag(Tag::CaptureScope);
+      ope.ope_->accept(*this);
+    }
+    void visit(Capture &ope) override {
+      // Only captures created from grammar text can be restored
+      if (ope.name_.empty()) { ok = false; }
+      write_tag(Tag::Capture);
+      write_string(ope.name_);
+      ope.ope_->accept(*this);
+    }
+    void visit(TokenBoundary &ope) override {
+      write_tag(Tag::TokenBoundary);
+      ope.ope_->accept(*this);
+    }
+    void visit(Ignore &ope) override {
+      write_tag(Tag::Ignore);
+      ope.ope_->accept(*this);
+    }
+    void visit(User &) override { ok = false; }
+    void visit(WeakHolder &) override { ok = false; }
+    void visit(Holder &) override { ok = false; }
+    void visit(Reference &ope) override {
+      write_tag(Tag::Reference);
+      write_string(ope.name_);
+      write_bool(ope.is_macro_);
+      write_opes(ope.args_);
+    }
+    void visit(Whitespace &ope) override {
+      write_tag(Tag::Whitespace);
+      ope.ope_->accept(*this);
+    }
+    void visit(BackReference &ope) override {
+      write_tag(Tag::BackReference);
+      write_string(ope.name_);
+    }
+    void visit(PrecedenceClimbing &ope) override {
+      write_tag(Tag::PrecedenceClimbing);
+      ope.atom_->accept(*this);
+      ope.binop_->accept(*this);
+      write_u64(ope.info_.size());
+      for (const auto &[key, info] : ope.info_) {
+        write_string(key);
+        write_u64(info.first);
+        os_.put(info.second);
+      }
+    }
+    void visit(Recovery &ope) override {
+      write_tag(Tag::Recovery);
+      ope.ope_->accept(*this);
+    }
+    void visit(Cut &) override { write_tag(Tag::Cut); }
+
+    bool ok = true;
+
+  private:
+    std::ostream &os_;
+  };
+
+  struct Reader {
+    Reader(std::string_view data, const Grammar &grammar,
+           std::deque<std::string> &strings)
+        : data_(data), grammar_(grammar), strings_(strings) {}
+
+    size_t left() const { return data_.size() - pos_; }
+
+    bool read_bytes(char *s, size_t n) {
+      if (ok && n > left()) { ok = false; }
+      if (ok) {
+        memcpy(s, data_.data() + pos_, n);
+        pos_ += n;
+      }
+      return ok;
+    }
+
+    // Sizes and counts of items that take at least a byte each, so larger
+    // ones can only come from a corrupt snapshot
+    uint64_t read_count() {
+      auto n = read_u64();
+      if (n > left()) { ok = false; }
+      return ok ? n : 0;
+    }
+
+    uint64_t read_u64() {
+      unsigned char buf[8] = {0};
+      read_bytes(reinterpret_cast<char *>(buf), 8);
+      uint64_t v = 0;
+      for (auto i = 0; i < 8; i++) {
+        v |= static_cast<uint64_t>(buf[i]) << (i * 8);
+      }
+      return v;
+    }
+
+    bool read_bool() {
+      char v = 0;
+      read_bytes(&v, 1);
+      return v != 0;
+    }
+
+    char read_char() {
+      char v = 0;
+      read_bytes(&v, 1);
+      return v;
+    }
+
+    std::string read_string() {
+      auto n = read_count();
+      if (!ok) { return std::string(); }
+      std::string s(n, '\0');
+      read_bytes(s.data(), n);
+      return s;
+    }
+
+    std::string_view read_stored_string() {
+      strings_.push_back(read_string());
+      return strings_.back();
+    }
+
+    std::vector<std::shared_ptr<Ope>> read_opes(const Definition &rule) {
+      std::vector<std::shared_ptr<Ope>> opes;
+      auto n = read_count();
+      for (uint64_t i = 0; ok && i < n; i++) {
+        opes.push_back(read_ope(rule));
+      }
+      return opes;
+    }
+
+    std::shared_ptr<Ope> read_ope(const Definition &rule) {
+      auto tag = static_cast<Tag>(read_char());
+      if (!ok) { return cut(); }
+
+      switch (tag) {
+      case Tag::Sequence: return std::make_shared<Sequence>(read_opes(rule));
+      case Tag::PrioritizedChoice: {
+        auto for_label = read_bool();
+        auto ope = std::make_shared<PrioritizedChoice>(read_opes(rule));
+        ope->for_label_ = for_label;
+        return ope;
+      }
+      case Tag::Repetition: {
+        auto min = read_u64();
+        auto max = read_u64();
+        return rep(read_ope(rule), min, max);
+      }
+      case Tag::AndPredicate: return apd(read_ope(rule));
+      case Tag::NotPredicate: return npd(read_ope(rule));
+      case Tag::Dictionary: {
+        auto ignore_case = read_bool();
+        std::vector<std::string> items;
+        auto n = read_count();
+        for (uint64_t i = 0; ok && i < n; i++) {
+          items.push_back(read_string());
+        }
+        return dic(items, ignore_case);
+      }
+      case Tag::LiteralString: {
+        auto ignore_case = read_bool();
+        return std::make_shared<LiteralString>(read_string(), ignore_case);
+      }
+      case Tag::CharacterClass: {
+        auto negated = read_bool();
+        auto ignore_case = read_bool();
+        std::vector<std::pair<char32_t, char32_t>> ranges;
+        auto n = read_count();
+        for (uint64_t i = 0; ok && i < n; i++) {
+          auto first = static_cast<char32_t>(read_u64());
+          auto second = static_cast<char32_t>(read_u64());
+          ranges.emplace_back(first, second);
+        }
+        if (ranges.empty()) {
+          ok = false;
+          return cut();
+        }
+        return std::make_shared<CharacterClass>(ranges, negated, ignore_case);
+      }
+      case Tag::Character: return chr(read_char());
+      case Tag::AnyCharacter: return dot();
+      case Tag::CaptureScope: return csc(read_ope(rule));
+      case Tag::Capture: {
+        auto name = read_stored_string();
+        return cap(
+            read_ope(rule),
+            [name](const char *a_s, size_t a_n, Context &c) {
+              c.set_capture_value(name, a_s, a_n);
+            },
+            name);
+      }
+      case Tag::TokenBoundary: return tok(read_ope(rule));
+      case Tag::Ignore: return ign(read_ope(rule));
+      case Tag::Reference: {
+        auto name = read_string();
+        auto is_macro = read_bool();
+        return ref(grammar_, name, nullptr, is_macro, read_opes(rule));
+      }
+      case Tag::Whitespace:
+        return std::make_shared<Whitespace>(read_ope(rule));
+      case Tag::BackReference: return bkr(read_string());
+      case Tag::PrecedenceClimbing: {
+        auto atom = read_ope(rule);
+        auto binop = read_ope(rule);
+        PrecedenceClimbing::BinOpeInfo info;
+        auto n = read_count();
+        for (uint64_t i = 0; ok && i < n; i++) {
+          auto key = read_stored_string();
+          auto level = read_u64();
+          auto assoc = read_char();
+          info[key] = std::pair(level, assoc);
+        }
+        return pre(atom, binop, info, rule);
+      }
+      case Tag::Recovery: return rec(read_ope(rule));
+      case Tag::Cut: return cut();
+      }
+
+      ok = false;
+      return cut();
+    }
+
+    bool ok = true;
+
+  private:
+    std::string_view data_;
+    size_t pos_ = 0;
+    const Grammar &grammar_;
+    std::deque<std::string> &strings_;
+  };
+};
+
+/*-----------------------------------------------------------------------------
+ *  C++ code generation
+ *---------------------------------------------------------------------------*/
+
+// Octal escapes never absorb the following characters, unlike hex escapes
+inline std::string cpp_string_literal(std::string_view s) {
+  std::string code = "\"";
+  for (auto ch : s) {
+    auto b = static_cast<unsigned char>(ch);
+    switch (ch) {
+    case '"': code += "\\\""; break;
+    case '\\': code += "\\\\"; break;
+    case '\n': code += "\\n"; break;
+    case '\t': code += "\\t"; break;
+    default:
+      if (b < 0x20 || b >= 0x7f || ch == '?') {
+        code += '\\';
+        code += static_cast<char>('0' + ((b >> 6) & 7));
+        code += static_cast<char>('0' + ((b >> 3) & 7));
+        code += static_cast<char>('0' + (b & 7));
+      } else {
+        code += ch;
+      }
+      break;
+    }
+  }
+  return code + "\"";
+}
+
+// Generates the parse function of a rule. Terminals are matched inline, and
+// references call the parse functions of the rules they refer to. Whatever
+// the operators do with semantic values, errors and the context is done the
+// same way, so the functions parse exactly like the operators.
+class CppRuleEmitter : public Ope::Visitor {
+public:
+  using Ope::Visitor::visit;
+
+  // What the functions of a grammar share
+  struct Module {
+    std::map<std::string, std::string> functions; // name suffix of each rule
+    bool whitespace = false;        // whether there is %whitespace
+    bool whitespace_values = false; // whether skipping it can add values
+    std::shared_ptr<Ope> word_ope;  // %word, if any
+    bool captures = false;          // whether any rule captures
+    bool cuts = false;              // whether any rule has a cut
+    std::string constants;          // literals, at class scope
+    size_t constant_count = 0;
+  };
+
+  CppRuleEmitter(Module &m) : m_(m) {}
+
+  // Whether `ope` can be generated. Rules which use anything else are parsed
+  // by their operators.
+  static bool can_emit(Ope &ope, const Module &m) {
+    struct Check : public Ope::Visitor {
+      Check(const Module &m) : m_(m) {}
+      using Ope::Visitor::visit;
+      void visit(Sequence &ope) override { all(ope.opes_); }
+      void visit(PrioritizedChoice &ope) override { all(ope.opes_); }
+      void visit(Repetition &ope) override { ope.ope_->accept(*this); }
+      void visit(AndPredicate &ope) override { ope.ope_->accept(*this); }
+      void visit(NotPredicate &ope) override { ope.ope_->accept(*this); }
+      void visit(LiteralString &) override {}
+      void visit(CharacterClass &) override {}
+      void visit(Character &) override {}
+      void visit(AnyCharacter &) override {}
+      void visit(TokenBoundary &ope) override { ope.ope_->accept(*this); }
+      void visit(Ignore &ope) override { ope.ope_->accept(*this); }
+      void visit(Reference &ope) override {
+        if (ope.is_macro_ || !ope.args_.empty() || !ope.rule_ ||
+            !m_.functions.count(ope.name_)) {
+          ok = false;
+        }
+      }
+      void visit(Dictionary &) override { ok = false; }
+      void visit(CaptureScope &) override { ok = false; }
+      void visit(Capture &) override { ok = false; }
+      void visit(User &) override { ok = false; }
+      void visit(WeakHolder &) override { ok = false; }
+      void visit(Holder &) override { ok = false; }
+      void visit(Whitespace &) override { ok = false; }
+      void visit(BackReference &) override { ok = false; }
+      void visit(PrecedenceClimbing &) override { ok = false; }
+      void visit(Recovery &) override { ok = false; }
+      void visit(Cut &) override { ok = false; }
+
+      void all(const std::vector<std::shared_ptr<Ope>> &opes) {
+        for (const auto &op : opes) {
+          op->accept(*this);
+        }
+      }
+
+      const Module &m_;
+      bool ok = true;
+    };
+
+    Check vis(m);
+    ope.accept(vis);
+    return vis.ok;
+  }
+
+  // Whether parsing `ope` can add semantic values or tokens, which then need
+  // a scope of their own to be dropped on failure
+  static bool adds_values(Ope &ope, const Module &m) {
+    struct Check : public Ope::Visitor {
+      Check(const Module &m) : m_(m) {}
+      using Ope::Visitor::visit;
+      void visit(Sequence &ope) override { any(ope.opes_); }
+      void visit(PrioritizedChoice &ope) override { any(ope.opes_); }
+      void visit(Repetition &ope) override { ope.ope_->accept(*this); }
+      void visit(AndPredicate &) override {}
+      void visit(NotPredicate &) override {}
+      void visit(LiteralString &) override {
+        if (m_.whitespace_values) { result = true; }
+      }
+      void visit(CharacterClass &) override {}
+      void visit(Character &) override {}
+      void visit(AnyCharacter &) override {}
+      void visit(Ignore &) override {}
+      void visit(TokenBoundary &) override { result = true; }
+      void visit(Reference &) override { result = true; }
+
+      void any(const std::vector<std::shared_ptr<Ope>> &opes) {
+        for (const auto &op : opes) {
+          op->accept(*this);
+        }
+      }
+
+      const Module &m_;
+      bool result = false;
+    };
+
+    Check vis(m);
+    ope.accept(vis);
+    return vis.result;
+  }
+
+  // Statements of the function body, which returns the match length
+  void emit_body(Ope &ope) {
+    line("size_t len;");
+    emit(ope, "s", "n", "vs", "len");
+    line("return len;");
+  }
+
+  // Whether the generated code uses the variable `name`
+  bool uses(std::string_view name) const {
+    auto is_ident = [](char ch) {
+      return std::isalnum(static_cast<unsigned char>(ch)) || ch == '_';
+    };
+    for (auto pos = code_.find(name); pos != std::string::npos;
+         pos = code_.find(name, pos + 1)) {
+      auto end = pos + name.size();
+      if ((pos == 0 || !is_ident(code_[pos - 1])) &&
+          (end == code_.size() || !is_ident(code_[end]))) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  std::string code_;
+
+  void visit(Sequence &ope) override {
+    auto values = adds_values(ope, m_);
+    auto i = var("i");
+    auto vs = values ? var("vs") : vs_;
+    open();
+    if (values) { push_values(vs); }
+    line("size_t " + i + " = 0;");
+    line("do {");
+    indent_++;
+    for (const auto &op : ope.opes_) {
+      auto l = var("len");
+      line("size_t " + l + ";");
+      emit(*op, s_ + " + " + i, n_ + " - " + i, vs, l);
+      line("if (peg::fail(" + l + ")) {");
+      line("  " + len_ + " = " + l + ";");
+      line("  break;");
+      line("}");
+      line(i + " += " + l + ";");
+    }
+    if (values) { append_values(vs); }
+    line(len_ + " = " + i + ";");
+    indent_--;
+    line("} while (false);");
+    close();
+  }
+
+  void visit(PrioritizedChoice &ope) override {
+    auto captures = var("captures");
+    open();
+    if (m_.cuts && !ope.for_label_) {
+      line("c.cut_stack.push_back(false);");
+      line("auto " + var("se") +
+           " = peg::scope_exit([&]() { c.cut_stack.pop_back(); });");
+    }
+    if (m_.captures) { line("auto " + captures + " = c.capture_scope();"); }
+    line(len_ + " = static_cast<size_t>(-1);");
+    line("do {");
+    indent_++;
+    for (size_t id = 0; id < ope.opes_.size(); id++) {
+      auto values = needs_scope(*ope.opes_[id]);
+      auto vs = values ? var("vs") : vs_;
+      open();
+      if (m_.cuts) {
+        line("if (!c.cut_stack.empty()) { c.cut_stack.back() = false; }");
+      }
+      if (values) { line("auto &" + vs + " = c.push();"); }
+      line(std::string("if (c.log) { c.error_info.keep_previous_token = ") +
+           (id > 0 ? "true" : "false") + "; }");
+      line("auto " + var("se") + " = peg::scope_exit([&]() {");
+      if (values) { line("  c.pop();"); }
+      line("  if (c.log) { c.error_info.keep_previous_token = false; }");
+      line("});");
+      emit(*ope.opes_[id], s_, n_, vs, len_);
+      line("if (peg::success(" + len_ + ")) {");
+      indent_++;
+      if (values) { append_values(vs); }
+      line(vs_ + ".set_choice(" + std::to_string(id) + ", " +
+           std::to_string(ope.opes_.size()) + ");");
+      line("break;");
+      indent_--;
+      line("}");
+      if (m_.captures) {
+        line("c.discard_capture_values(" + captures + ");");
+      }
+      if (m_.cuts) {
+        line("if (!c.cut_stack.empty() && c.cut_stack.back()) { break; }");
+      }
+      close();
+    }
+    indent_--;
+    line("} while (false);");
+    close();
+  }
+
+  void visit(Repetition &ope) override {
+    line(len_ + " = 0;");
+    if (ope.max_ == 0) { return; }
+
+    auto max = std::numeric_limits<size_t>::max();
+    auto values = needs_scope(*ope.ope_);
+    auto counted = ope.min_ > 0 || ope.max_ != max;
+    auto count = var("count");
+    auto captures = var("captures");
+    auto vs = values ? var("vs") : vs_;
+    auto l = var("len");
+    open();
+    if (counted) {
+      line("size_t " + count + " = 0;");
+      line(ope.max_ == max
+               ? std::string("for (;;) {")
+               : "while (" + count + " < " + std::to_string(ope.max_) +
+                     ") {");
+    } else {
+      line("for (;;) {");
+    }
+    indent_++;
+    if (m_.captures) { line("auto " + captures + " = c.capture_scope();"); }
+    if (values) { push_values(vs, "c.push()", "c.pop()"); }
+    line("size_t " + l + ";");
+    emit(*ope.ope_, s_ + " + " + len_, n_ + " - " + len_, vs, l);
+    line("if (peg::fail(" + l + ")) {");
+    indent_++;
+    if (m_.captures) {
+      line("c.discard_capture_values(" + captures + ");");
+    }
+    if (ope.min_ > 0) {
+      line("if (" + count + " < " + std::to_string(ope.min_) + ") { " + len_ +
+           " = " + l + "; }");
+    }
+    line("break;");
+    indent_--;
+    line("}");
+    if (values) { append_values(vs); }
+    line(len_ + " += " + l + ";");
+    if (counted) { line(count + "++;"); }
+    indent_--;
+    line("}");
+    close();
+  }
+
+  void visit(AndPredicate &ope) override { predicate(*ope.ope_, false); }
+  void visit(NotPredicate &ope) override { predicate(*ope.ope_, true); }
+
+  void visit(LiteralString &ope) override {
+    auto name = constant(ope.lit_);
+    auto size = std::to_string(ope.lit_.size());
+    bind();
+    if (ope.lit_.empty()) {
+      line(len_ + " = 0;");
+    } else {
+      open();
+      if (ope.ignore_case_) {
+        auto matched = var("matched");
+        line("auto " + matched + " = " + n_ + " >= " + size + ";");
+        line("for (size_t i = 0; " + matched + " && i < " + size + "; i++) {");
+        line("  " + matched + " = std::tolower(" + s_ +
+             "[i]) == std::tolower(" + name + "[i]);");
+        line("}");
+        line("if (!" + matched + ") {");
+      } else {
+        line("if (" + n_ + " < " + size + " || std::memcmp(" + s_ + ", " +
+             name + ", " + size + ") != 0) {");
+      }
+      // Up to the end of the literal counts as examined on a mismatch,
+      // which can only make incremental reparsing reuse less
+      line("  if (c.track_examined) { c.mark_examined(" + s_ + ", (std::min)(" +
+           n_ + " + 1, static_cast<size_t>(" + size + "))); }");
+      line("  c.set_error_pos(" + s_ + ", " + name + ");");
+      line("  " + len_ + " = static_cast<size_t>(-1);");
+      line("} else {");
+      line("  if (c.track_examined) { c.mark_examined(" + s_ + ", " + size +
+           "); }");
+      line("  " + len_ + " = " + size + ";");
+      line("}");
+      close();
+    }
+
+    if (m_.word_ope && is_word(ope.lit_)) {
+      auto l = var("len");
+      line("if (peg::success(" + len_ + ") && c.wordOpe) {");
+      indent_++;
+      line("peg::IgnoreTraceState ignore_trace_state(c);");
+      line("auto " + l + " = peg::parse_word_end(" + s_ + " + " + len_ + ", " +
+           n_ + " - " + len_ + ", c);");
+      line("if (peg::fail(" + l + ")) {");
+      line("  c.set_error_pos(" + s_ + ", " + name + ");");
+      line("  " + len_ + " = " + l + ";");
+      line("}");
+      indent_--;
+      line("}");
+    }
+
+    skip_whitespace();
+  }
+
+  void visit(CharacterClass &ope) override {
+    bind();
+    uint64_t bits[2] = {0, 0};
+    for (size_t b = 0; b < 0x80; b++) {
+      if (ope.ascii_bits_[b]) { bits[b / 64] |= uint64_t(1) << (b % 64); }
+    }
+
+    // Code points from U+0080, which are decoded first
+    std::string in_ranges;
+    for (const auto &[first, last] : ope.ranges_) {
+      if (!ope.ignore_case_ && last < 0x80) { continue; }
+      if (!in_ranges.empty()) { in_ranges += " || "; }
+      if (ope.ignore_case_) {
+        in_ranges += "(std::tolower(" + hex(first) +
+                     ") <= std::tolower(cp) && std::tolower(cp) <= "
+                     "std::tolower(" +
+                     hex(last) + "))";
+      } else if (first <= 0x80) {
+        in_ranges += "cp <= " + hex(last);
+      } else {
+        in_ranges += "(" + hex(first) + " <= cp && cp <= " + hex(last) + ")";
+      }
+    }
+    std::string matches;
+    if (in_ranges.empty()) {
+      matches = ope.negated_ ? "l != 0" : "false";
+    } else if (ope.negated_) {
+      matches = "l != 0 && !(" + in_ranges + ")";
+    } else {
+      matches = "l != 0 && (" + in_ranges + ")";
+    }
+
+    line("if (" + n_ + " < 1) {");
+    line("  if (c.track_examined) { c.mark_examined(" + s_ + ", 1); }");
+    line("  c.set_error_pos(" + s_ + ");");
+    line("  " + len_ + " = static_cast<size_t>(-1);");
+    line("} else if (static_cast<unsigned char>(" + s_ + "[0]) < 0x80) {");
+    line("  auto b = static_cast<unsigned char>(" + s_ + "[0]);");
+    line("  if (c.track_examined) { c.mark_examined(" + s_ + ", 1); }");
+    line("  if (((b < 0x40 ? " + hex(bits[0]) + "ull : " + hex(bits[1]) +
+         "ull) >> (b & 0x3f)) & 1) {");
+    line("    " + len_ + " = 1;");
+    line("  } else {");
+    line("    c.set_error_pos(" + s_ + ");");
+    line("    " + len_ + " = static_cast<size_t>(-1);");
+    line("  }");
+    line("} else {");
+    line("  char32_t cp = 0;");
+    line("  auto l = peg::decode_codepoint(" + s_ + ", " + n_ + ", cp);");
+    line("  if (c.track_examined) {");
+    line("    c.mark_examined(" + s_ +
+         ", (std::max)(l, static_cast<size_t>(1)));");
+    line("  }");
+    line("  if (" + matches + ") {");
+    line("    " + len_ + " = l;");
+    line("  } else {");
+    line("    c.set_error_pos(" + s_ + ");");
+    line("    " + len_ + " = static_cast<size_t>(-1);");
+    line("  }");
+    line("}");
+  }
+
+  void visit(Character &ope) override {
+    bind();
+    line("if (c.track_examined) { c.mark_examined(" + s_ + ", 1); }");
+    line("if (" + n_ + " < 1 || " + s_ + "[0] != static_cast<char>(" +
+         std::to_string(static_cast<int>(ope.ch_)) + ")) {");
+    line("  c.set_error_pos(" + s_ + ");");
+    line("  " + len_ + " = static_cast<size_t>(-1);");
+    line("} else {");
+    line("  " + len_ + " = 1;");
+    line("}");
+  }
+
+  void visit(AnyCharacter &) override {
+    bind();
+    line(len_ + " = peg::codepoint_length(" + s_ + ", " + n_ + ");");
+    line("if (c.track_examined) {");
+    line("  c.mark_examined(" + s_ + ", (std::max)(" + len_ +
+         ", static_cast<size_t>(1)));");
+    line("}");
+    line("if (" + len_ + " < 1) {");
+    line("  c.set_error_pos(" + s_ + ");");
+    line("  " + len_ + " = static_cast<size_t>(-1);");
+    line("}");
+  }
+
+  void visit(TokenBoundary &ope) override {
+    bind();
+    open();
+    line("peg::IgnoreTraceState ignore_trace_state(c);");
+    open();
+    line("c.in_token_boundary_count++;");
+    line("auto " + var("se") +
+         " = peg::scope_exit([&]() { c.in_token_boundary_count--; });");
+    emit(*ope.ope_, s_, n_, vs_, len_);
+    close();
+    line("if (peg::success(" + len_ + ")) {");
+    line("  " + vs_ + ".tokens.emplace_back(std::string_view(" + s_ + ", " +
+         len_ + "));");
+    line("}");
+    skip_whitespace();
+    close();
+  }
+
+  void visit(Ignore &ope) override {
+    if (!adds_values(*ope.ope_, m_)) {
+      emit(*ope.ope_, s_, n_, vs_, len_);
+      return;
+    }
+    auto vs = var("vs");
+    open();
+    push_values(vs);
+    emit(*ope.ope_, s_, n_, vs, len_);
+    close();
+  }
+
+  void visit(Reference &ope) override {
+    line(len_ + " = parse_" + m_.functions.at(ope.name_) + "(" + s_ + ", " +
+         n_ + ", " + vs_ + ", c, dt);");
+  }
+
+private:
+  void emit(Ope &ope, const std::string &s, const std::string &n,
+            const std::string &vs, const std::string &len) {
+    auto save = std::tuple(s_, n_, vs_, len_);
+    s_ = s;
+    n_ = n;
+    vs_ = vs;
+    len_ = len;
+    ope.accept(*this);
+    std::tie(s_, n_, vs_, len_) = save;
+  }
+
+  // Makes the position and the length names, for code using them repeatedly
+  void bind() {
+    if (s_.find(' ') != std::string::npos) {
+      auto s = var("s");
+      line("auto " + s + " = " + s_ + ";");
+      s_ = s;
+    }
+    if (n_.find(' ') != std::string::npos) {
+      auto n = var("n");
+      line("auto " + n + " = " + n_ + ";");
+      n_ = n;
+    }
+  }
+
+  // A reference adds its value only when it succeeds, so it can add to the
+  // values of a choice or a repetition directly
+  bool needs_scope(Ope &ope) const {
+    return adds_values(ope, m_) && !dynamic_cast<Reference *>(&ope);
+  }
+
+  void predicate(Ope &ope, bool negated) {
+    auto values = adds_values(ope, m_);
+    auto captures = var("captures");
+    auto vs = values ? var("vs") : vs_;
+    auto l = var("len");
+    bind();
+    open();
+    if (m_.captures) { line("auto " + captures + " = c.capture_scope();"); }
+    if (values) { line("auto &" + vs + " = c.push();"); }
+    if (values || m_.captures) {
+      line("auto " + var("se") + " = peg::scope_exit([&]() {");
+      if (values) { line("  c.pop();"); }
+      if (m_.captures) {
+        line("  c.discard_capture_values(" + captures + ");");
+      }
+      line("});");
+    }
+    line("size_t " + l + ";");
+    emit(ope, s_, n_, vs, l);
+    if (negated) {
+      line("if (peg::success(" + l + ")) {");
+      line("  c.set_error_pos(" + s_ + ");");
+      line("  " + len_ + " = static_cast<size_t>(-1);");
+      line("} else {");
+      line("  " + len_ + " = 0;");
+      line("}");
+    } else {
+      line(len_ + " = peg::success(" + l + ") ? 0 : " + l + ";");
+    }
+    close();
+  }
+
+  void skip_whitespace() {
+    if (!m_.whitespace) { return; }
+    auto l = var("len");
+    line("if (peg::success(" + len_ + ")) {");
+    line("  auto " + l + " = skip_whitespace(" + s_ + " + " + len_ + ", " + n_ +
+         " - " + len_ + ", " + vs_ + ", c, dt);");
+    line("  " + len_ + " = peg::fail(" + l + ") ? " + l + " : " + len_ +
+         " + " + l + ";");
+    line("}");
+  }
+
+  void push_values(const std::string &vs,
+                   const char *push = "c.push_semantic_values_scope()",
+                   const char *pop = "c.pop_semantic_values_scope()") {
+    line("auto &" + vs + " = " + push + ";");
+    line("auto " + var("se") + " = peg::scope_exit([&]() { " + pop + "; });");
+  }
+
+  void append_values(const std::string &vs) {
+    line(vs_ + ".append(" + vs + ");");
+  }
+
+  // Whether the word expression matches the literal, as parse_literal
+  // decides on the first match
+  bool is_word(const std::string &lit) const {
+    SemanticValues dummy_vs;
+    Context dummy_c(nullptr, lit.data(), lit.size(), 0, nullptr, nullptr, false,
+                    nullptr, nullptr, nullptr, false, nullptr);
+    std::any dummy_dt;
+    return success(m_.word_ope->parse(lit.data(), lit.size(), dummy_vs,
+                                      dummy_c, dummy_dt));
+  }
+
+  // Each literal is a constant of its own, since expected tokens in error
+  // messages are told apart by their addresses
+  std::string constant(const std::string &lit) {
+    auto name = "literal_" + std::to_string(m_.constant_count++) + "_";
+    m_.constants += "  static constexpr char " + name +
+                    "[] = " + cpp_string_literal(lit) + ";\n";
+    return name;
+  }
+
+  static std::string hex(uint64_t v) {
+    std::ostringstream ss;
+    ss << "0x" << std::hex << v;
+    return ss.str();
+  }
+
+  std::string var(const char *prefix) {
+    return prefix + std::string("_") + std::to_string(next_var_++);
+  }
+
+  void open() {
+    line("{");
+    indent_++;
+  }
+
+  void close() {
+    indent_--;
+    line("}");
+  }
+
+  void line(const std::string &text) {
+    code_ += std::string(indent_ * 2, ' ') + text + "\n";
+  }
+
+  Module &m_;
+  std::string s_;
+  std::string n_;
+  std::string vs_;
+  std::string len_;
+  size_t next_var_ = 0;
+  int indent_ = 2;
+};
+
+// Generates a C++ header with a parse function for each rule and a function
+// which builds the parser, so that a program can create the parser without
+// parsing and checking the grammar text at startup, and parse without the
+// operator tree where the rules can be generated.
+class CppEmitter : public Ope::Visitor {
+public:
+  using Ope::Visitor::visit;
+
+  static bool emit(std::ostream &os, const Grammar &grammar,
+                   const std::string &start, bool enablePackratParsing,
+                   const std::string &function_name) {
+    // Emit rules in a stable order
+    std::vector<std::string> names;
+    for (const auto &[name, _] : grammar) {
+      names.push_back(name);
+    }
+    std::sort(names.begin(), names.end());
+
+    // Every rule but a macro has a parse function
+    CppRuleEmitter::Module m;
+    std::vector<std::string> rules;
+    for (const auto &name : names) {
+      if (grammar.at(name).is_macro) { continue; }
+      m.functions[name] = function_suffix(name, rules.size());
+      rules.push_back(name);
+    }
+
+    struct Scan : public Ope::Visitor {
+      using Ope::Visitor::visit;
+      void visit(Sequence &ope) override { all(ope.opes_); }
+      void visit(PrioritizedChoice &ope) override { all(ope.opes_); }
+      void visit(Repetition &ope) override { ope.ope_->accept(*this); }
+      void visit(AndPredicate &ope) override { ope.ope_->accept(*this); }
+      void visit(NotPredicate &ope) override { ope.ope_->accept(*this); }
+      void visit(CaptureScope &ope) override { ope.ope_->accept(*this); }
+      void visit(Capture &ope) override {
+        captures = true;
+        ope.ope_->accept(*this);
+      }
+      void visit(TokenBoundary &ope) override { ope.ope_->accept(*this); }
+      void visit(Ignore &ope) override { ope.ope_->accept(*this); }
+      void visit(Reference &ope) override { all(ope.args_); }
+      void visit(Whitespace &ope) override { ope.ope_->accept(*this); }
+      void visit(PrecedenceClimbing &ope) override {
+        ope.atom_->accept(*this);
+        ope.binop_->accept(*this);
+      }
+      void visit(Recovery &ope) override { ope.ope_->accept(*this); }
+      void visit(Cut &) override { cuts = true; }
+
+      void all(const std::vector<std::shared_ptr<Ope>> &opes) {
+        for (const auto &op : opes) {
+          op->accept(*this);
+        }
+      }
+
+      bool captures = false;
+      bool cuts = false;
+    };
+
+    Scan scan;
+    for (const auto &name : names) {
+      grammar.at(name).get_core_operator()->accept(scan);
+    }
+    m.captures = scan.captures;
+    m.cuts = scan.cuts;
+
+    if (grammar.count(WORD_DEFINITION_NAME)) {
+      m.word_ope = grammar.at(WORD_DEFINITION_NAME).get_core_operator();
+    }
+    if (grammar.count(WHITESPACE_DEFINITION_NAME)) {
+      m.whitespace = true;
+      m.whitespace_values = CppRuleEmitter::adds_values(
+          *grammar.at(WHITESPACE_DEFINITION_NAME).get_core_operator(), m);
+    }
+
+    const auto class_name = function_name + "_functions";
+    const auto params = [](bool vs, bool dt) {
+      return std::string("const char *s, size_t n, peg::SemanticValues &") +
+             (vs ? "vs" : "/*vs*/") + ", peg::Context &c, std::any &" +
+             (dt ? "dt" : "/*dt*/");
+    };
+
+    std::string functions;
+    std::vector<std::string> bodies;
+    for (size_t i = 0; i < rules.size(); i++) {
+      const auto &name = rules[i];
+      const auto &rule = grammar.at(name);
+      const auto &suffix = m.functions.at(name);
+      auto ope = rule.get_core_operator();
+      auto rule_ptr = "rules_[" + std::to_string(i) + "]";
+
+      functions += "\n  // " + name + "\n";
+      functions += "  size_t parse_" + suffix + "(" + params(true, true) +
+                   ") {\n";
+      if (rule.user_rule_ || !CppRuleEmitter::can_emit(*ope, m)) {
+        functions += "    return " + rule_ptr +
+                     "->parse_rule(s, n, vs, c, dt);\n"
+                     "  }\n";
+        continue;
+      }
+
+      CppRuleEmitter vis(m);
+      vis.emit_body(*ope);
+      bodies.push_back(name);
+      functions += "    return " + rule_ptr +
+                   "->parse_rule(s, n, vs, c, dt, [&](peg::SemanticValues "
+                   "&chvs) {\n"
+                   "      return body_" +
+                   suffix +
+                   "(s, n, chvs, c, dt);\n"
+                   "    });\n"
+                   "  }\n"
+                   "\n"
+                   "  size_t body_" +
+                   suffix + "(" + params(vis.uses("vs"), vis.uses("dt")) +
+                   ") {\n" + vis.code_ + "  }\n";
+    }
+
+    if (m.whitespace) {
+      functions += "\n  size_t skip_whitespace(" + params(true, true) +
+                   ") {\n"
+                   "    if (c.in_token_boundary_count || !c.whitespaceOpe) "
+                   "{ return 0; }\n"
+                   "    peg::IgnoreTraceState ignore_trace_state(c);\n";
+      auto it = std::find(bodies.begin(), bodies.end(),
+                          WHITESPACE_DEFINITION_NAME);
+      if (it != bodies.end()) {
+        functions += "    if (c.in_whitespace) { return 0; }\n"
+                     "    c.in_whitespace = true;\n"
+                     "    auto se = peg::scope_exit([&]() { c.in_whitespace = "
+                     "false; });\n"
+                     "    return body_" +
+                     m.functions.at(*it) +
+                     "(s, n, vs, c, dt);\n"
+                     "  }\n";
+      } else {
+        functions += "    return c.whitespaceOpe->parse(s, n, vs, c, dt);\n"
+                     "  }\n";
+      }
+    }
+
+    os << "// Generated by peglint --emit-cpp. Do not edit.\n"
+          "#pragma once\n"
+          "\n"
+          "#include <peglib.h>\n"
+          "\n"
+          "#include <cstring>\n"
+          "\n"
+          "// Parse functions of the rules of "
+       << function_name
+       << "(). Rules which can't be generated\n"
+          "// are parsed by their operators.\n"
+          "class "
+       << class_name
+       << " {\n"
+          "public:\n"
+          "  explicit "
+       << class_name << "(peg::Grammar &g)\n      : rules_{";
+    for (size_t i = 0; i < rules.size(); i++) {
+      if (i > 0) { os << ",\n               "; }
+      os << "&g.at(" << cpp_string_literal(rules[i]) << ")";
+    }
+    os << "} {}\n"
+       << functions
+       << "\n"
+          "private:\n"
+       << m.constants << "  peg::Definition *rules_[" << rules.size()
+       << "];\n"
+          "};\n"
+          "\n"
+          "inline peg::parser "
+       << function_name
+       << "(const peg::Rules &rules = peg::Rules()) {\n"
+          "  using namespace peg;\n"
+          "  using Ranges = std::vector<std::pair<char32_t, char32_t>>;\n"
+          "  (void)rules;\n"
+          "\n"
+          "  auto grammar = std::make_shared<Grammar>();\n"
+          "  auto &g = *grammar;\n";
+
+    auto ok = true;
+    for (const auto &name : names) {
+      const auto &rule = grammar.at(name);
+
+      os << "\n  {\n"
+         << "    auto &rule = g[" << cpp_string_literal(name) << "];\n"
+         << "    rule.name = " << cpp_string_literal(name) << ";\n";
+      if (rule.ignoreSemanticValue) {
+        os << "    rule.ignoreSemanticValue = true;\n";
+      }
+      if (rule.is_macro) {
+        os << "    rule.is_macro = true;\n";
+        os << "    rule.params = {";
+        for (size_t i = 0; i < rule.params.size(); i++) {
+          if (i > 0) { os << ", "; }
+          os << cpp_string_literal(rule.params[i]);
+        }
+        os << "};\n";
+      }
+      if (!rule.error_message.empty()) {
+        os << "    rule.error_message = "
+           << cpp_string_literal(rule.error_message) << ";\n";
+      }
+      if (rule.no_ast_opt) { os << "    rule.no_ast_opt = true;\n"; }
+      if (rule.disable_action) { os << "    rule.disable_action = true;\n"; }
+
+      if (rule.user_rule_) {
+        os << "    rule <= rules.at(" << cpp_string_literal(name) << ");\n";
+      } else {
+        CppEmitter vis;
+        rule.get_core_operator()->accept(vis);
+        ok = ok && vis.ok_;
+        os << "    rule <= " << vis.code_ << ";\n";
+      }
+      os << "  }\n";
+    }
+
+    // The operators stay for the grammar checks made when parsing, such as
+    // which rules are tokens, and to parse what isn't generated
+    os << "\n"
+          "  parser parser;\n"
+          "  parser.load_grammar(grammar, "
+       << cpp_string_literal(start) << ", "
+       << (enablePackratParsing ? "true" : "false")
+       << ");\n"
+          "\n"
+          "  auto functions = std::make_shared<"
+       << class_name << ">(g);\n";
+    for (const auto &name : bodies) {
+      os << "  g[" << cpp_string_literal(name)
+         << "].parse_body = [functions](auto &&...args) {\n"
+            "    return functions->body_"
+         << m.functions.at(name) << "(args...);\n"
+         << "  };\n";
+    }
+    os << "  return parser;\n"
+          "}\n";
+
+    return ok && os.good();
+  }
+
+  void visit(Sequence &ope) override { call("seq", ope.opes_); }
+  void visit(PrioritizedChoice &ope) override {
+    call(ope.for_label_ ? "cho4label_" : "cho", ope.opes_);
+  }
+  void visit(Repetition &ope) override {
+    auto max = std::numeric_limits<size_t>::max();
+    if (ope.min_ == 0 && ope.max_ == 1) {
+      call("opt", {ope.ope_});
+    } else if (ope.min_ == 0 && ope.max_ == max) {
+      call("zom", {ope.ope_});
+    } else if (ope.min_ == 1 && ope.max_ == max) {
+      call("oom", {ope.ope_});
+    } else {
+      code_ = "rep(" + emit(*ope.ope_) + ", " + std::to_string(ope.min_) +
+              ", " +
+              (ope.max_ == max ? "std::numeric_limits<size_t>::max()"
+                               : std::to_string(ope.max_)) +
+              ")";
+    }
+  }
+  void visit(AndPredicate &ope) override { call("apd", {ope.ope_}); }
+  void visit(NotPredicate &ope) override { call("npd", {ope.ope_}); }
+  void visit(Dictionary &ope) override {
+    code_ = "dic({";
+    auto items = ope.trie_.items();
+    for (size_t i = 0; i < items.size(); i++) {
+      if (i > 0) { code_ += ", "; }
+      code_ += cpp_string_literal(items[i]);
+    }
+    code_ += std::string("}, ") + (ope.trie_.ignore_case() ? "true" : "false") +
+             ")";
+  }
+  void visit(LiteralString &ope) override {
+    code_ = (ope.ignore_case_ ? "liti(" : "lit(") +
+            cpp_string_literal(ope.lit_) + ")";
+  }
+  void visit(CharacterClass &ope) override {
+    code_ = ope.negated_ ? "ncls(Ranges{" : "cls(Ranges{";
+    for (size_t i = 0; i < ope.ranges_.size(); i++) {
+      if (i > 0) { code_ += ", "; }
+      code_ += "{" + std::to_string(ope.ranges_[i].first) + ", " +
+               std::to_string(ope.ranges_[i].second) + "}";
+    }
+    code_ += std::string("}, ") + (ope.ignore_case_ ? "true" : "false") + ")";
+  }
+  void visit(Character &ope) override {
+    code_ = "chr(" + std::to_string(static_cast<int>(ope.ch_)) + ")";
+  }
+  void visit(AnyCharacter &) override { code_ = "dot()"; }
+  void visit(CaptureScope &ope) override { call("csc", {ope.ope_}); }
+  void visit(Capture &ope) override {
+    // Only captures created from grammar text can be generated
+    if (ope.name_.empty()) { ok_ = false; }
+    auto name = cpp_string_literal(ope.name_);
+    code_ = "cap(" + emit(*ope.ope_) +
+            ", [](const char *a_s, size_t a_n, Context &c) {\n"
+            "      c.set_capture_value(" +
+            name +
+            ", a_s, a_n);\n"
+            "    }, " +
+            name + ")";
+  }
+  void visit(TokenBoundary &ope) override { call("tok", {ope.ope_}); }
+  void visit(Ignore &ope) override { call("ign", {ope.ope_}); }
+  void visit(User &) override { ok_ = false; }
+  void visit(WeakHolder &) override { ok_ = false; }
+  void visit(Holder &) override { ok_ = false; }
+  void visit(Reference &ope) override {
+    code_ = "ref(g, " + cpp_string_literal(ope.name_) + ", nullptr, " +
+            (ope.is_macro_ ? "true" : "false") + ", {";
+    for (size_t i = 0; i < ope.args_.size(); i++) {
+      if (i > 0) { code_ += ", "; }
+      code_ += emit(*ope.args_[i]);
+    }
+    code_ += "})";
+  }
+  void visit(Whitespace &ope) override {
+    code_ = "std::make_shared<Whitespace>(" + emit(*ope.ope_) + ")";
+  }
+  void visit(BackReference &ope) override {
+    code_ = "bkr(" + cpp_string_literal(ope.name_) + ")";
+  }
+  void visit(PrecedenceClimbing &ope) override {
+    code_ = "pre(" + emit(*ope.atom_) + ", " + emit(*ope.binop_) + ", {";
+    auto first = true;
+    for (const auto &[key, info] : ope.info_) {
+      if (!first) { code_ += ", "; }
+      first = false;
+      code_ += "{" + cpp_string_literal(key) + ", {" +
+               std::to_string(info.first) + ", " +
+               std::to_string(static_cast<int>(info.second)) + "}}";
+    }
+    code_ += "}, rule)";
+  }
+  void visit(Recovery &ope) override { call("rec", {ope.ope_}); }
+  void visit(Cut &) override { code_ = "cut()"; }
+
+private:
+  // Function names end with the rule name where it is an identifier
+  static std::string function_suffix(const std::string &name, size_t id) {
+    auto is_ident = std::all_of(name.begin(), name.end(), [](char ch) {
+      return std::isalnum(static_cast<unsigned char>(ch)) || ch == '_';
+    });
+    if (is_ident) { return name; }
+
+    auto suffix = std::to_string(id) + "_";
+    for (auto ch : name) {
+      if (std::isalnum(static_cast<unsigned char>(ch)) || ch == '_') {
+        suffix += ch;
+      }
+    }
+    return suffix;
+  }
+
+  std::string emit(Ope &ope) {
+    CppEmitter vis;
+    ope.accept(vis);
+    ok_ = ok_ && vis.ok_;
+    return vis.code_;
+  }
+
+  void call(const char *fn, const std::vector<std::shared_ptr<Ope>> &opes) {
+    code_ = std::string(fn) + "(";
+    for (size_t i = 0; i < opes.size(); i++) {
+      if (i > 0) { code_ += ", "; }
+      code_ += emit(*opes[i]);
+    }
+    code_ += ")";
+  }
+
+  std::string code_;
+  bool ok_ = true;
+};
+
+/*-----------------------------------------------------------------------------
+ *  AST
+ *---------------------------------------------------------------------------*/
+
+template <typename Annotation> struct AstBase : public Annotation {
+  AstBase(const char *path, size_t line, size_t column, const char *name,
+          const std::vector<std::shared_ptr<AstBase>> &nodes,
+          size_t position = 0, size_t length = 0, size_t choice_count = 0,
+          size_t choice = 0)
+      : path(path ? path : ""), line(line), column(column), name(name),
+        position(position), length(length), choice_count(choice_count),
+        choice(choice), original_name(name),
+        original_choice_count(choice_count), original_choice(choice),
+        tag(str2tag(name)), original_tag(tag), is_token(false), nodes(nodes) {}
+
+  AstBase(const char *path, size_t line, size_t column, const char *name,
+          const std::string_view &token, size_t position = 0, size_t length = 0,
+          size_t choice_count = 0, size_t choice = 0)
+      : path(path ? path : ""), line(line), column(column), name(name),
+        position(position), length(length), choice_count(choice_count),
+        choice(choice), original_name(name),
+        original_choice_count(choice_count), original_choice(choice),
+        tag(str2tag(name)), original_tag(tag), is_token(true), token(token) {}
+
+  AstBase(const AstBase &ast, const char *original_name, size_t position = 0,
+          size_t length = 0, size_t original_choice_count = 0,
+          size_t original_choice = 0)
+      : path(ast.path), line(ast.line), column(ast.column), name(ast.name),
+        position(position), length(length), choice_count(ast.choice_count),
+        choice(ast.choice), original_name(original_name),
+        original_choice_count(original_choice_count),
+        original_choice(original_choice), tag(ast.tag),
+        original_tag(str2tag(original_name)), is_token(ast.is_token),
+        token(ast.token), nodes(ast.nodes), parent(ast.parent) {}
+
+  const std::string path;
+  const size_t line = 1;
+  const size_t column = 1;
+
+  const std::string name;
+  size_t position;
+  size_t length;
+  const size_t choice_count;
+  const size_t choice;
+  const std::string original_name;
+  const size_t original_choice_count;
+  const size_t original_choice;
+  const unsigned int tag;
+  const unsigned int original_tag;
+
+  const bool is_token;
+  const std::string_view token;
+
+  std::vector<std::shared_ptr<AstBase<Annotation>>> nodes;
+  std::weak_ptr<AstBase<Annotation>> parent;
+
+  std::string token_to_string() const {
+    assert(is_token);
+    return std::string(token);
+  }
+
+  template <typename T> T token_to_number() const {
+    return token_to_number_<T>(token);
+  }
+};
+
+template <typename T>
+void ast_to_s_core(const std::shared_ptr<T> &ptr, std::string &s, int level,
+                   std::function<std::string(const T &ast, int level)> fn) {
+  const auto &ast = *ptr;
+  for (auto i = 0; i < level; i++) {
+    s += "  ";
+  }
+  auto name = ast.original_name;
+  if (ast.original_choice_count > 0) {
+    name += "/" + std::to_string(ast.original_choice);
+  }
+  if (ast.name != ast.original_name) { name += "[" + ast.name + "]"; }
+  if (ast.is_token) {
+    s += "- " + name + " (";
+    s += ast.token;
+    s += ")\n";
+  } else {
+    s += "+ " + name + "\n";
+  }
+  if (fn) { s += fn(ast, level + 1); }
+  for (auto node : ast.nodes) {
+    ast_to_s_core(node, s, level + 1, fn);
+  }
+}
+
+template <typename T>
+std::string
+ast_to_s(const std::shared_ptr<T> &ptr,
+         std::function<std::string(const T &ast, int level)> fn = nullptr) {
+  std::string s;
+  ast_to_s_core(ptr, s, 0, fn);
+  return s;
+}
+
+struct AstOptimizer {
+  AstOptimizer(bool mode, const std::vector<std::string> &rules = {})
+      : mode_(mode), rules_(rules) {}
+
+  template <typename T>
+  std::shared_ptr<T> optimize(std::shared_ptr<T> original,
+                              std::shared_ptr<T> parent = nullptr) {
+    auto found =
+        std::find(rules_.begin(), rules_.end(), original->name) != rules_.end();
+    auto opt = mode_ ? !found : found;
+
+    if (opt && original->nodes.size() == 1) {
+      auto child = optimize(original->nodes[0], parent);
+      auto ast = std::make_shared<T>(*child, original->name.data(),
+                                     original->choice_count, original->position,
+                                     original->length, original->choice);
+      for (auto node : ast->nodes) {
+        node->parent = ast;
+      }
+      return ast;
+    }
+
+    auto ast = std::make_shared<T>(*original);
+    ast->parent = parent;
+    ast->nodes.clear();
+    for (auto node : original->nodes) {
+      auto child = optimize(node, ast);
+      ast->nodes.push_back(child);
+    }
+    return ast;
+  }
+
+private:
+  const bool mode_;
+  const std::vector<std::string> rules_;
+};
+
+struct EmptyType {};
+using Ast = AstBase<EmptyType>;
+
+template <typename T = Ast> void add_ast_action(Definition &rule) {
+  rule.action = [&](const SemanticValues &vs) {
+    auto line = vs.line_info();
+
+    if (rule.is_token()) {
+      return std::make_shared<T>(
+          vs.path, line.first, line.second, rule.name.data(), vs.token(),
+          std::distance(vs.ss, vs.sv().data()), vs.sv().length(),
+          vs.choice_count(), vs.choice());
+    }
+
+    auto ast =
+        std::make_shared<T>(vs.path, line.first, line.second, rule.name.data(),
+                            vs.transform<std::shared_ptr<T>>(),
+                            std::distance(vs.ss, vs.sv().data()),
+                            vs.sv().length(), vs.choice_count(), vs.choice());
+
+    for (auto node : ast->nodes) {
+      node->parent = ast;
+    }
+    return ast;
+  };
+}
+
+#define PEG_EXPAND(...) __VA_ARGS__
+#define PEG_CONCAT(a, b) a##b
+#define PEG_CONCAT2(a, b) PEG_CONCAT(a, b)
+
+#define PEG_PICK(                                                              \
+    a0, a1, a2, a3, a4, a5, a6, a7, a8, a9, a10, a11, a12, a13, a14, a15, a16, \
+    a17, a18, a19, a20, a21, a22, a23, a24, a25, a26, a27, a28, a29, a30, a31, \
+    a32, a33, a34, a35, a36, a37, a38, a39, a40, a41, a42, a43, a44, a45, a46, \
+    a47, a48, a49, a50, a51, a52, a53, a54, a55, a56, a57, a58, a59, a60, a61, \
+    a62, a63, a64, a65, a66, a67, a68, a69, a70, a71, a72, a73, a74, a75, a76, \
+    a77, a78, a79, a80, a81, a82, a83, a84, a85, a86, a87, a88, a89, a90, a91, \
+    a92, a93, a94, a95, a96, a97, a98, a99, a100, ...)                         \
+  a100
+
+#define PEG_COUNT(...)                                                         \
+  PEG_EXPAND(PEG_PICK(                                                         \
+      __VA_ARGS__, 100, 99, 98, 97, 96, 95, 94, 93, 92, 91, 90, 89, 88, 87,    \
+      86, 85, 84, 83, 82, 81, 80, 79, 78, 77, 76, 75, 74, 73, 72, 71, 70, 69,  \
+      68, 67, 66, 65, 64, 63, 62, 61, 60, 59, 58, 57, 56, 55, 54, 53, 52, 51,  \
+      50, 49, 48, 47, 46, 45, 44, 43, 42, 41, 40, 39, 38, 37, 36, 35, 34, 33,  \
+      32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17, 16, 15,  \
+      14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0))
+
+#define PEG_DEF_1(r)                                                           \
+  peg::Definition r;                                                           \
+  r.name = #r;                                                                 \
+  peg::add_ast_action(r);
+
+#define PEG_DEF_2(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_1(__VA_ARGS__))
+#define PEG_DEF_3(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_2(__VA_ARGS__))
+#define PEG_DEF_4(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_3(__VA_ARGS__))
+#define PEG_DEF_5(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_4(__VA_ARGS__))
+#define PEG_DEF_6(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_5(__VA_ARGS__))
+#define PEG_DEF_7(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_6(__VA_ARGS__))
+#define PEG_DEF_8(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_7(__VA_ARGS__))
+#define PEG_DEF_9(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_8(__VA_ARGS__))
+#define PEG_DEF_10(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_9(__VA_ARGS__))
+#define PEG_DEF_11(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_10(__VA_ARGS__))
+#define PEG_DEF_12(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_11(__VA_ARGS__))
+#define PEG_DEF_13(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_12(__VA_ARGS__))
+#define PEG_DEF_14(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_13(__VA_ARGS__))
+#define PEG_DEF_15(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_14(__VA_ARGS__))
+#define PEG_DEF_16(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_15(__VA_ARGS__))
+#define PEG_DEF_17(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_16(__VA_ARGS__))
+#define PEG_DEF_18(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_17(__VA_ARGS__))
+#define PEG_DEF_19(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_18(__VA_ARGS__))
+#define PEG_DEF_20(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_19(__VA_ARGS__))
+#define PEG_DEF_21(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_20(__VA_ARGS__))
+#define PEG_DEF_22(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_21(__VA_ARGS__))
+#define PEG_DEF_23(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_22(__VA_ARGS__))
+#define PEG_DEF_24(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_23(__VA_ARGS__))
+#define PEG_DEF_25(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_24(__VA_ARGS__))
+#define PEG_DEF_26(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_25(__VA_ARGS__))
+#define PEG_DEF_27(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_26(__VA_ARGS__))
+#define PEG_DEF_28(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_27(__VA_ARGS__))
+#define PEG_DEF_29(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_28(__VA_ARGS__))
+#define PEG_DEF_30(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_29(__VA_ARGS__))
+#define PEG_DEF_31(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_30(__VA_ARGS__))
+#define PEG_DEF_32(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_31(__VA_ARGS__))
+#define PEG_DEF_33(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_32(__VA_ARGS__))
+#define PEG_DEF_34(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_33(__VA_ARGS__))
+#define PEG_DEF_35(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_34(__VA_ARGS__))
+#define PEG_DEF_36(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_35(__VA_ARGS__))
+#define PEG_DEF_37(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_36(__VA_ARGS__))
+#define PEG_DEF_38(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_37(__VA_ARGS__))
+#define PEG_DEF_39(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_38(__VA_ARGS__))
+#define PEG_DEF_40(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_39(__VA_ARGS__))
+#define PEG_DEF_41(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_40(__VA_ARGS__))
+#define PEG_DEF_42(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_41(__VA_ARGS__))
+#define PEG_DEF_43(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_42(__VA_ARGS__))
+#define PEG_DEF_44(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_43(__VA_ARGS__))
+#define PEG_DEF_45(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_44(__VA_ARGS__))
+#define PEG_DEF_46(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_45(__VA_ARGS__))
+#define PEG_DEF_47(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_46(__VA_ARGS__))
+#define PEG_DEF_48(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_47(__VA_ARGS__))
+#define PEG_DEF_49(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_48(__VA_ARGS__))
+#define PEG_DEF_50(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_49(__VA_ARGS__))
+#define PEG_DEF_51(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_50(__VA_ARGS__))
+#define PEG_DEF_52(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_51(__VA_ARGS__))
+#define PEG_DEF_53(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_52(__VA_ARGS__))
+#define PEG_DEF_54(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_53(__VA_ARGS__))
+#define PEG_DEF_55(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_54(__VA_ARGS__))
+#define PEG_DEF_56(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_55(__VA_ARGS__))
+#define PEG_DEF_57(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_56(__VA_ARGS__))
+#define PEG_DEF_58(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_57(__VA_ARGS__))
+#define PEG_DEF_59(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_58(__VA_ARGS__))
+#define PEG_DEF_60(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_59(__VA_ARGS__))
+#define PEG_DEF_61(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_60(__VA_ARGS__))
+#define PEG_DEF_62(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_61(__VA_ARGS__))
+#define PEG_DEF_63(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_62(__VA_ARGS__))
+#define PEG_DEF_64(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_63(__VA_ARGS__))
+#define PEG_DEF_65(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_64(__VA_ARGS__))
+#define PEG_DEF_66(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_65(__VA_ARGS__))
+#define PEG_DEF_67(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_66(__VA_ARGS__))
+#define PEG_DEF_68(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_67(__VA_ARGS__))
+#define PEG_DEF_69(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_68(__VA_ARGS__))
+#define PEG_DEF_70(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_69(__VA_ARGS__))
+#define PEG_DEF_71(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_70(__VA_ARGS__))
+#define PEG_DEF_72(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_71(__VA_ARGS__))
+#define PEG_DEF_73(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_72(__VA_ARGS__))
+#define PEG_DEF_74(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_73(__VA_ARGS__))
+#define PEG_DEF_75(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_74(__VA_ARGS__))
+#define PEG_DEF_76(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_75(__VA_ARGS__))
+#define PEG_DEF_77(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_76(__VA_ARGS__))
+#define PEG_DEF_78(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_77(__VA_ARGS__))
+#define PEG_DEF_79(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_78(__VA_ARGS__))
+#define PEG_DEF_80(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_79(__VA_ARGS__))
+#define PEG_DEF_81(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_80(__VA_ARGS__))
+#define PEG_DEF_82(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_81(__VA_ARGS__))
+#define PEG_DEF_83(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_82(__VA_ARGS__))
+#define PEG_DEF_84(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_83(__VA_ARGS__))
+#define PEG_DEF_85(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_84(__VA_ARGS__))
+#define PEG_DEF_86(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_85(__VA_ARGS__))
+#define PEG_DEF_87(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_86(__VA_ARGS__))
+#define PEG_DEF_88(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_87(__VA_ARGS__))
+#define PEG_DEF_89(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_88(__VA_ARGS__))
+#define PEG_DEF_90(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_89(__VA_ARGS__))
+#define PEG_DEF_91(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_90(__VA_ARGS__))
+#define PEG_DEF_92(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_91(__VA_ARGS__))
+#define PEG_DEF_93(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_92(__VA_ARGS__))
+#define PEG_DEF_94(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_93(__VA_ARGS__))
+#define PEG_DEF_95(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_94(__VA_ARGS__))
+#define PEG_DEF_96(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_95(__VA_ARGS__))
+#define PEG_DEF_97(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_96(__VA_ARGS__))
+#define PEG_DEF_98(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_97(__VA_ARGS__))
+#define PEG_DEF_99(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_98(__VA_ARGS__))
+#define PEG_DEF_100(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_99(__VA_ARGS__))
+
+#define AST_DEFINITIONS(...)                                                   \
+  PEG_EXPAND(PEG_CONCAT2(PEG_DEF_, PEG_COUNT(__VA_ARGS__))(__VA_ARGS__))
+
+/*-----------------------------------------------------------------------------
+ *  Executor
+ *---------------------------------------------------------------------------*/
+
+// Runs `task(0)` ... `task(count - 1)`, possibly concurrently, and returns
+// when all of them have finished.
+using Executor =
+    std::function<void(size_t count, const std::function<void(size_t)> &task)>;
+
+inline void thread_executor(size_t count,
+                            const std::function<void(size_t)> &task) {
+  auto thread_count = (std::min)(
+      count, static_cast<size_t>(
+                 (std::max)(1u, std::thread::hardware_concurrency())));
+
+  // Idle threads pick up the next pending task, so uneven tasks balance out
+  std::atomic<size_t> next{0};
+  std::exception_ptr error;
+  std::mutex error_mutex;
+
+  auto worker = [&]() {
+    for (size_t i; (i = next.fetch_add(1)) < count;) {
+      try {
+        task(i);
+      } catch (...) {
+        std::lock_guard<std::mutex> guard(error_mutex);
+        if (!error) { error = std::current_exception(); }
+        next = count;
       }
-    };
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < thread_count; i++) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto &t : threads) {
+    t.join();
+  }
+
+  if (error) { std::rethrow_exception(error); }
+}
+
+/*-----------------------------------------------------------------------------
+ *  Automatic cuts
+ *---------------------------------------------------------------------------*/
+
+struct AutoCut {
+  std::string rule;
+  size_t line = 1;
+  size_t col = 1;
+  size_t alternative = 0; // 1-based
+  std::string text;       // the alternative with the cut
+};
+
+// Inserts a cut into an alternative of a choice after the shortest prefix
+// that consumes input, when no later alternative can start with a character
+// the prefix starts with, and none of them can match the empty string. Once
+// the prefix has matched, the later alternatives would fail anyway, so the
+// accepted language stays the same.
+class CutInserter : public Ope::Visitor {
+public:
+  using Ope::Visitor::visit;
+
+  CutInserter(std::string_view text) : text_(text) {}
+
+  std::vector<AutoCut> insert(Grammar &grammar) {
+    std::vector<Definition *> rules;
+    for (auto &[_, rule] : grammar) {
+      rules.push_back(&rule);
+    }
+    std::sort(rules.begin(), rules.end(), [](auto a, auto b) {
+      return std::tie(a->line_, a->name) < std::tie(b->line_, b->name);
+    });
+
+    for (auto rule : rules) {
+      rule_ = rule;
+      rule->get_core_operator()->accept(*this);
+    }
+    return std::move(cuts_);
+  }
+
+  void visit(Sequence &ope) override {
+    for (auto op : ope.opes_) {
+      op->accept(*this);
+    }
+  }
+  void visit(PrioritizedChoice &ope) override {
+    insert_cuts(ope);
+    for (auto op : ope.opes_) {
+      op->accept(*this);
+    }
+  }
+  void visit(Repetition &ope) override { ope.ope_->accept(*this); }
+  void visit(AndPredicate &ope) override { ope.ope_->accept(*this); }
+  void visit(NotPredicate &ope) override { ope.ope_->accept(*this); }
+  void visit(CaptureScope &ope) override { ope.ope_->accept(*this); }
+  void visit(Capture &ope) override { ope.ope_->accept(*this); }
+  void visit(TokenBoundary &ope) override { ope.ope_->accept(*this); }
+  void visit(Ignore &ope) override { ope.ope_->accept(*this); }
+  void visit(Reference &ope) override {
+    for (auto arg : ope.args_) {
+      arg->accept(*this);
+    }
+  }
+  void visit(Whitespace &ope) override { ope.ope_->accept(*this); }
+  void visit(PrecedenceClimbing &ope) override {
+    ope.atom_->accept(*this);
+    ope.binop_->accept(*this);
+  }
+  void visit(Recovery &ope) override { ope.ope_->accept(*this); }
+
+private:
+  void insert_cuts(PrioritizedChoice &ope) {
+    // A cut in a choice for a label commits the enclosing choice
+    if (ope.for_label_ || ope.opes_.size() < 2) { return; }
+
+    // Characters the alternatives after each one can start with
+    auto n = ope.opes_.size();
+    std::vector<std::bitset<256>> later(n);
+    std::vector<bool> later_nullable(n);
+    for (size_t i = n - 1; i > 0; i--) {
+      auto fs = first_.get(*ope.opes_[i]);
+      later[i - 1] = later[i] | fs.bytes;
+      later_nullable[i - 1] = later_nullable[i] || fs.nullable;
+    }
+
+    for (size_t i = 0; i + 1 < n; i++) {
+      if (later_nullable[i]) { continue; }
+
+      auto seq = dynamic_cast<Sequence *>(ope.opes_[i].get());
+      if (!seq) { continue; }
+
+      auto has_cut = std::any_of(seq->opes_.begin(), seq->opes_.end(),
+                                 [](const auto &op) {
+                                   return dynamic_cast<Cut *>(op.get());
+                                 });
+      if (has_cut) { continue; }
+
+      std::bitset<256> bytes;
+      size_t k = 0;
+      for (; k < seq->opes_.size(); k++) {
+        auto fs = first_.get(*seq->opes_[k]);
+        bytes |= fs.bytes;
+        if (!fs.nullable) { break; }
+      }
+      if (k + 1 >= seq->opes_.size() || (bytes & later[i]).any()) {
+        continue;
+      }
+
+      auto opes = seq->opes_;
+      opes.insert(opes.begin() + static_cast<std::ptrdiff_t>(k + 1),
+                  std::make_shared<Cut>(true));
+      ope.opes_[i] = std::make_shared<Sequence>(opes);
+
+      AutoCut c;
+      c.rule = rule_->name;
+      std::less_equal<const char *> le;
+      if (ope.s_ && !text_.empty() && le(text_.data(), ope.s_) &&
+          le(ope.s_, text_.data() + text_.size())) {
+        std::tie(c.line, c.col) = line_info(text_.data(), ope.s_);
+      } else {
+        std::tie(c.line, c.col) = rule_->line_;
+      }
+      c.alternative = i + 1;
+      c.text = PegText::get(*ope.opes_[i]);
+      cuts_.push_back(std::move(c));
+    }
+  }
+
+  std::string_view text_;
+  ComputeFirstSet first_;
+  const Definition *rule_ = nullptr;
+  std::vector<AutoCut> cuts_;
+};
+
+/*-----------------------------------------------------------------------------
+ *  parser
+ *---------------------------------------------------------------------------*/
+
+struct ParseError {
+  size_t line;
+  size_t column;
+  std::string message;
+  std::string rule;
+};
+
+// Results of parser::parse_batch, one entry per input in each column
+template <typename T> struct BatchResult {
+  // Not std::vector<bool>, since entries are written concurrently
+  std::vector<unsigned char> success;
+  std::vector<size_t> lengths;
+  std::vector<T> values;
+  std::vector<std::vector<ParseError>> errors;
+
+  size_t size() const { return success.size(); }
+};
+
+struct SlowInput;
+struct SlowInputOptions;
+
+class parser {
+public:
+  parser() = default;
+
+  parser(const char *s, size_t n, const Rules &rules) {
+    load_grammar(s, n, rules);
+  }
+
+  parser(const char *s, size_t n) : parser(s, n, Rules()) {}
+
+  parser(std::string_view sv, const Rules &rules)
+      : parser(sv.data(), sv.size(), rules) {}
+
+  parser(std::string_view sv) : parser(sv.data(), sv.size(), Rules()) {}
+
+#if defined(__cpp_lib_char8_t)
+  parser(std::u8string_view sv, const Rules &rules)
+      : parser(reinterpret_cast<const char *>(sv.data()), sv.size(), rules) {}
+
+  parser(std::u8string_view sv)
+      : parser(reinterpret_cast<const char *>(sv.data()), sv.size(), Rules()) {}
+#endif
+
+  operator bool() { return grammar_ != nullptr; }
+
+  bool load_grammar(const char *s, size_t n, const Rules &rules) {
+    grammar_ = ParserGenerator::parse(s, n, rules, start_,
+                                      enablePackratParsing_, log_);
+    grammar_hash_ = grammar_text_hash(std::string_view(s, n));
+    return grammar_ != nullptr;
+  }
+
+  bool load_grammar(const char *s, size_t n) {
+    return load_grammar(s, n, Rules());
+  }
+
+  bool load_grammar(std::string_view sv, const Rules &rules) {
+    return load_grammar(sv.data(), sv.size(), rules);
+  }
+
+  bool load_grammar(std::string_view sv) {
+    return load_grammar(sv.data(), sv.size());
+  }
+
+  // Writes the loaded grammar as a snapshot keyed by its grammar text
+  bool save_snapshot(std::ostream &os) const {
+    if (grammar_ == nullptr) { return false; }
+    return GrammarSnapshot::save(os, *grammar_, start_, enablePackratParsing_,
+                                 grammar_hash_);
+  }
+
+  // Loads a snapshot written by save_snapshot. Fails if the snapshot was made
+  // from a different grammar text or by a different version, or is corrupt,
+  // in which case the caller should fall back to load_grammar.
+  bool load_snapshot(std::istream &is, std::string_view grammar_text,
+                     const Rules &rules = Rules()) {
+    std::string start;
+    bool enablePackratParsing = false;
+    auto grammar = GrammarSnapshot::load(is, grammar_text_hash(grammar_text),
+                                         rules, start, enablePackratParsing);
+    if (grammar == nullptr) { return false; }
+
+    grammar_ = grammar;
+    start_ = start;
+    enablePackratParsing_ = enablePackratParsing;
+    grammar_hash_ = grammar_text_hash(grammar_text);
+    return true;
+  }
+
+  // Loads a grammar built with the combinator API, such as the one returned by
+  // a function generated with emit_cpp. References are linked here, but the
+  // grammar is not checked.
+  bool load_grammar(const std::shared_ptr<Grammar> &grammar,
+                    const std::string &start,
+                    bool enablePackratParsing = true) {
+    if (grammar == nullptr || !grammar->count(start)) { return false; }
+    link_grammar(*grammar, start);
+    grammar_ = grammar;
+    start_ = start;
+    enablePackratParsing_ = enablePackratParsing;
+    return true;
+  }
+
+  // Writes a C++ header defining `function_name`, which returns a parser for
+  // the loaded grammar without parsing the grammar text. The parser runs a
+  // generated function for each rule it can, so changes made to the operators
+  // afterwards, as by enable_auto_cut, don't apply to those rules.
+  bool emit_cpp(std::ostream &os, const std::string &function_name) const {
+    if (grammar_ == nullptr) { return false; }
+    return CppEmitter::emit(os, *grammar_, start_, enablePackratParsing_,
+                            function_name);
+  }
+
+  bool parse_n(const char *s, size_t n, const char *path = nullptr) const {
+    if (grammar_ != nullptr) {
+      const auto &rule = (*grammar_)[start_];
+      auto result = parse_with_log(
+          [&](Log log) { return rule.parse(s, n, path, log); });
+      return post_process(s, n, result);
+    }
+    return false;
+  }
+
+  bool parse_n(const char *s, size_t n, std::any &dt,
+               const char *path = nullptr) const {
+    if (grammar_ != nullptr) {
+      const auto &rule = (*grammar_)[start_];
+      auto result = parse_with_log(
+          [&](Log log) { return rule.parse(s, n, dt, path, log); });
+      return post_process(s, n, result);
+    }
+    return false;
+  }
+
+  template <typename T>
+  bool parse_n(const char *s, size_t n, T &val,
+               const char *path = nullptr) const {
+    if (grammar_ != nullptr) {
+      const auto &rule = (*grammar_)[start_];
+      auto result = parse_with_log([&](Log log) {
+        return rule.parse_and_get_value(s, n, val, path, log);
+      });
+      return post_process(s, n, result);
+    }
+    return false;
+  }
+
+  template <typename T>
+  bool parse_n(const char *s, size_t n, std::any &dt, T &val,
+               const char *path = nullptr) const {
+    if (grammar_ != nullptr) {
+      const auto &rule = (*grammar_)[start_];
+      auto result = parse_with_log([&](Log log) {
+        return rule.parse_and_get_value(s, n, dt, val, path, log);
+      });
+      return post_process(s, n, result);
+    }
+    return false;
+  }
+
+  bool parse(std::string_view sv, const char *path = nullptr) const {
+    return parse_n(sv.data(), sv.size(), path);
+  }
+
+  bool parse(std::string_view sv, std::any &dt,
+             const char *path = nullptr) const {
+    return parse_n(sv.data(), sv.size(), dt, path);
+  }
+
+  template <typename T>
+  bool parse(std::string_view sv, T &val, const char *path = nullptr) const {
+    return parse_n(sv.data(), sv.size(), val, path);
+  }
+
+  template <typename T>
+  bool parse(std::string_view sv, std::any &dt, T &val,
+             const char *path = nullptr) const {
+    return parse_n(sv.data(), sv.size(), dt, val, path);
+  }
+
+#if defined(__cpp_lib_char8_t)
+  bool parse(std::u8string_view sv, const char *path = nullptr) const {
+    return parse_n(reinterpret_cast<const char *>(sv.data()), sv.size(), path);
+  }
 
-    g["Loop"] = [&](const SemanticValues &vs) {
-      switch (vs.choice()) {
-      case 0: // Option
-        return Loop{Loop::Type::opt, std::pair<size_t, size_t>()};
-      case 1: // Zero or More
-        return Loop{Loop::Type::zom, std::pair<size_t, size_t>()};
-      case 2: // One or More
-        return Loop{Loop::Type::oom, std::pair<size_t, size_t>()};
-      default: // Regex-like repetition
-        return Loop{Loop::Type::rep,
-                    std::any_cast<std::pair<size_t, size_t>>(vs[0])};
-      }
-    };
+  bool parse(std::u8string_view sv, std::any &dt,
+             const char *path = nullptr) const {
+    return parse_n(reinterpret_cast<const char *>(sv.data()), sv.size(), dt,
+                   path);
+  }
 
-    g["Primary"] = [&](const SemanticValues &vs, std::any &dt) {
-      auto &data = *std::any_cast<Data *>(dt);
+  template <typename T>
+  bool parse(std::u8string_view sv, T &val, const char *path = nullptr) const {
+    return parse_n(reinterpret_cast<const char *>(sv.data()), sv.size(), val,
+                   path);
+  }
 
-      switch (vs.choice()) {
-      case 0:   // Macro Reference
-      case 1: { // Reference
-        auto is_macro = vs.choice() == 0;
-        auto ignore = std::any_cast<bool>(vs[0]);
-        const auto &ident = std::any_cast<std::string>(vs[1]);
+  template <typename T>
+  bool parse(std::u8string_view sv, std::any &dt, T &val,
+             const char *path = nullptr) const {
+    return parse_n(reinterpret_cast<const char *>(sv.data()), sv.size(), dt,
+                   val, path);
+  }
+#endif
 
-        std::vector<std::shared_ptr<Ope>> args;
-        if (is_macro) {
-          args = std::any_cast<std::vector<std::shared_ptr<Ope>>>(vs[2]);
-        }
+  bool parse_incremental(ParseState &state, const std::vector<TextEdit> &edits,
+                         const char *path = nullptr) const {
+    std::any dt;
+    return parse_incremental(state, edits, dt, path);
+  }
 
-        auto ope = ref(*data.grammar, ident, vs.sv().data(), is_macro, args);
-        if (ident == RECOVER_DEFINITION_NAME) { ope = rec(ope); }
+  bool parse_incremental(ParseState &state, const std::vector<TextEdit> &edits,
+                         std::any &dt, const char *path = nullptr) const {
+    SemanticValues vs;
+    return parse_incremental_core(state, edits, vs, dt, path);
+  }
 
-        if (ignore) {
-          return ign(ope);
+  template <typename T>
+  bool parse_incremental(ParseState &state, const std::vector<TextEdit> &edits,
+                         T &val, const char *path = nullptr) const {
+    std::any dt;
+    return parse_incremental(state, edits, dt, val, path);
+  }
+
+  template <typename T>
+  bool parse_incremental(ParseState &state, const std::vector<TextEdit> &edits,
+                         std::any &dt, T &val,
+                         const char *path = nullptr) const {
+    SemanticValues vs;
+    auto ret = parse_incremental_core(state, edits, vs, dt, path);
+    if (ret && !vs.empty() && vs.front().has_value()) {
+      val = std::any_cast<T>(vs[0]);
+    }
+    return ret;
+  }
+
+  // Parses the input as a sequence of `record` matches. The input is split
+  // into chunks right after `delimiter` bytes and the chunks are parsed
+  // concurrently. Chunks which don't line up with the record boundaries of a
+  // serial parse (e.g. a delimiter inside a quoted field) are reparsed, and
+  // any failure is reported by a serial parse, so the result and the errors
+  // are the same as for a serial parse. Actions must be thread safe.
+  //
+  // Only the record rule and the rules it uses are run, as if the start rule
+  // were `record*`: the start rule's action, enter and leave handlers and
+  // recovery expressions are not. `record` must be reachable from the start
+  // rule. With packrat parsing, each chunk has its own memo.
+  template <typename T>
+  bool parse_records(std::string_view sv, const char *record, char delimiter,
+                     std::vector<T> &values, const char *path = nullptr) const {
+    return parse_records_core(
+        sv, record,
+        [&](size_t pos) -> size_t {
+          auto p = static_cast<const char *>(
+              std::memchr(sv.data() + pos, delimiter, sv.size() - pos));
+          return p ? static_cast<size_t>(p - sv.data()) + 1 : sv.size();
+        },
+        values, path);
+  }
+
+  // Same as above, but chunks start right after the first match of the
+  // `resync` rule. Use a predicate such as `&'{'` to start at the match.
+  template <typename T>
+  bool parse_records(std::string_view sv, const char *record,
+                     const char *resync, std::vector<T> &values,
+                     const char *path = nullptr) const {
+    if (grammar_ == nullptr || !grammar_->count(resync)) { return false; }
+
+    const auto &start = (*grammar_)[start_];
+    std::shared_ptr<Ope> ope = (*grammar_)[resync].holder_;
+
+    return parse_records_core(
+        sv, record,
+        [&](size_t pos) -> size_t {
+          Context c(path, sv.data(), sv.size(), 0, start.whitespaceOpe,
+                    start.wordOpe, false, nullptr, nullptr, std::any(), false,
+                    nullptr);
+          SemanticValues vs;
+          std::any dt;
+          for (; pos < sv.size(); pos++) {
+            auto len =
+                ope->parse(sv.data() + pos, sv.size() - pos, vs, c, dt);
+            if (success(len)) { return pos + len; }
+            vs.clear();
+          }
+          return sv.size();
+        },
+        values, path);
+  }
+
+  // Parses many independent inputs concurrently. Successful inputs are
+  // parsed without a logger; failed inputs are parsed again to collect their
+  // errors, so their actions run twice. Actions must be thread safe.
+  template <typename T = std::any>
+  BatchResult<T> parse_batch(const std::string_view *inputs, size_t count,
+                             const char *path = nullptr) const {
+    BatchResult<T> result;
+    result.success.resize(count);
+    result.lengths.resize(count);
+    result.values.resize(count);
+    result.errors.resize(count);
+
+    if (grammar_ == nullptr) { return result; }
+
+    const auto &rule = (*grammar_)[start_];
+
+    const size_t block_size = 256;
+    auto task_count = (count + block_size - 1) / block_size;
+
+    (executor_ ? executor_ : thread_executor)(task_count, [&](size_t k) {
+      thread_local std::vector<std::shared_ptr<SemanticValues>> scratch;
+
+      auto end = (std::min)(count, (k + 1) * block_size);
+      for (auto i = k * block_size; i < end; i++) {
+        auto s = inputs[i].data();
+        auto n = inputs[i].size();
+
+        SemanticValues vs;
+        std::any dt;
+        auto r = rule.parse_core(s, n, vs, dt, path, nullptr, nullptr,
+                                 &scratch);
+
+        result.success[i] = r.ret && !r.recovered;
+        result.lengths[i] = r.len;
+
+        if (result.success[i]) {
+          if (!vs.empty() && vs.front().has_value()) {
+            if constexpr (std::is_same_v<T, std::any>) {
+              result.values[i] = std::move(vs[0]);
+            } else {
+              result.values[i] = std::any_cast<T>(std::move(vs[0]));
+            }
+          }
         } else {
-          return ope;
+          auto &errors = result.errors[i];
+          Log log = [&](size_t line, size_t col, const std::string &msg,
+                        const std::string &rule_name) {
+            errors.push_back(ParseError{line, col, msg, rule_name});
+          };
+
+          SemanticValues dummy_vs;
+          r = rule.parse_core(s, n, dummy_vs, dt, path, log, nullptr,
+                              &scratch);
+          if (!r.ret) { r.error_info.output_log(log, s, n); }
         }
       }
-      case 2: { // (Expression)
-        return std::any_cast<std::shared_ptr<Ope>>(vs[0]);
-      }
-      case 3: { // TokenBoundary
-        return tok(std::any_cast<std::shared_ptr<Ope>>(vs[0]));
-      }
-      case 4: { // CaptureScope
-        return csc(std::any_cast<std::shared_ptr<Ope>>(vs[0]));
-      }
-      case 5: { // Capture
-        const auto &name = std::any_cast<std::string_view>(vs[0]);
-        auto ope = std::any_cast<std::shared_ptr<Ope>>(vs[1]);
+    });
 
-        data.captures_stack.back().insert(name);
-        data.captures_in_current_definition.insert(name);
+    return result;
+  }
 
-        return cap(ope, [name](const char *a_s, size_t a_n, Context &c) {
-          auto &cs = c.capture_scope_stack[c.capture_scope_stack_size - 1];
-          cs[name] = std::string(a_s, a_n);
-        });
-      }
-      default: {
-        return std::any_cast<std::shared_ptr<Ope>>(vs[0]);
-      }
-      }
-    };
+  template <typename T = std::any>
+  BatchResult<T> parse_batch(const std::vector<std::string_view> &inputs,
+                             const char *path = nullptr) const {
+    return parse_batch<T>(inputs.data(), inputs.size(), path);
+  }
 
-    g["IdentCont"] = [](const SemanticValues &vs) {
-      return std::string(vs.sv().data(), vs.sv().length());
-    };
+  // Experimental: parses a single document while worker threads parse the
+  // `resync` rule (e.g. the element rule of a top-level repetition) at every
+  // plausible position ahead of the serial parse. The serial parse takes a
+  // speculative result whenever it reaches the same rule at the same
+  // position, and ignores the rest. The resync rule and the rules it uses
+  // must not depend on parse state such as `dt`, captures or `enter`
+  // handlers, and their actions must be thread safe.
+  bool parse_speculative(std::string_view sv, const char *resync,
+                         const char *path = nullptr) const {
+    SemanticValues vs;
+    return parse_speculative_core(sv, resync, vs, path);
+  }
 
-    g["Dictionary"] = [](const SemanticValues &vs) {
-      auto items = vs.transform<std::string>();
-      return dic(items, false);
-    };
-    g["DictionaryI"] = [](const SemanticValues &vs) {
-      auto items = vs.transform<std::string>();
-      return dic(items, true);
-    };
+  template <typename T>
+  bool parse_speculative(std::string_view sv, const char *resync, T &val,
+                         const char *path = nullptr) const {
+    SemanticValues vs;
+    auto ret = parse_speculative_core(sv, resync, vs, path);
+    if (ret && !vs.empty() && vs.front().has_value()) {
+      val = std::any_cast<T>(vs[0]);
+    }
+    return ret;
+  }
 
-    g["Literal"] = [](const SemanticValues &vs) {
-      const auto &tok = vs.tokens.front();
-      return lit(resolve_escape_sequence(tok.data(), tok.size()));
-    };
-    g["LiteralI"] = [](const SemanticValues &vs) {
-      const auto &tok = vs.tokens.front();
-      return liti(resolve_escape_sequence(tok.data(), tok.size()));
-    };
-    g["LiteralD"] = [](const SemanticValues &vs) {
-      auto &tok = vs.tokens.front();
-      return resolve_escape_sequence(tok.data(), tok.size());
-    };
-    g["LiteralID"] = [](const SemanticValues &vs) {
-      auto &tok = vs.tokens.front();
-      return resolve_escape_sequence(tok.data(), tok.size());
-    };
+  void set_executor(Executor executor) { executor_ = executor; }
 
-    g["Class"] = [](const SemanticValues &vs) {
-      auto ranges = vs.transform<std::pair<char32_t, char32_t>>();
-      return cls(ranges);
-    };
-    g["ClassI"] = [](const SemanticValues &vs) {
-      auto ranges = vs.transform<std::pair<char32_t, char32_t>>();
-      return cls(ranges, true);
-    };
-    g["NegatedClass"] = [](const SemanticValues &vs) {
-      auto ranges = vs.transform<std::pair<char32_t, char32_t>>();
-      return ncls(ranges);
-    };
-    g["NegatedClassI"] = [](const SemanticValues &vs) {
-      auto ranges = vs.transform<std::pair<char32_t, char32_t>>();
-      return ncls(ranges, true);
-    };
-    g["Range"] = [](const SemanticValues &vs) {
-      switch (vs.choice()) {
-      case 0: {
-        auto s1 = std::any_cast<std::string>(vs[0]);
-        auto s2 = std::any_cast<std::string>(vs[1]);
-        auto cp1 = decode_codepoint(s1.data(), s1.length());
-        auto cp2 = decode_codepoint(s2.data(), s2.length());
-        return std::pair(cp1, cp2);
-      }
-      case 1: {
-        auto s = std::any_cast<std::string>(vs[0]);
-        auto cp = decode_codepoint(s.data(), s.length());
-        return std::pair(cp, cp);
-      }
-      }
-      return std::pair<char32_t, char32_t>(0, 0);
+  void set_parallel_chunk_size(size_t size) { chunk_size_ = size; }
+
+  Definition &operator[](const char *s) { return (*grammar_)[s]; }
+
+  const Definition &operator[](const char *s) const { return (*grammar_)[s]; }
+
+  const Grammar &get_grammar() const { return *grammar_; }
+
+  void disable_eoi_check() {
+    if (grammar_ != nullptr) {
+      auto &rule = (*grammar_)[start_];
+      rule.eoi_check = false;
+    }
+  }
+
+  // Rejects input that isn't valid UTF-8 before parsing, with an error at
+  // the first invalid sequence. Without it, invalid sequences don't match
+  // any character class, negated or not.
+  void enable_utf8_check() {
+    if (grammar_ != nullptr) {
+      auto &rule = (*grammar_)[start_];
+      rule.utf8_check = true;
+    }
+  }
+
+  void enable_packrat_parsing() {
+    if (grammar_ != nullptr) {
+      auto &rule = (*grammar_)[start_];
+      rule.enablePackratParsing = enablePackratParsing_ && true;
+    }
+  }
+
+  void enable_trace(TracerEnter tracer_enter, TracerLeave tracer_leave) {
+    if (grammar_ != nullptr) {
+      auto &rule = (*grammar_)[start_];
+      rule.tracer_enter = tracer_enter;
+      rule.tracer_leave = tracer_leave;
+    }
+  }
+
+  void enable_trace(TracerEnter tracer_enter, TracerLeave tracer_leave,
+                    TracerStartOrEnd tracer_start,
+                    TracerStartOrEnd tracer_end) {
+    if (grammar_ != nullptr) {
+      auto &rule = (*grammar_)[start_];
+      rule.tracer_enter = tracer_enter;
+      rule.tracer_leave = tracer_leave;
+      rule.tracer_start = tracer_start;
+      rule.tracer_end = tracer_end;
+    }
+  }
+
+  // Inserts cuts into choices where they can't change what the grammar
+  // accepts, so failing alternatives give up without trying the rest of the
+  // choice. `enter` and `leave` handlers of rules in the skipped alternatives
+  // are not called any more, and with packrat parsing, a cut in the outermost
+  // choice frees the memo entries before it. Positions come from
+  // `grammar_text` when it is the text the grammar was loaded from.
+  std::vector<AutoCut>
+  enable_auto_cut(std::string_view grammar_text = std::string_view()) {
+    if (grammar_ == nullptr) { return {}; }
+    return CutInserter(grammar_text).insert(*grammar_);
+  }
+
+  // Aggregates parse and rule counts and parse latency into `registry`,
+  // which must outlive the parser's use of it.
+  void enable_metrics(MetricsRegistry &registry) {
+    if (grammar_ != nullptr) {
+      auto &rule = (*grammar_)[start_];
+      registry.set_rule_names(rule.rule_names());
+      rule.metrics = &registry;
+    }
+  }
+
+  // Parses without error bookkeeping first, and parses again with it only
+  // when the input has errors. Actions and enter/leave handlers run again in
+  // that case, so they should not depend on running once.
+  void enable_two_pass_errors() { two_pass_errors_ = true; }
+
+  void set_verbose_trace(bool verbose_trace) {
+    if (grammar_ != nullptr) {
+      auto &rule = (*grammar_)[start_];
+      rule.verbose_trace = verbose_trace;
+    }
+  }
+
+  template <typename T = Ast> parser &enable_ast() {
+    for (auto &[_, rule] : *grammar_) {
+      if (!rule.action) { add_ast_action<T>(rule); }
+    }
+    return *this;
+  }
+
+  template <typename T>
+  std::shared_ptr<T> optimize_ast(std::shared_ptr<T> ast,
+                                  bool opt_mode = true) const {
+    return AstOptimizer(opt_mode, get_no_ast_opt_rules()).optimize(ast);
+  }
+
+  void set_logger(Log log) { log_ = log; }
+
+  void set_logger(
+      std::function<void(size_t line, size_t col, const std::string &msg)>
+          log) {
+    log_ = [log](size_t line, size_t col, const std::string &msg,
+                 const std::string & /*rule*/) { log(line, col, msg); };
+  }
+
+private:
+  template <typename F> Definition::Result parse_with_log(F parse) const {
+    if (two_pass_errors_ && log_) {
+      auto r = parse(nullptr);
+      if (r.ret && !r.recovered) { return r; }
+    }
+    return parse(log_);
+  }
+
+  bool post_process(const char *s, size_t n, Definition::Result &r) const {
+    if (log_ && !r.ret) { r.error_info.output_log(log_, s, n); }
+    return r.ret && !r.recovered;
+  }
+
+  bool parse_incremental_core(ParseState &state,
+                              const std::vector<TextEdit> &edits,
+                              SemanticValues &vs, std::any &dt,
+                              const char *path) const {
+    if (grammar_ == nullptr) { return false; }
+
+    state.apply_edits(edits);
+
+    const auto &rule = (*grammar_)[start_];
+    const auto &text = state.text();
+
+    // Memo entries can only be reused when the grammar allows packrat parsing
+    auto result = rule.parse_core(text.data(), text.size(), vs, dt, path, log_,
+                                  enablePackratParsing_ ? &state : nullptr);
+
+    // Reused entries don't replay error bookkeeping, so diagnostics come from
+    // a regular parse.
+    if (!result.ret && log_ && enablePackratParsing_) {
+      SemanticValues dummy_vs;
+      result =
+          rule.parse_core(text.data(), text.size(), dummy_vs, dt, path, log_);
+    }
+
+    return post_process(text.data(), text.size(), result);
+  }
+
+  template <typename T>
+  static void take_values(SemanticValues &vs, std::vector<T> &values) {
+    for (auto &v : vs) {
+      if (v.has_value()) { values.push_back(std::any_cast<T>(std::move(v))); }
+    }
+    vs.clear();
+  }
+
+  template <typename T, typename F>
+  bool parse_records_core(std::string_view sv, const char *record,
+                          F find_boundary, std::vector<T> &values,
+                          const char *path) const {
+    if (grammar_ == nullptr || !grammar_->count(record)) { return false; }
+
+    const auto &start = (*grammar_)[start_];
+    const auto &rule = (*grammar_)[record];
+
+    // Packrat parsing indexes the memo by the ids of the rules reachable from
+    // the start rule
+    start.initialize_definition_ids();
+    if (!start.definition_ids_.count(
+            static_cast<void *>(const_cast<Definition *>(&rule)))) {
+      return false;
+    }
+    auto s = sv.data();
+    auto n = sv.size();
+
+    auto parse_serial = [&](size_t pos, size_t end, std::vector<T> &out,
+                            Log log) {
+      SemanticValues vs;
+      std::any dt;
+      auto r = rule.parse_records_core(s, n, pos, end, vs, dt, path, log,
+                                       start);
+      if (r.ret && !r.recovered) { take_values(vs, out); }
+      return r;
     };
-    g["Char"] = [](const SemanticValues &vs) {
-      return resolve_escape_sequence(vs.sv().data(), vs.sv().length());
+
+    auto full_serial = [&]() {
+      values.clear();
+      auto r = parse_serial(0, n, values, log_);
+      return post_process(s, n, r);
     };
 
-    g["RepetitionRange"] = [&](const SemanticValues &vs) {
-      switch (vs.choice()) {
-      case 0: { // Number COMMA Number
-        auto min = std::any_cast<size_t>(vs[0]);
-        auto max = std::any_cast<size_t>(vs[1]);
-        return std::pair(min, max);
-      }
-      case 1: // Number COMMA
-        return std::pair(std::any_cast<size_t>(vs[0]),
-                         std::numeric_limits<size_t>::max());
-      case 2: { // Number
-        auto n = std::any_cast<size_t>(vs[0]);
-        return std::pair(n, n);
+    auto chunk_count = chunk_size_ ? n / chunk_size_ : 0;
+    if (chunk_count <= 1) { return full_serial(); }
+
+    struct Chunk {
+      size_t begin = 0;
+      size_t end = 0;
+      size_t last = 0;
+      bool ok = false;
+      std::vector<T> values;
+    };
+    std::vector<Chunk> chunks(chunk_count);
+
+    (executor_ ? executor_ : thread_executor)(chunk_count, [&](size_t k) {
+      auto &chunk = chunks[k];
+      chunk.begin = k == 0 ? 0 : find_boundary(n / chunk_count * k);
+      chunk.end = k + 1 == chunk_count
+                      ? n
+                      : find_boundary(n / chunk_count * (k + 1));
+      if (chunk.begin < chunk.end) {
+        auto r = parse_serial(chunk.begin, chunk.end, chunk.values, nullptr);
+        chunk.ok = r.ret && !r.recovered;
+        chunk.last = r.len;
+      } else {
+        chunk.ok = true;
+        chunk.last = chunk.begin;
       }
-      default: // COMMA Number
-        return std::pair(std::numeric_limits<size_t>::min(),
-                         std::any_cast<size_t>(vs[0]));
+    });
+
+    // Stitch the chunks together in order. A chunk can be used as-is only if
+    // the previous record ended exactly where the chunk begins; otherwise the
+    // gap up to the end of the chunk is parsed serially.
+    values.clear();
+    size_t pos = 0;
+    for (auto &chunk : chunks) {
+      if (chunk.ok && chunk.begin == pos) {
+        std::move(chunk.values.begin(), chunk.values.end(),
+                  std::back_inserter(values));
+        pos = chunk.last;
+      } else if (pos < chunk.end) {
+        auto r = parse_serial(pos, chunk.end, values, nullptr);
+        if (!r.ret || r.recovered) { return full_serial(); }
+        pos = r.len;
       }
-    };
-    g["Number"] = [&](const SemanticValues &vs) {
-      return vs.token_to_number<size_t>();
-    };
+    }
+    return true;
+  }
 
-    g["CapScope"].enter = [](const Context & /*c*/, const char * /*s*/,
-                             size_t /*n*/, std::any &dt) {
-      auto &data = *std::any_cast<Data *>(dt);
-      data.captures_stack.emplace_back();
-    };
-    g["CapScope"].leave = [](const Context & /*c*/, const char * /*s*/,
-                             size_t /*n*/, size_t /*matchlen*/,
-                             std::any & /*value*/, std::any &dt) {
-      auto &data = *std::any_cast<Data *>(dt);
-      data.captures_stack.pop_back();
-    };
+  bool parse_speculative_core(std::string_view sv, const char *resync,
+                              SemanticValues &vs, const char *path) const {
+    if (grammar_ == nullptr || !grammar_->count(resync)) { return false; }
 
-    g["AND"] = [](const SemanticValues &vs) { return *vs.sv().data(); };
-    g["NOT"] = [](const SemanticValues &vs) { return *vs.sv().data(); };
-    g["QUESTION"] = [](const SemanticValues &vs) { return *vs.sv().data(); };
-    g["STAR"] = [](const SemanticValues &vs) { return *vs.sv().data(); };
-    g["PLUS"] = [](const SemanticValues &vs) { return *vs.sv().data(); };
+    const auto &start = (*grammar_)[start_];
+    const auto &rule = (*grammar_)[resync];
+    auto s = sv.data();
+    auto n = sv.size();
+    std::any dt;
 
-    g["DOT"] = [](const SemanticValues & /*vs*/) { return dot(); };
+    auto chunk_count = chunk_size_ ? (n + chunk_size_ - 1) / chunk_size_ : 0;
+
+    // Parse serially where speculating can't help or isn't sound:
+    // - A speculative result is reused like a memo entry, so it is only
+    //   valid where memoizing is. The grammar disables packrat parsing when
+    //   a back reference can refer to a capture made in another rule, since
+    //   the result would then depend on text before the chunk.
+    // - A macro has no body of its own to parse ahead of the serial parse.
+    // - With a single hardware thread and no executor, nothing runs
+    //   alongside the serial parse.
+    if (chunk_count <= 1 || !enablePackratParsing_ || rule.is_macro ||
+        (!executor_ && std::thread::hardware_concurrency() <= 1)) {
+      auto r = start.parse_core(s, n, vs, dt, path, log_);
+      return post_process(s, n, r);
+    }
 
-    g["CUT"] = [](const SemanticValues & /*vs*/) { return cut(); };
+    Speculation speculation(&rule, chunk_size_, chunk_count);
 
-    g["BeginCap"] = [](const SemanticValues &vs) { return vs.token(); };
+    Definition::Result result{};
+    std::shared_ptr<Ope> ope = rule.holder_;
 
-    g["BackRef"] = [&](const SemanticValues &vs, std::any &dt) {
-      auto &data = *std::any_cast<Data *>(dt);
+    // Task 0 is the serial parse. Chunk 0 is never speculated on, since the
+    // serial parse starts there anyway.
+    (executor_ ? executor_ : thread_executor)(chunk_count, [&](size_t k) {
+      if (k == 0) {
+        result = start.parse_core(s, n, vs, dt, path, nullptr, nullptr,
+                                  nullptr, &speculation);
+        return;
+      }
 
-      // Undefined back reference check
-      {
-        auto found = false;
-        auto it = data.captures_stack.rbegin();
-        while (it != data.captures_stack.rend()) {
-          if (it->find(vs.token()) != it->end()) {
-            found = true;
-            break;
-          }
-          ++it;
-        }
-        if (!found) {
-          auto ptr = vs.token().data() - 1; // include '$' symbol
-          data.undefined_back_references.emplace_back(vs.token(), ptr);
+      auto &chunk = speculation.chunks[k];
+      auto se = scope_exit(
+          [&]() { chunk.done.store(true, std::memory_order_release); });
+
+      Context c(path, s, n, 0, start.whitespaceOpe, start.wordOpe, false,
+                nullptr, nullptr, std::any(), false, nullptr);
+      SemanticValues chunk_vs;
+      std::any chunk_dt;
+
+      auto end = (std::min)(n, (k + 1) * chunk_size_);
+      for (auto pos = k * chunk_size_; pos < end;) {
+        auto len = ope->parse(s + pos, n - pos, chunk_vs, c, chunk_dt);
+        if (success(len) && len > 0) {
+          chunk.fragments.push_back(Speculation::Fragment{
+              pos, len,
+              chunk_vs.empty() ? std::any() : std::move(chunk_vs.back())});
+          pos += len;
+        } else {
+          pos++;
         }
+        chunk_vs.clear();
       }
+    });
 
-      // NOTE: Disable packrat parsing if a back reference is not defined in
-      // captures in the current definition rule.
-      if (data.captures_in_current_definition.find(vs.token()) ==
-          data.captures_in_current_definition.end()) {
-        data.enablePackratParsing = false;
-      }
+    // Speculative results don't carry error bookkeeping, so diagnostics come
+    // from a regular parse.
+    if (!result.ret && log_) {
+      vs.clear();
+      result = start.parse_core(s, n, vs, dt, path, log_);
+    }
 
-      return bkr(vs.token_to_string());
-    };
+    return post_process(s, n, result);
+  }
 
-    g["Ignore"] = [](const SemanticValues &vs) { return vs.size() > 0; };
+  std::vector<std::string> get_no_ast_opt_rules() const {
+    std::vector<std::string> rules;
+    for (auto &[name, rule] : *grammar_) {
+      if (rule.no_ast_opt) { rules.push_back(name); }
+    }
+    return rules;
+  }
 
-    g["Parameters"] = [](const SemanticValues &vs) {
-      return vs.transform<std::string>();
-    };
+#ifndef CPPPEGLIB_DISABLE_TRACE
+  friend SlowInput find_slow_input(parser &parser,
+                                   const std::vector<std::string> &seeds,
+                                   SlowInputOptions options);
+#endif
 
-    g["Arguments"] = [](const SemanticValues &vs) {
-      return vs.transform<std::shared_ptr<Ope>>();
-    };
+  std::shared_ptr<Grammar> grammar_;
+  std::string start_;
+  bool enablePackratParsing_ = false;
+  Log log_;
+  bool two_pass_errors_ = false;
+  Executor executor_;
+  size_t chunk_size_ = 1024 * 1024;
+  uint64_t grammar_hash_ = 0;
+};
 
-    g["PrecedenceClimbing"] = [](const SemanticValues &vs) {
-      PrecedenceClimbing::BinOpeInfo binOpeInfo;
-      size_t level = 1;
-      for (auto v : vs) {
-        auto tokens = std::any_cast<std::vector<std::string_view>>(v);
-        auto assoc = tokens[0][0];
-        for (size_t i = 1; i < tokens.size(); i++) {
-          binOpeInfo[tokens[i]] = std::pair(level, assoc);
+/*-----------------------------------------------------------------------------
+ *  enable_tracing
+ *---------------------------------------------------------------------------*/
+
+inline void enable_tracing(parser &parser, std::ostream &os) {
+  parser.enable_trace(
+      [&](auto &ope, auto s, auto, auto &, auto &c, auto &, auto &trace_data) {
+        auto prev_pos = std::any_cast<size_t>(trace_data);
+        auto pos = static_cast<size_t>(s - c.s);
+        auto backtrack = (pos < prev_pos ? "*" : "");
+        std::string indent;
+        auto level = c.trace_ids.size() - 1;
+        while (level--) {
+          indent += "│";
         }
-        level++;
-      }
-      Instruction instruction;
-      instruction.type = "precedence";
-      instruction.data = binOpeInfo;
-      instruction.sv = vs.sv();
-      return instruction;
-    };
-    g["PrecedenceInfo"] = [](const SemanticValues &vs) {
-      return vs.transform<std::string_view>();
-    };
-    g["PrecedenceOpe"] = [](const SemanticValues &vs) { return vs.token(); };
-    g["PrecedenceAssoc"] = [](const SemanticValues &vs) { return vs.token(); };
+        std::string name;
+        {
+          name = peg::TraceOpeName::get(const_cast<peg::Ope &>(ope));
 
-    g["ErrorMessage"] = [](const SemanticValues &vs) {
-      Instruction instruction;
-      instruction.type = "error_message";
-      instruction.data = std::any_cast<std::string>(vs[0]);
-      instruction.sv = vs.sv();
-      return instruction;
-    };
+          auto lit = dynamic_cast<const peg::LiteralString *>(&ope);
+          if (lit) { name += " '" + peg::escape_characters(lit->lit_) + "'"; }
+        }
+        os << "E " << pos + 1 << backtrack << "\t" << indent << "┌" << name
+           << " #" << c.trace_ids.back() << std::endl;
+        trace_data = static_cast<size_t>(pos);
+      },
+      [&](auto &ope, auto s, auto, auto &sv, auto &c, auto &, auto len,
+          auto &) {
+        auto pos = static_cast<size_t>(s - c.s);
+        if (len != static_cast<size_t>(-1)) { pos += len; }
+        std::string indent;
+        auto level = c.trace_ids.size() - 1;
+        while (level--) {
+          indent += "│";
+        }
+        auto ret = len != static_cast<size_t>(-1) ? "└o " : "└x ";
+        auto name = peg::TraceOpeName::get(const_cast<peg::Ope &>(ope));
+        std::stringstream choice;
+        if (sv.choice_count() > 0) {
+          choice << " " << sv.choice() << "/" << sv.choice_count();
+        }
+        std::string token;
+        if (!sv.tokens.empty()) {
+          token += ", token '";
+          token += sv.tokens[0];
+          token += "'";
+        }
+        std::string matched;
+        if (peg::success(len) &&
+            peg::TokenChecker::is_token(const_cast<peg::Ope &>(ope))) {
+          matched = ", match '" + peg::escape_characters(s, len) + "'";
+        }
+        os << "L " << pos + 1 << "\t" << indent << ret << name << " #"
+           << c.trace_ids.back() << choice.str() << token << matched
+           << std::endl;
+      },
+      [&](auto &trace_data) { trace_data = static_cast<size_t>(0); },
+      [&](auto &) {});
+}
 
-    g["NoAstOpt"] = [](const SemanticValues &vs) {
-      Instruction instruction;
-      instruction.type = "no_ast_opt";
-      instruction.sv = vs.sv();
-      return instruction;
-    };
+/*-----------------------------------------------------------------------------
+ *  enable_binary_tracing
+ *---------------------------------------------------------------------------*/
 
-    g["Instruction"] = [](const SemanticValues &vs) {
-      return vs.transform<Instruction>();
-    };
+class BinaryTrace;
+
+inline void enable_binary_tracing(parser &parser, BinaryTrace &trace);
+
+// Records trace events of the last parse as fixed-size binary records in a
+// preallocated ring buffer. When the buffer is full, the oldest events are
+// overwritten. Recording can be limited to the parts of the parse inside
+// given rules and to a range of input offsets. `decode` prints the events in
+// the format of enable_tracing, without the captured token of each step.
+//
+// Offsets and lengths are stored in 32 bits.
+class BinaryTrace {
+public:
+  enum Kind : uint8_t { Enter, Leave };
+
+  struct Event {
+    uint32_t id;  // trace id, as in enable_tracing
+    uint32_t ope; // index into operators()
+    uint32_t pos;
+    uint32_t len; // matched length on leave, 0xffffffff on failure
+    uint16_t depth;
+    uint16_t choice;
+    uint16_t choice_count;
+    uint8_t kind;
+    uint8_t reserved;
+  };
+  static_assert(sizeof(Event) == 24);
+
+  struct Operator {
+    std::string name;
+    bool is_token = false;
+    bool is_literal = false;
+    std::string literal; // escaped
+  };
+
+  explicit BinaryTrace(size_t capacity = 1024 * 1024)
+      : events_(capacity ? capacity : 1) {}
+
+  // Records only operators that run inside one of these rules. An empty list
+  // records everything.
+  void set_rule_filter(std::vector<std::string> rules) {
+    rule_filter_ = std::move(rules);
+    opes_.clear();
+    operators_.clear();
   }
 
-  bool apply_precedence_instruction(Definition &rule,
-                                    const PrecedenceClimbing::BinOpeInfo &info,
-                                    const char *s, Log log) {
-    try {
-      auto &seq = dynamic_cast<Sequence &>(*rule.get_core_operator());
-      auto atom = seq.opes_[0];
-      auto &rep = dynamic_cast<Repetition &>(*seq.opes_[1]);
-      auto &seq1 = dynamic_cast<Sequence &>(*rep.ope_);
-      auto binop = seq1.opes_[0];
-      auto atom1 = seq1.opes_[1];
+  // Records only operators that start at an offset in [begin, end).
+  void set_range_filter(size_t begin, size_t end) {
+    begin_ = begin;
+    end_ = end;
+  }
 
-      auto atom_name = dynamic_cast<Reference &>(*atom).name_;
-      auto binop_name = dynamic_cast<Reference &>(*binop).name_;
-      auto atom1_name = dynamic_cast<Reference &>(*atom1).name_;
+  const std::vector<Operator> &operators() const { return operators_; }
 
-      if (!rep.is_zom() || atom_name != atom1_name || atom_name == binop_name) {
-        if (log) {
-          auto line = line_info(s, rule.s_);
-          log(line.first, line.second,
-              "'precedence' instruction cannot be applied to '" + rule.name +
-                  "'.",
-              "");
-        }
-        return false;
-      }
+  // Recorded events, oldest first
+  std::vector<Event> events() const {
+    std::vector<Event> events;
+    auto capacity = events_.size();
+    if (count_ <= capacity) {
+      events.assign(events_.begin(), events_.begin() + count_);
+    } else {
+      auto next = count_ % capacity;
+      events.assign(events_.begin() + next, events_.end());
+      events.insert(events.end(), events_.begin(), events_.begin() + next);
+    }
+    return events;
+  }
 
-      rule.holder_->ope_ = pre(atom, binop, info, rule);
-      rule.disable_action = true;
-    } catch (...) {
-      if (log) {
-        auto line = line_info(s, rule.s_);
-        log(line.first, line.second,
-            "'precedence' instruction cannot be applied to '" + rule.name +
-                "'.",
-            "");
+  // Number of events overwritten because the buffer was full
+  uint64_t dropped() const {
+    return count_ > events_.size() ? count_ - events_.size() : 0;
+  }
+
+  void save(std::ostream &os) const {
+    auto put = [&](const auto &v) {
+      os.write(reinterpret_cast<const char *>(&v), sizeof(v));
+    };
+
+    os.write(magic, sizeof(magic));
+    put(static_cast<uint32_t>(operators_.size()));
+    for (const auto &ope : operators_) {
+      put(static_cast<uint8_t>(ope.is_token | (ope.is_literal << 1)));
+      for (const auto &str : {ope.name, ope.literal}) {
+        put(static_cast<uint32_t>(str.size()));
+        os.write(str.data(), static_cast<std::streamsize>(str.size()));
       }
-      return false;
     }
-    return true;
+    auto events = this->events();
+    put(static_cast<uint64_t>(events.size()));
+    os.write(reinterpret_cast<const char *>(events.data()),
+             static_cast<std::streamsize>(events.size() * sizeof(Event)));
   }
 
-  std::shared_ptr<Grammar> perform_core(const char *s, size_t n,
-                                        const Rules &rules, std::string &start,
-                                        bool &enablePackratParsing, Log log) {
-    Data data;
-    auto &grammar = *data.grammar;
+  // Reads a trace written by save. Returns false, leaving this trace as it
+  // was, if the stream isn't seekable or doesn't hold a valid trace.
+  bool load(std::istream &is) {
+    auto get = [&](auto &v) {
+      return !!is.read(reinterpret_cast<char *>(&v), sizeof(v));
+    };
 
-    // Built-in macros
-    {
-      // `%recover`
-      {
-        auto &rule = grammar[RECOVER_DEFINITION_NAME];
-        rule <= ref(grammar, "x", "", false, {});
-        rule.name = RECOVER_DEFINITION_NAME;
-        rule.s_ = "[native]";
-        rule.ignoreSemanticValue = true;
-        rule.is_macro = true;
-        rule.params = {"x"};
+    // Sizes stored in the file are checked against what is left of the
+    // stream, so a truncated or corrupt file can't make us allocate more
+    auto start = is.tellg();
+    if (start < 0 || !is.seekg(0, std::ios::end)) { return false; }
+    auto end = is.tellg();
+    if (end < 0 || !is.seekg(start)) { return false; }
+    auto left = [&]() { return static_cast<uint64_t>(end - is.tellg()); };
+
+    char buf[sizeof(magic)];
+    if (!is.read(buf, sizeof(buf)) || memcmp(buf, magic, sizeof(buf))) {
+      return false;
+    }
+
+    uint32_t ope_count;
+    if (!get(ope_count)) { return false; }
+    // Each operator takes at least a flags byte and two string sizes
+    if (ope_count > left() / 9) { return false; }
+    std::vector<Operator> operators(ope_count);
+    for (auto &ope : operators) {
+      uint8_t flags;
+      if (!get(flags)) { return false; }
+      ope.is_token = flags & 1;
+      ope.is_literal = flags & 2;
+      for (auto str : {&ope.name, &ope.literal}) {
+        uint32_t size;
+        if (!get(size) || size > left()) { return false; }
+        str->resize(size);
+        if (!is.read(str->data(), size)) { return false; }
       }
     }
 
-    std::any dt = &data;
-    auto r = g["Grammar"].parse(s, n, dt, nullptr, log);
+    uint64_t count;
+    if (!get(count) || count > left() / sizeof(Event)) { return false; }
+    std::vector<Event> events(count ? count : 1);
+    if (!is.read(reinterpret_cast<char *>(events.data()),
+                 static_cast<std::streamsize>(count * sizeof(Event)))) {
+      return false;
+    }
+    for (size_t i = 0; i < count; i++) {
+      if (events[i].ope >= operators.size()) { return false; }
+    }
 
-    if (!r.ret) {
-      if (log) {
-        if (r.error_info.message_pos) {
-          auto line = line_info(s, r.error_info.message_pos);
-          log(line.first, line.second, r.error_info.message,
-              r.error_info.label);
-        } else {
-          auto line = line_info(s, r.error_info.error_pos);
-          log(line.first, line.second, "syntax error", r.error_info.label);
+    operators_.swap(operators);
+    events_.swap(events);
+    count_ = count;
+    return true;
+  }
+
+  // Prints the events like enable_tracing. `source` is the parsed text,
+  // which is needed to show what tokens matched.
+  void decode(std::ostream &os, std::string_view source = {}) const {
+    uint32_t prev_pos = 0;
+    for (const auto &e : events()) {
+      std::string indent;
+      for (auto level = 1; level < e.depth; level++) {
+        indent += "│";
+      }
+      assert(e.ope < operators_.size()); // checked by load
+      const auto &ope = operators_[e.ope];
+      if (e.kind == Enter) {
+        auto backtrack = (e.pos < prev_pos ? "*" : "");
+        os << "E " << e.pos + 1 << backtrack << "\t" << indent << "┌"
+           << ope.name;
+        if (ope.is_literal) { os << " '" << ope.literal << "'"; }
+        os << " #" << e.id << "\n";
+        prev_pos = e.pos;
+      } else {
+        auto success = e.len != fail_len;
+        auto pos = success ? e.pos + e.len : e.pos;
+        os << "L " << pos + 1 << "\t" << indent << (success ? "└o " : "└x ")
+           << ope.name << " #" << e.id;
+        if (e.choice_count > 0) {
+          os << " " << e.choice << "/" << e.choice_count;
+        }
+        if (success && ope.is_token &&
+            size_t(e.pos) + e.len <= source.size()) {
+          os << ", match '"
+             << escape_characters(source.data() + e.pos, e.len) << "'";
         }
+        os << "\n";
       }
-      return nullptr;
     }
+  }
 
-    // User provided rules
-    for (auto [user_name, user_rule] : rules) {
-      auto name = user_name;
-      auto ignore = false;
-      if (!name.empty() && name[0] == '~') {
-        ignore = true;
-        name.erase(0, 1);
-      }
-      if (!name.empty()) {
-        auto &rule = grammar[name];
-        rule <= user_rule;
-        rule.name = name;
-        rule.ignoreSemanticValue = ignore;
-      }
+private:
+  friend void enable_binary_tracing(parser &parser, BinaryTrace &trace);
+
+  static constexpr char magic[8] = {'P', 'E', 'G', 'T', 'R', 'C', '0', '1'};
+  static constexpr uint32_t fail_len = 0xffffffff;
+
+  struct OpeInfo {
+    uint32_t index;
+    bool in_rule_filter;
+  };
+
+  void clear() {
+    count_ = 0;
+    inside_depth_ = 0;
+  }
+
+  const OpeInfo &info(const Ope &ope) {
+    auto it = opes_.find(&ope);
+    if (it != opes_.end()) { return it->second; }
+
+    auto &o = const_cast<Ope &>(ope);
+    Operator op;
+    op.name = TraceOpeName::get(o);
+    op.is_token = TokenChecker::is_token(o);
+    if (auto lit = dynamic_cast<const LiteralString *>(&ope)) {
+      op.is_literal = true;
+      op.literal = escape_characters(lit->lit_);
     }
 
-    // Check duplicated definitions
-    auto ret = true;
+    auto in_rule_filter = false;
+    if (auto holder = dynamic_cast<const Holder *>(&ope)) {
+      in_rule_filter = std::find(rule_filter_.begin(), rule_filter_.end(),
+                                 holder->name()) != rule_filter_.end();
+    }
 
-    if (!data.duplicates_of_definition.empty()) {
-      for (const auto &[name, ptr] : data.duplicates_of_definition) {
-        if (log) {
-          auto line = line_info(s, ptr);
-          log(line.first, line.second,
-              "The definition '" + name + "' is already defined.", "");
-        }
-      }
-      ret = false;
+    auto index = static_cast<uint32_t>(operators_.size());
+    operators_.push_back(std::move(op));
+    return opes_.emplace(&ope, OpeInfo{index, in_rule_filter}).first->second;
+  }
+
+  void record(const Event &e) {
+    events_[count_ % events_.size()] = e;
+    count_++;
+  }
+
+  void enter(const Ope &ope, size_t pos, size_t depth, size_t id) {
+    const auto &i = info(ope);
+    if (!rule_filter_.empty() && !inside_depth_) {
+      if (!i.in_rule_filter) { return; }
+      inside_depth_ = depth;
     }
+    if (pos < begin_ || pos >= end_) { return; }
+    record(Event{static_cast<uint32_t>(id), i.index,
+                 static_cast<uint32_t>(pos), 0, static_cast<uint16_t>(depth),
+                 0, 0, Enter, 0});
+  }
 
-    // Check duplicated instructions
-    if (!data.duplicates_of_instruction.empty()) {
-      for (const auto &[type, ptr] : data.duplicates_of_instruction) {
-        if (log) {
-          auto line = line_info(s, ptr);
-          log(line.first, line.second,
-              "The instruction '" + type + "' is already defined.", "");
-        }
-      }
-      ret = false;
+  void leave(const Ope &ope, size_t pos, size_t len, size_t depth, size_t id,
+             const SemanticValues &vs) {
+    if (!rule_filter_.empty()) {
+      if (!inside_depth_) { return; }
+      if (depth == inside_depth_) { inside_depth_ = 0; }
     }
+    if (pos < begin_ || pos >= end_) { return; }
+    record(Event{static_cast<uint32_t>(id), info(ope).index,
+                 static_cast<uint32_t>(pos),
+                 success(len) ? static_cast<uint32_t>(len) : fail_len,
+                 static_cast<uint16_t>(depth),
+                 static_cast<uint16_t>(vs.choice_count() > 0 ? vs.choice() : 0),
+                 static_cast<uint16_t>(vs.choice_count()), Leave, 0});
+  }
+
+  std::vector<Event> events_;
+  uint64_t count_ = 0;
+  std::vector<Operator> operators_;
+  std::unordered_map<const Ope *, OpeInfo> opes_;
+  std::vector<std::string> rule_filter_;
+  size_t inside_depth_ = 0;
+  size_t begin_ = 0;
+  size_t end_ = static_cast<size_t>(-1);
+};
 
-    // Check undefined back references
-    if (!data.undefined_back_references.empty()) {
-      for (const auto &[name, ptr] : data.undefined_back_references) {
-        if (log) {
-          auto line = line_info(s, ptr);
-          log(line.first, line.second,
-              "The back reference '" + name + "' is undefined.", "");
+inline void enable_binary_tracing(parser &parser, BinaryTrace &trace) {
+  parser.enable_trace(
+      [&trace](auto &ope, auto s, auto, auto &, auto &c, auto &, auto &) {
+        trace.enter(ope, static_cast<size_t>(s - c.s), c.trace_ids.size(),
+                    c.trace_ids.back());
+      },
+      [&trace](auto &ope, auto s, auto, auto &vs, auto &c, auto &, auto len,
+               auto &) {
+        trace.leave(ope, static_cast<size_t>(s - c.s), len,
+                    c.trace_ids.size(), c.trace_ids.back(), vs);
+      },
+      [&trace](auto &) { trace.clear(); }, [](auto &) {});
+}
+
+/*-----------------------------------------------------------------------------
+ *  enable_chrome_tracing
+ *---------------------------------------------------------------------------*/
+
+struct ChromeTraceOptions {
+  // Rules nested deeper than this are not recorded. The start rule is depth 1.
+  size_t max_depth = static_cast<size_t>(-1);
+  // Rule calls shorter than this are not recorded.
+  std::chrono::nanoseconds min_duration{0};
+  // Recording stops after this many events.
+  size_t max_events = 1000000;
+};
+
+// Writes each rule call as a slice in the Chrome trace event format, which
+// chrome://tracing and Perfetto can open. Slices are named after rules and
+// carry the input offset, the matched length and the result as arguments.
+inline void enable_chrome_tracing(parser &parser, std::ostream &os,
+                                  ChromeTraceOptions options = {}) {
+  using Clock = std::chrono::steady_clock;
+
+  struct State {
+    Clock::time_point start;
+    std::vector<Clock::time_point> frames;
+    size_t events = 0;
+  };
+
+  parser.enable_trace(
+      [](auto &ope, auto, auto, auto &, auto &, auto &, std::any &trace_data) {
+        if (dynamic_cast<const peg::Holder *>(&ope)) {
+          auto &state = *std::any_cast<State *>(trace_data);
+          state.frames.push_back(Clock::now());
         }
-      }
-      ret = false;
-    }
+      },
+      [&os, options](auto &ope, auto s, auto, auto &, auto &c, auto &,
+                     auto len, std::any &trace_data) {
+        if (auto holder = dynamic_cast<const peg::Holder *>(&ope)) {
+          auto &state = *std::any_cast<State *>(trace_data);
+          auto now = Clock::now();
+          auto start = state.frames.back();
+          auto depth = state.frames.size();
+          state.frames.pop_back();
+
+          if (depth > options.max_depth || now - start < options.min_duration ||
+              state.events >= options.max_events) {
+            return;
+          }
 
-    // Set root definition
-    auto &start_rule = grammar[data.start];
+          auto us = [](Clock::duration d) {
+            return std::chrono::duration<double, std::micro>(d).count();
+          };
 
-    // Check if the start rule has ignore operator
-    {
-      if (start_rule.ignoreSemanticValue) {
-        if (log) {
-          auto line = line_info(s, start_rule.s_);
-          log(line.first, line.second,
-              "Ignore operator cannot be applied to '" + start_rule.name + "'.",
-              "");
+          std::string name;
+          for (auto ch : holder->name()) {
+            if (ch == '"' || ch == '\\') { name += '\\'; }
+            name += ch;
+          }
+
+          os << (state.events++ ? ",\n" : "\n") << "{\"name\":\"" << name
+             << "\",\"cat\":\"rule\",\"ph\":\"X\",\"pid\":1,\"tid\":1"
+             << ",\"ts\":" << us(start - state.start)
+             << ",\"dur\":" << us(now - start)
+             << ",\"args\":{\"pos\":" << s - c.s << ",\"len\":"
+             << (success(len) ? len : 0)
+             << ",\"success\":" << (success(len) ? "true" : "false") << "}}";
         }
-        ret = false;
-      }
-    }
+      },
+      [&os](auto &trace_data) {
+        auto state = new State{};
+        state->start = Clock::now();
+        trace_data = state;
+        os << "{\"traceEvents\":[";
+      },
+      [&os](auto &trace_data) {
+        auto state = std::any_cast<State *>(trace_data);
+        os << "\n],\"displayTimeUnit\":\"ns\"}" << std::endl;
+        delete state;
+      });
+}
 
-    if (!ret) { return nullptr; }
+/*-----------------------------------------------------------------------------
+ *  enable_profiling
+ *---------------------------------------------------------------------------*/
 
-    // Check missing definitions
-    auto referenced = std::unordered_set<std::string>{
-        WHITESPACE_DEFINITION_NAME,
-        WORD_DEFINITION_NAME,
-        RECOVER_DEFINITION_NAME,
-        start_rule.name,
+enum class ProfileFormat { Table, Json, Folded };
+
+// Collects per-rule statistics and prints a report when the parse ends.
+// Times are inclusive (the whole rule, counted once for recursive calls) or
+// exclusive (without the time spent in other rules), and action time is the
+// part of exclusive time spent in the rule's semantic action. 'consumed' is
+// the number of bytes matched and 'examined' the number of bytes looked at,
+// including lookahead. A backtrack is a call at a position before the
+// furthest one reached so far. Memo hits and misses are counted when packrat
+// parsing is enabled.
+//
+// ProfileFormat::Folded prints exclusive nanoseconds per call stack in the
+// folded format that flame graph tools read.
+inline void enable_profiling(parser &parser, std::ostream &os,
+                             ProfileFormat format = ProfileFormat::Table) {
+  using Clock = std::chrono::steady_clock;
+
+  struct Stats {
+    struct Item {
+      std::string name;
+      size_t success = 0;
+      size_t fail = 0;
+      size_t consumed = 0;
+      size_t examined = 0;
+      size_t backtracks = 0;
+      size_t memo_hits = 0;
+      size_t memo_misses = 0;
+      size_t active = 0;
+      Clock::duration inclusive{};
+      Clock::duration exclusive{};
+      Clock::duration action{};
+    };
+    struct Frame {
+      size_t id;
+      size_t node;
+      size_t examined_end;
+      Clock::duration action_start;
+      Clock::time_point start;
+      Clock::duration children{};
+      Clock::duration children_action{};
+    };
+    struct Node {
+      size_t id;
+      size_t parent;
+      Clock::duration self{};
     };
 
-    for (auto &[_, rule] : grammar) {
-      ReferenceChecker vis(grammar, rule.params);
-      rule.accept(vis);
-      referenced.insert(vis.referenced.begin(), vis.referenced.end());
-      for (const auto &[name, ptr] : vis.error_s) {
-        if (log) {
-          auto line = line_info(s, ptr);
-          log(line.first, line.second, vis.error_message[name], "");
-        }
-        ret = false;
-      }
-    }
+    // Indexed by definition id
+    std::vector<Item> items;
+    std::vector<Frame> frames;
+    // Call tree for the folded output
+    std::vector<Node> nodes;
+    std::map<std::pair<size_t, size_t>, size_t> node_index;
+    size_t total = 0;
+    size_t furthest = 0;
+    Clock::time_point start;
+  };
 
-    for (auto &[name, rule] : grammar) {
-      if (!referenced.count(name)) {
-        if (log) {
-          auto line = line_info(s, rule.s_);
-          auto msg = "'" + name + "' is not referenced.";
-          log(line.first, line.second, msg, "");
+  static const auto npos = static_cast<size_t>(-1);
+
+  auto us = [](Clock::duration d) {
+    return static_cast<long long>(
+        std::chrono::duration_cast<std::chrono::microseconds>(d).count());
+  };
+
+  auto ns = [](Clock::duration d) {
+    return static_cast<long long>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(d).count());
+  };
+
+  parser.enable_trace(
+      [format](auto &ope, auto s, auto, auto &, auto &c, auto &,
+               std::any &trace_data) {
+        if (auto holder = dynamic_cast<const peg::Holder *>(&ope)) {
+          auto &stats = *std::any_cast<Stats *>(trace_data);
+
+          auto id = holder->outer_->id;
+          if (id >= stats.items.size()) { stats.items.resize(id + 1); }
+          auto &item = stats.items[id];
+          if (item.name.empty()) { item.name = holder->name(); }
+
+          auto pos = static_cast<size_t>(s - c.s);
+          if (pos < stats.furthest) {
+            item.backtracks++;
+          } else {
+            stats.furthest = pos;
+          }
+          item.active++;
+          stats.total++;
+
+          auto node = npos;
+          if (format == ProfileFormat::Folded) {
+            auto parent =
+                stats.frames.empty() ? npos : stats.frames.back().node;
+            auto key = std::pair(parent, id);
+            auto it = stats.node_index.find(key);
+            if (it == stats.node_index.end()) {
+              node = stats.nodes.size();
+              stats.nodes.push_back({id, parent});
+              stats.node_index.emplace(key, node);
+            } else {
+              node = it->second;
+            }
+          }
+
+          stats.frames.push_back(
+              {id, node, c.examined_end, c.action_time, Clock::now()});
+
+          // Measure from here how far the rule looks ahead. The high-water
+          // mark is restored when the rule leaves.
+          const_cast<Context &>(c).examined_end = pos;
         }
-      }
-    }
+      },
+      [format](auto &ope, auto s, auto, auto &, auto &c, auto &, auto len,
+               std::any &trace_data) {
+        if (auto holder = dynamic_cast<const peg::Holder *>(&ope)) {
+          auto now = Clock::now();
+          auto &stats = *std::any_cast<Stats *>(trace_data);
 
-    if (!ret) { return nullptr; }
+          auto frame = stats.frames.back();
+          stats.frames.pop_back();
 
-    // Link references
-    for (auto &x : grammar) {
-      auto &rule = x.second;
-      LinkReferences vis(grammar, rule.params);
-      rule.accept(vis);
-    }
+          auto &item = stats.items[frame.id];
+          auto elapsed = now - frame.start;
+          auto action = c.action_time - frame.action_start;
+          auto self = elapsed - frame.children;
 
-    // Check left recursion
-    ret = true;
+          if (--item.active == 0) { item.inclusive += elapsed; }
+          item.exclusive += self;
+          item.action += action - frame.children_action;
+          if (!stats.frames.empty()) {
+            stats.frames.back().children += elapsed;
+            stats.frames.back().children_action += action;
+          }
+          if (format == ProfileFormat::Folded) {
+            stats.nodes[frame.node].self += self;
+          }
 
-    for (auto &[name, rule] : grammar) {
-      DetectLeftRecursion vis(name);
-      rule.accept(vis);
-      if (vis.error_s) {
-        if (log) {
-          auto line = line_info(s, vis.error_s);
-          log(line.first, line.second, "'" + name + "' is left recursive.", "");
+          if (len != static_cast<size_t>(-1)) {
+            item.success++;
+            item.consumed += len;
+          } else {
+            item.fail++;
+          }
+
+          auto pos = static_cast<size_t>(s - c.s);
+          if (c.examined_end > pos) { item.examined += c.examined_end - pos; }
+          const_cast<Context &>(c).examined_end =
+              (std::max)(c.examined_end, frame.examined_end);
+
+          if (c.enablePackratParsing && !holder->outer_->is_macro) {
+            if (c.memo_hit) {
+              item.memo_hits++;
+            } else {
+              item.memo_misses++;
+            }
+          }
         }
-        ret = false;
-      }
-    }
+      },
+      [](auto &trace_data) {
+        auto stats = new Stats{};
+        stats->start = Clock::now();
+        trace_data = stats;
+      },
+      [&, format, us, ns](auto &trace_data) {
+        auto stats = std::any_cast<Stats *>(trace_data);
+        auto duration = Clock::now() - stats->start;
+
+        switch (format) {
+        case ProfileFormat::Table: {
+          auto micro = us(duration);
+          os << "duration: " << micro / 1000000.0 << "s (" << micro << "µs)"
+             << std::endl
+             << std::endl;
+
+          char buff[BUFSIZ];
+          size_t total_success = 0;
+          size_t total_fail = 0;
+          for (auto &item : stats->items) {
+            total_success += item.success;
+            total_fail += item.fail;
+          }
+
+          os << "  id       total      %     success        fail    "
+                "incl(us)    excl(us)  action(us)    consumed    examined  "
+                "backtracks   memo hits memo misses  definition"
+             << std::endl;
+
+          auto grand_total = total_success + total_fail;
+          snprintf(buff, BUFSIZ, "%4s  %10zu  %5s  %10zu  %10zu  %s", "",
+                   grand_total, "", total_success, total_fail,
+                   "Total counters");
+          os << buff << std::endl;
+
+          snprintf(buff, BUFSIZ, "%4s  %10s  %5s  %10.2f  %10.2f  %s", "", "",
+                   "", total_success * 100.0 / grand_total,
+                   total_fail * 100.0 / grand_total, "% success/fail");
+          os << buff << std::endl << std::endl;
+
+          for (size_t id = 0; id < stats->items.size(); id++) {
+            auto &item = stats->items[id];
+            auto total = item.success + item.fail;
+            if (!total) { continue; }
+            auto ratio = total * 100.0 / stats->total;
+            snprintf(buff, BUFSIZ,
+                     "%4zu  %10zu  %5.2f  %10zu  %10zu  %10lld  %10lld  "
+                     "%10lld  %10zu  %10zu  %10zu  %10zu  %10zu  %s",
+                     id, total, ratio, item.success, item.fail,
+                     us(item.inclusive), us(item.exclusive), us(item.action),
+                     item.consumed, item.examined, item.backtracks,
+                     item.memo_hits, item.memo_misses, item.name.c_str());
+            os << buff << std::endl;
+          }
+          break;
+        }
+        case ProfileFormat::Json: {
+          os << "{\"duration_ns\":" << ns(duration)
+             << ",\"total\":" << stats->total << ",\"rules\":[";
+          auto first = true;
+          for (size_t id = 0; id < stats->items.size(); id++) {
+            auto &item = stats->items[id];
+            if (!(item.success + item.fail)) { continue; }
+            if (!first) { os << ","; }
+            first = false;
+            os << "{\"id\":" << id << ",\"name\":\"" << item.name << "\""
+               << ",\"success\":" << item.success
+               << ",\"fail\":" << item.fail
+               << ",\"inclusive_ns\":" << ns(item.inclusive)
+               << ",\"exclusive_ns\":" << ns(item.exclusive)
+               << ",\"action_ns\":" << ns(item.action)
+               << ",\"consumed\":" << item.consumed
+               << ",\"examined\":" << item.examined
+               << ",\"backtracks\":" << item.backtracks
+               << ",\"memo_hits\":" << item.memo_hits
+               << ",\"memo_misses\":" << item.memo_misses << "}";
+          }
+          os << "]}" << std::endl;
+          break;
+        }
+        case ProfileFormat::Folded: {
+          for (auto &node : stats->nodes) {
+            if (ns(node.self) <= 0) { continue; }
+            std::vector<size_t> path;
+            for (auto n = &node;; n = &stats->nodes[n->parent]) {
+              path.push_back(n->id);
+              if (n->parent == npos) { break; }
+            }
+            for (auto it = path.rbegin(); it != path.rend(); ++it) {
+              if (it != path.rbegin()) { os << ";"; }
+              os << stats->items[*it].name;
+            }
+            os << " " << ns(node.self) << std::endl;
+          }
+          break;
+        }
+        }
+
+        delete stats;
+      });
+}
+
+/*-----------------------------------------------------------------------------
+ *  enable_heatmap
+ *---------------------------------------------------------------------------*/
 
-    if (!ret) { return nullptr; }
+struct HeatmapOptions {
+  // Number of byte ranges in the histogram
+  size_t buckets = 40;
+  // Number of rules listed for each range
+  size_t top_rules = 3;
+};
 
-    // Check infinite loop
-    if (detect_infiniteLoop(data, start_rule, log, s)) { return nullptr; }
+// Counts how many times each input byte was examined by rule calls,
+// including lookahead, and which rules were called in each byte range. When
+// the parse ends, prints a histogram over byte ranges and the source lines
+// of the hottest range with a heat marker under each character. Bytes that
+// are examined many times point at backtracking that memoization or a
+// grammar change could avoid.
+inline void enable_heatmap(parser &parser, std::ostream &os,
+                           HeatmapOptions options = {}) {
+  struct State {
+    const char *s = nullptr;
+    size_t l = 0;
+    size_t bucket_size = 1;
+    // Difference array of examination counts per byte
+    std::vector<int64_t> diff;
+    // Rule calls per bucket, indexed by definition id
+    std::vector<std::vector<size_t>> calls;
+    std::vector<std::string> names;
+    std::vector<size_t> examined_ends;
+    size_t total_calls = 0;
+  };
 
-    // Automatic whitespace skipping
-    if (grammar.count(WHITESPACE_DEFINITION_NAME)) {
-      for (auto &x : grammar) {
-        auto &rule = x.second;
-        auto ope = rule.get_core_operator();
-        if (IsLiteralToken::check(*ope)) { rule <= tok(ope); }
-      }
+  if (!options.buckets) { options.buckets = 1; }
 
-      auto &rule = grammar[WHITESPACE_DEFINITION_NAME];
-      start_rule.whitespaceOpe = wsp(rule.get_core_operator());
+  parser.enable_trace(
+      [options](auto &ope, auto s, auto, auto &, auto &c, auto &,
+                std::any &trace_data) {
+        if (auto holder = dynamic_cast<const peg::Holder *>(&ope)) {
+          auto &state = *std::any_cast<State *>(trace_data);
+          if (!state.s) {
+            state.s = c.s;
+            state.l = c.l;
+            state.bucket_size =
+                (std::max)((c.l + options.buckets - 1) / options.buckets,
+                           static_cast<size_t>(1));
+            state.diff.resize(c.l + 1);
+            state.calls.resize(c.l / state.bucket_size + 1);
+          }
 
-      if (detect_infiniteLoop(data, rule, log, s)) { return nullptr; }
-    }
+          auto id = holder->outer_->id;
+          if (id >= state.names.size()) { state.names.resize(id + 1); }
+          if (state.names[id].empty()) { state.names[id] = holder->name(); }
 
-    // Word expression
-    if (grammar.count(WORD_DEFINITION_NAME)) {
-      auto &rule = grammar[WORD_DEFINITION_NAME];
-      start_rule.wordOpe = rule.get_core_operator();
+          auto pos = static_cast<size_t>(s - c.s);
+          auto &calls = state.calls[pos / state.bucket_size];
+          if (id >= calls.size()) { calls.resize(id + 1); }
+          calls[id]++;
+          state.total_calls++;
 
-      if (detect_infiniteLoop(data, rule, log, s)) { return nullptr; }
-    }
+          // See enable_profiling
+          state.examined_ends.push_back(c.examined_end);
+          const_cast<Context &>(c).examined_end = pos;
+        }
+      },
+      [](auto &ope, auto s, auto, auto &, auto &c, auto &, auto,
+         std::any &trace_data) {
+        if (dynamic_cast<const peg::Holder *>(&ope)) {
+          auto &state = *std::any_cast<State *>(trace_data);
+
+          auto pos = static_cast<size_t>(s - c.s);
+          auto end = (std::min)(c.examined_end, state.l);
+          if (pos < end) {
+            state.diff[pos]++;
+            state.diff[end]--;
+          }
 
-    // Apply instructions
-    for (const auto &[name, instructions] : data.instructions) {
-      auto &rule = grammar[name];
+          const_cast<Context &>(c).examined_end =
+              (std::max)(c.examined_end, state.examined_ends.back());
+          state.examined_ends.pop_back();
+        }
+      },
+      [](auto &trace_data) { trace_data = new State{}; },
+      [&os, options](auto &trace_data) {
+        auto state = std::any_cast<State *>(trace_data);
+        auto se = scope_exit([&]() { delete state; });
+
+        if (!state->s || !state->l) {
+          os << "heatmap: no input was examined" << std::endl;
+          return;
+        }
 
-      for (const auto &instruction : instructions) {
-        if (instruction.type == "precedence") {
-          const auto &info =
-              std::any_cast<PrecedenceClimbing::BinOpeInfo>(instruction.data);
+        // Examination counts per byte
+        std::vector<size_t> counts(state->l);
+        int64_t count = 0;
+        size_t total = 0;
+        for (size_t i = 0; i < state->l; i++) {
+          count += state->diff[i];
+          counts[i] = static_cast<size_t>(count);
+          total += counts[i];
+        }
 
-          if (!apply_precedence_instruction(rule, info, s, log)) {
-            return nullptr;
-          }
-        } else if (instruction.type == "error_message") {
-          rule.error_message = std::any_cast<std::string>(instruction.data);
-        } else if (instruction.type == "no_ast_opt") {
-          rule.no_ast_opt = true;
+        auto bucket_count = state->calls.size();
+        std::vector<size_t> sums(bucket_count);
+        for (size_t i = 0; i < state->l; i++) {
+          sums[i / state->bucket_size] += counts[i];
         }
-      }
-    }
 
-    // Set root definition
-    start = data.start;
-    enablePackratParsing = data.enablePackratParsing;
+        auto bytes_in = [&](size_t b) {
+          return (std::min)(state->bucket_size,
+                            state->l - b * state->bucket_size);
+        };
+
+        size_t hottest = 0;
+        double max_avg = 0;
+        for (size_t b = 0; b < bucket_count; b++) {
+          if (b * state->bucket_size >= state->l) { break; }
+          auto avg = static_cast<double>(sums[b]) / bytes_in(b);
+          if (avg > max_avg) {
+            max_avg = avg;
+            hottest = b;
+          }
+        }
 
-    return data.grammar;
-  }
+        char buff[BUFSIZ];
+        snprintf(buff, BUFSIZ,
+                 "heatmap: %zu rule calls examined %zu bytes %.2f times on "
+                 "average",
+                 state->total_calls, state->l,
+                 static_cast<double>(total) / state->l);
+        os << buff << std::endl << std::endl;
 
-  bool detect_infiniteLoop(const Data &data, Definition &rule, const Log &log,
-                           const char *s) const {
-    std::vector<std::pair<const char *, std::string>> refs;
-    std::unordered_map<std::string, bool> has_error_cache;
-    DetectInfiniteLoop vis(data.start_pos, rule.name, refs, has_error_cache);
-    rule.accept(vis);
-    if (vis.has_error) {
-      if (log) {
-        auto line = line_info(s, vis.error_s);
-        log(line.first, line.second,
-            "infinite loop is detected in '" + vis.error_name + "'.", "");
-      }
-      return true;
-    }
-    return false;
-  }
+        os << "         offset    line:col     avg  heat                    "
+              "        rules"
+           << std::endl;
 
-  Grammar g;
-};
+        const size_t bar_width = 30;
+        for (size_t b = 0; b < bucket_count; b++) {
+          auto begin = b * state->bucket_size;
+          if (begin >= state->l) { break; }
+          auto end = begin + bytes_in(b);
+          auto avg = static_cast<double>(sums[b]) / bytes_in(b);
+          auto [ln, col] = line_info(state->s, state->s + begin);
+
+          std::string bar(
+              max_avg > 0 ? static_cast<size_t>(avg / max_avg * bar_width) : 0,
+              '#');
+          bar.resize(bar_width, ' ');
+
+          // Rules called most in the range
+          const auto &calls = state->calls[b];
+          std::vector<size_t> ids;
+          for (size_t id = 0; id < calls.size(); id++) {
+            if (calls[id]) { ids.push_back(id); }
+          }
+          std::stable_sort(ids.begin(), ids.end(), [&](auto x, auto y) {
+            return calls[x] > calls[y];
+          });
+          if (ids.size() > options.top_rules) { ids.resize(options.top_rules); }
+          std::string rules;
+          for (auto id : ids) {
+            if (!rules.empty()) { rules += " "; }
+            rules += state->names[id] + "(" + std::to_string(calls[id]) + ")";
+          }
 
-/*-----------------------------------------------------------------------------
- *  AST
- *---------------------------------------------------------------------------*/
+          snprintf(buff, BUFSIZ, "%7zu-%-7zu %5zu:%-5zu %7.2f  %s  %s", begin,
+                   end, ln, col, avg, bar.c_str(), rules.c_str());
+          std::string line = buff;
+          line.erase(line.find_last_not_of(' ') + 1);
+          os << line << std::endl;
+        }
 
-template <typename Annotation> struct AstBase : public Annotation {
-  AstBase(const char *path, size_t line, size_t column, const char *name,
-          const std::vector<std::shared_ptr<AstBase>> &nodes,
-          size_t position = 0, size_t length = 0, size_t choice_count = 0,
-          size_t choice = 0)
-      : path(path ? path : ""), line(line), column(column), name(name),
-        position(position), length(length), choice_count(choice_count),
-        choice(choice), original_name(name),
-        original_choice_count(choice_count), original_choice(choice),
-        tag(str2tag(name)), original_tag(tag), is_token(false), nodes(nodes) {}
+        // Source lines of the hottest range
+        auto begin = hottest * state->bucket_size;
+        auto end = begin + bytes_in(hottest);
+        while (begin > 0 && state->s[begin - 1] != '\n') {
+          begin--;
+        }
+        while (end < state->l && state->s[end - 1] != '\n') {
+          end++;
+        }
 
-  AstBase(const char *path, size_t line, size_t column, const char *name,
-          const std::string_view &token, size_t position = 0, size_t length = 0,
-          size_t choice_count = 0, size_t choice = 0)
-      : path(path ? path : ""), line(line), column(column), name(name),
-        position(position), length(length), choice_count(choice_count),
-        choice(choice), original_name(name),
-        original_choice_count(choice_count), original_choice(choice),
-        tag(str2tag(name)), original_tag(tag), is_token(true), token(token) {}
+        os << std::endl
+           << "hottest range: " << hottest * state->bucket_size << "-"
+           << hottest * state->bucket_size + bytes_in(hottest) << std::endl;
 
-  AstBase(const AstBase &ast, const char *original_name, size_t position = 0,
-          size_t length = 0, size_t original_choice_count = 0,
-          size_t original_choice = 0)
-      : path(ast.path), line(ast.line), column(ast.column), name(ast.name),
-        position(position), length(length), choice_count(ast.choice_count),
-        choice(ast.choice), original_name(original_name),
-        original_choice_count(original_choice_count),
-        original_choice(original_choice), tag(ast.tag),
-        original_tag(str2tag(original_name)), is_token(ast.is_token),
-        token(ast.token), nodes(ast.nodes), parent(ast.parent) {}
+        static const char levels[] = " .:-=+*#%@";
+        const size_t level_count = sizeof(levels) - 1;
+        size_t max_count = 0;
+        for (auto i = begin; i < end; i++) {
+          max_count = (std::max)(max_count, counts[i]);
+        }
 
-  const std::string path;
-  const size_t line = 1;
-  const size_t column = 1;
+        auto i = begin;
+        while (i < end) {
+          auto [ln, col] = line_info(state->s, state->s + i);
+          std::string text;
+          std::string marks;
+          while (i < end && state->s[i] != '\n') {
+            auto len = (std::max)(
+                codepoint_length(state->s + i, state->l - i),
+                static_cast<size_t>(1));
+            size_t c = 0;
+            for (size_t j = i; j < i + len && j < state->l; j++) {
+              c = (std::max)(c, counts[j]);
+            }
+            text += state->s[i] == '\t' ? std::string(" ")
+                                        : std::string(state->s + i, len);
+            auto level = max_count ? (c * (level_count - 1) + max_count - 1) /
+                                         max_count
+                                   : 0;
+            marks += levels[level];
+            i += len;
+          }
+          i++;
 
-  const std::string name;
-  size_t position;
-  size_t length;
-  const size_t choice_count;
-  const size_t choice;
-  const std::string original_name;
-  const size_t original_choice_count;
-  const size_t original_choice;
-  const unsigned int tag;
-  const unsigned int original_tag;
+          snprintf(buff, BUFSIZ, "%5zu | ", ln);
+          os << buff << text << std::endl;
+          os << "      | " << marks << std::endl;
+        }
+      });
+}
 
-  const bool is_token;
-  const std::string_view token;
+/*-----------------------------------------------------------------------------
+ *  find_slow_input
+ *---------------------------------------------------------------------------*/
 
-  std::vector<std::shared_ptr<AstBase<Annotation>>> nodes;
-  std::weak_ptr<AstBase<Annotation>> parent;
+struct SlowInputOptions {
+  // Number of mutated inputs to try
+  size_t iterations = 5000;
+  // Inputs don't grow beyond this many bytes
+  size_t max_length = 1024;
+  // A parse is stopped after this many operator calls
+  size_t max_invocations = 1000000;
+  // The search stops when this time is up
+  std::chrono::milliseconds time_limit{10000};
+  uint64_t seed = 1;
+};
 
-  std::string token_to_string() const {
-    assert(is_token);
-    return std::string(token);
-  }
+struct SlowInput {
+  std::string input;
+  // Operator calls while parsing the input
+  size_t invocations = 0;
+  // Parsing was stopped at SlowInputOptions::max_invocations
+  bool capped = false;
+  // Calls per rule, most first
+  std::vector<std::pair<std::string, size_t>> rules;
 
-  template <typename T> T token_to_number() const {
-    return token_to_number_<T>(token);
+  double invocations_per_byte() const {
+    return static_cast<double>(invocations) /
+           static_cast<double>(
+               (std::max)(input.size(), static_cast<size_t>(1)));
   }
 };
 
-template <typename T>
-void ast_to_s_core(const std::shared_ptr<T> &ptr, std::string &s, int level,
-                   std::function<std::string(const T &ast, int level)> fn) {
-  const auto &ast = *ptr;
-  for (auto i = 0; i < level; i++) {
-    s += "  ";
-  }
-  auto name = ast.original_name;
-  if (ast.original_choice_count > 0) {
-    name += "/" + std::to_string(ast.original_choice);
-  }
-  if (ast.name != ast.original_name) { name += "[" + ast.name + "]"; }
-  if (ast.is_token) {
-    s += "- " + name + " (";
-    s += ast.token;
-    s += ")\n";
-  } else {
-    s += "+ " + name + "\n";
-  }
-  if (fn) { s += fn(ast, level + 1); }
-  for (auto node : ast.nodes) {
-    ast_to_s_core(node, s, level + 1, fn);
-  }
-}
+// Searches for an input that makes the parser run as many operators per
+// input byte as possible, which exposes exponential backtracking. Inputs are
+// mutated from the seeds with bytes, literals of the grammar and repeated
+// chunks. Mutants are kept when they reach rule outcomes not seen before or
+// cost more than the input they came from. The slowest input is minimized
+// before it is returned.
+//
+// The search runs with its own tracer, and the parser's tracer is restored
+// when it returns. Failed parses are logged if the parser has a logger. An
+// exception thrown by an action counts as a failed parse and is not reported.
+// It needs tracing, so it isn't available with CPPPEGLIB_DISABLE_TRACE.
+#ifdef CPPPEGLIB_DISABLE_TRACE
+SlowInput find_slow_input(parser &parser,
+                          const std::vector<std::string> &seeds,
+                          SlowInputOptions options = {}) = delete;
+#else
+inline SlowInput find_slow_input(parser &parser,
+                                 const std::vector<std::string> &seeds,
+                                 SlowInputOptions options = {}) {
+  if (parser.grammar_ == nullptr) { return {}; }
+
+  auto &start = (*parser.grammar_)[parser.start_];
+  auto se = scope_exit([&, enter = start.tracer_enter,
+                        leave = start.tracer_leave,
+                        begin = start.tracer_start, end = start.tracer_end]() {
+    parser.enable_trace(enter, leave, begin, end);
+  });
 
-template <typename T>
-std::string
-ast_to_s(const std::shared_ptr<T> &ptr,
-         std::function<std::string(const T &ast, int level)> fn = nullptr) {
-  std::string s;
-  ast_to_s_core(ptr, s, 0, fn);
-  return s;
-}
+  struct Run {
+    size_t invocations = 0;
+    size_t limit = 0;
+    std::vector<size_t> rule_calls;
+    std::vector<std::string> names;
+    // Rule outcomes seen in this run: (definition id << 1) | success
+    std::vector<size_t> edges;
+    std::unordered_set<const Ope *> literal_opes;
+    std::vector<std::string> literals;
+  } run;
 
-struct AstOptimizer {
-  AstOptimizer(bool mode, const std::vector<std::string> &rules = {})
-      : mode_(mode), rules_(rules) {}
+  parser.enable_trace(
+      [&run](auto &ope, auto, auto, auto &, auto &c, auto &, auto &) {
+        if (++run.invocations > run.limit) {
+          c.stop_parse = true;
+          return;
+        }
+        if (auto holder = dynamic_cast<const peg::Holder *>(&ope)) {
+          auto id = holder->outer_->id;
+          if (id >= run.rule_calls.size()) {
+            run.rule_calls.resize(id + 1);
+            run.names.resize(id + 1);
+          }
+          if (run.names[id].empty()) { run.names[id] = holder->name(); }
+          run.rule_calls[id]++;
+        } else if (auto lit = dynamic_cast<const peg::LiteralString *>(&ope)) {
+          if (run.literal_opes.insert(&ope).second && !lit->lit_.empty()) {
+            run.literals.push_back(lit->lit_);
+          }
+        }
+      },
+      [&run](auto &ope, auto, auto, auto &, auto &, auto &, auto len,
+             auto &) {
+        if (run.invocations > run.limit) { return; }
+        if (auto holder = dynamic_cast<const peg::Holder *>(&ope)) {
+          run.edges.push_back((holder->outer_->id << 1) | success(len));
+        }
+      },
+      nullptr, nullptr);
 
-  template <typename T>
-  std::shared_ptr<T> optimize(std::shared_ptr<T> original,
-                              std::shared_ptr<T> parent = nullptr) {
-    auto found =
-        std::find(rules_.begin(), rules_.end(), original->name) != rules_.end();
-    auto opt = mode_ ? !found : found;
+  struct Entry {
+    std::string input;
+    size_t invocations;
+    bool capped;
+    double score;
+  };
 
-    if (opt && original->nodes.size() == 1) {
-      auto child = optimize(original->nodes[0], parent);
-      auto ast = std::make_shared<T>(*child, original->name.data(),
-                                     original->choice_count, original->position,
-                                     original->length, original->choice);
-      for (auto node : ast->nodes) {
-        node->parent = ast;
-      }
-      return ast;
-    }
+  auto measure = [&](const std::string &input) {
+    run.invocations = 0;
+    run.limit = options.max_invocations;
+    run.edges.clear();
+    std::fill(run.rule_calls.begin(), run.rule_calls.end(), 0);
+    try {
+      parser.parse(input);
+    } catch (...) {}
+    auto capped = run.invocations > run.limit;
+    auto invocations = (std::min)(run.invocations, run.limit);
+    auto size = (std::max)(input.size(), static_cast<size_t>(1));
+    return Entry{input, invocations, capped,
+                 static_cast<double>(invocations) / static_cast<double>(size)};
+  };
 
-    auto ast = std::make_shared<T>(*original);
-    ast->parent = parent;
-    ast->nodes.clear();
-    for (auto node : original->nodes) {
-      auto child = optimize(node, ast);
-      ast->nodes.push_back(child);
+  // xorshift64*
+  auto state = options.seed ? options.seed : 1;
+  auto random = [&](size_t n) {
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return n ? static_cast<size_t>((state * 2685821657736338717ULL) % n) : 0;
+  };
+
+  std::set<size_t> coverage;
+  auto add_coverage = [&]() {
+    auto found = false;
+    for (auto edge : run.edges) {
+      found = coverage.insert(edge).second || found;
     }
-    return ast;
-  }
+    return found;
+  };
 
-private:
-  const bool mode_;
-  const std::vector<std::string> rules_;
-};
+  std::vector<Entry> corpus;
+  for (const auto &seed : seeds) {
+    corpus.push_back(measure(seed.substr(0, options.max_length)));
+    add_coverage();
+  }
+  if (corpus.empty()) {
+    corpus.push_back(measure(""));
+    add_coverage();
+  }
 
-struct EmptyType {};
-using Ast = AstBase<EmptyType>;
+  // Bytes to insert: those of the seeds, or printable ASCII
+  std::string alphabet;
+  {
+    std::set<char> bytes;
+    for (const auto &seed : seeds) {
+      bytes.insert(seed.begin(), seed.end());
+    }
+    alphabet.assign(bytes.begin(), bytes.end());
+    if (alphabet.empty()) {
+      for (auto ch = ' '; ch <= '~'; ch++) {
+        alphabet += ch;
+      }
+    }
+  }
 
-template <typename T = Ast> void add_ast_action(Definition &rule) {
-  rule.action = [&](const SemanticValues &vs) {
-    auto line = vs.line_info();
+  auto best_index = [&]() {
+    size_t best = 0;
+    for (size_t i = 1; i < corpus.size(); i++) {
+      if (corpus[i].score > corpus[best].score) { best = i; }
+    }
+    return best;
+  };
 
-    if (rule.is_token()) {
-      return std::make_shared<T>(
-          vs.path, line.first, line.second, rule.name.data(), vs.token(),
-          std::distance(vs.ss, vs.sv().data()), vs.sv().length(),
-          vs.choice_count(), vs.choice());
+  auto mutate = [&](std::string s) {
+    auto pos = random(s.size() + 1);
+    switch (random(6)) {
+    case 0: s.insert(pos, 1, alphabet[random(alphabet.size())]); break;
+    case 1:
+      if (!run.literals.empty()) {
+        s.insert(pos, run.literals[random(run.literals.size())]);
+      }
+      break;
+    case 2:
+      if (!s.empty()) {
+        auto begin = random(s.size());
+        auto len = 1 + random((std::min)(s.size() - begin,
+                                         static_cast<size_t>(16)));
+        auto chunk = s.substr(begin, len);
+        for (auto n = 1 + random(4); n > 0; n--) {
+          s.insert(begin, chunk);
+        }
+      }
+      break;
+    case 3:
+      if (!s.empty()) {
+        s.erase(random(s.size()), 1 + random(8));
+      }
+      break;
+    case 4:
+      if (!s.empty()) {
+        s[random(s.size())] = alphabet[random(alphabet.size())];
+      }
+      break;
+    case 5: {
+      const auto &other = corpus[random(corpus.size())].input;
+      s = s.substr(0, pos) + other.substr(random(other.size() + 1));
+      break;
     }
-
-    auto ast =
-        std::make_shared<T>(vs.path, line.first, line.second, rule.name.data(),
-                            vs.transform<std::shared_ptr<T>>(),
-                            std::distance(vs.ss, vs.sv().data()),
-                            vs.sv().length(), vs.choice_count(), vs.choice());
-
-    for (auto node : ast->nodes) {
-      node->parent = ast;
     }
-    return ast;
+    if (s.size() > options.max_length) { s.resize(options.max_length); }
+    return s;
   };
-}
-
-#define PEG_EXPAND(...) __VA_ARGS__
-#define PEG_CONCAT(a, b) a##b
-#define PEG_CONCAT2(a, b) PEG_CONCAT(a, b)
 
-#define PEG_PICK(                                                              \
-    a0, a1, a2, a3, a4, a5, a6, a7, a8, a9, a10, a11, a12, a13, a14, a15, a16, \
-    a17, a18, a19, a20, a21, a22, a23, a24, a25, a26, a27, a28, a29, a30, a31, \
-    a32, a33, a34, a35, a36, a37, a38, a39, a40, a41, a42, a43, a44, a45, a46, \
-    a47, a48, a49, a50, a51, a52, a53, a54, a55, a56, a57, a58, a59, a60, a61, \
-    a62, a63, a64, a65, a66, a67, a68, a69, a70, a71, a72, a73, a74, a75, a76, \
-    a77, a78, a79, a80, a81, a82, a83, a84, a85, a86, a87, a88, a89, a90, a91, \
-    a92, a93, a94, a95, a96, a97, a98, a99, a100, ...)                         \
-  a100
-
-#define PEG_COUNT(...)                                                         \
-  PEG_EXPAND(PEG_PICK(                                                         \
-      __VA_ARGS__, 100, 99, 98, 97, 96, 95, 94, 93, 92, 91, 90, 89, 88, 87,    \
-      86, 85, 84, 83, 82, 81, 80, 79, 78, 77, 76, 75, 74, 73, 72, 71, 70, 69,  \
-      68, 67, 66, 65, 64, 63, 62, 61, 60, 59, 58, 57, 56, 55, 54, 53, 52, 51,  \
-      50, 49, 48, 47, 46, 45, 44, 43, 42, 41, 40, 39, 38, 37, 36, 35, 34, 33,  \
-      32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17, 16, 15,  \
-      14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0))
+  auto deadline = std::chrono::steady_clock::now() + options.time_limit;
+  const size_t corpus_limit = 64;
 
-#define PEG_DEF_1(r)                                                           \
-  peg::Definition r;                                                           \
-  r.name = #r;                                                                 \
-  peg::add_ast_action(r);
+  for (size_t i = 0; i < options.iterations; i++) {
+    if (std::chrono::steady_clock::now() > deadline) { break; }
 
-#define PEG_DEF_2(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_1(__VA_ARGS__))
-#define PEG_DEF_3(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_2(__VA_ARGS__))
-#define PEG_DEF_4(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_3(__VA_ARGS__))
-#define PEG_DEF_5(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_4(__VA_ARGS__))
-#define PEG_DEF_6(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_5(__VA_ARGS__))
-#define PEG_DEF_7(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_6(__VA_ARGS__))
-#define PEG_DEF_8(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_7(__VA_ARGS__))
-#define PEG_DEF_9(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_8(__VA_ARGS__))
-#define PEG_DEF_10(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_9(__VA_ARGS__))
-#define PEG_DEF_11(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_10(__VA_ARGS__))
-#define PEG_DEF_12(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_11(__VA_ARGS__))
-#define PEG_DEF_13(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_12(__VA_ARGS__))
-#define PEG_DEF_14(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_13(__VA_ARGS__))
-#define PEG_DEF_15(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_14(__VA_ARGS__))
-#define PEG_DEF_16(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_15(__VA_ARGS__))
-#define PEG_DEF_17(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_16(__VA_ARGS__))
-#define PEG_DEF_18(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_17(__VA_ARGS__))
-#define PEG_DEF_19(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_18(__VA_ARGS__))
-#define PEG_DEF_20(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_19(__VA_ARGS__))
-#define PEG_DEF_21(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_20(__VA_ARGS__))
-#define PEG_DEF_22(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_21(__VA_ARGS__))
-#define PEG_DEF_23(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_22(__VA_ARGS__))
-#define PEG_DEF_24(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_23(__VA_ARGS__))
-#define PEG_DEF_25(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_24(__VA_ARGS__))
-#define PEG_DEF_26(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_25(__VA_ARGS__))
-#define PEG_DEF_27(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_26(__VA_ARGS__))
-#define PEG_DEF_28(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_27(__VA_ARGS__))
-#define PEG_DEF_29(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_28(__VA_ARGS__))
-#define PEG_DEF_30(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_29(__VA_ARGS__))
-#define PEG_DEF_31(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_30(__VA_ARGS__))
-#define PEG_DEF_32(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_31(__VA_ARGS__))
-#define PEG_DEF_33(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_32(__VA_ARGS__))
-#define PEG_DEF_34(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_33(__VA_ARGS__))
-#define PEG_DEF_35(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_34(__VA_ARGS__))
-#define PEG_DEF_36(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_35(__VA_ARGS__))
-#define PEG_DEF_37(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_36(__VA_ARGS__))
-#define PEG_DEF_38(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_37(__VA_ARGS__))
-#define PEG_DEF_39(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_38(__VA_ARGS__))
-#define PEG_DEF_40(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_39(__VA_ARGS__))
-#define PEG_DEF_41(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_40(__VA_ARGS__))
-#define PEG_DEF_42(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_41(__VA_ARGS__))
-#define PEG_DEF_43(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_42(__VA_ARGS__))
-#define PEG_DEF_44(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_43(__VA_ARGS__))
-#define PEG_DEF_45(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_44(__VA_ARGS__))
-#define PEG_DEF_46(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_45(__VA_ARGS__))
-#define PEG_DEF_47(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_46(__VA_ARGS__))
-#define PEG_DEF_48(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_47(__VA_ARGS__))
-#define PEG_DEF_49(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_48(__VA_ARGS__))
-#define PEG_DEF_50(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_49(__VA_ARGS__))
-#define PEG_DEF_51(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_50(__VA_ARGS__))
-#define PEG_DEF_52(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_51(__VA_ARGS__))
-#define PEG_DEF_53(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_52(__VA_ARGS__))
-#define PEG_DEF_54(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_53(__VA_ARGS__))
-#define PEG_DEF_55(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_54(__VA_ARGS__))
-#define PEG_DEF_56(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_55(__VA_ARGS__))
-#define PEG_DEF_57(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_56(__VA_ARGS__))
-#define PEG_DEF_58(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_57(__VA_ARGS__))
-#define PEG_DEF_59(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_58(__VA_ARGS__))
-#define PEG_DEF_60(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_59(__VA_ARGS__))
-#define PEG_DEF_61(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_60(__VA_ARGS__))
-#define PEG_DEF_62(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_61(__VA_ARGS__))
-#define PEG_DEF_63(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_62(__VA_ARGS__))
-#define PEG_DEF_64(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_63(__VA_ARGS__))
-#define PEG_DEF_65(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_64(__VA_ARGS__))
-#define PEG_DEF_66(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_65(__VA_ARGS__))
-#define PEG_DEF_67(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_66(__VA_ARGS__))
-#define PEG_DEF_68(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_67(__VA_ARGS__))
-#define PEG_DEF_69(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_68(__VA_ARGS__))
-#define PEG_DEF_70(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_69(__VA_ARGS__))
-#define PEG_DEF_71(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_70(__VA_ARGS__))
-#define PEG_DEF_72(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_71(__VA_ARGS__))
-#define PEG_DEF_73(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_72(__VA_ARGS__))
-#define PEG_DEF_74(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_73(__VA_ARGS__))
-#define PEG_DEF_75(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_74(__VA_ARGS__))
-#define PEG_DEF_76(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_75(__VA_ARGS__))
-#define PEG_DEF_77(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_76(__VA_ARGS__))
-#define PEG_DEF_78(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_77(__VA_ARGS__))
-#define PEG_DEF_79(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_78(__VA_ARGS__))
-#define PEG_DEF_80(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_79(__VA_ARGS__))
-#define PEG_DEF_81(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_80(__VA_ARGS__))
-#define PEG_DEF_82(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_81(__VA_ARGS__))
-#define PEG_DEF_83(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_82(__VA_ARGS__))
-#define PEG_DEF_84(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_83(__VA_ARGS__))
-#define PEG_DEF_85(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_84(__VA_ARGS__))
-#define PEG_DEF_86(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_85(__VA_ARGS__))
-#define PEG_DEF_87(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_86(__VA_ARGS__))
-#define PEG_DEF_88(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_87(__VA_ARGS__))
-#define PEG_DEF_89(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_88(__VA_ARGS__))
-#define PEG_DEF_90(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_89(__VA_ARGS__))
-#define PEG_DEF_91(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_90(__VA_ARGS__))
-#define PEG_DEF_92(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_91(__VA_ARGS__))
-#define PEG_DEF_93(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_92(__VA_ARGS__))
-#define PEG_DEF_94(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_93(__VA_ARGS__))
-#define PEG_DEF_95(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_94(__VA_ARGS__))
-#define PEG_DEF_96(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_95(__VA_ARGS__))
-#define PEG_DEF_97(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_96(__VA_ARGS__))
-#define PEG_DEF_98(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_97(__VA_ARGS__))
-#define PEG_DEF_99(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_98(__VA_ARGS__))
-#define PEG_DEF_100(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_99(__VA_ARGS__))
+    auto parent = random(2) ? best_index() : random(corpus.size());
+    auto mutant = measure(mutate(corpus[parent].input));
+    auto new_coverage = add_coverage();
 
-#define AST_DEFINITIONS(...)                                                   \
-  PEG_EXPAND(PEG_CONCAT2(PEG_DEF_, PEG_COUNT(__VA_ARGS__))(__VA_ARGS__))
+    if (new_coverage || mutant.score > corpus[parent].score) {
+      corpus.push_back(std::move(mutant));
+      if (corpus.size() > corpus_limit) {
+        // Drop the cheapest entry
+        size_t worst = 0;
+        for (size_t j = 1; j < corpus.size(); j++) {
+          if (corpus[j].score < corpus[worst].score) { worst = j; }
+        }
+        corpus.erase(corpus.begin() + static_cast<std::ptrdiff_t>(worst));
+      }
+    }
+  }
 
-/*-----------------------------------------------------------------------------
- *  parser
- *---------------------------------------------------------------------------*/
+  // Minimize by removing chunks while the cost per byte doesn't drop
+  auto best = corpus[best_index()];
+  for (auto chunk = (std::max)(best.input.size() / 2, static_cast<size_t>(1));
+       chunk > 0; chunk /= 2) {
+    size_t pos = 0;
+    while (pos < best.input.size()) {
+      if (std::chrono::steady_clock::now() > deadline) { break; }
+      auto candidate = best.input;
+      candidate.erase(pos, chunk);
+      auto e = measure(candidate);
+      if (e.score >= best.score) {
+        best = std::move(e);
+      } else {
+        pos += chunk;
+      }
+    }
+  }
 
-class parser {
-public:
-  parser() = default;
+  measure(best.input);
 
-  parser(const char *s, size_t n, const Rules &rules) {
-    load_grammar(s, n, rules);
+  SlowInput result;
+  result.input = best.input;
+  result.invocations = best.invocations;
+  result.capped = best.capped;
+  for (size_t id = 0; id < run.rule_calls.size(); id++) {
+    if (run.rule_calls[id]) {
+      result.rules.emplace_back(run.names[id], run.rule_calls[id]);
+    }
   }
+  std::stable_sort(result.rules.begin(), result.rules.end(),
+                   [](const auto &a, const auto &b) {
+                     return a.second > b.second;
+                   });
 
-  parser(const char *s, size_t n) : parser(s, n, Rules()) {}
+  return result;
+}
+#endif
 
-  parser(std::string_view sv, const Rules &rules)
-      : parser(sv.data(), sv.size(), rules) {}
+/*-----------------------------------------------------------------------------
+ *  analyze_backtracking
+ *---------------------------------------------------------------------------*/
 
-  parser(std::string_view sv) : parser(sv.data(), sv.size(), Rules()) {}
+struct BacktrackFinding {
+  enum class Kind {
+    // An earlier alternative can fail after consuming input that a later
+    // alternative parses again
+    OverlappingAlternatives,
+    // A rule is called at the same position by several alternatives
+    ReenteredRule,
+    // A lookahead scans a region that is parsed again
+    RescanningPredicate,
+  };
 
-#if defined(__cpp_lib_char8_t)
-  parser(std::u8string_view sv, const Rules &rules)
-      : parser(reinterpret_cast<const char *>(sv.data()), sv.size(), rules) {}
+  enum class Growth {
+    Constant,    // `factor` times
+    Quadratic,   // up to the rest of the input on each loop iteration
+    Exponential, // `factor` times per nesting level
+  };
 
-  parser(std::u8string_view sv)
-      : parser(reinterpret_cast<const char *>(sv.data()), sv.size(), Rules()) {}
-#endif
+  Kind kind = Kind::OverlappingAlternatives;
+  Growth growth = Growth::Constant;
+  // Times the same input can be parsed without memoization
+  size_t factor = 1;
+  std::string rule;
+  size_t line = 1;
+  size_t col = 1;
+  std::string message;
+  std::string suggestion;
+};
 
-  operator bool() { return grammar_ != nullptr; }
+// Longest match of an operator in bytes
+struct ComputeMaxLength : public Ope::Visitor {
+  using Ope::Visitor::visit;
 
-  bool load_grammar(const char *s, size_t n, const Rules &rules) {
-    grammar_ = ParserGenerator::parse(s, n, rules, start_,
-                                      enablePackratParsing_, log_);
-    return grammar_ != nullptr;
-  }
+  static constexpr size_t unbounded = std::numeric_limits<size_t>::max();
 
-  bool load_grammar(const char *s, size_t n) {
-    return load_grammar(s, n, Rules());
+  void visit(Sequence &ope) override {
+    size_t len = 0;
+    for (auto op : ope.opes_) {
+      auto l = get(*op);
+      len = (l == unbounded || len > unbounded - l) ? unbounded : len + l;
+    }
+    result_ = len;
   }
-
-  bool load_grammar(std::string_view sv, const Rules &rules) {
-    return load_grammar(sv.data(), sv.size(), rules);
+  void visit(PrioritizedChoice &ope) override {
+    size_t len = 0;
+    for (auto op : ope.opes_) {
+      len = (std::max)(len, get(*op));
+    }
+    result_ = len;
+  }
+  void visit(Repetition &ope) override {
+    auto len = ope.max_ == 0 ? 0 : get(*ope.ope_);
+    if (len == 0) {
+      result_ = 0;
+    } else if (len == unbounded || ope.max_ == unbounded ||
+               len > unbounded / ope.max_) {
+      result_ = unbounded;
+    } else {
+      result_ = len * ope.max_;
+    }
+  }
+  void visit(Dictionary &ope) override { result_ = ope.trie_.max_length(); }
+  void visit(LiteralString &ope) override { result_ = ope.lit_.size(); }
+  void visit(CharacterClass &) override { result_ = 4; }
+  void visit(Character &) override { result_ = 1; }
+  void visit(AnyCharacter &) override { result_ = 4; }
+  void visit(CaptureScope &ope) override { result_ = get(*ope.ope_); }
+  void visit(Capture &ope) override { result_ = get(*ope.ope_); }
+  void visit(TokenBoundary &ope) override { result_ = get(*ope.ope_); }
+  void visit(Ignore &ope) override { result_ = get(*ope.ope_); }
+  void visit(User &) override { result_ = unbounded; }
+  void visit(WeakHolder &ope) override { result_ = get(*ope.weak_.lock()); }
+  void visit(Holder &ope) override {
+    const auto *rule = ope.outer_;
+    auto it = cache_.find(rule);
+    if (it != cache_.end()) {
+      result_ = it->second;
+    } else if (active_.count(rule)) {
+      result_ = unbounded; // recursion
+    } else {
+      active_.insert(rule);
+      auto len = get(*ope.ope_);
+      active_.erase(rule);
+      cache_[rule] = len;
+      result_ = len;
+    }
   }
+  void visit(Reference &ope) override {
+    // Macro arguments are not known here
+    result_ = ope.rule_ ? get(*ope.get_core_operator()) : unbounded;
+  }
+  void visit(Whitespace &ope) override { result_ = get(*ope.ope_); }
+  void visit(BackReference &) override { result_ = unbounded; }
+  void visit(PrecedenceClimbing &) override { result_ = unbounded; }
+  void visit(Recovery &ope) override { result_ = get(*ope.ope_); }
 
-  bool load_grammar(std::string_view sv) {
-    return load_grammar(sv.data(), sv.size());
+  size_t get(Ope &ope) {
+    result_ = 0;
+    ope.accept(*this);
+    return result_;
   }
 
-  bool parse_n(const char *s, size_t n, const char *path = nullptr) const {
-    if (grammar_ != nullptr) {
-      const auto &rule = (*grammar_)[start_];
-      auto result = rule.parse(s, n, path, log_);
-      return post_process(s, n, result);
+private:
+  size_t result_ = 0;
+  std::unordered_map<const Definition *, size_t> cache_;
+  std::unordered_set<const Definition *> active_;
+};
+
+class BacktrackAnalyzer : public Ope::Visitor {
+public:
+  using Ope::Visitor::visit;
+
+  BacktrackAnalyzer(const Grammar &grammar, std::string_view text)
+      : grammar_(grammar), text_(text) {
+    for (const auto &[name, rule] : grammar_) {
+      ReferenceChecker vis(grammar_, rule.params);
+      rule.get_core_operator()->accept(vis);
+      references_[name] = vis.referenced;
     }
-    return false;
   }
 
-  bool parse_n(const char *s, size_t n, std::any &dt,
-               const char *path = nullptr) const {
-    if (grammar_ != nullptr) {
-      const auto &rule = (*grammar_)[start_];
-      auto result = rule.parse(s, n, dt, path, log_);
-      return post_process(s, n, result);
+  std::vector<BacktrackFinding> analyze() {
+    std::vector<const Definition *> rules;
+    for (const auto &[_, rule] : grammar_) {
+      rules.push_back(&rule);
     }
-    return false;
-  }
+    std::sort(rules.begin(), rules.end(), [](auto a, auto b) {
+      return std::tie(a->line_, a->name) < std::tie(b->line_, b->name);
+    });
 
-  template <typename T>
-  bool parse_n(const char *s, size_t n, T &val,
-               const char *path = nullptr) const {
-    if (grammar_ != nullptr) {
-      const auto &rule = (*grammar_)[start_];
-      auto result = rule.parse_and_get_value(s, n, val, path, log_);
-      return post_process(s, n, result);
+    for (auto rule : rules) {
+      rule_ = rule;
+      rule->get_core_operator()->accept(*this);
     }
-    return false;
+
+    std::stable_sort(findings_.begin(), findings_.end(),
+                     [](const auto &a, const auto &b) {
+                       return std::tie(a.line, a.col) <
+                              std::tie(b.line, b.col);
+                     });
+    return std::move(findings_);
   }
 
-  template <typename T>
-  bool parse_n(const char *s, size_t n, std::any &dt, T &val,
-               const char *path = nullptr) const {
-    if (grammar_ != nullptr) {
-      const auto &rule = (*grammar_)[start_];
-      auto result = rule.parse_and_get_value(s, n, dt, val, path, log_);
-      return post_process(s, n, result);
+  void visit(Sequence &ope) override {
+    for (size_t i = 0; i < ope.opes_.size(); i++) {
+      next_ = i + 1 < ope.opes_.size() ? ope.opes_[i + 1].get() : nullptr;
+      ope.opes_[i]->accept(*this);
+    }
+    next_ = nullptr;
+  }
+  void visit(PrioritizedChoice &ope) override {
+    check_choice(ope);
+    for (auto op : ope.opes_) {
+      next_ = nullptr;
+      op->accept(*this);
+    }
+  }
+  void visit(Repetition &ope) override {
+    auto loop = ope.max_ == std::numeric_limits<size_t>::max();
+    if (loop) { loops_++; }
+    next_ = nullptr;
+    ope.ope_->accept(*this);
+    if (loop) { loops_--; }
+  }
+  void visit(AndPredicate &ope) override {
+    check_predicate(ope, *ope.ope_, ope.s_);
+    next_ = nullptr;
+    ope.ope_->accept(*this);
+  }
+  void visit(NotPredicate &ope) override {
+    check_predicate(ope, *ope.ope_, ope.s_);
+    next_ = nullptr;
+    ope.ope_->accept(*this);
+  }
+  void visit(CaptureScope &ope) override { ope.ope_->accept(*this); }
+  void visit(Capture &ope) override { ope.ope_->accept(*this); }
+  void visit(TokenBoundary &ope) override { ope.ope_->accept(*this); }
+  void visit(Ignore &ope) override { ope.ope_->accept(*this); }
+  void visit(Reference &ope) override {
+    for (auto arg : ope.args_) {
+      next_ = nullptr;
+      arg->accept(*this);
     }
-    return false;
   }
-
-  bool parse(std::string_view sv, const char *path = nullptr) const {
-    return parse_n(sv.data(), sv.size(), path);
+  void visit(Whitespace &ope) override { ope.ope_->accept(*this); }
+  void visit(PrecedenceClimbing &ope) override {
+    next_ = nullptr;
+    ope.atom_->accept(*this);
+    ope.binop_->accept(*this);
   }
+  void visit(Recovery &ope) override { ope.ope_->accept(*this); }
 
-  bool parse(std::string_view sv, std::any &dt,
-             const char *path = nullptr) const {
-    return parse_n(sv.data(), sv.size(), dt, path);
-  }
+private:
+  using Finding = BacktrackFinding;
 
-  template <typename T>
-  bool parse(std::string_view sv, T &val, const char *path = nullptr) const {
-    return parse_n(sv.data(), sv.size(), val, path);
-  }
+  void check_choice(PrioritizedChoice &ope) {
+    auto n = ope.opes_.size();
+    if (n < 2) { return; }
 
-  template <typename T>
-  bool parse(std::string_view sv, std::any &dt, T &val,
-             const char *path = nullptr) const {
-    return parse_n(sv.data(), sv.size(), dt, val, path);
-  }
+    struct Alternative {
+      std::vector<Ope *> elements;
+      std::vector<std::string> texts;
+      FirstSet first;
+      bool unbounded = false;
+    };
 
-#if defined(__cpp_lib_char8_t)
-  bool parse(std::u8string_view sv, const char *path = nullptr) const {
-    return parse_n(reinterpret_cast<const char *>(sv.data()), sv.size(), path);
-  }
+    std::vector<Alternative> alts(n);
+    for (size_t i = 0; i < n; i++) {
+      auto &alt = alts[i];
+      auto op = ope.opes_[i].get();
+      if (auto seq = dynamic_cast<Sequence *>(op)) {
+        for (auto el : seq->opes_) {
+          alt.elements.push_back(el.get());
+        }
+      } else {
+        alt.elements.push_back(op);
+      }
+      for (auto el : alt.elements) {
+        alt.texts.push_back(PegText::group(*el));
+      }
+      alt.first = first_.get(*op);
+      alt.unbounded = max_length_.get(*op) == ComputeMaxLength::unbounded;
+    }
 
-  bool parse(std::u8string_view sv, std::any &dt,
-             const char *path = nullptr) const {
-    return parse_n(reinterpret_cast<const char *>(sv.data()), sv.size(), dt,
-                   path);
-  }
+    // Rules called at the same position: after the same prefix of elements,
+    // at the start of an element
+    std::map<std::pair<std::string, std::string>, std::vector<size_t>> calls;
+    for (size_t i = 0; i < n; i++) {
+      const auto &alt = alts[i];
+      std::string prefix;
+      for (size_t k = 0; k < alt.elements.size(); k++) {
+        for (const auto &name : first_.get(*alt.elements[k]).rules) {
+          auto &v = calls[{prefix, name}];
+          if (v.empty() || v.back() != i) { v.push_back(i); }
+        }
+        prefix += (k ? " " : "") + alt.texts[k];
+      }
+    }
 
-  template <typename T>
-  bool parse(std::u8string_view sv, T &val, const char *path = nullptr) const {
-    return parse_n(reinterpret_cast<const char *>(sv.data()), sv.size(), val,
-                   path);
-  }
+    std::set<std::pair<size_t, size_t>> explained;
+    for (const auto &[key, indexes] : calls) {
+      const auto &[prefix, name] = key;
+      if (indexes.size() < 2) { continue; }
+
+      // Only report the outermost rule when rules call each other
+      auto inner = false;
+      for (const auto &[other_key, other_indexes] : calls) {
+        if (other_key.first == prefix &&
+            other_indexes.size() >= indexes.size() &&
+            calls_first(other_key.second, name)) {
+          inner = true;
+          break;
+        }
+      }
+      if (inner) { continue; }
 
-  template <typename T>
-  bool parse(std::u8string_view sv, std::any &dt, T &val,
-             const char *path = nullptr) const {
-    return parse_n(reinterpret_cast<const char *>(sv.data()), sv.size(), dt,
-                   val, path);
-  }
-#endif
+      auto growth = reaches(name, rule_->name) ? Finding::Growth::Exponential
+                                               : Finding::Growth::Constant;
 
-  Definition &operator[](const char *s) { return (*grammar_)[s]; }
+      // Parsing a short rule again costs little
+      if (growth == Finding::Growth::Constant && grammar_.count(name) &&
+          max_length_.get(*grammar_.at(name).get_core_operator()) !=
+              ComputeMaxLength::unbounded) {
+        continue;
+      }
 
-  const Definition &operator[](const char *s) const { return (*grammar_)[s]; }
+      for (auto i : indexes) {
+        for (auto j : indexes) {
+          if (i < j) { explained.emplace(i, j); }
+        }
+      }
 
-  const Grammar &get_grammar() const { return *grammar_; }
+      Finding f;
+      f.kind = Finding::Kind::ReenteredRule;
+      f.factor = indexes.size();
+      f.growth = growth;
+      f.message = "'" + name +
+                  "' is parsed again at the same position by alternatives " +
+                  list(indexes) + "; re-parse factor: " + estimate(f);
+
+      auto factored = factor_out(alts, indexes);
+      if (!factored.empty()) {
+        f.suggestion = "factor out the common prefix: " + factored +
+                       ", or enable packrat parsing";
+      } else {
+        f.suggestion =
+            "enable packrat parsing so that '" + name + "' is parsed once";
+      }
+      add(f, ope.s_);
+    }
 
-  void disable_eoi_check() {
-    if (grammar_ != nullptr) {
-      auto &rule = (*grammar_)[start_];
-      rule.eoi_check = false;
+    // Alternatives that can consume any amount of input before failing,
+    // followed by ones that start with the same characters
+    for (size_t i = 0; i < n; i++) {
+      if (!alts[i].unbounded) { continue; }
+
+      std::vector<size_t> later;
+      std::bitset<256> overlap;
+      for (size_t j = i + 1; j < n; j++) {
+        auto bytes = alts[i].first.bytes & alts[j].first.bytes;
+        if (bytes.any() && !explained.count({i, j})) {
+          later.push_back(j);
+          overlap |= bytes;
+        }
+      }
+      if (later.empty()) { continue; }
+
+      Finding f;
+      f.kind = Finding::Kind::OverlappingAlternatives;
+      f.factor = 1 + later.size();
+      f.message = "alternative " + std::to_string(i + 1) +
+                  " can fail after consuming any amount of input, and " +
+                  (later.size() == 1 ? "alternative " : "alternatives ") +
+                  list(later) + " can start with the same " +
+                  format_bytes(overlap) + " and parse it again; re-parse " +
+                  "factor: " + estimate(f);
+      f.suggestion = "put a cut (↑) in alternative " + std::to_string(i + 1) +
+                     " after the part that decides it, or left-factor the " +
+                     "alternatives";
+      add(f, ope.s_);
     }
   }
 
-  void enable_packrat_parsing() {
-    if (grammar_ != nullptr) {
-      auto &rule = (*grammar_)[start_];
-      rule.enablePackratParsing = enablePackratParsing_ && true;
+  void check_predicate(Ope &pred, Ope &operand, const char *s) {
+    if (max_length_.get(operand) != ComputeMaxLength::unbounded) { return; }
+
+    auto text = PegText::get(pred);
+
+    Finding f;
+    f.kind = Finding::Kind::RescanningPredicate;
+    f.factor = 2;
+
+    if (loops_) {
+      f.growth = Finding::Growth::Quadratic;
+      f.message = "the lookahead " + text +
+                  " can scan to the end of the input on each iteration of "
+                  "the enclosing repetition; re-parse factor: " +
+                  estimate(f);
+      f.suggestion = "bound the lookahead to a fixed number of characters "
+                     "or tokens";
+      add(f, s);
+      return;
     }
-  }
 
-  void enable_trace(TracerEnter tracer_enter, TracerLeave tracer_leave) {
-    if (grammar_ != nullptr) {
-      auto &rule = (*grammar_)[start_];
-      rule.tracer_enter = tracer_enter;
-      rule.tracer_leave = tracer_leave;
+    ReferenceChecker vis(grammar_, rule_->params);
+    operand.accept(vis);
+    for (const auto &name : vis.referenced) {
+      if (reaches(name, rule_->name)) {
+        f.growth = Finding::Growth::Exponential;
+        break;
+      }
     }
-  }
 
-  void enable_trace(TracerEnter tracer_enter, TracerLeave tracer_leave,
-                    TracerStartOrEnd tracer_start,
-                    TracerStartOrEnd tracer_end) {
-    if (grammar_ != nullptr) {
-      auto &rule = (*grammar_)[start_];
-      rule.tracer_enter = tracer_enter;
-      rule.tracer_leave = tracer_leave;
-      rule.tracer_start = tracer_start;
-      rule.tracer_end = tracer_end;
+    std::vector<std::string> shared;
+    if (next_) {
+      auto rules = first_.get(*next_).rules;
+      for (const auto &name : first_.get(operand).rules) {
+        if (rules.count(name)) { shared.push_back(name); }
+      }
     }
-  }
 
-  void set_verbose_trace(bool verbose_trace) {
-    if (grammar_ != nullptr) {
-      auto &rule = (*grammar_)[start_];
-      rule.verbose_trace = verbose_trace;
+    // The outermost one
+    std::stable_partition(shared.begin(), shared.end(), [&](const auto &name) {
+      return std::none_of(shared.begin(), shared.end(), [&](const auto &other) {
+        return calls_first(other, name);
+      });
+    });
+
+    if (!shared.empty()) {
+      f.message = "'" + shared.front() + "' is parsed by the lookahead " +
+                  text + " and again right after it; re-parse factor: " +
+                  estimate(f);
+      f.suggestion = "enable packrat parsing so that '" + shared.front() +
+                     "' is parsed once";
+    } else {
+      f.message = "the lookahead " + text +
+                  " can scan any amount of input, which is parsed again "
+                  "after it; re-parse factor: " +
+                  estimate(f);
+      f.suggestion = "bound the lookahead to a fixed number of characters "
+                     "or tokens";
     }
+    add(f, s);
   }
 
-  template <typename T = Ast> parser &enable_ast() {
-    for (auto &[_, rule] : *grammar_) {
-      if (!rule.action) { add_ast_action<T>(rule); }
+  void add(Finding &f, const char *s) {
+    f.rule = rule_->name;
+    std::less_equal<const char *> le;
+    if (s && !text_.empty() && le(text_.data(), s) &&
+        le(s, text_.data() + text_.size())) {
+      std::tie(f.line, f.col) = line_info(text_.data(), s);
+    } else {
+      std::tie(f.line, f.col) = rule_->line_;
     }
-    return *this;
+    findings_.push_back(std::move(f));
+  }
+
+  // Whether `name` can be called at the start of another rule `from`
+  bool calls_first(const std::string &from, const std::string &name) {
+    if (from == name || !grammar_.count(from)) { return false; }
+    return first_.get(*grammar_.at(from).get_core_operator()).rules.count(name);
+  }
+
+  bool reaches(const std::string &from, const std::string &to) const {
+    std::unordered_set<std::string> visited{from};
+    std::vector<std::string> stack{from};
+    while (!stack.empty()) {
+      auto name = stack.back();
+      stack.pop_back();
+      if (name == to) { return true; }
+      auto it = references_.find(name);
+      if (it == references_.end()) { continue; }
+      for (const auto &next : it->second) {
+        if (visited.insert(next).second) { stack.push_back(next); }
+      }
+    }
+    return false;
   }
 
-  template <typename T>
-  std::shared_ptr<T> optimize_ast(std::shared_ptr<T> ast,
-                                  bool opt_mode = true) const {
-    return AstOptimizer(opt_mode, get_no_ast_opt_rules()).optimize(ast);
-  }
+  template <typename Alternatives>
+  static std::string factor_out(const Alternatives &alts,
+                                const std::vector<size_t> &indexes) {
+    size_t k = 0;
+    for (;; k++) {
+      const auto &texts = alts[indexes[0]].texts;
+      auto same = k < texts.size();
+      for (auto i : indexes) {
+        same = same && k < alts[i].texts.size() && alts[i].texts[k] == texts[k];
+      }
+      if (!same) { break; }
+    }
+    if (k == 0) { return std::string(); }
 
-  void set_logger(Log log) { log_ = log; }
+    const auto &texts = alts[indexes[0]].texts;
+    std::string prefix;
+    for (size_t i = 0; i < k; i++) {
+      prefix += (i ? " " : "") + texts[i];
+    }
 
-  void set_logger(
-      std::function<void(size_t line, size_t col, const std::string &msg)>
-          log) {
-    log_ = [log](size_t line, size_t col, const std::string &msg,
-                 const std::string & /*rule*/) { log(line, col, msg); };
+    std::string rests;
+    auto optional = false;
+    for (size_t i = 0; i < indexes.size(); i++) {
+      const auto &t = alts[indexes[i]].texts;
+      std::string rest;
+      for (auto j = k; j < t.size(); j++) {
+        rest += (j > k ? " " : "") + t[j];
+      }
+      if (rest.empty()) {
+        if (i + 1 == indexes.size()) {
+          optional = true;
+          break;
+        }
+        rest = "''";
+      }
+      rests += (i ? " / " : "") + rest;
+    }
+    return prefix + " (" + rests + ")" + (optional ? "?" : "");
   }
 
-private:
-  bool post_process(const char *s, size_t n, Definition::Result &r) const {
-    if (log_ && !r.ret) { r.error_info.output_log(log_, s, n); }
-    return r.ret && !r.recovered;
+  static std::string list(const std::vector<size_t> &indexes) {
+    std::string s;
+    for (size_t i = 0; i < indexes.size(); i++) {
+      if (i) { s += i + 1 == indexes.size() ? " and " : ", "; }
+      s += std::to_string(indexes[i] + 1);
+    }
+    return s;
   }
 
-  std::vector<std::string> get_no_ast_opt_rules() const {
-    std::vector<std::string> rules;
-    for (auto &[name, rule] : *grammar_) {
-      if (rule.no_ast_opt) { rules.push_back(name); }
+  static std::string estimate(const Finding &f) {
+    switch (f.growth) {
+    case Finding::Growth::Constant: return std::to_string(f.factor);
+    case Finding::Growth::Quadratic:
+      return "up to the input length (quadratic)";
+    case Finding::Growth::Exponential:
+      return std::to_string(f.factor) + " per nesting level (exponential)";
     }
-    return rules;
+    return std::string();
   }
 
-  std::shared_ptr<Grammar> grammar_;
-  std::string start_;
-  bool enablePackratParsing_ = false;
-  Log log_;
-};
-
-/*-----------------------------------------------------------------------------
- *  enable_tracing
- *---------------------------------------------------------------------------*/
-
-inline void enable_tracing(parser &parser, std::ostream &os) {
-  parser.enable_trace(
-      [&](auto &ope, auto s, auto, auto &, auto &c, auto &, auto &trace_data) {
-        auto prev_pos = std::any_cast<size_t>(trace_data);
-        auto pos = static_cast<size_t>(s - c.s);
-        auto backtrack = (pos < prev_pos ? "*" : "");
-        std::string indent;
-        auto level = c.trace_ids.size() - 1;
-        while (level--) {
-          indent += "│";
-        }
-        std::string name;
-        {
-          name = peg::TraceOpeName::get(const_cast<peg::Ope &>(ope));
-
-          auto lit = dynamic_cast<const peg::LiteralString *>(&ope);
-          if (lit) { name += " '" + peg::escape_characters(lit->lit_) + "'"; }
-        }
-        os << "E " << pos + 1 << backtrack << "\t" << indent << "┌" << name
-           << " #" << c.trace_ids.back() << std::endl;
-        trace_data = static_cast<size_t>(pos);
-      },
-      [&](auto &ope, auto s, auto, auto &sv, auto &c, auto &, auto len,
-          auto &) {
-        auto pos = static_cast<size_t>(s - c.s);
-        if (len != static_cast<size_t>(-1)) { pos += len; }
-        std::string indent;
-        auto level = c.trace_ids.size() - 1;
-        while (level--) {
-          indent += "│";
-        }
-        auto ret = len != static_cast<size_t>(-1) ? "└o " : "└x ";
-        auto name = peg::TraceOpeName::get(const_cast<peg::Ope &>(ope));
-        std::stringstream choice;
-        if (sv.choice_count() > 0) {
-          choice << " " << sv.choice() << "/" << sv.choice_count();
-        }
-        std::string token;
-        if (!sv.tokens.empty()) {
-          token += ", token '";
-          token += sv.tokens[0];
-          token += "'";
-        }
-        std::string matched;
-        if (peg::success(len) &&
-            peg::TokenChecker::is_token(const_cast<peg::Ope &>(ope))) {
-          matched = ", match '" + peg::escape_characters(s, len) + "'";
-        }
-        os << "L " << pos + 1 << "\t" << indent << ret << name << " #"
-           << c.trace_ids.back() << choice.str() << token << matched
-           << std::endl;
-      },
-      [&](auto &trace_data) { trace_data = static_cast<size_t>(0); },
-      [&](auto &) {});
-}
-
-/*-----------------------------------------------------------------------------
- *  enable_profiling
- *---------------------------------------------------------------------------*/
+  static std::string format_bytes(const std::bitset<256> &bytes) {
+    if (bytes.all()) { return "characters"; }
 
-inline void enable_profiling(parser &parser, std::ostream &os) {
-  struct Stats {
-    struct Item {
-      std::string name;
-      size_t success;
-      size_t fail;
+    auto escape = [](size_t b) {
+      if (b == ']' || b == '\\' || b == '-' || b == '^') {
+        return "\\" + std::string(1, static_cast<char>(b));
+      } else if (0x20 < b && b < 0x7f) {
+        return std::string(1, static_cast<char>(b));
+      }
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\x%02zX", b);
+      return std::string(buf);
     };
-    std::vector<Item> items;
-    std::map<std::string, size_t> index;
-    size_t total = 0;
-    std::chrono::steady_clock::time_point start;
-  };
-
-  parser.enable_trace(
-      [&](auto &ope, auto, auto, auto &, auto &, auto &, std::any &trace_data) {
-        if (auto holder = dynamic_cast<const peg::Holder *>(&ope)) {
-          auto &stats = *std::any_cast<Stats *>(trace_data);
-
-          auto &name = holder->name();
-          if (stats.index.find(name) == stats.index.end()) {
-            stats.index[name] = stats.index.size();
-            stats.items.push_back({name, 0, 0});
-          }
-          stats.total++;
-        }
-      },
-      [&](auto &ope, auto, auto, auto &, auto &, auto &, auto len,
-          std::any &trace_data) {
-        if (auto holder = dynamic_cast<const peg::Holder *>(&ope)) {
-          auto &stats = *std::any_cast<Stats *>(trace_data);
-
-          auto &name = holder->name();
-          auto index = stats.index[name];
-          auto &stat = stats.items[index];
-          if (len != static_cast<size_t>(-1)) {
-            stat.success++;
-          } else {
-            stat.fail++;
-          }
 
-          if (index == 0) {
-            auto end = std::chrono::steady_clock::now();
-            auto nano = std::chrono::duration_cast<std::chrono::microseconds>(
-                            end - stats.start)
-                            .count();
-            auto sec = nano / 1000000.0;
-            os << "duration: " << sec << "s (" << nano << "µs)" << std::endl
-               << std::endl;
-
-            char buff[BUFSIZ];
-            size_t total_success = 0;
-            size_t total_fail = 0;
-            for (auto &[name, success, fail] : stats.items) {
-              total_success += success;
-              total_fail += fail;
-            }
+    std::string s;
+    size_t b = 0;
+    while (b < 256) {
+      if (!bytes[b]) {
+        b++;
+        continue;
+      }
+      auto e = b;
+      while (e + 1 < 256 && bytes[e + 1]) {
+        e++;
+      }
+      s += escape(b);
+      if (e > b) { s += (e > b + 1 ? "-" : "") + escape(e); }
+      b = e + 1;
+    }
+    return "characters [" + s + "]";
+  }
 
-            os << "  id       total      %     success        fail  "
-                  "definition"
-               << std::endl;
+  const Grammar &grammar_;
+  std::string_view text_;
+  std::unordered_map<std::string, std::unordered_set<std::string>> references_;
+  ComputeFirstSet first_;
+  ComputeMaxLength max_length_;
+  const Definition *rule_ = nullptr;
+  Ope *next_ = nullptr;
+  size_t loops_ = 0;
+  std::vector<Finding> findings_;
+};
 
-            auto grand_total = total_success + total_fail;
-            snprintf(buff, BUFSIZ, "%4s  %10zu  %5s  %10zu  %10zu  %s", "",
-                     grand_total, "", total_success, total_fail,
-                     "Total counters");
-            os << buff << std::endl;
+// Finds where the grammar can parse the same input more than once without
+// memoization, with an estimate of how many times and a suggested fix.
+// Positions come from `grammar_text` when it is the text the grammar was
+// loaded from, or are the rule's position otherwise.
+inline std::vector<BacktrackFinding>
+analyze_backtracking(const Grammar &grammar,
+                     std::string_view grammar_text = std::string_view()) {
+  return BacktrackAnalyzer(grammar, grammar_text).analyze();
+}
 
-            snprintf(buff, BUFSIZ, "%4s  %10s  %5s  %10.2f  %10.2f  %s", "", "",
-                     "", total_success * 100.0 / grand_total,
-                     total_fail * 100.0 / grand_total, "% success/fail");
-            os << buff << std::endl << std::endl;
-            ;
-
-            size_t id = 0;
-            for (auto &[name, success, fail] : stats.items) {
-              auto total = success + fail;
-              auto ratio = total * 100.0 / stats.total;
-              snprintf(buff, BUFSIZ, "%4zu  %10zu  %5.2f  %10zu  %10zu  %s", id,
-                       total, ratio, success, fail, name.c_str());
-              os << buff << std::endl;
-              id++;
-            }
-          }
-        }
-      },
-      [&](auto &trace_data) {
-        auto stats = new Stats{};
-        stats->start = std::chrono::steady_clock::now();
-        trace_data = stats;
-      },
-      [&](auto &trace_data) {
-        auto stats = std::any_cast<Stats *>(trace_data);
-        delete stats;
-      });
+inline std::vector<BacktrackFinding>
+analyze_backtracking(parser &parser,
+                     std::string_view grammar_text = std::string_view()) {
+  if (!parser) { return {}; }
+  return analyze_backtracking(parser.get_grammar(), grammar_text);
 }
 } // namespace peg
@@ -49,6 +49,45 @@ TEST(GeneralTest, Invalid_UTF8_text_test) {
   EXPECT_FALSE(ret);
 }
 
+TEST(GeneralTest, Invalid_UTF8_input_test) {
+  parser parser("S <- .*");
+
+  std::vector<std::string> errors;
+  parser.set_logger([&](size_t ln, size_t col, const std::string &msg) {
+    errors.push_back(std::to_string(ln) + ":" + std::to_string(col) + ": " +
+                     msg);
+  });
+
+  // Overlong encoding of '/'
+  std::string s = "\xce\xb1\n\xce\xb2\xc0\xaf";
+  EXPECT_TRUE(parser.parse(s));
+
+  parser.enable_utf8_check();
+  EXPECT_TRUE(parser.parse("\xce\xb1\n\xce\xb2"));
+  EXPECT_FALSE(parser.parse(s));
+  ASSERT_EQ(1, errors.size());
+  EXPECT_EQ("2:2: invalid UTF-8 sequence.", errors[0]);
+}
+
+TEST(GeneralTest, Valid_UTF8_length_test) {
+  auto valid = [](std::string_view s) {
+    return valid_utf8_length(s.data(), s.size());
+  };
+
+  EXPECT_EQ(16, valid("0123456789abcdef"));
+  EXPECT_EQ(12, valid("a\xc2\x80\xdf\xbf\xe0\xa0\x80\xf4\x8f\xbf\xbf"));
+  EXPECT_EQ(9, valid("012345678\x80"));
+  EXPECT_EQ(1, valid("a\xc1\xbf"));         // overlong
+  EXPECT_EQ(1, valid("a\xe0\x9f\xbf"));     // overlong
+  EXPECT_EQ(1, valid("a\xed\xa0\x80"));     // surrogate
+  EXPECT_EQ(1, valid("a\xf4\x90\x80\x80")); // above U+10FFFF
+  EXPECT_EQ(1, valid("a\xe3\x81"));         // truncated
+  EXPECT_EQ(1, valid("a\xe3\x81z"));
+
+  std::string_view s = "abc\xce\xb1\xce\xb2\xe3\x81\x82xyz\xf0\x9f\x98\x80";
+  EXPECT_EQ(10, codepoint_count(s.data(), s.size()));
+}
+
 TEST(GeneralTest, Backslash_escape_sequence_test) {
   parser parser(R"(
         ROOT <- _
@@ -152,6 +191,45 @@ TEST(GeneralTest, String_capture_test3) {
   EXPECT_EQ("tag-3", tags[2]);
 }
 
+TEST(GeneralTest, Static_expression_test) {
+  using Alpha = st::cls<st::range<'a', 'z'>, st::range<'_'>>;
+  using Ident =
+      st::seq<Alpha, st::zom<st::cho<Alpha, st::cls<st::range<'0', '9'>>>>>;
+  using Keyword = st::seq<st::liti<'i', 'f'>, st::npd<Alpha>>;
+  using Quoted = st::seq<st::chr<'\''>, st::zom<st::ncls<st::range<'\''>>>,
+                         st::chr<'\''>>;
+
+  static_assert(Alpha::bits[1] != 0 && Alpha::bits[0] == 0);
+
+  EXPECT_EQ(5, Ident::match("abc_1 ", 6));
+  EXPECT_TRUE(fail(Ident::match("1abc", 4)));
+  EXPECT_EQ(2, Keyword::match("IF x", 4));
+  EXPECT_TRUE(fail(Keyword::match("iffy", 4)));
+  EXPECT_EQ(6, Quoted::match(u8"'\u3042x' ", 7));
+  EXPECT_TRUE(fail(Quoted::match("'abc", 4)));
+  EXPECT_EQ(2, (st::rep<st::dot, 2, 2>::match("abc", 3)));
+  EXPECT_EQ(1, (st::zom<st::opt<st::chr<'a'>>>::match("ab", 2)));
+  EXPECT_EQ(0, (st::rep<st::apd<Alpha>, 3, 3>::match("a", 1)));
+  EXPECT_EQ(0, st::apd<Alpha>::match("a", 1));
+
+  parser pg(R"(
+        ROOT        <- (KEYWORD / IDENT)*
+        %whitespace <- [ \t]*
+    )",
+            {{"IDENT", tok(st::ope<Ident>())},
+             {"KEYWORD", tok(st::ope<Keyword>())}});
+  ASSERT_TRUE(static_cast<bool>(pg));
+
+  std::vector<std::string> idents;
+  pg["IDENT"] = [&](const SemanticValues &vs) {
+    idents.emplace_back(vs.token());
+  };
+
+  EXPECT_TRUE(pg.parse(" foo  If bar_2 "));
+  EXPECT_EQ((std::vector<std::string>{"foo", "bar_2"}), idents);
+  EXPECT_FALSE(pg.parse("foo 2bar"));
+}
+
 TEST(GeneralTest, Cyclic_grammar_test) {
   Definition PARENT;
   Definition CHILD;
@@ -1,7 +1,12 @@
 ﻿#include <gtest/gtest.h>
+#include <fstream>
+#include <numeric>
 #include <peglib.h>
 #include <sstream>
 
+#include "emit_cpp_parser.h"
+#include "json_parser.h"
+
 using namespace peg;
 
 TEST(TokenBoundaryTest, Token_boundary_1) {
@@ -537,6 +542,339 @@ TEST(PackratTest, Packrat_parser_test_with_precedence_expression_parser) {
   EXPECT_TRUE(ret);
 }
 
+TEST(IncrementalTest, Reparse_after_edits) {
+  parser parser(R"(
+    LIST    <- '[' ITEM (',' ITEM)* ']'
+    ITEM    <- NUMBER / LIST
+    NUMBER  <- < [0-9]+ >
+    %whitespace <- [ \t\r\n]*
+  )");
+
+  size_t number_count = 0;
+  parser["LIST"] = [](const SemanticValues &vs) {
+    long sum = 0;
+    for (const auto &v : vs) {
+      sum += std::any_cast<long>(v);
+    }
+    return sum;
+  };
+  parser["NUMBER"] = [&](const SemanticValues &vs) {
+    number_count++;
+    return vs.token_to_number<long>();
+  };
+
+  ParseState state("[1, 2, [3, 4], 5]");
+
+  long val = 0;
+  EXPECT_TRUE(parser.parse_incremental(state, {}, val));
+  EXPECT_EQ(15, val);
+  EXPECT_EQ(5, number_count);
+  EXPECT_LT(0, state.memo_size());
+
+  // Replace '4' with '40'
+  number_count = 0;
+  EXPECT_TRUE(parser.parse_incremental(state, {{11, 1, "40"}}, val));
+  EXPECT_EQ("[1, 2, [3, 40], 5]", state.text());
+  EXPECT_EQ(51, val);
+  EXPECT_EQ(1, number_count);
+
+  // Append an item at the end and remove the first one
+  number_count = 0;
+  EXPECT_TRUE(parser.parse_incremental(state, {{17, 0, ", 6"}, {1, 3, ""}},
+                                       val));
+  EXPECT_EQ("[2, [3, 40], 5, 6]", state.text());
+  EXPECT_EQ(56, val);
+  EXPECT_EQ(2, number_count);
+}
+
+TEST(IncrementalTest, Reparse_matches_full_parse) {
+  parser parser(R"(
+    EXPR    <- TERM (('+' / '-') TERM)*
+    TERM    <- FACTOR (('*' / '/') FACTOR)*
+    FACTOR  <- 'x' / NUMBER / '(' EXPR ')'
+    NUMBER  <- < [0-9]+ >
+    %whitespace <- [ \t]*
+    %word   <- [a-z0-9]+
+  )");
+
+  std::vector<std::string> errors;
+  parser.set_logger([&](size_t ln, size_t col, const std::string &msg) {
+    errors.push_back(std::to_string(ln) + ":" + std::to_string(col) + ":" +
+                     msg);
+  });
+
+  ParseState state("1 + 2 * (3 - x) / 4");
+  EXPECT_TRUE(parser.parse_incremental(state, {}));
+
+  std::vector<TextEdit> edits = {
+      {0, 1, "10"},   {5, 0, "x * "}, {9, 1, "(2 + 2)"}, {3, 0, "+"},
+      {3, 1, ""},     {0, 0, "("},    {1, 0, ")"},       {1, 1, ""},
+      {0, 1, ""},     {28, 0, "7"},   {0, 0, "xx"},      {0, 2, ""},
+  };
+
+  for (const auto &edit : edits) {
+    errors.clear();
+    auto ret = parser.parse_incremental(state, {edit});
+    auto incremental_errors = errors;
+
+    errors.clear();
+    EXPECT_EQ(parser.parse(state.text()), ret) << state.text();
+    EXPECT_EQ(errors, incremental_errors) << state.text();
+  }
+}
+
+TEST(ParallelTest, Records_with_delimiter) {
+  parser parser(R"(
+    FILE    <- RECORD*
+    RECORD  <- FIELD (',' FIELD)* '\n'
+    FIELD   <- QUOTED / PLAIN
+    QUOTED  <- '"' < [^"]* > '"'
+    PLAIN   <- < [^,"\n]* >
+  )");
+
+  parser["RECORD"] = [](const SemanticValues &vs) { return vs.size(); };
+
+  std::string text;
+  std::vector<size_t> expected;
+  for (size_t i = 0; i < 200; i++) {
+    if (i % 7 == 0) {
+      text += "a,\"multi\nline\",b\n";
+      expected.push_back(3);
+    } else {
+      text += std::to_string(i) + "," + std::to_string(i * i) + "\n";
+      expected.push_back(2);
+    }
+  }
+
+  std::vector<std::string> errors;
+  parser.set_logger([&](size_t ln, size_t col, const std::string &msg) {
+    errors.push_back(std::to_string(ln) + ":" + std::to_string(col) + ":" +
+                     msg);
+  });
+
+  size_t task_count = 0;
+  parser.set_executor(
+      [&](size_t count, const std::function<void(size_t)> &task) {
+        task_count = count;
+        thread_executor(count, task);
+      });
+  parser.set_parallel_chunk_size(64);
+
+  std::vector<size_t> values;
+  EXPECT_TRUE(parser.parse_records(text, "RECORD", '\n', values));
+  EXPECT_EQ(text.size() / 64, task_count);
+  EXPECT_EQ(expected, values);
+  EXPECT_TRUE(errors.empty());
+
+  text.insert(text.size() / 2, "x\"y");
+
+  EXPECT_FALSE(parser.parse_records(text, "RECORD", '\n', values));
+  auto parallel_errors = errors;
+  EXPECT_FALSE(parallel_errors.empty());
+
+  errors.clear();
+  parser.set_parallel_chunk_size(0);
+  EXPECT_FALSE(parser.parse_records(text, "RECORD", '\n', values));
+  EXPECT_EQ(errors, parallel_errors);
+}
+
+TEST(ParallelTest, Records_with_resync_rule) {
+  parser parser(R"(
+    ITEMS   <- ITEM*
+    ITEM    <- '{' < [a-z]* > '}' _
+    START   <- &'{'
+    ~_      <- [ \n]*
+  )");
+
+  parser["ITEM"] = [](const SemanticValues &vs) {
+    return vs.token_to_string();
+  };
+
+  std::string text;
+  std::vector<std::string> expected;
+  for (size_t i = 0; i < 100; i++) {
+    expected.push_back(std::string(i % 5, 'a' + i % 26));
+    text += "{" + expected.back() + "}" + (i % 3 ? " " : "\n");
+  }
+
+  parser.set_parallel_chunk_size(32);
+
+  std::vector<std::string> values;
+  EXPECT_TRUE(parser.parse_records(text, "ITEM", "START", values));
+  EXPECT_EQ(expected, values);
+}
+
+TEST(ParallelTest, Records_with_packrat_parsing) {
+  parser parser(R"(
+    RECORDS <- RECORD*
+    RECORD  <- A 'x' '\n' / A 'y' '\n' / A '\n'
+    A       <- '(' A ')' 'a' / '(' A ')' 'b' / 'c'
+    OTHER   <- 'z'
+  )");
+
+  std::atomic<size_t> calls{0};
+  parser["A"].enter = [&](const Context &, const char *, size_t, std::any &) {
+    calls++;
+  };
+
+  std::string line = "c";
+  for (auto i = 0; i < 12; i++) {
+    line = "(" + line + ")b";
+  }
+  line += "\n";
+  std::string text;
+  for (auto i = 0; i < 32; i++) {
+    text += line;
+  }
+
+  parser.enable_packrat_parsing();
+  parser.set_parallel_chunk_size(128);
+
+  std::vector<size_t> values;
+  EXPECT_TRUE(parser.parse_records(text, "RECORD", '\n', values));
+  EXPECT_GT(text.size() * 2, calls);
+
+  // The record rule has to be reachable from the start rule
+  EXPECT_FALSE(parser.parse_records(text, "OTHER", '\n', values));
+}
+
+TEST(ParallelTest, Batch_parse) {
+  parser parser(R"(
+    LIST    <- NUMBER (',' NUMBER)*
+    NUMBER  <- < [0-9]+ >
+    %whitespace <- [ ]*
+  )");
+
+  parser["LIST"] = [](const SemanticValues &vs) {
+    long sum = 0;
+    for (const auto &v : vs) {
+      sum += std::any_cast<long>(v);
+    }
+    return sum;
+  };
+  parser["NUMBER"] = [](const SemanticValues &vs) {
+    return vs.token_to_number<long>();
+  };
+
+  std::vector<std::string> texts;
+  for (size_t i = 0; i < 1000; i++) {
+    auto text = std::to_string(i);
+    if (i % 3) { text += ", " + std::to_string(i * 2); }
+    if (i % 100 == 0) { text += " ,"; }
+    texts.push_back(text);
+  }
+  std::vector<std::string_view> inputs(texts.begin(), texts.end());
+
+  auto result = parser.parse_batch<long>(inputs);
+  EXPECT_EQ(inputs.size(), result.size());
+
+  for (size_t i = 0; i < inputs.size(); i++) {
+    std::vector<std::string> errors;
+    parser.set_logger([&](size_t ln, size_t col, const std::string &msg) {
+      errors.push_back(std::to_string(ln) + ":" + std::to_string(col) + ":" +
+                       msg);
+    });
+
+    long val = 0;
+    auto ret = parser.parse(inputs[i], val);
+    EXPECT_EQ(ret, result.success[i] != 0);
+    if (ret) {
+      EXPECT_EQ(inputs[i].size(), result.lengths[i]);
+      EXPECT_EQ(val, result.values[i]);
+      EXPECT_TRUE(result.errors[i].empty());
+    } else {
+      EXPECT_FALSE(errors.empty());
+      ASSERT_EQ(errors.size(), result.errors[i].size());
+      for (size_t j = 0; j < errors.size(); j++) {
+        const auto &err = result.errors[i][j];
+        EXPECT_EQ(errors[j], std::to_string(err.line) + ":" +
+                                 std::to_string(err.column) + ":" +
+                                 err.message);
+      }
+    }
+  }
+
+  auto any_result = parser.parse_batch(inputs);
+  EXPECT_EQ(3, std::any_cast<long>(any_result.values[1]));
+}
+
+TEST(ParallelTest, Speculative_parse) {
+  parser parser(R"(
+    LIST    <- '[' (VALUE (',' VALUE)*)? ']'
+    VALUE   <- NUMBER / STRING / LIST
+    NUMBER  <- < [0-9]+ >
+    STRING  <- '"' < [^"]* > '"'
+    %whitespace <- [ \n]*
+  )");
+
+  std::atomic<size_t> value_count{0};
+  parser["LIST"] = [](const SemanticValues &vs) {
+    std::string s = "(";
+    for (const auto &v : vs) {
+      s += std::any_cast<std::string>(v) + ";";
+    }
+    return s + ")";
+  };
+  parser["VALUE"] = [&](const SemanticValues &vs) {
+    value_count++;
+    return vs.choice() == 2 ? std::any_cast<std::string>(vs[0])
+                            : std::string(vs.token());
+  };
+
+  std::string text = "[";
+  for (size_t i = 0; i < 300; i++) {
+    if (i) { text += ",\n "; }
+    switch (i % 3) {
+    case 0: text += std::to_string(i); break;
+    case 1: text += "\"[" + std::to_string(i) + ", \""; break;
+    default: text += "[" + std::to_string(i) + ", [], [\"x\"]]"; break;
+    }
+  }
+  text += "]";
+
+  std::string expected;
+  EXPECT_TRUE(parser.parse(text, expected));
+  auto serial_count = value_count.load();
+
+  // Run the speculative tasks before the serial one to make the reuse
+  // deterministic.
+  size_t serial_task_count = 0;
+  parser.set_executor(
+      [&](size_t count, const std::function<void(size_t)> &task) {
+        for (size_t k = count; k-- > 1;) {
+          task(k);
+        }
+        value_count = 0;
+        task(0);
+        serial_task_count = value_count;
+      });
+  parser.set_parallel_chunk_size(128);
+
+  std::string actual;
+  EXPECT_TRUE(parser.parse_speculative(text, "VALUE", actual));
+  EXPECT_EQ(expected, actual);
+  EXPECT_LT(serial_task_count, serial_count / 2);
+
+  parser.set_executor(thread_executor);
+  actual.clear();
+  EXPECT_TRUE(parser.parse_speculative(text, "VALUE", actual));
+  EXPECT_EQ(expected, actual);
+
+  std::vector<std::string> errors;
+  parser.set_logger([&](size_t ln, size_t col, const std::string &msg) {
+    errors.push_back(std::to_string(ln) + ":" + std::to_string(col) + ":" +
+                     msg);
+  });
+
+  text.insert(text.size() * 3 / 4, "}");
+  EXPECT_FALSE(parser.parse_speculative(text, "VALUE"));
+  auto speculative_errors = errors;
+
+  errors.clear();
+  EXPECT_FALSE(parser.parse(text));
+  EXPECT_EQ(errors, speculative_errors);
+}
+
 TEST(BackreferenceTest, Backreference_test) {
   parser parser(R"(
         START  <- _ LQUOTE < (!RQUOTE .)* > RQUOTE _
@@ -716,6 +1054,31 @@ TEST(BackreferenceTest, Backreference_with_Option_test) {
   EXPECT_FALSE(parser.parse("branchthatiswron_branchthatiscorrect"));
 }
 
+TEST(BackreferenceTest, Backreference_discarded_by_predicate_test) {
+  parser parser(R"(
+        START <- &($tag<[a-z]+>) [a-z]+ ':' $tag
+    )");
+
+  std::string msg;
+  parser.set_logger([&](size_t, size_t, const std::string &m) { msg = m; });
+
+  EXPECT_FALSE(parser.parse("abc:abc"));
+  EXPECT_EQ("undefined back reference '$tag'...", msg);
+}
+
+TEST(BackreferenceTest, Backreference_error_message_test) {
+  parser parser(R"(
+        START <- ($tag<[a-z]+> ':' $tag ';')+
+    )");
+
+  std::string msg;
+  parser.set_logger([&](size_t, size_t, const std::string &m) { msg = m; });
+
+  EXPECT_TRUE(parser.parse("abc:abc;xy:xy;"));
+  EXPECT_FALSE(parser.parse("abc:abc;xy:xz;"));
+  EXPECT_EQ("syntax error, unexpected 'xz', expecting 'xy'.", msg);
+}
+
 TEST(RepetitionTest, Repetition_0) {
   parser parser(R"(
         START <- '(' DIGIT{3} ') ' DIGIT{3} '-' DIGIT{4}
@@ -833,6 +1196,250 @@ TEST(UserRuleTest, User_defined_rule_test) {
   EXPECT_TRUE(g.parse(" Hello BNF! "));
 }
 
+TEST(SnapshotTest, Save_and_load_snapshot) {
+  auto grammar = R"(
+    START       <- STATEMENT*
+    STATEMENT   <- (ASSIGN / HEREDOC / EXPR) ';'^semicolon
+    ASSIGN      <- NAME '=' EXPR
+    HEREDOC     <- '<<' $tag< [A-Z]+ > < (!$tag .)* > $tag
+    EXPR        <- ATOM (BINOP ATOM)* {
+                     precedence
+                       L + -
+                       L * /
+                   }
+    ATOM        <- NUMBER / KEYWORD / LIST(NAME) / NAME / '(' EXPR ')'
+    LIST(X)     <- '[' (X (',' X)*)? ']'
+    KEYWORD     <- 'true'i | 'false'i
+    BINOP       <- < [-+*/] >
+    NAME        <- < !KEYWORD [a-z]+ >
+    NUMBER      <- < [0-9]+ > EXT
+    %whitespace <- [ \t\n]*
+    %word       <- [a-z]+
+    semicolon   <- '' { error_message "missing semicolon" }
+  )";
+
+  Rules rules = {{"EXT", opt(chr('u'))}};
+
+  parser original(grammar, rules);
+  ASSERT_TRUE(static_cast<bool>(original));
+  original.enable_ast();
+
+  std::stringstream ss;
+  EXPECT_TRUE(original.save_snapshot(ss));
+  auto snapshot = ss.str();
+
+  parser loaded;
+  {
+    std::istringstream is(snapshot);
+    ASSERT_TRUE(loaded.load_snapshot(is, grammar, rules));
+  }
+  loaded.enable_ast();
+
+  std::vector<std::string> inputs = {
+      "a = 1 + 2 * [x, y];",
+      "<<EOF hello; EOF;",
+      "TRUE; x = (1 + 2u) * 3 - 4;",
+      "a = trueish;",
+      "a = 1 b = 2;",
+      "<<EOF oops EOX;",
+  };
+
+  for (size_t k = 0; k < inputs.size(); k++) {
+    const auto &input = inputs[k];
+    std::vector<std::string> errors[2];
+    std::shared_ptr<Ast> asts[2];
+    bool rets[2];
+
+    parser *parsers[] = {&original, &loaded};
+    for (auto i = 0; i < 2; i++) {
+      parsers[i]->set_logger(
+          [&errors, i](size_t ln, size_t col, const std::string &msg) {
+            errors[i].push_back(std::to_string(ln) + ":" +
+                                std::to_string(col) + ":" + msg);
+          });
+      rets[i] = parsers[i]->parse(input, asts[i]);
+    }
+
+    EXPECT_EQ(k < 4, rets[0]) << input;
+    EXPECT_EQ(rets[0], rets[1]) << input;
+    EXPECT_EQ(errors[0], errors[1]) << input;
+    if (rets[0] && rets[1]) { EXPECT_EQ(ast_to_s(asts[0]), ast_to_s(asts[1])); }
+  }
+
+  // Different grammar text
+  {
+    std::istringstream is(snapshot);
+    EXPECT_FALSE(loaded.load_snapshot(is, std::string(grammar) + " ", rules));
+  }
+
+  // Missing user rule
+  {
+    std::istringstream is(snapshot);
+    EXPECT_FALSE(loaded.load_snapshot(is, grammar));
+  }
+
+  // Truncated snapshot
+  {
+    std::istringstream is(snapshot.substr(0, snapshot.size() / 2));
+    EXPECT_FALSE(loaded.load_snapshot(is, grammar, rules));
+  }
+
+  // Corrupt snapshots
+  for (size_t i = 0; i < snapshot.size(); i++) {
+    auto data = snapshot;
+    data[i] ^= 0x10;
+    std::istringstream is(data);
+    EXPECT_FALSE(loaded.load_snapshot(is, grammar, rules)) << i;
+  }
+
+  // A reference to a missing rule, with a matching checksum
+  {
+    auto data = snapshot;
+    data[data.find("EXPR")] = 'X';
+    auto checksum = grammar_text_hash(std::string_view(data).substr(36));
+    for (auto i = 0; i < 8; i++) {
+      data[28 + i] = static_cast<char>(checksum >> (i * 8));
+    }
+    std::istringstream is(data);
+    EXPECT_FALSE(loaded.load_snapshot(is, grammar, rules));
+  }
+}
+
+// Parses each input with both parsers, which must agree on the result, the
+// error messages and the AST
+static void expect_same_parses(parser &original, parser &generated,
+                               const std::vector<std::string> &inputs,
+                               size_t valid_count) {
+  original.enable_ast();
+  generated.enable_ast();
+
+  for (size_t k = 0; k < inputs.size(); k++) {
+    const auto &input = inputs[k];
+    std::vector<std::string> errors[2];
+    std::shared_ptr<Ast> asts[2];
+    bool rets[2];
+
+    parser *parsers[] = {&original, &generated};
+    for (auto i = 0; i < 2; i++) {
+      parsers[i]->set_logger(
+          [&errors, i](size_t ln, size_t col, const std::string &msg) {
+            errors[i].push_back(std::to_string(ln) + ":" +
+                                std::to_string(col) + ":" + msg);
+          });
+      rets[i] = parsers[i]->parse(input, asts[i]);
+    }
+
+    EXPECT_EQ(k < valid_count, rets[0]) << input;
+    EXPECT_EQ(rets[0], rets[1]) << input;
+    EXPECT_EQ(errors[0], errors[1]) << input;
+    if (rets[0] && rets[1]) { EXPECT_EQ(ast_to_s(asts[0]), ast_to_s(asts[1])); }
+  }
+}
+
+TEST(EmitCppTest, Generated_parser_matches_grammar_text) {
+  std::ifstream ifs(PEGLIB_GRAMMAR_DIR "/json.peg");
+  std::string grammar((std::istreambuf_iterator<char>(ifs)),
+                      std::istreambuf_iterator<char>());
+
+  parser original(grammar);
+  ASSERT_TRUE(static_cast<bool>(original));
+
+  auto generated = json_parser();
+  ASSERT_TRUE(static_cast<bool>(generated));
+
+  // Every rule of the JSON grammar runs as generated code
+  for (auto name : {"json", "object", "value", "number", "string", "char",
+                    "unescaped", "%whitespace"}) {
+    EXPECT_TRUE(static_cast<bool>(generated[name].parse_body)) << name;
+  }
+
+  std::vector<std::string> inputs = {
+      R"({"a": [1, -2.5e3, true, null], "b": {"c": "\u00e9\n"}})",
+      "[ ]",
+      " [0, 10.25, \"\xC3\xA9\u4e2d\",\n{}] ",
+      "[1, 2,]",
+      R"({"a" 1})",
+      R"(["unterminated])",
+      "[01]",
+      "[\"\xC3\"]",
+      "[tru]",
+  };
+  expect_same_parses(original, generated, inputs, 3);
+}
+
+TEST(EmitCppTest, Generated_parser_with_operator_fallback) {
+  std::ifstream ifs(PEGLIB_TEST_DIR "/emit_cpp.peg");
+  std::string grammar((std::istreambuf_iterator<char>(ifs)),
+                      std::istreambuf_iterator<char>());
+
+  parser original(grammar);
+  ASSERT_TRUE(static_cast<bool>(original));
+
+  auto generated = emit_cpp_parser();
+  ASSERT_TRUE(static_cast<bool>(generated));
+
+  // Captures, cuts, macros, dictionaries and precedence climbing are parsed
+  // by the operators
+  for (auto name : {"START", "STATEMENT", "LET", "ATOM", "NUMBER", "NAME",
+                    "STRING", "SUFFIX"}) {
+    EXPECT_TRUE(static_cast<bool>(generated[name].parse_body)) << name;
+  }
+  for (auto name : {"PRINT", "HEREDOC", "LIST", "EXPR", "UNIT"}) {
+    EXPECT_FALSE(static_cast<bool>(generated[name].parse_body)) << name;
+  }
+
+  std::vector<std::string> inputs = {
+      "LET x = 1 + 2 * (3 - y);\nprint x; print \"hi\";",
+      "<<EOT some text EOT [1, 22, 333] km * 2;",
+      "caf\xC3\xA9? + 123456.5;",
+      "letx = 1;",
+      "print 1;",
+      "[1, 1234567];",
+      "<<EOT text EOX",
+      "x +;",
+      "\"open",
+  };
+  expect_same_parses(original, generated, inputs, 3);
+}
+
+TEST(EmitCppTest, Emit_cpp) {
+  parser parser(R"(
+    START  <- (HEREDOC / EXPR / LIST(NUMBER))*
+    HEREDOC <- '<<' $tag< [A-Z]+ > (!$tag .)* $tag
+    EXPR   <- NUMBER (BINOP NUMBER)* {
+                precedence
+                  L + -
+                  L * /
+              }
+    LIST(X) <- '[' X (',' X)* ']'
+    BINOP  <- < [-+*/] >
+    NUMBER <- < [0-9]+ > EXT
+    %whitespace <- [ \t]*
+  )",
+                {{"EXT", opt(chr('u'))}});
+  ASSERT_TRUE(static_cast<bool>(parser));
+
+  std::stringstream ss;
+  EXPECT_TRUE(parser.emit_cpp(ss, "my_parser"));
+
+  auto code = ss.str();
+  EXPECT_NE(std::string::npos,
+            code.find("inline peg::parser my_parser(const peg::Rules &rules"));
+  EXPECT_NE(std::string::npos, code.find("rule <= rules.at(\"EXT\");"));
+  EXPECT_NE(std::string::npos, code.find("bkr(\"tag\")"));
+  EXPECT_NE(std::string::npos, code.find("pre("));
+  EXPECT_NE(std::string::npos, code.find("ref(g, \"LIST\", nullptr, true"));
+  EXPECT_NE(std::string::npos, code.find("lit(\"<<\")"));
+  EXPECT_NE(std::string::npos, code.find("load_grammar(grammar, \"START\""));
+
+  // Parse functions, except for the rules using back references
+  EXPECT_NE(std::string::npos, code.find("class my_parser_functions {"));
+  EXPECT_NE(std::string::npos, code.find("size_t parse_NUMBER(const char *s"));
+  EXPECT_NE(std::string::npos, code.find("size_t body_NUMBER(const char *s"));
+  EXPECT_NE(std::string::npos, code.find("g[\"NUMBER\"].parse_body = "));
+  EXPECT_EQ(std::string::npos, code.find("g[\"HEREDOC\"].parse_body = "));
+}
+
 TEST(PredicateTest, Semantic_predicate_test) {
   parser parser("NUMBER  <-  [0-9]+");
 
@@ -1359,6 +1966,32 @@ TEST(MacroTest, Nested_macro_call2) {
   EXPECT_TRUE(parser.parse("#TestVal1#End"));
 }
 
+TEST(MacroTest, Macro_values_with_packrat) {
+  parser parser(R"(
+        S       <- LIST(NUM) ';' / LIST(NUM) '.'
+        LIST(X) <- X (',' X)*
+        NUM     <- < [0-9]+ >
+	)");
+
+  parser["NUM"] = [](const SemanticValues &vs) {
+    return vs.token_to_number<int>();
+  };
+  parser["S"] = [](const SemanticValues &vs) {
+    EXPECT_EQ(1, vs.choice());
+    return std::accumulate(vs.begin(), vs.end(), 0,
+                           [](int sum, const std::any &v) {
+                             return sum + std::any_cast<int>(v);
+                           });
+  };
+
+  for (auto packrat : {false, true}) {
+    if (packrat) { parser.enable_packrat_parsing(); }
+    int val = 0;
+    EXPECT_TRUE(parser.parse("1,2,3.", val));
+    EXPECT_EQ(6, val);
+  }
+}
+
 TEST(LineInformationTest, Line_information_test) {
   parser parser(R"(
         S    <- _ (WORD _)+
@@ -1912,6 +2545,51 @@ STR         <- < [a-z0-9]+ >
   EXPECT_EQ(i, errors.size());
 }
 
+TEST(ErrorTest, Two_pass_errors) {
+  auto grammar = R"(
+    START       <- STMT*
+    STMT        <- LIST(NAME) ';'^semicolon / NAME '=' VALUE ';'
+    LIST(X)     <- '[' X (',' X)* ']'
+    VALUE       <- HEX / DEC { error_message 'value format error...' }
+    HEX         <- < [a-f0-9]+ 'h' >
+    DEC         <- < [0-9]+ >
+    NAME        <- < [a-z]+ >
+    %whitespace <- [ \t\n]*
+    semicolon   <- '' { error_message 'missing semicolon' }
+  )";
+
+  parser pg1(grammar);
+  parser pg2(grammar);
+  pg2.enable_two_pass_errors();
+
+  size_t names = 0;
+  pg2["NAME"] = [&](const SemanticValues &) { names++; };
+
+  std::vector<std::string> inputs = {
+      "a = 1; [b, c]; d = ffh;", "a = 1; b = x1;", "[a, b] c = 1;", "[a, 1];",
+      "a = 1",
+  };
+
+  for (const auto &input : inputs) {
+    std::vector<std::string> errors[2];
+    parser *parsers[] = {&pg1, &pg2};
+    for (auto i = 0; i < 2; i++) {
+      parsers[i]->set_logger([&errors, i](size_t ln, size_t col,
+                                          const std::string &msg) {
+        errors[i].push_back(std::to_string(ln) + ":" + std::to_string(col) +
+                            ": " + msg);
+      });
+    }
+
+    names = 0;
+    auto ret = pg2.parse(input);
+    EXPECT_EQ(pg1.parse(input), ret) << input;
+    EXPECT_EQ(errors[0], errors[1]) << input;
+    EXPECT_EQ(ret, errors[1].empty()) << input;
+    if (ret) { EXPECT_EQ(4, names) << input; }
+  }
+}
+
 TEST(StateTest, Indent) {
   parser pg(R"(Start <- Statements {}
 Statements <- Statement*
@@ -2046,3 +2724,513 @@ expr <- 'hello'
   EXPECT_EQ(i, errors.size());
 }
 
+
+TEST(ProfilerTest, Profile_formats) {
+  auto grammar = R"(
+    Additive       <- Multiplicative '+' Additive / Multiplicative
+    Multiplicative <- Primary '*' Multiplicative / Primary
+    Primary        <- '(' Additive ')' / Number
+    Number         <- < [0-9]+ >
+    %whitespace    <- [ \t]*
+  )";
+
+  parser pg(grammar);
+  pg.enable_packrat_parsing();
+
+  {
+    std::stringstream ss;
+    enable_profiling(pg, ss);
+    EXPECT_TRUE(pg.parse("1 + (2 * 3)"));
+
+    auto out = ss.str();
+    EXPECT_NE(std::string::npos, out.find("memo hits"));
+    EXPECT_NE(std::string::npos, out.find("Total counters"));
+    EXPECT_NE(std::string::npos, out.find("Multiplicative"));
+  }
+
+  {
+    std::stringstream ss;
+    enable_profiling(pg, ss, ProfileFormat::Json);
+    EXPECT_TRUE(pg.parse("1 + (2 * 3)"));
+
+    auto out = ss.str();
+    EXPECT_EQ(0, out.find("{\"duration_ns\":"));
+    EXPECT_NE(std::string::npos,
+              out.find("{\"id\":0,\"name\":\"Additive\",\"success\":3,"
+                       "\"fail\":0,"));
+    EXPECT_NE(std::string::npos,
+              out.find("\"consumed\":5,\"examined\":8,\"backtracks\":0,"
+                       "\"memo_hits\":0,\"memo_misses\":3}"));
+    EXPECT_NE(std::string::npos,
+              out.find("\"backtracks\":2,\"memo_hits\":2,\"memo_misses\":4}"));
+  }
+
+  {
+    std::stringstream ss;
+    enable_profiling(pg, ss, ProfileFormat::Folded);
+    EXPECT_TRUE(pg.parse("1 + (2 * 3)"));
+
+    std::vector<std::string> stacks;
+    std::string line;
+    while (std::getline(ss, line)) {
+      auto pos = line.rfind(' ');
+      ASSERT_NE(std::string::npos, pos);
+      EXPECT_LT(0, std::stoll(line.substr(pos + 1)));
+      stacks.push_back(line.substr(0, pos));
+    }
+    EXPECT_EQ("Additive", stacks.front());
+    EXPECT_NE(stacks.end(),
+              std::find(stacks.begin(), stacks.end(),
+                        "Additive;Multiplicative;Primary;Number"));
+  }
+}
+
+TEST(MetricsTest, Aggregate_over_threads) {
+  parser pg(R"(
+    LIST   <- NUMBER (',' NUMBER)*
+    NUMBER <- < [0-9]+ >
+    %whitespace <- [ \t]*
+  )");
+
+  MetricsRegistry registry;
+  pg.enable_metrics(registry);
+
+  std::vector<std::thread> threads;
+  for (auto t = 0; t < 4; t++) {
+    threads.emplace_back([&]() {
+      for (auto i = 0; i < 100; i++) {
+        EXPECT_TRUE(pg.parse("1, 2, 3"));
+        EXPECT_FALSE(pg.parse("1, x"));
+      }
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+
+  auto s = registry.snapshot();
+  EXPECT_EQ(800, s.parses);
+  EXPECT_EQ(400, s.failures);
+  EXPECT_EQ(800, std::accumulate(s.latency_buckets.begin(),
+                                 s.latency_buckets.end(), uint64_t(0)));
+
+  ASSERT_EQ(2, s.rules.size());
+  EXPECT_EQ("LIST", s.rules[0].name);
+  EXPECT_EQ(800, s.rules[0].success);
+  EXPECT_EQ(0, s.rules[0].fail);
+  EXPECT_EQ("NUMBER", s.rules[1].name);
+  EXPECT_EQ(400 * 3 + 400, s.rules[1].success);
+  EXPECT_EQ(400, s.rules[1].fail);
+
+  std::stringstream ss;
+  registry.write_prometheus(ss);
+  auto out = ss.str();
+  EXPECT_NE(std::string::npos, out.find("peglib_parses_total 800\n"));
+  EXPECT_NE(std::string::npos, out.find("peglib_parse_failures_total 400\n"));
+  EXPECT_NE(std::string::npos,
+            out.find("peglib_parse_duration_seconds_bucket{le=\"+Inf\"} "
+                     "800\n"));
+  EXPECT_NE(std::string::npos,
+            out.find("peglib_rule_calls_total{rule=\"NUMBER\",result=\"fail\"} "
+                     "400\n"));
+
+  registry.reset();
+  EXPECT_TRUE(pg.parse("1"));
+
+  s = registry.snapshot();
+  EXPECT_EQ(1, s.parses);
+  EXPECT_EQ(0, s.failures);
+  EXPECT_EQ(1, s.rules[1].success);
+  EXPECT_EQ(0, s.rules[1].fail);
+}
+
+TEST(MetricsTest, Registries_used_in_turn) {
+  auto grammar = "LIST <- [0-9]+ (',' [0-9]+)*";
+  parser pg1(grammar);
+  parser pg2(grammar);
+
+  MetricsRegistry registry;
+  pg1.enable_metrics(registry);
+
+  for (auto i = 0; i < 10; i++) {
+    // A registry per request
+    MetricsRegistry other;
+    pg2.enable_metrics(other);
+    EXPECT_TRUE(pg1.parse("1,2"));
+    EXPECT_TRUE(pg2.parse("1"));
+    EXPECT_FALSE(pg2.parse("x"));
+    EXPECT_TRUE(pg1.parse("3"));
+
+    auto s = other.snapshot();
+    EXPECT_EQ(2, s.parses);
+    EXPECT_EQ(1, s.failures);
+  }
+
+  EXPECT_EQ(20, registry.snapshot().parses);
+}
+
+TEST(BinaryTraceTest, Decode_matches_text_trace) {
+  parser pg(R"(
+    S <- A+ / 'x'
+    A <- 'a' ('b' / 'c')* !'d'
+  )");
+
+  auto input = "abcab";
+
+  std::stringstream text;
+  enable_tracing(pg, text);
+  EXPECT_TRUE(pg.parse(input));
+
+  BinaryTrace trace;
+  enable_binary_tracing(pg, trace);
+  EXPECT_TRUE(pg.parse(input));
+
+  std::stringstream bin;
+  trace.save(bin);
+
+  BinaryTrace loaded;
+  ASSERT_TRUE(loaded.load(bin));
+
+  std::stringstream decoded;
+  loaded.decode(decoded, input);
+  EXPECT_EQ(text.str(), decoded.str());
+  EXPECT_EQ(0, loaded.dropped());
+}
+
+TEST(BinaryTraceTest, Load_rejects_corrupt_files) {
+  parser pg(R"(
+    S <- A+
+    A <- 'a'
+  )");
+
+  BinaryTrace trace;
+  enable_binary_tracing(pg, trace);
+  EXPECT_TRUE(pg.parse("aa"));
+
+  std::stringstream out;
+  trace.save(out);
+  auto saved = out.str();
+  auto events_at = saved.size() - trace.events().size() * 24;
+
+  auto load = [](const std::string &data) {
+    std::stringstream in(data);
+    BinaryTrace loaded;
+    return loaded.load(in);
+  };
+
+  EXPECT_TRUE(load(saved));
+  EXPECT_FALSE(load(saved.substr(0, saved.size() - 1)));
+
+  // Event count far larger than the file
+  auto data = saved;
+  data[events_at - 1] = '\x7f';
+  EXPECT_FALSE(load(data));
+
+  // Operator index out of range
+  data = saved;
+  data.replace(events_at + 4, 4, std::string(4, '\xff'));
+  EXPECT_FALSE(load(data));
+
+  // Operator name longer than the file
+  data = saved;
+  data.replace(8 + 4 + 1, 4, std::string(4, '\xff'));
+  EXPECT_FALSE(load(data));
+}
+
+TEST(BinaryTraceTest, Filters_and_ring_buffer) {
+  parser pg(R"(
+    S <- A+
+    A <- B 'a'
+    B <- 'b'
+  )");
+
+  {
+    BinaryTrace trace;
+    trace.set_rule_filter({"B"});
+    trace.set_range_filter(2, 4);
+    enable_binary_tracing(pg, trace);
+    EXPECT_TRUE(pg.parse("bababa"));
+
+    auto events = trace.events();
+    ASSERT_EQ(4, events.size());
+    for (const auto &e : events) {
+      EXPECT_TRUE(e.pos >= 2 && e.pos < 4);
+    }
+    EXPECT_EQ("[B]", trace.operators()[events.front().ope].name);
+  }
+
+  {
+    BinaryTrace trace(4);
+    enable_binary_tracing(pg, trace);
+    EXPECT_TRUE(pg.parse("bababa"));
+
+    auto events = trace.events();
+    ASSERT_EQ(4, events.size());
+    EXPECT_LT(0, trace.dropped());
+    EXPECT_EQ(BinaryTrace::Leave, events.back().kind);
+    EXPECT_EQ(0, events.back().id);
+    EXPECT_EQ(6, events.back().len);
+  }
+}
+
+TEST(ChromeTraceTest, Rule_slices) {
+  parser pg(R"(
+    S <- A+
+    A <- B 'a'
+    B <- 'b'
+  )");
+
+  auto count = [](const std::string &s, const std::string &sub) {
+    size_t n = 0;
+    for (auto pos = s.find(sub); pos != std::string::npos;
+         pos = s.find(sub, pos + 1)) {
+      n++;
+    }
+    return n;
+  };
+
+  {
+    std::stringstream ss;
+    enable_chrome_tracing(pg, ss);
+    EXPECT_TRUE(pg.parse("baba"));
+
+    auto out = ss.str();
+    EXPECT_EQ(0, out.find("{\"traceEvents\":["));
+    EXPECT_NE(std::string::npos, out.find("],\"displayTimeUnit\":\"ns\"}"));
+    EXPECT_EQ(1, count(out, "\"name\":\"S\""));
+    EXPECT_EQ(3, count(out, "\"name\":\"A\""));
+    EXPECT_EQ(3, count(out, "\"name\":\"B\""));
+    EXPECT_NE(std::string::npos,
+              out.find("\"args\":{\"pos\":2,\"len\":2,\"success\":true}"));
+    EXPECT_NE(std::string::npos,
+              out.find("\"args\":{\"pos\":4,\"len\":0,\"success\":false}"));
+  }
+
+  {
+    ChromeTraceOptions options;
+    options.max_depth = 2;
+    std::stringstream ss;
+    enable_chrome_tracing(pg, ss, options);
+    EXPECT_TRUE(pg.parse("baba"));
+
+    auto out = ss.str();
+    EXPECT_EQ(1, count(out, "\"name\":\"S\""));
+    EXPECT_EQ(3, count(out, "\"name\":\"A\""));
+    EXPECT_EQ(0, count(out, "\"name\":\"B\""));
+  }
+
+  {
+    ChromeTraceOptions options;
+    options.max_events = 2;
+    std::stringstream ss;
+    enable_chrome_tracing(pg, ss, options);
+    EXPECT_TRUE(pg.parse("baba"));
+
+    EXPECT_EQ(2, count(ss.str(), "\"ph\":\"X\""));
+  }
+}
+
+TEST(HeatmapTest, Hottest_range) {
+  parser pg(R"(
+    S    <- LINE+
+    LINE <- (A / B) '\n'
+    A    <- 'x'+ 'a'
+    B    <- 'x'+ 'b'
+  )");
+
+  HeatmapOptions options;
+  options.buckets = 2;
+
+  std::stringstream ss;
+  enable_heatmap(pg, ss, options);
+  EXPECT_TRUE(pg.parse("xa\nxxxxxxxb\n"));
+
+  auto out = ss.str();
+  EXPECT_EQ(0, out.find("heatmap: 9 rule calls examined 12 bytes"));
+  EXPECT_NE(std::string::npos, out.find("hottest range: 6-12\n"
+                                        "    2 | xxxxxxxb\n"
+                                        "      | @@@@@@@@\n"));
+}
+
+TEST(FindSlowInputTest, Exponential_backtracking) {
+  auto grammar = R"(
+    S <- A 'x' / A 'y' / A
+    A <- '(' A ')' 'a' / '(' A ')' 'b' / 'c'
+  )";
+
+  SlowInputOptions options;
+  options.iterations = 500;
+  options.max_invocations = 20000;
+
+  {
+    parser pg(grammar);
+    auto slow = find_slow_input(pg, {"(c)a"}, options);
+    EXPECT_TRUE(slow.capped);
+    EXPECT_EQ(20000, slow.invocations);
+    EXPECT_LT(slow.input.size(), 20);
+    ASSERT_FALSE(slow.rules.empty());
+    EXPECT_EQ("A", slow.rules.front().first);
+  }
+
+  {
+    parser pg(grammar);
+    size_t calls = 0;
+    pg.enable_trace(
+        [&](auto &&...) { calls++; }, [&](auto &&...) {});
+    pg["A"] = [](const SemanticValues &vs) {
+      if (vs.choice() == 1) { throw std::runtime_error("b"); }
+    };
+
+    auto slow = find_slow_input(pg, {"(c)a", "(c)b"}, options);
+    EXPECT_TRUE(slow.capped);
+
+    // The caller's tracer is restored
+    EXPECT_EQ(0, calls);
+    EXPECT_TRUE(pg.parse("(c)a"));
+    EXPECT_LT(0, calls);
+  }
+
+  {
+    parser pg(grammar);
+    pg.enable_packrat_parsing();
+    auto slow = find_slow_input(pg, {"(c)a"}, options);
+    EXPECT_FALSE(slow.capped);
+    EXPECT_GT(100, slow.invocations_per_byte());
+  }
+}
+
+TEST(BacktrackAnalysisTest, Findings) {
+  std::string grammar = R"(
+    S       <- A 'x' / A 'y' / A
+    A       <- '(' A ')' 'a' / '(' A ')' 'b' / 'c'
+    Comment <- '/*' (!(Body '*/') .)* '*/'
+    Body    <- [a-z]*
+    Field   <- [a-z]+ ',' / [a-z0-9]
+  )";
+
+  parser pg;
+  ASSERT_TRUE(pg.load_grammar(grammar));
+
+  auto findings = analyze_backtracking(pg, grammar);
+  ASSERT_EQ(4, findings.size());
+
+  using Kind = BacktrackFinding::Kind;
+  using Growth = BacktrackFinding::Growth;
+
+  EXPECT_EQ(Kind::ReenteredRule, findings[0].kind);
+  EXPECT_EQ(Growth::Constant, findings[0].growth);
+  EXPECT_EQ(3, findings[0].factor);
+  EXPECT_EQ("S", findings[0].rule);
+  EXPECT_EQ(2, findings[0].line);
+  EXPECT_EQ(16, findings[0].col);
+  EXPECT_EQ("factor out the common prefix: A ('x' / 'y')?, or enable packrat "
+            "parsing",
+            findings[0].suggestion);
+
+  EXPECT_EQ(Kind::ReenteredRule, findings[1].kind);
+  EXPECT_EQ(Growth::Exponential, findings[1].growth);
+  EXPECT_EQ(2, findings[1].factor);
+  EXPECT_EQ("A", findings[1].rule);
+  EXPECT_EQ("'A' is parsed again at the same position by alternatives 1 and "
+            "2; re-parse factor: 2 per nesting level (exponential)",
+            findings[1].message);
+
+  EXPECT_EQ(Kind::RescanningPredicate, findings[2].kind);
+  EXPECT_EQ(Growth::Quadratic, findings[2].growth);
+  EXPECT_EQ("Comment", findings[2].rule);
+  EXPECT_EQ(4, findings[2].line);
+  EXPECT_EQ(22, findings[2].col);
+
+  EXPECT_EQ(Kind::OverlappingAlternatives, findings[3].kind);
+  EXPECT_EQ("Field", findings[3].rule);
+  EXPECT_EQ("alternative 1 can fail after consuming any amount of input, and "
+            "alternative 2 can start with the same characters [a-z] and "
+            "parse it again; re-parse factor: 2",
+            findings[3].message);
+
+  // Without the grammar text, findings are at the rule
+  findings = analyze_backtracking(pg);
+  ASSERT_EQ(4, findings.size());
+  EXPECT_EQ(2, findings[0].line);
+  EXPECT_EQ(5, findings[0].col);
+
+  // A repetition with no iterations consumes nothing, so these lookaheads
+  // read a single byte
+  ASSERT_TRUE(pg.load_grammar(R"(
+    S <- (!(([a-z]*){0} 'b') .)* (!(([a-z]*){,0} 'c') .)*
+  )"));
+  EXPECT_TRUE(analyze_backtracking(pg).empty());
+}
+
+TEST(AutoCutTest, Disjoint_alternatives) {
+  std::string grammar = R"(
+    S    <- '(' List ')' / '[' List ']' / List
+    List <- Item (',' Item)*
+    Item <- [0-9]+ '.' [0-9]+ / [0-9]+ / 'x' Item / 'x'
+    Opt  <- 'a' 'b' / 'c'?
+    Cut  <- 'a' ↑ 'b' / 'c' 'd'
+    M(X) <- 'y' X / 'z'
+  )";
+
+  parser pg;
+  ASSERT_TRUE(pg.load_grammar(grammar));
+
+  auto cuts = pg.enable_auto_cut(grammar);
+  ASSERT_EQ(3, cuts.size());
+
+  EXPECT_EQ("S", cuts[0].rule);
+  EXPECT_EQ(2, cuts[0].line);
+  EXPECT_EQ(13, cuts[0].col);
+  EXPECT_EQ(1, cuts[0].alternative);
+  EXPECT_EQ("'(' ↑ List ')'", cuts[0].text);
+
+  EXPECT_EQ("S", cuts[1].rule);
+  EXPECT_EQ(2, cuts[1].alternative);
+  EXPECT_EQ("'[' ↑ List ']'", cuts[1].text);
+
+  EXPECT_EQ("M", cuts[2].rule);
+  EXPECT_EQ("'y' ↑ X", cuts[2].text);
+
+  for (auto packrat : {false, true}) {
+    if (packrat) { pg.enable_packrat_parsing(); }
+    EXPECT_TRUE(pg.parse("(1.5,2,xx3)"));
+    EXPECT_TRUE(pg.parse("[1,2]"));
+    EXPECT_TRUE(pg.parse("1,2"));
+    EXPECT_FALSE(pg.parse("(1,2]"));
+    EXPECT_FALSE(pg.parse("(1"));
+  }
+}
+
+TEST(AutoCutTest, Packrat_memo_after_lookahead) {
+  // The lookahead parses past the cuts and then backtracks before them
+  for (auto grammar : {R"(
+    S <- &(A A) A A
+    A <- 'a' ↑ 'b' / 'z'
+  )",
+                       R"(
+    S <- &(A A) A A
+    A <- 'a' 'b' / 'z'
+  )"}) {
+    parser pg(grammar);
+    ASSERT_TRUE(static_cast<bool>(pg));
+    pg.enable_packrat_parsing();
+    pg.enable_auto_cut();
+    EXPECT_TRUE(pg.parse("abab"));
+    EXPECT_TRUE(pg.parse("zab"));
+    EXPECT_FALSE(pg.parse("abaz"));
+  }
+}
+
+TEST(AutoCutTest, Class_from_U0000) {
+  // Invalid UTF-8 matches no class, so only ASCII can start this one
+  std::string grammar = R"(
+    S <- [\x00-z] 'a' / 'é'
+  )";
+
+  parser pg;
+  ASSERT_TRUE(pg.load_grammar(grammar));
+  EXPECT_EQ(1, pg.enable_auto_cut(grammar).size());
+  EXPECT_TRUE(pg.parse("ba"));
+  EXPECT_TRUE(pg.parse("é"));
+  EXPECT_FALSE(pg.parse("\xff"));
+}
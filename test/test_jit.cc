@@ -0,0 +1,71 @@
+#include <fstream>
+#include <gtest/gtest.h>
+#include <peglib-jit.h>
+
+using namespace peg;
+
+namespace {
+
+void expect_same_results(const std::string &grammar,
+                         const std::vector<std::string> &inputs) {
+  parser interpreted(grammar);
+  ASSERT_TRUE(static_cast<bool>(interpreted));
+  interpreted.enable_ast();
+
+  parser compiled;
+  ASSERT_TRUE(jit::load_grammar(compiled, grammar));
+  compiled.enable_ast();
+
+  for (const auto &input : inputs) {
+    std::shared_ptr<Ast> asts[2];
+    auto ret = interpreted.parse(input, asts[0]);
+    EXPECT_EQ(ret, compiled.parse(input, asts[1])) << input;
+    if (asts[0] && asts[1]) {
+      EXPECT_EQ(ast_to_s(asts[0]), ast_to_s(asts[1])) << input;
+    }
+  }
+}
+
+} // namespace
+
+TEST(JitTest, Compile_lexical_rules) {
+  parser parser(R"(
+    ROOT   <- (NUMBER / IDENT / STRING)*
+    NUMBER <- [0-9]+ ('.' [0-9]+)?
+    IDENT  <- [a-z_] [a-z0-9_]*
+    STRING <- '"' (!'"' .)* '"'
+  )");
+  ASSERT_TRUE(static_cast<bool>(parser));
+  EXPECT_EQ(3, jit::compile(parser));
+  EXPECT_TRUE(parser.parse("12.5abc\"x y\""));
+  EXPECT_FALSE(parser.parse("12.abc"));
+}
+
+TEST(JitTest, Same_results_as_interpreter) {
+  expect_same_results(R"(
+    ROOT    <- ITEM (',' ITEM)*
+    ITEM    <- HEX / WORD / QUOTED / ANY
+    HEX     <- '0x'i [0-9a-fA-F]{2,4} ![0-9a-zA-Z]
+    WORD    <- &[a-z] [^,0-9　-ヿ]+
+    QUOTED  <- '\'' [ぁ-ん]* '\''
+    ANY     <- '#' . .?
+  )",
+                      {"0x1F", "0X1f2a", "0x12345", "abc,def",
+                       u8"'あん',#é", "#", "#ab", "abア",
+                       "\xe3\x81", "'a'"});
+}
+
+TEST(JitTest, Same_results_as_interpreter_with_whitespace) {
+  std::ifstream ifs(PEGLIB_GRAMMAR_DIR "/json.peg");
+  std::string grammar((std::istreambuf_iterator<char>(ifs)),
+                      std::istreambuf_iterator<char>());
+
+  expect_same_results(grammar, {
+                                   R"({"a": [1, -2.5e3, true, null]})",
+                                   R"({ "b" : { "c" : "é\n" } })",
+                                   u8"[\"あ\", 0, 1e10, false ]",
+                                   "[1, 2,]",
+                                   "[01]",
+                                   R"({"a" 1})",
+                               });
+}
@@ -0,0 +1,29 @@
+#define CPPPEGLIB_DISABLE_TRACE
+#include <gtest/gtest.h>
+#include <peglib.h>
+
+using namespace peg;
+
+TEST(NoTraceTest, Trace_is_compiled_out) {
+  parser pg(R"(
+    ROOT        <- NAME (',' NAME)*
+    NAME        <- < [a-z]+ >
+    %whitespace <- [ ]*
+  )");
+  ASSERT_TRUE(static_cast<bool>(pg));
+
+  size_t calls = 0;
+  pg.enable_trace(
+      [&](const Ope &, const char *, size_t, const SemanticValues &,
+          const Context &, const std::any &, std::any &) { calls++; },
+      [&](const Ope &, const char *, size_t, const SemanticValues &,
+          const Context &, const std::any &, size_t, std::any &) { calls++; },
+      [&](std::any &) { calls++; }, [&](std::any &) { calls++; });
+
+  std::vector<std::string_view> names;
+  pg["NAME"] = [&](const SemanticValues &vs) { names.push_back(vs.token()); };
+
+  EXPECT_TRUE(pg.parse(" a, bc ,d "));
+  EXPECT_EQ((std::vector<std::string_view>{"a", "bc", "d"}), names);
+  EXPECT_EQ(0, calls);
+}